@@ -1,11 +1,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include "./src/qw_aot.h"
 #include "./src/qw_chunk.h"
 #include "./src/qw_compiler.h"
 #include "./src/qw_debug.h"
+#include "./src/qw_image.h"
+#include "./src/qw_ir.h"
+#include "./src/qw_jit.h"
 #include "./src/qw_object.h"
+#include "./src/qw_tier.h"
 #include "./src/qw_vm.h"
 
 #define EXIT_IF_ERR(expr, msg, code) \
@@ -46,10 +53,71 @@ static char* read_file(const char* path) {
   return buffer;
 }
 
+/// Directory of the images run_file() keeps by the hash of the source, NULL without --cache
+static const char* cache_dir = NULL;
+
+/// Compiles `source` and writes its image (see qw_image.h) to `out_path`, through a temporary file
+/// so nobody maps half of it. Exits on compile errors, returns false if it couldn't write it
+static bool write_image_file(const char* source, const char* out_path) {
+  init_vm();
+  // The image needs the code of every function
+  bool lazy = lazy_compile;
+  lazy_compile = false;
+  ObjectFunction* script = compile(source);
+  lazy_compile = lazy;
+  // The compiler already reported the errors
+  if (script == NULL) exit(65);
+  char temporary[4096];
+  snprintf(temporary, sizeof(temporary), "%s.%d.tmp", out_path, (int)getpid());
+  FILE* out = fopen(temporary, "wb");
+  bool written = out != NULL && write_image(script, hash_source(source), out);
+  if (out != NULL) written &= fclose(out) == 0;
+  written = written && rename(temporary, out_path) == 0;
+  if (!written) remove(temporary);
+  free_value_array(script->global_array);
+  free_vm();
+  return written;
+}
+
+/// Runs the image at `path`, of the source with `source_hash` unless NULL. Returns false if it isn't
+/// an image this build can run
+static bool run_image(const char* path, const u64* source_hash, InterpretResult* result) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return false;
+  Image image;
+  bool mapped = map_image(&image, file);
+  fclose(file);
+  if (!mapped) return false;
+  if (source_hash != NULL && image.header->source_hash != *source_hash) {
+    unmap_image(&image);
+    return false;
+  }
+  *result = interpret_image(&image);
+  unmap_image(&image);
+  return true;
+}
+
+/// Runs `source` from its image in `cache_dir`, writing it there first if it isn't yet (or is
+/// stale). Returns false if the cache can't be used
+static bool run_cached(const char* source, InterpretResult* result) {
+  u64 hash = hash_source(source);
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%016llx.qwc", cache_dir, (unsigned long long)hash);
+  if (run_image(path, &hash, result)) return true;
+  mkdir(cache_dir, 0755);
+  return write_image_file(source, path) && run_image(path, &hash, result);
+}
+
 static void run_file(const char* path) {
-  char* source = read_file(path);
-  InterpretResult result = interpret_source(source);
-  free(source);
+  InterpretResult result;
+  isize length = strlen(path);
+  if (length > 4 && strcmp(path + length - 4, ".qwc") == 0) {
+    EXIT_IF_ERR(!run_image(path, NULL, &result), "not a compiled image this build can run\n", 65);
+  } else {
+    char* source = read_file(path);
+    if (cache_dir == NULL || !run_cached(source, &result)) result = interpret_source(source);
+    free(source);
+  }
   if (result == INTERPRET_COMPILER_ERROR) {
     exit(65);
   } else if (result == INTERPRET_RUNTIME_ERROR) {
@@ -57,7 +125,98 @@ static void run_file(const char* path) {
   }
 }
 
+/// Writes the C program of the script at `path` into `out_path`, stdout if NULL (see qw_aot.h)
+static void emit_c_file(const char* path, const char* out_path) {
+  char* source = read_file(path);
+  init_vm();
+  // The C program needs the code of every function
+  lazy_compile = false;
+  ObjectFunction* script = compile(source);
+  free(source);
+  // The compiler already reported the errors
+  if (script == NULL) exit(65);
+  FILE* out = out_path != NULL ? fopen(out_path, "w") : stdout;
+  EXIT_IF_ERR(out == NULL, "couldn't open the output file\n", 74);
+  bool written = emit_c(script, out);
+  if (out != stdout) written &= fclose(out) == 0;
+  EXIT_IF_ERR(!written, "couldn't write the C file\n", 74);
+  free_value_array(script->global_array);
+  free_vm();
+}
+
+/// Writes the image of the script at `path` into `out_path`, `<path>c` if NULL (see qw_image.h)
+static void emit_image_file(const char* path, const char* out_path) {
+  char image_path[4096];
+  if (out_path == NULL) {
+    snprintf(image_path, sizeof(image_path), "%sc", path);
+    out_path = image_path;
+  }
+  char* source = read_file(path);
+  bool written = write_image_file(source, out_path);
+  free(source);
+  EXIT_IF_ERR(!written, "couldn't write the image\n", 74);
+}
+
 int main(int argc, const char* argv[]) {
+    bool emit = false;
+    const char* emit_path = NULL;
+    bool emit_image = false;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        const char* flag = argv[1];
+        if (strcmp(flag, "--jit") == 0) {
+            // --jit runs the hot functions as native code and traces the hot loops of the script
+#ifdef QW_JIT
+            jit_enabled = true;
+#else
+            fprintf(stderr, "the JIT isn't available in this build\n");
+#endif
+        } else if (strncmp(flag, "--tier-calls=", 13) == 0) {
+            tier_call_threshold = (u32)strtoul(flag + 13, NULL, 10);
+        } else if (strncmp(flag, "--tier-loops=", 13) == 0) {
+            tier_loop_threshold = (u32)strtoul(flag + 13, NULL, 10);
+        } else if (strcmp(flag, "--emit-c") == 0 || strncmp(flag, "--emit-c=", 9) == 0) {
+            // --emit-c writes the script compiled ahead of time as a C program, to stdout or to --emit-c=PATH
+            emit = true;
+            emit_path = flag[8] == '=' ? flag + 9 : NULL;
+        } else if (strcmp(flag, "--emit-qwc") == 0 || strncmp(flag, "--emit-qwc=", 11) == 0) {
+            // --emit-qwc writes the compiled image of the script, to <script>c or to --emit-qwc=PATH
+            emit_image = true;
+            emit_path = flag[10] == '=' ? flag + 11 : NULL;
+        } else if (strcmp(flag, "--cache") == 0 || strncmp(flag, "--cache=", 8) == 0) {
+            // --cache runs scripts from their compiled image, kept in .qwcache or --cache=DIR
+            cache_dir = flag[7] == '=' ? flag + 8 : ".qwcache";
+        } else if (strcmp(flag, "--tier-report") == 0) {
+            tier_report = true;
+        } else if (strcmp(flag, "--dump-ir") == 0) {
+            // --dump-ir prints the IR of every function after the optimization passes (qw_ir.h)
+            dump_ir = true;
+        } else if (strcmp(flag, "--no-optimize") == 0) {
+            // --no-optimize generates the bytecode as the compiler emitted it, without the passes
+            optimize = false;
+        } else if (strcmp(flag, "--lazy") == 0) {
+            // --lazy compiles the body of every function on its first call
+            lazy_compile = true;
+        } else {
+            fprintf(stderr, "unknown flag %s\n", flag);
+            exit(64);
+        }
+        argc--;
+        argv++;
+    }
+    if (emit) {
+        EXIT_IF_ERR(argc < 2, "--emit-c needs a script\n", 64);
+        emit_c_file(argv[1], emit_path);
+        return 0;
+    }
+    if (emit_image) {
+        EXIT_IF_ERR(argc < 2, "--emit-qwc needs a script\n", 64);
+        emit_image_file(argv[1], emit_path);
+        return 0;
+    }
+    if (argc > 1) {
+        run_file(argv[1]);
+        return 0;
+    }
     for (int i = 0; i < 1; i++) {
         run_file("./examples/fib.qw");
 //        run_file("./examples/fib.qw");
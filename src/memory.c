@@ -4,7 +4,10 @@
 #include <stdlib.h>
 
 #include "qw_compiler.h"
+#include "qw_jit.h"
 #include "qw_object.h"
+#include "qw_tier.h"
+#include "qw_trace.h"
 #include "qw_vm.h"
 #define GC_HEAP_GROW_FACTOR 2
 #ifdef DEBUG_LOG_GC
@@ -51,12 +54,22 @@ static void free_object(Object* object) {
     case OBJECT_INSTANCE: {
       ObjectInstance* instance = (ObjectInstance*)object;
       free_table(&instance->fields);
-      FREE(ObjectInstance, object);
+      if (instance->values != instance->inline_values) {
+        FREE_ARRAY(Value, instance->values, instance->capacity);
+      }
+      reallocate(object, sizeof(ObjectInstance) + sizeof(Value) * instance->inline_capacity, 0);
+      break;
+    }
+    case OBJECT_SHAPE: {
+      ObjectShape* shape = (ObjectShape*)object;
+      free_table(&shape->slots);
+      free_table(&shape->transitions);
+      FREE(ObjectShape, object);
       break;
     }
     case OBJECT_CLASS: {
-      FREE(ObjectClass, object);
       free_table(&((ObjectClass*)object)->methods);
+      FREE(ObjectClass, object);
       break;
     }
     case OBJECT_STRING: {
@@ -70,13 +83,27 @@ static void free_object(Object* object) {
     }
     case OBJECT_CLOSURE: {
       ObjectClosure* closure = (ObjectClosure*)object;
-      FREE_ARRAY(ObjectUpvalue*, closure->upvalues, closure->upvalue_count);
-      FREE(ObjectClosure, object);
+      reallocate(object, sizeof(ObjectClosure) + sizeof(Value) * closure->upvalue_count, 0);
       break;
     }
     case OBJECT_FUNCTION: {
       ObjectFunction* fn = (ObjectFunction*)object;
       free_chunk(&fn->chunk);
+      FREE_ARRAY(InlineCache, fn->inline_caches, fn->inline_cache_capacity);
+      free_switch_tables(fn);
+      set_inlined_code(fn, NULL, 0, NULL, 0);
+      free_loop_counts(fn);
+      free_lazy_body(fn);
+#ifdef QW_THREADED_CODE
+      FREE_ARRAY(ThreadedWord, fn->threaded_code, fn->threaded_count);
+      FREE_ARRAY(u32, fn->threaded_offsets, fn->threaded_count);
+#endif
+#ifdef QW_JIT
+      free_jit_code(fn);
+#endif
+#ifdef QW_TRACING
+      free_traces(fn);
+#endif
       // FREE(ObjectString, fn->name);
       FREE(ObjectFunction, object);
       break;
@@ -143,10 +170,10 @@ void mark_object(Object* object) {
 }
 
 void mark_value(Value value) {
-  if (value.type != VAL_OBJECT) {
+  if (!IS_OBJECT(value)) {
     return;
   }
-  mark_object(value.as.object);
+  mark_object(AS_OBJECT(value));
 }
 
 static void mark_roots() {
@@ -186,19 +213,30 @@ static void blackend_object(Object* object) {
       ObjectInstance* instance = (ObjectInstance*)object;
       mark_table(&instance->fields);
       mark_object((Object*)instance->klass);
+      if (instance->shape != NULL) {
+        mark_object((Object*)instance->shape);
+        for (u32 i = 0; i < instance->shape->field_count; ++i) {
+          mark_value(instance->values[i]);
+        }
+      }
+      break;
+    }
+    case OBJECT_SHAPE: {
+      mark_table(&((ObjectShape*)object)->slots);
+      mark_table(&((ObjectShape*)object)->transitions);
       break;
     }
     case OBJECT_CLASS: {
       mark_object((Object*)((ObjectClass*)object)->name);
       mark_table(&((ObjectClass*)object)->methods);
+      mark_object((Object*)((ObjectClass*)object)->root_shape);
       break;
     }
     case OBJECT_CLOSURE: {
       ObjectClosure* closure = (ObjectClosure*)object;
       mark_object((Object*)closure->function);
-      if (closure->upvalues == NULL) break;
       for (u32 i = 0; i < closure->upvalue_count; ++i) {
-        mark_object((Object*)closure->upvalues[i]);
+        mark_value(closure->upvalues[i]);
       }
       // mark_object((Object*)closure);
       break;
@@ -209,6 +247,17 @@ static void blackend_object(Object* object) {
       mark_object((Object*)function);
       mark_object((Object*)function->name);
       mark_array(&function->chunk.constants);
+      // Cached classes/methods are compared by address, so they must stay alive
+      for (u32 i = 0; i < function->inline_cache_count; ++i) {
+        for (u32 j = 0; j < INLINE_CACHE_ENTRIES; ++j) {
+          InlineCacheEntry* entry = &function->inline_caches[i].entries[j];
+          mark_object((Object*)entry->shape);
+          if (entry->kind == CACHE_TRANSITION) mark_object((Object*)entry->next_shape);
+          if (entry->kind == CACHE_METHOD) mark_value(entry->method);
+        }
+      }
+      for (u32 i = 0; i < function->switch_count; ++i) mark_table(&function->switches[i].strings);
+      for (u32 i = 0; i < function->inlined_call_count; ++i) mark_object((Object*)function->inlined_calls[i].function);
       // printf(">> constants of func %p\n", (void*)object);
       break;
     }
@@ -5,8 +5,8 @@
 #include "qw_values.h"
 
 #define GROW_CAPACITY(cap) ((cap) < 8 ? 8 : (cap)*2)
-#define GROW_ARRAY(type, arr, old_cap, cap) (type*)reallocate(arr, sizeof(type) * old_cap, sizeof(type) * cap)
-#define FREE_ARRAY(type, arr, old_cap) reallocate(arr, sizeof(type) * old_cap, 0)
+#define GROW_ARRAY(type, arr, old_cap, cap) (type*)reallocate(arr, sizeof(type) * (old_cap), sizeof(type) * (cap))
+#define FREE_ARRAY(type, arr, old_cap) reallocate(arr, sizeof(type) * (old_cap), 0)
 #define FREE(type, object) reallocate(object, sizeof(type), 0)
 void* reallocate(void* pointer, isize old_size, isize new_size);
 void mark_value(Value);
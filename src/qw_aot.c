@@ -0,0 +1,781 @@
+#include "qw_aot.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "qw_chunk.h"
+#include "qw_peephole.h"
+#include "qw_vm.h"
+
+/// An instruction as the C code sees it: superinstructions are compiled as the instructions they
+/// replaced, which are still in the bytecode (as the JIT does)
+typedef struct {
+  u8 op_code;
+  u32 offset;
+  u32 length;
+  /// Constant index, variable index or jump destination. OP_WIDE is decoded as the instruction it
+  /// widens
+  u32 operand;
+} Instruction;
+
+static u32 read_u16(Chunk* chunk, u32 offset) { return (chunk->code[offset] << 8) | chunk->code[offset + 1]; }
+
+static Instruction decode(Chunk* chunk, u32 offset) {
+  Instruction instruction = {checked_op_code(unfused_op_code(chunk->code[offset])), offset, 0, 0};
+  instruction.length =
+      instruction.op_code == chunk->code[offset] ? instruction_length(chunk, offset) : op_code_length(instruction.op_code);
+  if (instruction.op_code == OP_WIDE) {
+    instruction.op_code = chunk->code[offset + 1];
+    instruction.operand = read_u16(chunk, offset + 2);
+    return instruction;
+  }
+  switch (instruction.op_code) {
+    case OP_GET_LOCAL_0:
+    case OP_GET_LOCAL_1:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3:
+      instruction.operand = instruction.op_code - OP_GET_LOCAL_0;
+      instruction.op_code = OP_GET_LOCAL;
+      break;
+    case OP_JUMP_BACK:
+      instruction.operand = offset + instruction.length - read_u16(chunk, offset + 1);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      instruction.operand = offset + instruction.length + read_u16(chunk, offset + 1);
+      break;
+    default:
+      if (instruction.length == 2) instruction.operand = chunk->code[offset + 1];
+      if (instruction.length == 3) instruction.operand = read_u16(chunk, offset + 1);
+      break;
+  }
+  return instruction;
+}
+
+static bool is_jump(u8 op_code) {
+  switch (op_code) {
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether `instruction` is written as C, the rest exit to run()
+static bool compiles_to_c(Instruction* instruction, u32 global_count) {
+  switch (instruction->op_code) {
+    // Undefined globals are reported by run()
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+      return instruction->operand < global_count;
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_PUSH_TOP:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_PRINT:
+    case OP_ASSERT:
+      return true;
+    default:
+      return is_jump(instruction->op_code);
+  }
+}
+
+/// Entering the C code costs about as much as interpreting a few instructions, so run() only
+/// enters it at loop headers and after calls where it runs at least this many before exiting.
+/// Functions are entered at their start whenever their first instruction is written as C
+#define AOT_MIN_RUN 8
+
+/// Fills `runs` with the number of instructions the C code runs from every instruction until it
+/// exits, up to AOT_MIN_RUN. Same walk as the JIT's: branches are followed on their fall through
+/// and loops around their back edge
+static void count_runs(Instruction* instructions, bool* native, u32 count, u32* runs) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (u32 i = count; i-- > 0;) {
+      Instruction* instruction = &instructions[i];
+      u32 next;
+      if (!native[i]) {
+        next = 0;
+      } else if (instruction->op_code == OP_JUMP || instruction->op_code == OP_JUMP_BACK) {
+        next = runs[instruction->operand] + 1;
+      } else {
+        next = runs[instruction->offset + instruction->length] + 1;
+      }
+      if (next > AOT_MIN_RUN) next = AOT_MIN_RUN;
+      changed |= next != runs[instruction->offset];
+      runs[instruction->offset] = next;
+    }
+  }
+}
+
+/// Adds to `labels`, which starts with the entries, the targets of the jumps in the code reachable
+/// from them, as the C code is written: straight on from a label until an exit or a jump. Jumps
+/// in code that is never written don't get a label nobody goes to
+static void find_labels(Instruction* instructions, bool* native, u32 count, bool* labels) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    bool reachable = false;
+    for (u32 i = 0; i < count; i++) {
+      Instruction* instruction = &instructions[i];
+      reachable |= labels[instruction->offset];
+      if (!reachable) continue;
+      if (!native[i]) {
+        reachable = false;
+        continue;
+      }
+      if (is_jump(instruction->op_code) && !labels[instruction->operand]) {
+        labels[instruction->operand] = true;
+        changed = true;
+      }
+      reachable = instruction->op_code != OP_JUMP && instruction->op_code != OP_JUMP_BACK;
+    }
+  }
+}
+
+/// Writes the C of a function. The values an instruction pushes are kept in the temporaries t0..
+/// (pending) and only stored to the VM stack at the end of the block, before exits and where
+/// there is no temporary left, so the C compiler keeps them in registers
+typedef struct {
+  FILE* out;
+  u32 pending;
+  /// Temporaries the function uses, the most pending at once
+  u32 used;
+} Writer;
+
+/// Longest C expression of a stack value
+#define OPERAND_MAX 16
+
+/// Writes into `c` the lvalue of the value `distance` from the top of the stack
+static void operand(Writer* writer, u32 distance, char* c) {
+  if (distance < writer->pending) {
+    snprintf(c, OPERAND_MAX, "t%u", writer->pending - 1 - distance);
+  } else {
+    snprintf(c, OPERAND_MAX, "sp[-%u]", distance - writer->pending + 1);
+  }
+}
+
+/// Stores the pending values to the VM stack
+static void flush(Writer* writer) {
+  if (writer->pending == 0) return;
+  for (u32 i = 0; i < writer->pending; i++) fprintf(writer->out, "  sp[%u] = t%u;\n", i, i);
+  fprintf(writer->out, "  sp += %u;\n", writer->pending);
+  writer->pending = 0;
+}
+
+/// Writes the exit to the instruction at `offset`, storing the pending values on its way out
+static void exit_to(Writer* writer, u32 offset) {
+  fprintf(writer->out, "{\n");
+  for (u32 i = 0; i < writer->pending; i++) fprintf(writer->out, "    sp[%u] = t%u;\n", i, i);
+  fprintf(writer->out, "    state->sp = sp + %u;\n    return %u;\n  }\n", writer->pending, offset);
+}
+
+/// Makes room for a pushed value
+static void reserve(Writer* writer) {
+  if (writer->pending == AOT_TEMPORARIES) flush(writer);
+}
+
+static void push_c(Writer* writer, const char* value) {
+  reserve(writer);
+  fprintf(writer->out, "  t%u = %s;\n", writer->pending++, value);
+  if (writer->pending > writer->used) writer->used = writer->pending;
+}
+
+static void pop_c(Writer* writer, u32 count) {
+  u32 stored = 0;
+  for (u32 i = 0; i < count; i++) {
+    if (writer->pending > 0) {
+      writer->pending--;
+    } else {
+      stored++;
+    }
+  }
+  if (stored > 0) fprintf(writer->out, "  sp -= %u;\n", stored);
+}
+
+/// Pops two numbers and pushes `value_type(left _op_ right)`, or `value_type(!(left _op_ right))`
+/// when `negated` (>= and <= are !(<) and !(>) like in run(), true when a number is NaN)
+static void binary(Writer* writer, u32 offset, const char* value_type, const char* op, bool negated) {
+  char left[OPERAND_MAX], right[OPERAND_MAX];
+  operand(writer, 1, left);
+  operand(writer, 0, right);
+  fprintf(writer->out, "  if (!IS_NUMBER(%s) || !IS_NUMBER(%s)) ", left, right);
+  exit_to(writer, offset);
+  fprintf(writer->out, "  r = %s(%s(AS_NUMBER(%s) %s AS_NUMBER(%s)));\n", value_type, negated ? "!" : "", left, op, right);
+  pop_c(writer, 2);
+  push_c(writer, "r");
+}
+
+/// Pops two numbers and jumps when `left _op_ right` is `jump_if`
+static void compare_jump(Writer* writer, Instruction* instruction, const char* op, bool jump_if) {
+  char left[OPERAND_MAX], right[OPERAND_MAX];
+  operand(writer, 1, left);
+  operand(writer, 0, right);
+  fprintf(writer->out, "  if (!IS_NUMBER(%s) || !IS_NUMBER(%s)) ", left, right);
+  exit_to(writer, instruction->offset);
+  fprintf(writer->out, "  c = AS_NUMBER(%s) %s AS_NUMBER(%s);\n", left, op, right);
+  pop_c(writer, 2);
+  flush(writer);
+  fprintf(writer->out, "  if (%sc) goto at_%u;\n", jump_if ? "" : "!", instruction->operand);
+}
+
+/// Writes the C of `instruction`, one compiles_to_c() accepts
+static void emit_instruction(Writer* writer, Instruction* instruction) {
+  FILE* out = writer->out;
+  u32 offset = instruction->offset;
+  u32 index = instruction->operand;
+  char value[OPERAND_MAX];
+  char source[OPERAND_MAX + 16];
+  switch (instruction->op_code) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      snprintf(source, sizeof(source), "constants[%u]", index);
+      push_c(writer, source);
+      break;
+    case OP_NIL:
+      push_c(writer, "NIL_VAL");
+      break;
+    case OP_TRUE:
+      push_c(writer, "BOOL_VAL(true)");
+      break;
+    case OP_FALSE:
+      push_c(writer, "BOOL_VAL(false)");
+      break;
+    case OP_POP:
+      pop_c(writer, 1);
+      break;
+    case OP_PUSH_TOP:
+      reserve(writer);
+      operand(writer, 0, value);
+      push_c(writer, value);
+      break;
+    // A local may be one of the pending values, they are stored first
+    case OP_GET_LOCAL:
+      flush(writer);
+      snprintf(source, sizeof(source), "slots[%u]", index);
+      push_c(writer, source);
+      break;
+    case OP_SET_LOCAL:
+      flush(writer);
+      operand(writer, 0, value);
+      fprintf(out, "  slots[%u] = %s;\n", index, value);
+      break;
+    case OP_GET_GLOBAL:
+      snprintf(source, sizeof(source), "globals[%u]", index);
+      push_c(writer, source);
+      break;
+    case OP_SET_GLOBAL:
+      operand(writer, 0, value);
+      fprintf(out, "  globals[%u] = %s;\n", index, value);
+      break;
+    case OP_DEFINE_GLOBAL:
+      operand(writer, 0, value);
+      fprintf(out, "  globals[%u] = %s;\n", index, value);
+      pop_c(writer, 1);
+      break;
+    case OP_ADD:
+      binary(writer, offset, "NUMBER_VAL", "+", false);
+      break;
+    case OP_SUBTRACT:
+      binary(writer, offset, "NUMBER_VAL", "-", false);
+      break;
+    case OP_MULTIPLY:
+      binary(writer, offset, "NUMBER_VAL", "*", false);
+      break;
+    case OP_DIVIDE:
+      binary(writer, offset, "NUMBER_VAL", "/", false);
+      break;
+    // Equality of anything but numbers is left to run()
+    case OP_EQUAL:
+      binary(writer, offset, "BOOL_VAL", "==", false);
+      break;
+    case OP_NOT_EQUAL:
+      binary(writer, offset, "BOOL_VAL", "!=", false);
+      break;
+    case OP_GREATER:
+      binary(writer, offset, "BOOL_VAL", ">", false);
+      break;
+    case OP_GREATER_EQUAL:
+      binary(writer, offset, "BOOL_VAL", "<", true);
+      break;
+    case OP_LESS:
+      binary(writer, offset, "BOOL_VAL", "<", false);
+      break;
+    case OP_LESS_EQUAL:
+      binary(writer, offset, "BOOL_VAL", ">", true);
+      break;
+    case OP_NEGATE:
+      operand(writer, 0, value);
+      fprintf(out, "  if (!IS_NUMBER(%s)) ", value);
+      exit_to(writer, offset);
+      fprintf(out, "  %s = NUMBER_VAL(-AS_NUMBER(%s));\n", value, value);
+      break;
+    case OP_NOT:
+      operand(writer, 0, value);
+      fprintf(out, "  %s = aot_not(%s);\n", value, value);
+      break;
+    case OP_PRINT:
+      operand(writer, 0, value);
+      fprintf(out, "  print_value(%s);\n  printf(\"\\n\");\n", value);
+      pop_c(writer, 1);
+      break;
+    // Failed asserts are reported by run()
+    case OP_ASSERT:
+      operand(writer, 0, value);
+      fprintf(out, "  if (!aot_truthy(%s)) ", value);
+      exit_to(writer, offset);
+      pop_c(writer, 1);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+      flush(writer);
+      fprintf(out, "  goto at_%u;\n", index);
+      break;
+    case OP_JUMP_IF_FALSE:
+      operand(writer, 0, value);
+      fprintf(out, "  c = aot_truthy(%s);\n", value);
+      flush(writer);
+      fprintf(out, "  if (!c) goto at_%u;\n", index);
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+      operand(writer, 0, value);
+      fprintf(out, "  c = aot_truthy(%s);\n", value);
+      pop_c(writer, 1);
+      flush(writer);
+      fprintf(out, "  if (!c) goto at_%u;\n", index);
+      break;
+    // Jumps when equal, when the numbers aren't different
+    case OP_JUMP_IF_EQUAL:
+      compare_jump(writer, instruction, "!=", false);
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+      compare_jump(writer, instruction, "==", false);
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      compare_jump(writer, instruction, "<", false);
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      compare_jump(writer, instruction, ">", true);
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      compare_jump(writer, instruction, ">", false);
+      break;
+    default:
+      compare_jump(writer, instruction, "<", true);
+      break;
+  }
+}
+
+/// Writes `native_<id>`, the C code of `function`, and `native_entries_<id>`, the offsets run()
+/// enters it at, and returns false instead when run() would never enter it. Instructions get a
+/// label when something jumps to them, run() enters at the start, and at loop headers and after
+/// the instructions that exit (where calls return to) when there is enough C code to run from there
+static bool emit_native(FILE* out, ObjectFunction* function, u32 id, u32 global_count) {
+  Chunk* chunk = &function->chunk;
+  Instruction* instructions = malloc(sizeof(Instruction) * (chunk->count + 1));
+  bool* native = malloc(sizeof(bool) * (chunk->count + 1));
+  bool* labels = calloc(chunk->count + 1, sizeof(bool));
+  bool* entries = calloc(chunk->count + 1, sizeof(bool));
+  u32* runs = calloc(chunk->count + 1, sizeof(u32));
+
+  u32 count = 0;
+  for (u32 offset = 0; offset < chunk->count; offset += instructions[count++].length) {
+    instructions[count] = decode(chunk, offset);
+  }
+  entries[0] = true;
+  for (u32 i = 0; i < count; i++) {
+    Instruction* instruction = &instructions[i];
+    native[i] = compiles_to_c(instruction, global_count);
+    if (native[i] && instruction->op_code == OP_JUMP_BACK) entries[instruction->operand] = true;
+    if (!native[i]) entries[instruction->offset + instruction->length] = true;
+  }
+  count_runs(instructions, native, count, runs);
+  bool entered = false;
+  for (u32 i = 0; i < count; i++) {
+    u32 offset = instructions[i].offset;
+    // At the start even for a short run, a function with C code is otherwise only entered when it loops
+    entries[offset] &= runs[offset] >= (offset == 0 ? 1 : AOT_MIN_RUN);
+    labels[offset] = entries[offset];
+    entered |= entries[offset];
+  }
+  find_labels(instructions, native, count, labels);
+
+  if (entered) {
+    // The body goes first to `body`, the temporaries it uses are declared before it
+    char* body_chars;
+    size_t body_size;
+    FILE* body = open_memstream(&body_chars, &body_size);
+    fprintf(body, "  switch (offset) {\n");
+    for (u32 i = 0; i < count; i++) {
+      u32 offset = instructions[i].offset;
+      if (entries[offset]) fprintf(body, "    case %u: goto at_%u;\n", offset, offset);
+    }
+    fprintf(body, "    default: return offset;\n");
+    fprintf(body, "  }\n");
+    Writer writer = {body, 0, 0};
+    // Code after an exit or a jump is only reached through its label
+    bool reachable = false;
+    for (u32 i = 0; i < count; i++) {
+      Instruction* instruction = &instructions[i];
+      if (labels[instruction->offset]) {
+        flush(&writer);
+        fprintf(body, "at_%u:\n", instruction->offset);
+        reachable = true;
+      }
+      if (!reachable) continue;
+      if (native[i]) {
+        emit_instruction(&writer, instruction);
+        reachable = instruction->op_code != OP_JUMP && instruction->op_code != OP_JUMP_BACK;
+      } else {
+        fprintf(body, "  ");
+        exit_to(&writer, instruction->offset);
+        writer.pending = 0;
+        reachable = false;
+      }
+    }
+    fclose(body);
+    fprintf(out, "static const u8 native_entries_%u[] = {", id);
+    for (u32 byte = 0; byte < (chunk->count + 7) / 8; byte++) {
+      u32 bits = 0;
+      for (u32 bit = 0; bit < 8 && byte * 8 + bit < chunk->count; bit++) bits |= entries[byte * 8 + bit] << bit;
+      fprintf(out, "%s0x%02x,", byte % 16 == 0 ? "\n    " : " ", bits);
+    }
+    fprintf(out, "};\n");
+    fprintf(out, "static u32 native_%u(JitState* state, u32 offset) {\n", id);
+    fprintf(out, "  AOT_PROLOGUE();\n");
+    if (writer.used > 0) {
+      fprintf(out, "  Value t0");
+      for (u32 i = 1; i < writer.used; i++) fprintf(out, ", t%u", i);
+      fprintf(out, ";\n");
+    }
+    fwrite(body_chars, 1, body_size, out);
+    free(body_chars);
+    // Every function ends with OP_RETURN, which exits
+    fprintf(out, "}\n\n");
+  }
+
+  free(instructions);
+  free(native);
+  free(labels);
+  free(entries);
+  free(runs);
+  return entered;
+}
+
+/// Writes `number` as a C constant. Hexadecimal floating point keeps every bit of finite numbers,
+/// infinities and NaNs (folded constants like 0 / 0) are written with their sign
+static void emit_number(FILE* out, double number) {
+  if (isnan(number)) {
+    fprintf(out, "%s__builtin_nan(\"\")", signbit(number) ? "-" : "");
+  } else if (isinf(number)) {
+    fprintf(out, "%s__builtin_inf()", number < 0 ? "-" : "");
+  } else {
+    fprintf(out, "%a", number);
+  }
+}
+
+static void emit_string(FILE* out, const char* chars, u32 length) {
+  fputc('"', out);
+  for (u32 i = 0; i < length; i++) {
+    u8 c = (u8)chars[i];
+    if (c == '"' || c == '\\' || c == '?') {
+      // `?` too, the start of a trigraph such as ??> in C99 and C11
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      // Always 3 digits so a digit that follows isn't taken as part of the escape
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/// The functions emit_c() writes, `function_<index>`, and the closures and classes their constants
+/// share (qw_inline.h), which the program creates once
+typedef struct {
+  ObjectFunction** functions;
+  u32 function_count;
+  u32 function_capacity;
+  Object** shared;
+  u32 shared_count;
+  u32 shared_capacity;
+} Emitter;
+
+/// Returns the index of `object` among the first `count` of `objects`, `count` if it isn't there
+static u32 find_object(void** objects, u32 count, void* object) {
+  u32 index = 0;
+  while (index < count && objects[index] != object) index++;
+  return index;
+}
+
+static void add_object(void*** objects, u32* count, u32* capacity, void* object) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *objects = realloc(*objects, sizeof(void*) * *capacity);
+  }
+  (*objects)[(*count)++] = object;
+}
+
+/// Adds `function`, the functions in its constants and the objects they share
+static void collect_function(Emitter* emitter, ObjectFunction* function) {
+  if (find_object((void**)emitter->functions, emitter->function_count, function) < emitter->function_count) return;
+  add_object((void***)&emitter->functions, &emitter->function_count, &emitter->function_capacity, function);
+  ValueArray* constants = &function->chunk.constants;
+  for (u32 i = 0; i < constants->count; i++) {
+    if (!IS_OBJECT(constants->values[i])) continue;
+    Object* object = AS_OBJECT(constants->values[i]);
+    if (object->type == OBJECT_FUNCTION) collect_function(emitter, (ObjectFunction*)object);
+    if (object->type != OBJECT_CLOSURE && object->type != OBJECT_CLASS) continue;
+    if (find_object((void**)emitter->shared, emitter->shared_count, object) == emitter->shared_count) {
+      add_object((void***)&emitter->shared, &emitter->shared_count, &emitter->shared_capacity, object);
+    }
+    if (object->type == OBJECT_CLOSURE) collect_function(emitter, ((ObjectClosure*)object)->function);
+  }
+  for (u32 i = 0; i < function->inlined_call_count; i++) collect_function(emitter, function->inlined_calls[i].function);
+}
+
+static u32 function_id(Emitter* emitter, ObjectFunction* function) {
+  return find_object((void**)emitter->functions, emitter->function_count, function);
+}
+
+/// Writes the constant `constant` of `script`'s tree
+static void emit_constant(FILE* out, Emitter* emitter, ObjectFunction* script, Value constant) {
+  if (IS_NUMBER(constant)) {
+    fprintf(out, "    {LOAD_CONSTANT_NUMBER, ");
+    emit_number(out, AS_NUMBER(constant));
+    fprintf(out, "},\n");
+    return;
+  }
+  Object* object = AS_OBJECT(constant);
+  u32 shared = find_object((void**)emitter->shared, emitter->shared_count, object);
+  switch (object->type) {
+    case OBJECT_STRING:
+      fprintf(out, "    {LOAD_CONSTANT_STRING, 0, ");
+      emit_string(out, AS_CSTRING(constant), (u32)AS_STRING(constant)->length);
+      fprintf(out, ", %u},\n", (u32)AS_STRING(constant)->length);
+      break;
+    case OBJECT_NATIVE: {
+      ValueArray* globals = script->global_array;
+      u32 global = 0;
+      while (global < globals->count) {
+        if (IS_OBJECT(globals->values[global]) && AS_OBJECT(globals->values[global]) == object) break;
+        global++;
+      }
+      fprintf(out, "    {LOAD_CONSTANT_NATIVE, 0, NULL, 0, %u},\n", global);
+      break;
+    }
+    case OBJECT_CLOSURE: {
+      u32 id = function_id(emitter, ((ObjectClosure*)object)->function);
+      fprintf(out, "    {LOAD_CONSTANT_CLOSURE, 0, NULL, 0, %u, %u},\n", id, shared);
+      break;
+    }
+    case OBJECT_CLASS: {
+      ObjectString* name = ((ObjectClass*)object)->name;
+      fprintf(out, "    {LOAD_CONSTANT_CLASS, 0, ");
+      emit_string(out, name->chars, (u32)name->length);
+      fprintf(out, ", %u, 0, %u},\n", (u32)name->length, shared);
+      break;
+    }
+    default:
+      fprintf(out, "    {LOAD_CONSTANT_FUNCTION, 0, NULL, 0, %u},\n", function_id(emitter, (ObjectFunction*)object));
+      break;
+  }
+}
+
+/// Writes `function_<id>`, the function of index `id`
+static void emit_function(FILE* out, Emitter* emitter, ObjectFunction* script, u32 id, u32 global_count) {
+  ObjectFunction* function = emitter->functions[id];
+  Chunk* chunk = &function->chunk;
+  ValueArray* constants = &chunk->constants;
+
+  fprintf(out, "static const u8 code_%u[] = {", id);
+  for (u32 i = 0; i < chunk->count; i++) fprintf(out, "%s%u,", i % 20 == 0 ? "\n    " : " ", chunk->code[i]);
+  fprintf(out, "};\n");
+  fprintf(out, "static const Line lines_%u[] = {", id);
+  for (u32 i = 0; i < chunk->lines.count; i++) {
+    fprintf(out, "{%u, %u}, ", chunk->lines.lines[i].line, chunk->lines.lines[i].times);
+  }
+  fprintf(out, "};\n");
+  if (constants->count > 0) {
+    fprintf(out, "static const LoadConstant constants_%u[] = {\n", id);
+    for (u32 i = 0; i < constants->count; i++) emit_constant(out, emitter, script, constants->values[i]);
+    fprintf(out, "};\n");
+  }
+  if (function->inline_cache_count > 0) {
+    fprintf(out, "static const u32 cache_offsets_%u[] = {", id);
+    for (u32 i = 0; i < function->inline_cache_count; i++) fprintf(out, "%u, ", function->inline_caches[i].offset);
+    fprintf(out, "};\n");
+  }
+  if (function->switch_count > 0) {
+    for (u32 i = 0; i < function->switch_count; i++) {
+      SwitchTable* table = &function->switches[i];
+      fprintf(out, "static const SwitchPattern patterns_%u_%u[] = {", id, i);
+      for (u32 j = 0; j < table->pattern_count; j++) {
+        SwitchPattern* pattern = &table->patterns[j];
+        fprintf(out, "%s{%u, %d, %u, %u, %u},", j % 8 == 0 ? "\n    " : " ", pattern->arm, pattern->range,
+                pattern->low, pattern->high, pattern->line);
+      }
+      fprintf(out, "};\nstatic const u32 targets_%u_%u[] = {", id, i);
+      for (u32 arm = 0; arm <= table->arm_count; arm++) fprintf(out, "%u, ", table->targets[arm]);
+      fprintf(out, "};\n");
+    }
+    fprintf(out, "static const LoadSwitch switches_%u[] = {\n", id);
+    for (u32 i = 0; i < function->switch_count; i++) {
+      SwitchTable* table = &function->switches[i];
+      fprintf(out, "    {patterns_%u_%u, %u, %u, targets_%u_%u},\n", id, i, table->pattern_count, table->arm_count, id, i);
+    }
+    fprintf(out, "};\n");
+  }
+  if (function->inlined_call_count > 0) {
+    fprintf(out, "static const LoadInlinedCall inlined_calls_%u[] = {", id);
+    for (u32 i = 0; i < function->inlined_call_count; i++) {
+      InlinedCall* call = &function->inlined_calls[i];
+      fprintf(out, "{%u, %u, %d}, ", function_id(emitter, call->function), call->line, call->parent);
+    }
+    fprintf(out, "};\nstatic const InlinedRange inlined_ranges_%u[] = {", id);
+    for (u32 i = 0; i < function->inlined_range_count; i++) {
+      InlinedRange* range = &function->inlined_ranges[i];
+      fprintf(out, "{%u, %u, %u}, ", range->start, range->end, range->call);
+    }
+    fprintf(out, "};\n");
+  }
+  bool native = emit_native(out, function, id, global_count);
+
+  fprintf(out, "static const AotFunction function_%u = {", id);
+  if (function->name != NULL) {
+    emit_string(out, function->name->chars, (u32)function->name->length);
+  } else {
+    fprintf(out, "NULL");
+  }
+  fprintf(out, ", %u, %d, code_%u, %u, lines_%u, %u, ", function->number_of_parameters, function->upvalue_count, id,
+          chunk->count, id, chunk->lines.count);
+  if (constants->count > 0) {
+    fprintf(out, "constants_%u, %u, ", id, constants->count);
+  } else {
+    fprintf(out, "NULL, 0, ");
+  }
+  if (function->inline_cache_count > 0) {
+    fprintf(out, "cache_offsets_%u, %u, ", id, function->inline_cache_count);
+  } else {
+    fprintf(out, "NULL, 0, ");
+  }
+  if (function->switch_count > 0) {
+    fprintf(out, "switches_%u, %u, ", id, function->switch_count);
+  } else {
+    fprintf(out, "NULL, 0, ");
+  }
+  if (function->inlined_call_count > 0) {
+    fprintf(out, "inlined_calls_%u, %u, inlined_ranges_%u, %u, ", id, function->inlined_call_count, id,
+            function->inlined_range_count);
+  } else {
+    fprintf(out, "NULL, 0, NULL, 0, ");
+  }
+  if (native) {
+    fprintf(out, "native_%u, native_entries_%u};\n\n", id, id);
+  } else {
+    fprintf(out, "NULL, NULL};\n\n");
+  }
+}
+
+bool emit_c(ObjectFunction* script, FILE* out) {
+  u32 global_count = script->global_array->count;
+  fprintf(out, "// Generated by qwlang --emit-c, build it with the runtime: clang -I./src <this file> ./src/*.c\n");
+  fprintf(out, "#include \"qw_aot.h\"\n\n");
+  Emitter emitter = {NULL, 0, 0, NULL, 0, 0};
+  collect_function(&emitter, script);
+  for (u32 id = 0; id < emitter.function_count; id++) emit_function(out, &emitter, script, id, global_count);
+  fprintf(out, "static const AotFunction* const functions[] = {");
+  for (u32 id = 0; id < emitter.function_count; id++) fprintf(out, "%s&function_%u,", id % 8 == 0 ? "\n    " : " ", id);
+  fprintf(out, "};\nstatic const AotProgram program = {functions, %u, %u, %u};\n\n", emitter.function_count,
+          emitter.shared_count, global_count);
+  fprintf(out, "int main(void) { return aot_main(&program); }\n");
+  free(emitter.functions);
+  free(emitter.shared);
+  fflush(out);
+  return !ferror(out);
+}
+
+/// The tables of an AotProgram, read by load_script()
+typedef struct {
+  LoadSource source;
+  const AotProgram* program;
+} AotSource;
+
+static void read_function(const LoadSource* source, u32 index, LoadFunction* function) {
+  const AotFunction* aot = ((const AotSource*)source)->program->functions[index];
+  function->name = aot->name;
+  function->name_length = aot->name == NULL ? 0 : (u32)strlen(aot->name);
+  function->number_of_parameters = aot->number_of_parameters;
+  function->upvalue_count = aot->upvalue_count;
+  function->code = aot->code;
+  function->count = aot->count;
+  function->lines = aot->lines;
+  function->line_count = aot->line_count;
+  function->constant_count = aot->constant_count;
+  function->cache_offsets = aot->cache_offsets;
+  function->cache_count = aot->cache_count;
+  function->switch_count = aot->switch_count;
+  function->inlined_calls = aot->inlined_calls;
+  function->inlined_call_count = aot->inlined_call_count;
+  function->inlined_ranges = aot->inlined_ranges;
+  function->inlined_range_count = aot->inlined_range_count;
+  function->native = aot->native;
+  function->native_entries = aot->native_entries;
+}
+
+static void read_constant(const LoadSource* source, u32 function, u32 index, LoadConstant* constant) {
+  *constant = ((const AotSource*)source)->program->functions[function]->constants[index];
+}
+
+static void read_switch(const LoadSource* source, u32 function, u32 index, LoadSwitch* table) {
+  *table = ((const AotSource*)source)->program->functions[function]->switches[index];
+}
+
+ObjectFunction* load_aot_script(const AotProgram* program) {
+  // The code and lines are read only data
+  AotSource source = {{program->function_count, program->shared_count, program->global_count, false, read_function,
+                       read_constant, read_switch},
+                      program};
+  return load_script(&source.source);
+}
+
+int aot_main(const AotProgram* program) {
+  InterpretResult result = interpret_aot(program);
+  return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+}
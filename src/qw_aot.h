@@ -0,0 +1,102 @@
+#ifndef qw_aot_h
+#define qw_aot_h
+
+#include <stdio.h>
+
+#include "qw_common.h"
+#include "qw_jit.h"
+#include "qw_lines.h"
+#include "qw_loader.h"
+#include "qw_object.h"
+
+/// Ahead-of-time compilation of a script into C (`qwlang --emit-c`). emit_c() writes the compiled
+/// ObjectFunction tree as C data (bytecode, lines, constants) and every function as a C function
+/// that runs its simple instructions (constants, variables, arithmetic, comparisons, jumps, print)
+/// on the VM stack, the same way native code of the JIT does (qw_jit.h). Built together with the
+/// runtime (`make aot SCRIPT=...`) it gives an executable that loads the tree without compiling
+/// the source and runs it in run(), which hands the frames over to the C functions on entry,
+/// after calls and returns and at loop headers, and interprets the instructions they exit on
+/// (calls, returns, objects, operands of unexpected types and errors).
+///
+/// Calls and returns always exit to run() on purpose: frames belong to the VM, which never recurses
+/// into run(), so the C code of a function doesn't call the C code of another. A call-heavy script
+/// runs the short stretches of C between its calls, entering them only where the bitset of the
+/// function (AotFunction.native_entries) says it pays
+
+/// Function of a script compiled ahead of time, as emit_c() writes it. Constants point to
+/// functions by their index in AotProgram.functions
+typedef struct AotFunction {
+  /// NULL for the top-level script
+  const char* name;
+  u32 number_of_parameters;
+  i32 upvalue_count;
+  const u8* code;
+  u32 count;
+  const Line* lines;
+  u32 line_count;
+  const LoadConstant* constants;
+  u32 constant_count;
+  /// Bytecode offset of the instruction owning every inline cache
+  const u32* cache_offsets;
+  u32 cache_count;
+  const LoadSwitch* switches;
+  u32 switch_count;
+  const LoadInlinedCall* inlined_calls;
+  u32 inlined_call_count;
+  const InlinedRange* inlined_ranges;
+  u32 inlined_range_count;
+  AotCode native;
+  /// Bytecode offsets `native` is entered at, as ObjectFunction.aot_entries
+  const u8* native_entries;
+} AotFunction;
+
+/// The function tree emit_c() writes, the top-level script first (see qw_loader.h)
+typedef struct AotProgram {
+  const AotFunction* const* functions;
+  u32 function_count;
+  u32 shared_count;
+  u32 global_count;
+} AotProgram;
+
+/// Writes the C program of `script`, a function tree fresh out of compile(). Returns false if it
+/// couldn't write it all
+bool emit_c(ObjectFunction* script, FILE* out);
+
+/// Rebuilds the function tree of `program` along with its globals
+ObjectFunction* load_aot_script(const AotProgram* program);
+
+/// main() of the programs written by emit_c(): runs `program` and returns the exit code qwlang
+/// would exit with
+int aot_main(const AotProgram* program);
+
+/// Stack values the C code keeps in temporaries
+#define AOT_TEMPORARIES 8
+
+/// Registers of the C code written by emit_c(): the interpreter's and the result of the last
+/// operation. The temporaries t0.. holding the values on top of the stack above `sp` are declared
+/// after it, as many as the function uses
+#define AOT_PROLOGUE()                                  \
+  Value* sp = state->sp;                                \
+  Value* slots = state->slots;                          \
+  Value* constants = state->constants;                  \
+  Value* globals = state->globals;                      \
+  Value r;                                              \
+  bool c;                                               \
+  (void)slots, (void)constants, (void)globals, (void)r, (void)c
+
+/// Same truthiness as is_truthy()
+static inline bool aot_truthy(Value value) {
+  if (IS_BOOL(value)) return AS_BOOL(value);
+  if (IS_NUMBER(value)) return AS_NUMBER(value) > 0.0;
+  return IS_OBJECT(value);
+}
+
+/// Same as OP_NOT in run()
+static inline Value aot_not(Value value) {
+  if (IS_NIL(value)) return BOOL_VAL(true);
+  if (IS_BOOL(value)) return BOOL_VAL(!AS_BOOL(value));
+  if (IS_NUMBER(value)) return BOOL_VAL(AS_NUMBER(value) <= 0.0001);
+  return BOOL_VAL(false);
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "qw_object.h"
 #include "qw_values.h"
 #include "qw_vm.h"
 
@@ -52,8 +53,11 @@ void write_chunk_u24(Chunk* chunk, u32 bytes, u32 line) {
 }
 
 void free_chunk(Chunk* chunk) {
-  FREE_ARRAY(u8, chunk->code, chunk->capacity);
-  free_lines(&chunk->lines);
+  // Without capacity there is no code, or it is in a mapped image along with the lines
+  if (chunk->capacity != 0) {
+    FREE_ARRAY(u8, chunk->code, chunk->capacity);
+    free_lines(&chunk->lines);
+  }
   free_value_array(&chunk->constants);
 }
 
@@ -64,6 +68,145 @@ u32 add_constant(Chunk* chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+u32 op_code_length(u8 op_code) {
+  switch (op_code) {
+    case OP_CONSTANT:
+    case OP_CALL:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_INLINE_RETURN:
+      return 2;
+    case OP_CONSTANT_LONG:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_NUMBERS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_ARRAY:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+    case OP_SWITCH:
+      return 3;
+    case OP_SUPER_INVOKE:
+    case OP_WIDE:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_POP_JUMP_BACK:
+    case OP_GET_LOCAL_CONSTANT:
+      return 4;
+    case OP_SET_PROPERTY:
+    case OP_GET_PROPERTY:
+    case OP_ADD_LOCAL_LOCAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+      return 5;
+    case OP_INVOKE:
+      return 6;
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+      return 7;
+    default:
+      return 1;
+  }
+}
+
+u32 instruction_length(Chunk* chunk, u32 offset) {
+  if (chunk->code[offset] == OP_CLOSURE) {
+    // Followed by an (is_local, index) pair per upvalue
+    u16 constant = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    ObjectFunction* function = (ObjectFunction*)AS_OBJECT(chunk->constants.values[constant]);
+    return 3 + 2 * function->upvalue_count;
+  }
+  return op_code_length(chunk->code[offset]);
+}
+
+u8 checked_op_code(u8 op_code) {
+  switch (op_code) {
+    case OP_NEGATE_NUMBER:
+      return OP_NEGATE;
+    case OP_ADD_NUMBERS:
+      return OP_ADD;
+    case OP_SUBTRACT_NUMBERS:
+      return OP_SUBTRACT;
+    case OP_MULTIPLY_NUMBERS:
+      return OP_MULTIPLY;
+    case OP_DIVIDE_NUMBERS:
+      return OP_DIVIDE;
+    case OP_GREATER_NUMBERS:
+      return OP_GREATER;
+    case OP_LESS_NUMBERS:
+      return OP_LESS;
+    case OP_GREATER_EQUAL_NUMBERS:
+      return OP_GREATER_EQUAL;
+    case OP_LESS_EQUAL_NUMBERS:
+      return OP_LESS_EQUAL;
+    case OP_JUMP_IF_NOT_LESS_NUMBERS:
+      return OP_JUMP_IF_NOT_LESS;
+    case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS:
+      return OP_JUMP_IF_NOT_LESS_EQUAL;
+    case OP_JUMP_IF_NOT_GREATER_NUMBERS:
+      return OP_JUMP_IF_NOT_GREATER;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS:
+      return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    default:
+      return op_code;
+  }
+}
+
+bool find_jump(Chunk* chunk, u32 offset, Jump* jump) {
+  u32 length = instruction_length(chunk, offset);
+  switch (chunk->code[offset]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_NUMBERS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS:
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+      *jump = (Jump){offset + length - 2, offset + length, false};
+      return true;
+    case OP_JUMP_BACK:
+    case OP_POP_JUMP_BACK:
+      *jump = (Jump){offset + length - 2, offset + length, true};
+      return true;
+    case OP_JUMP_IF_FALSE_POP:
+      // Relative to the end of the OP_JUMP_IF_FALSE, before the OP_POP
+      *jump = (Jump){offset + 1, offset + 3, false};
+      return true;
+    default:
+      return false;
+  }
+}
+
+u32 jump_target(Chunk* chunk, Jump* jump) {
+  u16 distance = (chunk->code[jump->operand] << 8) | chunk->code[jump->operand + 1];
+  return jump->backward ? jump->base - distance : jump->base + distance;
+}
+
 u32 get_line_from_chunk(Chunk* chunk, u32 op_code_index) { return get_line(&chunk->lines, op_code_index); }
 
 /// Adds a constant OP_CODE_LONG
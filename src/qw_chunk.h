@@ -31,6 +31,7 @@ typedef enum {
 
   OP_POP,
 
+  // Variable access opcodes have a 1 byte index, OP_WIDE in front of them makes it 2 bytes
   OP_DEFINE_GLOBAL,
   OP_GET_GLOBAL,
   OP_SET_GLOBAL,
@@ -47,22 +48,111 @@ typedef enum {
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
   OP_CLOSE_UPVALUE,
+  // OP_GET_UPVALUE of a variable the closure holds a copy of (CAPTURE_LOCAL_VALUE), 1 byte index
+  OP_GET_CAPTURED,
   OP_CLASS,
+  // 2 bytes name constant, 2 bytes inline cache index
   OP_SET_PROPERTY,
+  // 2 bytes name constant, 2 bytes inline cache index
   OP_GET_PROPERTY,
   OP_SET_PROPERTY_TOP_STACK,
   OP_GET_PROPERTY_TOP_STACK,
   OP_METHOD,
+  // 2 bytes name constant, 1 byte argument count, 2 bytes inline cache index
   OP_INVOKE,
   OP_INHERIT,
   OP_GET_SUPER,
   OP_SUPER_INVOKE,
-  OP_ARRAY
+  OP_ARRAY,
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
+  // Conditions of if/while/for/when, 2 bytes jump offset. They pop the condition whether they jump or not
+  OP_POP_JUMP_IF_FALSE,
+  // Compare-and-branch, they pop both operands and jump (2 bytes offset) when the comparison is false
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_LESS_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL,
+  // `when` over literal patterns, 2 bytes index of a SwitchTable of the function. Jumps to the arm
+  // the value on top of the stack matches, which stays there
+  OP_SWITCH,
+  // Replaces the class on top of the stack with a new instance of it, without running `init`.
+  // Written by inline_calls() for the constructor calls it inlines
+  OP_INSTANCE,
+  // End of a call inlined by inline_calls(), a variable access opcode: moves the value on top of
+  // the stack to the slot of the callee and drops the slots above it
+  OP_INLINE_RETURN,
+  // Arithmetic, comparisons and compare-and-branch with operands the specialize-numbers pass
+  // (qw_passes.h) proved to be numbers: same operands as the opcodes they replace, no type checks
+  OP_NEGATE_NUMBER,
+  OP_ADD_NUMBERS,
+  OP_SUBTRACT_NUMBERS,
+  OP_MULTIPLY_NUMBERS,
+  OP_DIVIDE_NUMBERS,
+  OP_GREATER_NUMBERS,
+  OP_LESS_NUMBERS,
+  OP_GREATER_EQUAL_NUMBERS,
+  OP_LESS_EQUAL_NUMBERS,
+  OP_JUMP_IF_NOT_LESS_NUMBERS,
+  OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS,
+  OP_JUMP_IF_NOT_GREATER_NUMBERS,
+  OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS,
+  // OP_ADD quickened by the VM after seeing two numbers/strings, back to OP_ADD when that changes
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  // OP_GET_LOCAL of the first slots without operand, written by peephole_optimize()
+  OP_GET_LOCAL_0,
+  OP_GET_LOCAL_1,
+  OP_GET_LOCAL_2,
+  OP_GET_LOCAL_3,
+  // Prefix, the variable access opcode that follows has a 2 bytes index
+  OP_WIDE,
+
+  // Superinstructions, written by peephole_optimize() over the instructions they replace. They keep
+  // the layout (and length) of the original sequence, so the opcode bytes in the middle are skipped
+
+  // OP_GET_LOCAL, OP_CONSTANT
+  OP_GET_LOCAL_CONSTANT,
+  // OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD
+  OP_ADD_LOCAL_LOCAL,
+  // OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+  OP_ADD_LOCAL_CONSTANT,
+  // OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT
+  OP_SUBTRACT_LOCAL_CONSTANT,
+  // OP_GET_LOCAL, OP_CONSTANT, OP_LESS
+  OP_LESS_LOCAL_CONSTANT,
+  // OP_GET_LOCAL, OP_CONSTANT, OP_JUMP_IF_NOT_LESS
+  OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT,
+  // OP_SET_LOCAL, OP_POP
+  OP_SET_LOCAL_POP,
+  // OP_SET_GLOBAL, OP_POP
+  OP_SET_GLOBAL_POP,
+  // OP_JUMP_IF_FALSE, OP_POP
+  OP_JUMP_IF_FALSE_POP,
+  // OP_POP, OP_JUMP_BACK
+  OP_POP_JUMP_BACK,
+  // Not an opcode, the number of opcodes
+  OP_CODE_COUNT
 } OpCode;
 
+/// First byte of the (kind, index) pair OP_CLOSURE has for every upvalue of the function
+typedef enum {
+  /// Upvalue `index` of the enclosing closure, whatever it holds
+  CAPTURE_UPVALUE,
+  /// The local in slot `index`, shared through an ObjectUpvalue
+  CAPTURE_LOCAL,
+  /// A copy of the local in slot `index`, which never changes once captured
+  CAPTURE_LOCAL_VALUE,
+} CaptureKind;
+
 /// Chunk is a sequence of bytecode
 typedef struct {
   u32 count;
+  /// 0 with instructions when `code` and `lines` are used in place from a mapped image
+  /// (qw_image.h), which the chunk doesn't free
   u32 capacity;
   u8* code;
   /// Contain the line number for the i'th opcode
@@ -70,6 +160,20 @@ typedef struct {
   ValueArray constants;
 } Chunk;
 
+#ifdef QW_THREADED_CODE
+/// Word of threaded code (see qw_threaded.h): the address of an opcode handler followed by one
+/// word per operand, already decoded
+typedef union {
+  void* handler;
+  u32 operand;
+} ThreadedWord;
+
+/// Unit of the code the VM runs
+typedef ThreadedWord CodeUnit;
+#else
+typedef u8 CodeUnit;
+#endif
+
 /// Initializes a chunk
 void init_chunk(Chunk* chunk);
 
@@ -90,6 +194,30 @@ void write_chunk_u24(Chunk* chunk, u32 bytes, u32 line);
 void write_chunk_u32(Chunk* chunk, u32 bytes, u32 line);
 void write_chunk_u64(Chunk* chunk, u64 bytes, u32 line);
 
+/// Returns the number of bytes (opcode and operands) of an instruction with `op_code`. OP_CLOSURE
+/// is followed by a variable number of bytes that only instruction_length() counts
+u32 op_code_length(u8 op_code);
+
+/// Returns the number of bytes (opcode and operands) of the instruction at `offset`
+u32 instruction_length(Chunk* chunk, u32 offset);
+
+/// Returns the opcode that checks the operand types of the unchecked numeric `op_code` (OP_ADD for
+/// OP_ADD_NUMBERS), for the tiers that compile them alike. Other opcodes are returned as is
+u8 checked_op_code(u8 op_code);
+
+/// A jump inside an instruction: where its u16 distance is and the offset it is relative to
+typedef struct {
+  u32 operand;
+  u32 base;
+  bool backward;
+} Jump;
+
+/// Fills `jump` if the instruction at `offset` jumps
+bool find_jump(Chunk* chunk, u32 offset, Jump* jump);
+
+/// Returns the offset the jump lands on
+u32 jump_target(Chunk* chunk, Jump* jump);
+
 /// Gets the line corresponding to the `op_code_index`
 u32 get_line_from_chunk(Chunk* lines, u32 op_code_index);
 
@@ -1,9 +1,25 @@
 #ifndef qw_common_h
 #define qw_common_h
 #include <string.h>
+// Build with -DQW_RELEASE to drop the debugging output (bytecode dumps, execution traces)
+#ifndef QW_RELEASE
 #define DEBUG_PRINT_CODE
+#endif
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_INLINE_CACHE_STATS
+// #define DEBUG_OPCODE_PROFILE
+// #define DEBUG_PRINT_TRACE
+// The baseline JIT (qw_jit.h) is built for x86-64 Linux, without threaded code, and turned on with
+// --jit. Build with -DQW_NO_JIT to leave it out
+#if defined(__x86_64__) && defined(__linux__) && !defined(QW_THREADED_CODE) && !defined(QW_NO_JIT)
+#define QW_JIT
+#endif
+// The tracing JIT (qw_trace.h) for the loops of the top-level script runs on top of the baseline
+// JIT. Build with -DQW_NO_TRACING to leave it out
+#if defined(QW_JIT) && !defined(QW_NO_TRACING)
+#define QW_TRACING
+#endif
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -29,4 +45,7 @@ typedef size_t isize;
 #define assert_or_exit(expr) \
   if (!(expr)) exit(1);
 
+/// Branch hint for checks the dispatch loop almost never takes
+#define unlikely(expr) __builtin_expect(!!(expr), 0)
+
 #endif
@@ -11,8 +11,10 @@
 #include "memory.h"
 #include "qw_common.h"
 #include "qw_debug.h"
+#include "qw_ir.h"
 #include "qw_native_functions.h"
 #include "qw_object.h"
+#include "qw_peephole.h"
 #include "qw_scanner.h"
 #include "qw_table.h"
 #include "qw_vm.h"
@@ -105,12 +107,40 @@ typedef struct ClassCompiler {
 
 ClassCompiler* current_class = NULL;
 
+typedef struct {
+  Token name;
+  /// Whether the closures of the function copy the variable (see capture_by_value()), so its reads
+  /// become OP_GET_CAPTURED once the body is compiled
+  bool by_value;
+} LazyUpvalue;
+
+/// A function body compile() skipped (lazy_compile)
+typedef struct LazyBody {
+  /// The '(' of the parameters, in the source compile() was given
+  const char* source;
+  u32 line;
+  FunctionType type;
+  /// The class around the function, for `this` and `super`
+  bool in_class;
+  bool has_superclass;
+  /// One per upvalue of the function, in the order of the pairs of its OP_CLOSURE
+  LazyUpvalue upvalues[];
+} LazyBody;
+
+bool lazy_compile = false;
+
+/// Whether a body is being compiled by compile_function_body(), when the VM already has the globals
+static bool globals_fixed = false;
+
 Parser parser;
 
 Table symbol_table;
 
 Compiler* current;
 
+/// Script being optimized by compile(), once its compiler is gone
+static ObjectFunction* optimized_script = NULL;
+
 void mark_compiler_roots() {
   Compiler* compiler = current;
   while (compiler != NULL) {
@@ -118,9 +148,32 @@ void mark_compiler_roots() {
     mark_object((Object*)compiler->function);
     compiler = compiler->enclosing_compiler;
   }
+  if (optimized_script != NULL) {
+    mark_array(optimized_script->global_array);
+    mark_object((Object*)optimized_script);
+  }
   mark_table(&symbol_table);
 }
 
+/// Adds the first local of the function `current` compiles, in the slot of the closure being called
+static void add_callee_local(FunctionType type) {
+  Local* local = &current->locals[current->local_count++];
+  // Allocate first local to the this keyword
+  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
+    local->name.start = "this";
+    local->name.length = 4;
+    local->depth = current->scope_depth;
+    local->is_captured = false;
+  } else {  // else just init to 0 because in the stack it will only be stored the closure
+    local->depth = 0;
+    local->name.start = "";
+    local->name.length = 0;
+    local->is_captured = false;
+  }
+  local->mutated = false;
+  local->declared_at = 0;
+}
+
 static void init_compiler(Compiler* compiler_parameter, FunctionType type) {
   compiler_parameter->function = NULL;
   compiler_parameter->local_count = 0;
@@ -136,6 +189,7 @@ static void init_compiler(Compiler* compiler_parameter, FunctionType type) {
   } else {
     compiler_parameter->globals = current->globals;
   }
+  compiler_parameter->lazy = NULL;
   //
   compiler_parameter->enclosing_compiler = current;
   current = compiler_parameter;
@@ -143,29 +197,15 @@ static void init_compiler(Compiler* compiler_parameter, FunctionType type) {
   if (type != TYPE_SCRIPT) {
     current->function->name = copy_string(parser.previous.length, parser.previous.start);
   }
-
-  Local* local = &current->locals[current->local_count++];
-  // Allocate first local to the this keyword
-  if (type == TYPE_METHOD || type == TYPE_INITIALIZER) {
-    local->name.start = "this";
-    local->name.length = 4;
-    local->depth = compiler_parameter->scope_depth;
-    local->is_captured = false;
-  } else {  // else just init to 0 because in the stack it will only be stored the closure
-    local->depth = 0;
-    local->name.start = "";
-    local->name.length = 0;
-    local->is_captured = false;
-  }
+  add_callee_local(type);
   if (compiler_parameter->enclosing_compiler == NULL) {
     if (symbol_table.capacity != 0) {
       free_table(&symbol_table);
     }
     init_table(&symbol_table);
-    add_native_function("clock", clock_native);
-    add_native_function("push", push_array);
-    add_native_function("len", len_array);
-    add_native_function("pop", pop_array);
+    for (u32 i = 0; i < NATIVE_FUNCTION_COUNT; i++) {
+      add_native_function(native_functions[i].name, native_functions[i].function);
+    }
   }
 }
 
@@ -190,10 +230,20 @@ static inline void emit_op_u32(u8 op, u32 value) {
   emit_u32((op << 24) | (value << 16) | (value & 0xFF)); /* ! TODO: INCOMPLETE*/
 }
 // static inline void emit_op_u32(u8 op, u32 value) { emit_u((op << 24) | value); }
+/// Emits a variable access opcode, with the OP_WIDE prefix if `index` doesn't fit in a byte
+static inline void emit_variable_op(u8 op, u16 index) {
+  if (index <= UINT8_MAX) {
+    emit_op_u8(op, (u8)index);
+  } else {
+    emit_byte(OP_WIDE);
+    emit_op_u16(op, index);
+  }
+}
+
 static inline void emit_empty_return() {
   if (current->function_type == TYPE_INITIALIZER) {
     // Return the instance (first in the stack)
-    emit_op_u16(OP_GET_LOCAL, 0);
+    emit_op_u8(OP_GET_LOCAL, 0);
   } else {
     emit_byte(OP_NIL);
   }
@@ -302,6 +352,12 @@ i32 add_upvalue(Compiler* compiler, i32 upvalue_index, bool is_local) {
 /// Returns the upvalue index (if it finds one)
 static i32 resolve_upvalue(Compiler* compiler, Token* name) {
   if (compiler->enclosing_compiler == NULL) {
+    // A function compiled on its first call only has the upvalues it was created with
+    if (compiler->lazy == NULL) return -1;
+    for (i32 i = 0; i < compiler->function->upvalue_count; i++) {
+      Token* upvalue = &compiler->lazy->upvalues[i].name;
+      if (upvalue->length == name->length && memcmp(upvalue->start, name->start, name->length) == 0) return i;
+    }
     return -1;
   }
 
@@ -310,7 +366,9 @@ static i32 resolve_upvalue(Compiler* compiler, Token* name) {
 
   // It means that it's just above this function
   if (local != -1) {
-    compiler->enclosing_compiler->locals[local].is_captured = true;
+    Local* captured = &compiler->enclosing_compiler->locals[local];
+    captured->is_captured = true;
+    if (captured->depth == -1) captured->mutated = true;
     return add_upvalue(compiler, local, true);
   }
 
@@ -324,6 +382,17 @@ static i32 resolve_upvalue(Compiler* compiler, Token* name) {
   return -1;
 }
 
+/// Marks the local `name` resolves to, in `compiler` or in a function around it, as assigned
+static void mark_mutated(Compiler* compiler, Token* name) {
+  for (; compiler != NULL; compiler = compiler->enclosing_compiler) {
+    i32 local = resolve_local(compiler, name);
+    if (local != -1) {
+      compiler->locals[local].mutated = true;
+      return;
+    }
+  }
+}
+
 /// This is a function that parses a identifier ['=' <expression>] or emits a GET/SET code
 static void named_variable(Token name, bool can_assign) {
   u8 get_op;
@@ -350,9 +419,10 @@ static void named_variable(Token name, bool can_assign) {
   // This is an assignment
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_op_u16(set_op, (u16)arg);
+    if (set_op != OP_SET_GLOBAL) mark_mutated(current, &name);
+    emit_variable_op(set_op, (u16)arg);
   } else {
-    emit_op_u16(get_op, (u16)arg);
+    emit_variable_op(get_op, (u16)arg);
   }
 }
 
@@ -405,21 +475,23 @@ static i32 add_variable_to_global_symbols(Token* name, bool mutable, bool can_as
   bool exists = table_get(&symbol_table, str, &value);
   if (exists) {
     pop();
-    // if (mutable && value.type == VAL_INTERNAL_COMPILER_IMMUTABLE && can_assign) return -1;
-    return (u16)value.as.number;
+    // if (mutable && IS_COMPILER_SYMBOL_IMMUTABLE(value) && can_assign) return -1;
+    return (u16)AS_COMPILER_SYMBOL_INDEX(value);
   }
   // if (!can_assign) {
   //   return -1;
   // }
-  Value nil;
-  value.type = mutable ? VAL_INTERNAL_COMPILER_MUTABLE : VAL_INTERNAL_COMPILER_IMMUTABLE;
-  nil.type = VAL_NUMBER;
-  nil.as.number = 0;
-  push_value(current->globals, nil);
-  value.as.number = current->globals->count - 1;
-  table_set(&symbol_table, str, value);
+  if (globals_fixed) {
+    // The VM sized its globals already, compile() gives a slot to every name in the skipped bodies
+    pop();
+    error_at_previous("can't add a global variable once the script runs");
+    return 0;
+  }
+  push_value(current->globals, NUMBER_VAL(0));
+  i32 index = (i32)current->globals->count - 1;
+  table_set(&symbol_table, str, COMPILER_SYMBOL_VAL(mutable, index));
   pop();
-  return value.as.number;
+  return index;
 }
 
 static void add_native_function(const char* name, NativeFn function) {
@@ -436,9 +508,7 @@ static void add_native_function(const char* name, NativeFn function) {
     error_at_current("can't declare native function because name already exists");
     return;
   }
-  fill_value.type = VAL_INTERNAL_COMPILER_IMMUTABLE;
-  fill_value.as.number = current->globals->count - 1;
-  table_set(&symbol_table, name_str, fill_value);
+  table_set(&symbol_table, name_str, COMPILER_SYMBOL_VAL(false, current->globals->count - 1));
   pop();
 }
 
@@ -455,7 +525,7 @@ static inline void define_variable(u16 global) {
     mark_initialized();
     return;
   }
-  emit_op_u16(OP_DEFINE_GLOBAL, global);
+  emit_variable_op(OP_DEFINE_GLOBAL, global);
 }
 
 static inline void expression() { parse_precedence(PREC_ASSIGNMENT); }
@@ -465,12 +535,53 @@ static inline void begin_scope() {
   ++current->scope_depth;
 }
 
+/// Turns the reads of upvalue `index` of `function` into OP_GET_CAPTURED, in the closures it makes
+/// that capture it again too
+static void read_captured(ObjectFunction* function, u8 index) {
+  if (function->lazy != NULL) {
+    // compile_function_body() does it on the body
+    function->lazy->upvalues[index].by_value = true;
+    return;
+  }
+  Chunk* chunk = &function->chunk;
+  for (u32 offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+    u8* code = &chunk->code[offset];
+    if (code[0] == OP_GET_UPVALUE && code[1] == index) code[0] = OP_GET_CAPTURED;
+    if (code[0] != OP_CLOSURE) continue;
+    ObjectFunction* closure = (ObjectFunction*)AS_OBJECT(chunk->constants.values[(code[1] << 8) | code[2]]);
+    for (i32 i = 0; i < closure->upvalue_count; i++) {
+      if (code[3 + 2 * i] == CAPTURE_UPVALUE && code[4 + 2 * i] == index) read_captured(closure, (u8)i);
+    }
+  }
+}
+
+/// Makes the closures that capture the local in `slot` copy it instead of sharing it through an
+/// ObjectUpvalue, unless it can change after they capture it. Called once the local goes out of
+/// scope, when all of them are compiled. Returns whether they copy it
+static bool capture_by_value(i32 slot) {
+  Local* local = &current->locals[slot];
+  if (!local->is_captured || local->mutated || parser.had_error) return false;
+  // The local is the only one in its slot from its declaration on
+  Chunk* chunk = current_chunk();
+  for (u32 offset = local->declared_at; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+    u8* code = &chunk->code[offset];
+    if (code[0] != OP_CLOSURE) continue;
+    ObjectFunction* closure = (ObjectFunction*)AS_OBJECT(chunk->constants.values[(code[1] << 8) | code[2]]);
+    for (i32 i = 0; i < closure->upvalue_count; i++) {
+      if (code[3 + 2 * i] != CAPTURE_LOCAL || code[4 + 2 * i] != slot) continue;
+      code[3 + 2 * i] = CAPTURE_LOCAL_VALUE;
+      read_captured(closure, (u8)i);
+    }
+  }
+  return true;
+}
+
 static inline void end_scope() {
   // : )
   --current->scope_depth;
   // Pop out of the scope all the declared variables...
   while (current->local_count > 0 && current->locals[current->local_count - 1].depth > current->scope_depth) {
-    if (current->locals[current->local_count - 1].is_captured)
+    if (current->locals[current->local_count - 1].is_captured && !capture_by_value(current->local_count - 1))
       emit_byte(OP_CLOSE_UPVALUE);
     else
       emit_byte(OP_POP);
@@ -514,6 +625,8 @@ static void add_local(Token name, bool mutable) {
   local->depth = -1;
   local->mutable = mutable;
   local->is_captured = false;
+  local->mutated = false;
+  local->declared_at = current_chunk()->count;
 }
 
 static void try_declare_local_variable(bool mutable) {
@@ -559,17 +672,29 @@ static void var_declaration(bool mutable) {
 
 static inline ObjectFunction* end_compiler() {
   emit_empty_return();
+  // The locals of the outermost scope, OP_RETURN closes the upvalues of the ones still shared
+  for (i32 i = 0; i < current->local_count; i++) capture_by_value(i);
   ObjectFunction* function = current->function;
   function->global_array = current->globals;
-#ifdef DEBUG_PRINT_CODE
-  if (!parser.had_error) {
-    dissasemble_chunk(&function->chunk, function->name != NULL ? function->name->chars : "<script>");
-  }
-#endif
   current = current->enclosing_compiler;
   return function;
 }
 
+/// Runs peephole_optimize() on `function` and the functions it creates, which go first
+static void peephole_optimize_tree(ObjectFunction* function) {
+  ValueArray* constants = &function->chunk.constants;
+  for (u32 i = 0; i < constants->count; i++) {
+    if (IS_OBJECT(constants->values[i]) && OBJECT_TYPE(constants->values[i]) == OBJECT_FUNCTION &&
+        ((ObjectFunction*)AS_OBJECT(constants->values[i]))->lazy == NULL) {
+      peephole_optimize_tree((ObjectFunction*)AS_OBJECT(constants->values[i]));
+    }
+  }
+  peephole_optimize(function);
+#ifdef DEBUG_PRINT_CODE
+  dissasemble_chunk(&function->chunk, function->name != NULL ? function->name->chars : "<script>");
+#endif
+}
+
 static void user_level_statement(u8 op_code_to_emit) {
   expression();
   assert_current_and_advance(TOKEN_SEMICOLON, "Expected ';' after value.");
@@ -598,9 +723,6 @@ static void binary(bool _) {
   parse_precedence((Precedence)(rule->precedence + 1));
   // Emit the operator instruction.
   switch (operator_type) {
-    // case TOKEN_EQUAL:
-    //   emit_byte(OP_EQUAL);
-    //   break;
     case TOKEN_GREATER:
       emit_byte(OP_GREATER);
       break;
@@ -610,18 +732,15 @@ static void binary(bool _) {
     case TOKEN_EQUAL_EQUAL:
       emit_byte(OP_EQUAL);
       break;
-    case TOKEN_BANG_EQUAL: {
-      emit_op_u8(OP_EQUAL, OP_NOT);
+    case TOKEN_BANG_EQUAL:
+      emit_byte(OP_NOT_EQUAL);
       break;
-    }
-    case TOKEN_GREATER_EQUAL: {
-      emit_op_u8(OP_LESS, OP_NOT);
+    case TOKEN_GREATER_EQUAL:
+      emit_byte(OP_GREATER_EQUAL);
       break;
-    }
-    case TOKEN_LESS_EQUAL: {
-      emit_op_u8(OP_GREATER, OP_NOT);
+    case TOKEN_LESS_EQUAL:
+      emit_byte(OP_LESS_EQUAL);
       break;
-    }
     case TOKEN_PLUS:
       emit_byte(OP_ADD);
       break;
@@ -716,11 +835,14 @@ static void patch_jump(i32 jump_code_slot) {
     error_at_current("we can't let you do ifs that jump 65000 op codes");
     return;
   }
-  // printf("%d %d\n", ((lines_to_jump & 0xFF00) | (lines_to_jump & 0xFF)), jump_code_slot);
   current_chunk()->code[jump_code_slot] = (lines_to_jump & 0xFF00) >> 8;
   current_chunk()->code[jump_code_slot + 1] = lines_to_jump & 0xFF;
 }
 
+/// Emits the jump taken when the condition on top of the stack is false. The condition is popped
+/// on both paths, the fuse-conditions pass (qw_passes.h) turns it into a compare-and-branch
+static i32 emit_condition_jump() { return emit_jump(OP_POP_JUMP_IF_FALSE); }
+
 static void and_op(bool _) {
   i32 end_jump = emit_jump(OP_JUMP_IF_FALSE);
   emit_byte(OP_POP);
@@ -746,15 +868,11 @@ static void if_statement() {
   assert_current_and_advance(TOKEN_RIGHT_PAREN, "Expected ')' after condition");
 #endif
   // First condition
-  i32 then_jump = emit_jump(OP_JUMP_IF_FALSE);
-  // Pop the condition
-  emit_byte(OP_POP);
+  i32 then_jump = emit_condition_jump();
   // Parse stmts of if
   statement(false);
   // Emit else opcode
   i32 else_jump = emit_jump(OP_JUMP);
-  // Pop the condition
-  emit_byte(OP_POP);
   // Patch now the if
   patch_jump(then_jump);
   // Now if there is an else, parse more statements
@@ -790,18 +908,33 @@ static void call(bool can_assign) {
   emit_op_u8(OP_CALL, arg_list);
 }
 
+/// Reserves an inline cache for the instruction that starts at the current offset
+static u16 make_inline_cache() {
+  if (current->function->inline_cache_count == UINT16_MAX) {
+    error_at_previous("too many property accesses in one function");
+    return 0;
+  }
+  return (u16)add_inline_cache(current->function, current_chunk()->count);
+}
+
 static void dot(bool assignable) {
   assert_current_and_advance(TOKEN_IDENTIFIER, "Expected identifier after .");
   u16 name = make_constant(OBJECT_VAL(copy_string(parser.previous.length, parser.previous.start)));
   if (assignable && match(TOKEN_EQUAL)) {
     expression();
+    u16 cache = make_inline_cache();
     emit_op_u16(OP_SET_PROPERTY, name);
+    emit_u16(cache);
   } else if (match(TOKEN_LEFT_PAREN)) {
     u8 arg_count = argument_list();
+    u16 cache = make_inline_cache();
     emit_op_u16(OP_INVOKE, name);
     emit_byte(arg_count);
+    emit_u16(cache);
   } else {
+    u16 cache = make_inline_cache();
     emit_op_u16(OP_GET_PROPERTY, name);
+    emit_u16(cache);
   }
 }
 
@@ -814,12 +947,10 @@ static void while_statement() {
 #if USE_PARENS_FOR_STATEMENT_CONDITIONS
   assert_current_and_advance(TOKEN_RIGHT_PAREN, "Expected ')' after condition");
 #endif
-  i32 jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  i32 jump = emit_condition_jump();
   statement(false);
   emit_loop(condition_start);
   patch_jump(jump);
-  emit_byte(OP_POP);
 }
 
 static void for_statement() {
@@ -844,9 +975,7 @@ static void for_statement() {
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     assert_current_and_advance(TOKEN_SEMICOLON, "Expected ; after second expression on for");
-    jump = emit_jump(OP_JUMP_IF_FALSE);
-    // pop prev. expression
-    emit_byte(OP_POP);
+    jump = emit_condition_jump();
   }
 
   if (!match(TOKEN_RIGHT_PAREN)) {
@@ -866,14 +995,61 @@ static void for_statement() {
 
   if (jump != -1) {
     patch_jump(jump);
-    emit_byte(OP_POP);
   }
 
   end_scope();
 }
 
-static void when_condition(void);
-static void handle_token_bar() {
+/// Patterns of the `when` being compiled. It becomes an OP_SWITCH if they are all literals
+typedef struct {
+  SwitchPattern* patterns;
+  u32 pattern_count;
+  u32 pattern_capacity;
+  /// Offset of the statement of every arm, one more for the `nothing` arm
+  u32* targets;
+  /// OP_JUMP to the end of the `when` at the end of every arm
+  i32* end_jumps;
+  u32 arm_count;
+  u32 arm_capacity;
+  /// Whether every pattern so far is a number or string literal, numbers for ranges
+  bool literal;
+} WhenPatterns;
+
+/// Returns whether the code from `start` on only pushes a number or string constant (`-` in front of
+/// numbers included), whose index it leaves in `constant`
+static bool literal_pattern(u32 start, u32* constant) {
+  Chunk* chunk = current_chunk();
+  u8* code = &chunk->code[start];
+  u32 length = chunk->count - start;
+  if (length == 0 || (code[0] != OP_CONSTANT && code[0] != OP_CONSTANT_LONG)) return false;
+  u32 constant_length = op_code_length(code[0]);
+  bool negated = length == constant_length + 1 && code[constant_length] == OP_NEGATE;
+  if (length != constant_length && !negated) return false;
+  *constant = code[0] == OP_CONSTANT ? code[1] : (u32)((code[1] << 8) | code[2]);
+  Value value = chunk->constants.values[*constant];
+  if (negated) {
+    if (!IS_NUMBER(value)) return false;
+    *constant = make_constant(NUMBER_VAL(-AS_NUMBER(value)));
+    return true;
+  }
+  return IS_NUMBER(value) || IS_STRING(value);
+}
+
+static void add_when_pattern(WhenPatterns* when, SwitchPattern pattern, bool literal) {
+  if (!literal) {
+    when->literal = false;
+    return;
+  }
+  if (when->pattern_capacity < when->pattern_count + 1) {
+    u32 old_capacity = when->pattern_capacity;
+    when->pattern_capacity = GROW_CAPACITY(old_capacity);
+    when->patterns = GROW_ARRAY(SwitchPattern, when->patterns, old_capacity, when->pattern_capacity);
+  }
+  when->patterns[when->pattern_count++] = pattern;
+}
+
+static void when_condition(WhenPatterns* when);
+static void handle_token_bar(WhenPatterns* when) {
   // This is the equivalent of doing an OR
   i32 else_jump = emit_jump(OP_JUMP_IF_FALSE);
   i32 end_jump = emit_jump(OP_JUMP);
@@ -881,47 +1057,90 @@ static void handle_token_bar() {
   // Pop previous condition
   emit_byte(OP_POP);
   // Try again
-  when_condition();
+  when_condition(when);
   // Set the jump to this if true
   patch_jump(end_jump);
 }
 
-static void when_condition() {
+static void when_condition(WhenPatterns* when) {
   // Repeat the same value
   emit_byte(OP_PUSH_TOP);
+  SwitchPattern pattern = {.arm = (u16)when->arm_count};
+  u32 start = current_chunk()->count;
   expression();
+  bool literal = literal_pattern(start, &pattern.low);
   if (match(TOKEN_BAR)) {
     emit_byte(OP_EQUAL);
-    handle_token_bar();
+    add_when_pattern(when, pattern, literal);
+    handle_token_bar(when);
   } else if (match(TOKEN_DOUBLE_POINT)) {
+    pattern.line = parser.previous.line;
     emit_byte(OP_GREATER);
     i32 jump = emit_jump(OP_JUMP_IF_FALSE);
     emit_byte(OP_POP);
     emit_byte(OP_PUSH_TOP);
+    start = current_chunk()->count;
     expression();
+    pattern.range = true;
+    literal = literal && IS_NUMBER(current_chunk()->constants.values[pattern.low]) &&
+              literal_pattern(start, &pattern.high) && IS_NUMBER(current_chunk()->constants.values[pattern.high]);
     emit_byte(OP_LESS);
     patch_jump(jump);
+    add_when_pattern(when, pattern, literal);
     // Keep checking token_bars
     if (match(TOKEN_BAR)) {
-      handle_token_bar();
+      handle_token_bar(when);
     }
   } else {
     emit_byte(OP_EQUAL);
+    add_when_pattern(when, pattern, literal);
   }
 }
 
-static i32 do_when_condition() {
-  when_condition();
-  i32 to_jump = emit_jump(OP_JUMP_IF_FALSE);
+/// Records the statement of the next arm, which starts at `target` and ends with `end_jump`
+static void add_when_arm(WhenPatterns* when, u32 target, i32 end_jump) {
+  // Room for the target of the `nothing` arm
+  if (when->arm_capacity < when->arm_count + 2) {
+    u32 old_capacity = when->arm_capacity;
+    when->arm_capacity = GROW_CAPACITY(old_capacity + 1);
+    when->targets = GROW_ARRAY(u32, when->targets, old_capacity, when->arm_capacity);
+    when->end_jumps = GROW_ARRAY(i32, when->end_jumps, old_capacity, when->arm_capacity);
+  }
+  when->targets[when->arm_count] = target;
+  when->end_jumps[when->arm_count++] = end_jump;
+}
+
+static void do_when_condition(WhenPatterns* when) {
+  // Arms are numbered with a u16 and the last number is the `nothing` arm
+  if (when->arm_count == UINT16_MAX - 1) when->literal = false;
+  when_condition(when);
+  i32 to_jump = emit_condition_jump();
   assert_current_and_advance(TOKEN_MINUS_ARROW, "expected arrow...");
-  // emit_byte(OP_POP);
+  u32 target = current_chunk()->count;
   statement(false);
-  emit_byte(OP_POP);
-  i32 jump = emit_jump(OP_JUMP);
+  add_when_arm(when, target, emit_jump(OP_JUMP));
   patch_jump(to_jump);
-  // Pop out the condition
-  emit_byte(OP_POP);
-  return jump;
+}
+
+/// Turns the OP_SWITCH placeholder at `dispatch` into the switch of `when`, the `nothing` arm starting
+/// at `nothing`. If some pattern isn't a literal it becomes a jump to the comparisons right after it,
+/// which the thread-jumps pass removes
+static void emit_switch_table(WhenPatterns* when, u32 dispatch, u32 nothing) {
+  ObjectFunction* function = current->function;
+  if (!when->literal || when->pattern_count == 0 || parser.had_error || function->switch_count == UINT16_MAX) {
+    current_chunk()->code[dispatch] = OP_JUMP;
+    current_chunk()->code[dispatch + 1] = current_chunk()->code[dispatch + 2] = 0;
+    FREE_ARRAY(SwitchPattern, when->patterns, when->pattern_capacity);
+    FREE_ARRAY(u32, when->targets, when->arm_capacity);
+    return;
+  }
+  when->targets[when->arm_count] = nothing;
+  // The table takes both arrays
+  SwitchPattern* patterns = GROW_ARRAY(SwitchPattern, when->patterns, when->pattern_capacity, when->pattern_count);
+  u32* targets = GROW_ARRAY(u32, when->targets, when->arm_capacity, when->arm_count + 1);
+  u32 index = add_switch_table(function, patterns, when->pattern_count, (u16)when->arm_count, targets);
+  current_chunk()->code[dispatch + 1] = (index >> 8) & 0xFF;
+  current_chunk()->code[dispatch + 2] = index & 0xFF;
 }
 
 // Parses and generates bytecode for the following grammar rules
@@ -933,33 +1152,35 @@ static i32 do_when_condition() {
 //     when_expression ::= expression (when_operators expression)*
 //     when_operators ::= '|' | '..'
 // ```
+// The patterns are compared with the value one after the other, unless they are all literals: then
+// an OP_SWITCH jumps straight to the arm and the comparisons are left unreachable
 static void when_statement() {
   // Get the expression on top of the stack
   expression();
   assert_current_and_advance(TOKEN_LEFT_BRACE, "Expected brace TODO ERROR");
-  // Maximum 64 Jumps. NOTE: Maybe we should do it dynamic?
-  i32 jumps[64] = {};
-  u8 i = 0;
-  // Meanwhile we don't arrive at the last condition, keep getting jumps
-  while (!match(TOKEN_NOTHING)) {
-    jumps[i] = do_when_condition();
-    i++;
+  u32 dispatch = current_chunk()->count;
+  emit_op_u16(OP_SWITCH, 0xFFFF);
+  WhenPatterns when = {NULL, 0, 0, NULL, NULL, 0, 0, true};
+  // Meanwhile we don't arrive at the last condition, keep getting arms
+  while (!match(TOKEN_NOTHING) && !check(TOKEN_EOF)) {
+    do_when_condition(&when);
   }
   // Check that we got a -> next to the nothing
   assert_current_and_advance(TOKEN_MINUS_ARROW, "Expected arrow");
+  u32 nothing = current_chunk()->count;
   // parse the statement next to ->
   statement(false);
-  for (int j = 0; j < i; j++) {
-    patch_jump(jumps[j]);
+  for (u32 i = 0; i < when.arm_count; i++) {
+    patch_jump(when.end_jumps[i]);
   }
+  FREE_ARRAY(i32, when.end_jumps, when.arm_capacity);
   emit_byte(OP_POP);
   assert_current_and_advance(TOKEN_RIGHT_BRACE, "Expected brace TODO ERROR");
+  emit_switch_table(&when, dispatch, nothing);
 }
 
-static void parse_function(FunctionType type) {
-  // Initialize a new compiler for this function
-  Compiler compiler;
-  init_compiler(&compiler, type);
+/// Parses the parameters of the function `current` compiles, up to the '{' of its body
+static void function_parameters() {
   begin_scope();
   assert_current_and_advance(TOKEN_LEFT_PAREN, "Expected '(' after a function name");
   if (!check(TOKEN_RIGHT_PAREN)) {
@@ -975,9 +1196,143 @@ static void parse_function(FunctionType type) {
   assert_current_and_advance(TOKEN_RIGHT_PAREN, "Expected ')' after a function name");
 
   assert_current_and_advance(TOKEN_LEFT_BRACE, "Expected '{' before fn body");
-  block();
+}
+
+/// Resolves the identifier `name` of a skipped body the way named_variable() will: a local of the
+/// function needs nothing, a variable of the functions around it becomes an upvalue (named in
+/// `upvalues`) and anything else gets its global slot
+static void resolve_skipped_name(Token* name, Token* upvalues) {
+  if (resolve_local(current, name) != -1) return;
+  i32 upvalue = resolve_upvalue(current, name);
+  if (upvalue == -1) {
+    add_variable_to_global_symbols(name, true, true);
+    return;
+  }
+  upvalues[upvalue] = *name;
+  if (check(TOKEN_EQUAL)) mark_mutated(current, name);
+}
 
-  ObjectFunction* function = end_compiler();
+/// Names declared in a skipped body: its locals, the ones of the functions in it and their
+/// parameters. `depths` holds the depth of the block each is in, they go out of scope with it
+typedef struct {
+  Token* names;
+  u32* depths;
+  u32 count;
+  u32 capacity;
+} SkippedDeclarations;
+
+static void declare_skipped(SkippedDeclarations* declarations, Token* name, u32 depth) {
+  if (declarations->capacity < declarations->count + 1) {
+    u32 old_capacity = declarations->capacity;
+    declarations->capacity = GROW_CAPACITY(old_capacity);
+    declarations->names = GROW_ARRAY(Token, declarations->names, old_capacity, declarations->capacity);
+    declarations->depths = GROW_ARRAY(u32, declarations->depths, old_capacity, declarations->capacity);
+  }
+  declarations->names[declarations->count] = *name;
+  declarations->depths[declarations->count++] = depth;
+}
+
+static bool is_skipped_declaration(SkippedDeclarations* declarations, Token* name) {
+  for (u32 i = 0; i < declarations->count; i++) {
+    Token* declared = &declarations->names[i];
+    if (declared->length == name->length && memcmp(declared->start, name->start, name->length) == 0) return true;
+  }
+  return false;
+}
+
+/// Skips the body of the function `current` compiles, leaving compile_function_body() what it needs
+/// to compile it. The closure is created before the body is compiled, so every identifier of the
+/// body (of the functions in it too) that isn't declared in it is resolved now. Declarations are
+/// only tracked where their scope is the block they are in (a statement of their own, not the
+/// body of an if or a for): a name taken for an outer variable only costs an unused upvalue or
+/// global slot, one missed would leave the body without its upvalue
+static ObjectFunction* skip_function_body(const char* source, u32 line, FunctionType type) {
+  Token upvalues[UINT8_MAX];
+  SkippedDeclarations declarations = {NULL, NULL, 0, 0};
+  u32 depth = 1;
+  // Depth of the class bodies being skipped, whose `name(` start methods
+  u32 class_bodies[UINT8_MAX];
+  u32 class_body_count = 0;
+  bool class_body_next = false;
+  bool in_parameters = false;
+  TokenType before = TOKEN_LEFT_BRACE;
+  TokenType before_before = TOKEN_LEFT_BRACE;
+  while (depth > 0 && !check(TOKEN_EOF)) {
+    advance();
+    Token token = parser.previous;
+    bool at_class_body = class_body_count > 0 && class_bodies[class_body_count - 1] == depth;
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+      if (class_body_next && class_body_count < UINT8_MAX) class_bodies[class_body_count++] = depth;
+      class_body_next = false;
+    } else if (token.type == TOKEN_RIGHT_BRACE) {
+      if (at_class_body) class_body_count--;
+      depth--;
+      while (declarations.count > 0 && declarations.depths[declarations.count - 1] > depth) declarations.count--;
+    } else if (in_parameters) {
+      // Their scope is the body that follows
+      if (token.type == TOKEN_IDENTIFIER) declare_skipped(&declarations, &token, depth + 1);
+      in_parameters = token.type != TOKEN_RIGHT_PAREN;
+    } else if (token.type == TOKEN_LEFT_PAREN && before == TOKEN_IDENTIFIER &&
+               (before_before == TOKEN_FUN ||
+                (at_class_body && (before_before == TOKEN_LEFT_BRACE || before_before == TOKEN_RIGHT_BRACE)))) {
+      in_parameters = true;
+    } else if (before == TOKEN_DOT) {
+      // A property
+    } else if (token.type == TOKEN_IDENTIFIER &&
+               (before == TOKEN_VAR || before == TOKEN_LET || before == TOKEN_FUN || before == TOKEN_CLASS)) {
+      bool statement = before_before == TOKEN_LEFT_BRACE || before_before == TOKEN_RIGHT_BRACE ||
+                       before_before == TOKEN_SEMICOLON;
+      if (statement) declare_skipped(&declarations, &token, depth);
+      class_body_next = before == TOKEN_CLASS;
+    } else if (token.type == TOKEN_IDENTIFIER) {
+      if (!at_class_body && !is_skipped_declaration(&declarations, &token)) resolve_skipped_name(&token, upvalues);
+    } else if ((token.type == TOKEN_THIS || token.type == TOKEN_SUPER) && current_class != NULL) {
+      // super() reads both
+      Token this_token = {.type = TOKEN_THIS, .start = "this", .length = 4, .line = token.line};
+      resolve_skipped_name(&this_token, upvalues);
+      Token super_token = {.type = TOKEN_IDENTIFIER, .start = "super", .length = 5, .line = token.line};
+      if (token.type == TOKEN_SUPER) resolve_skipped_name(&super_token, upvalues);
+    }
+    before_before = before;
+    before = token.type;
+  }
+  FREE_ARRAY(Token, declarations.names, declarations.capacity);
+  FREE_ARRAY(u32, declarations.depths, declarations.capacity);
+  if (depth > 0) error_at_current("Expected '}' at the end of the block");
+
+  ObjectFunction* function = current->function;
+  LazyBody* lazy = malloc(sizeof(LazyBody) + function->upvalue_count * sizeof(LazyUpvalue));
+  lazy->source = source;
+  lazy->line = line;
+  lazy->type = type;
+  lazy->in_class = current_class != NULL;
+  lazy->has_superclass = current_class != NULL && current_class->has_superclass;
+  for (i32 i = 0; i < function->upvalue_count; i++) {
+    lazy->upvalues[i].name = upvalues[i];
+    lazy->upvalues[i].by_value = false;
+  }
+  function->lazy = lazy;
+  function->global_array = current->globals;
+  current = current->enclosing_compiler;
+  return function;
+}
+
+static void parse_function(FunctionType type) {
+  // Initialize a new compiler for this function
+  Compiler compiler;
+  init_compiler(&compiler, type);
+  // Where compile_function_body() starts over
+  const char* source = parser.current.start;
+  u32 line = parser.current.line;
+  function_parameters();
+  ObjectFunction* function;
+  if (lazy_compile) {
+    function = skip_function_body(source, line, type);
+  } else {
+    block();
+    function = end_compiler();
+  }
   push(OBJECT_VAL(function));
   u16 constant = make_constant(OBJECT_VAL(function));
   pop();
@@ -985,7 +1340,7 @@ static void parse_function(FunctionType type) {
 
   // emit_constant(OBJECT_VAL(function));
   for (i32 i = 0; i < function->upvalue_count; ++i) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
+    emit_byte(compiler.upvalues[i].is_local ? CAPTURE_LOCAL : CAPTURE_UPVALUE);
     // IF NOT LOCAL: It will store where in the frame above is stored
     // IF LOCAL : It will store where in the stack is stored
     emit_byte(compiler.upvalues[i].index);
@@ -998,6 +1353,10 @@ static void fun_declaration(void) {
   u16 global = parse_variable("Expected function name.", false);
   mark_initialized();
   parse_function(TYPE_FUNCTION);
+  // A function calling itself captures its variable before OP_CLOSURE puts it there
+  if (current->scope_depth > 0 && current->locals[current->local_count - 1].is_captured) {
+    current->locals[current->local_count - 1].mutated = true;
+  }
   define_variable(global);
 }
 
@@ -1212,7 +1571,64 @@ ObjectFunction* compile(const char* source) {
   }
   assert_current_and_advance(TOKEN_EOF, "Expected end of expression");
   ObjectFunction* fn = end_compiler();
-  return parser.had_error ? NULL : fn;
+  if (parser.had_error) return NULL;
+  // Inlining needs the whole script, the calls of a function can be to functions declared after it
+  optimized_script = fn;
+  // Without the bodies there is nothing to inline, each function is optimized once it is compiled
+  if (lazy_compile) {
+    optimize_function(fn);
+  } else {
+    optimize_script(fn);
+  }
+  peephole_optimize_tree(fn);
+  optimized_script = NULL;
+  return fn;
+}
+
+bool compile_function_body(ObjectFunction* function) {
+  LazyBody* lazy = function->lazy;
+  init_scanner_at(lazy->source, lazy->line);
+  parser.had_error = 0;
+  parser.panic_mode = 0;
+  Compiler compiler;
+  compiler.enclosing_compiler = NULL;
+  compiler.function = function;
+  compiler.function_type = lazy->type;
+  compiler.globals = function->global_array;
+  compiler.local_count = 0;
+  compiler.scope_depth = 0;
+  compiler.lazy = lazy;
+  current = &compiler;
+  add_callee_local(lazy->type);
+  ClassCompiler class_compiler;
+  class_compiler.enclosing = NULL;
+  class_compiler.has_superclass = lazy->has_superclass;
+  current_class = lazy->in_class ? &class_compiler : NULL;
+  globals_fixed = true;
+
+  function->number_of_parameters = 0;
+  advance();
+  function_parameters();
+  block();
+  end_compiler();
+
+  globals_fixed = false;
+  current_class = NULL;
+  // The VM stops at the error, the function is never called again
+  if (parser.had_error) return false;
+  function->lazy = NULL;
+  for (i32 i = 0; i < function->upvalue_count; i++) {
+    if (lazy->upvalues[i].by_value) read_captured(function, (u8)i);
+  }
+  free(lazy);
+  optimize_function(function);
+  peephole_optimize_tree(function);
+  return true;
+}
+
+void free_lazy_body(ObjectFunction* function) {
+  free(function->lazy);
+  function->lazy = NULL;
 }
 
 /*
@@ -35,6 +35,11 @@ typedef struct {
   i32 depth;
   bool mutable;
   bool is_captured;
+  /// Whether the variable can change after a closure captured it: it is assigned, or captured
+  /// before it has its value (a function calling itself). Closures copy the others
+  bool mutated;
+  /// Offset of the code where the variable is declared, the closures capturing it come after
+  u32 declared_at;
 } Local;
 
 typedef struct {
@@ -59,12 +64,26 @@ typedef struct Compiler {
   i32 local_count;
   i32 scope_depth;
   Upvalue upvalues[UINT8_MAX];
+  /// Upvalues of a function compiled on its first call, where the names the functions around it
+  /// resolve to are looked up. NULL for the others
+  struct LazyBody* lazy;
 } Compiler;
 
 extern Table symbol_table;
 extern Compiler* current;
+/// Whether compile() skips the bodies of functions, for call_value() to compile each one on its
+/// first call with compile_function_body(), set with --lazy. The source given to compile() must
+/// stay alive while the functions can be called
+extern bool lazy_compile;
 ObjectFunction* compile(const char* source);
 
+/// Compiles the body compile() skipped of `function` (ObjectFunction.lazy), returns false if it
+/// has errors, which are reported like the ones compile() finds
+bool compile_function_body(ObjectFunction* function);
+
+/// Frees the record of the body compile() skipped of `function`, if it still has it
+void free_lazy_body(ObjectFunction* function);
+
 void mark_compiler_roots();
 
 #endif
\ No newline at end of file
@@ -50,6 +50,51 @@ static u32 constant_instruction_long(const char* name, Chunk* chunk, u32 offset)
   return offset + 3;
 }
 
+/// Instructions with a 1 byte operand that isn't a constant (slots, indexes)
+static u32 byte_instruction(const char* name, Chunk* chunk, u32 offset) {
+  printf("%-16s %4d\n", name, chunk->code[offset + 1]);
+  return offset + 2;
+}
+
+/// Reads the big endian u16 at `offset`
+static u16 read_u16(Chunk* chunk, u32 offset) { return (chunk->code[offset] << 8) | chunk->code[offset + 1]; }
+
+/// Jumps with a u16 offset relative to the end of the instruction, `sign` is -1 for backward jumps
+static u32 jump_instruction(const char* name, i32 sign, Chunk* chunk, u32 offset) {
+  u16 jump = read_u16(chunk, offset + 1);
+  printf("%-16s %4d -> %d\n", name, jump, (i32)offset + 3 + sign * jump);
+  return offset + 3;
+}
+
+/// Instructions with a u16 constant followed by a u16 inline cache index
+static u32 cached_instruction(const char* name, Chunk* chunk, u32 offset) {
+  u16 cache = (chunk->code[offset + 3] << 8) | chunk->code[offset + 4];
+  printf("%-16s (cache %d) ", name, cache);
+  constant_instruction_long("", chunk, offset);
+  return offset + 5;
+}
+
+
+/// Superinstructions that read a local and a 1 byte constant
+static u32 local_constant_instruction(const char* name, Chunk* chunk, u32 offset) {
+  printf("%-16s %4d, ", name, chunk->code[offset + 1]);
+  print_value(chunk->constants.values[chunk->code[offset + 3]]);
+  printf("\n");
+  return offset + instruction_length(chunk, offset);
+}
+
+/// Superinstructions with a single u16 operand `operand_offset` bytes after the opcode
+static u32 u16_superinstruction(const char* name, Chunk* chunk, u32 offset, u32 operand_offset) {
+  printf("%-16s %4d\n", name, read_u16(chunk, offset + operand_offset));
+  return offset + instruction_length(chunk, offset);
+}
+
+/// Superinstructions with a single u8 operand right after the opcode
+static u32 u8_superinstruction(const char* name, Chunk* chunk, u32 offset) {
+  printf("%-16s %4d\n", name, chunk->code[offset + 1]);
+  return offset + instruction_length(chunk, offset);
+}
+
 u32 dissasemble_instruction(Chunk* chunk, u32 offset) {
   printf("%04d | ", offset);
   if (offset > 0 && get_line_from_chunk(chunk, offset) == get_line_from_chunk(chunk, offset - 1)) {
@@ -114,36 +159,37 @@ u32 dissasemble_instruction(Chunk* chunk, u32 offset) {
       return simple_instruction("OP_POP", offset);
     }
     case OP_GET_GLOBAL: {
-      return constant_instruction_long("OP_GET_GLOBAL", chunk, offset);
+      return byte_instruction("OP_GET_GLOBAL", chunk, offset);
     }
     case OP_INVOKE: {
-      offset = constant_instruction_long("OP_INVOKE", chunk, offset);
-      offset++;
-      return offset;
+      u16 cache = (chunk->code[offset + 4] << 8) | chunk->code[offset + 5];
+      printf("OP_INVOKE (args %d) (cache %d) ", chunk->code[offset + 3], cache);
+      constant_instruction_long("", chunk, offset);
+      return offset + 6;
     }
     case OP_DEFINE_GLOBAL: {
-      return constant_instruction_long("OP_DEFINE_GLOBAL", chunk, offset);
+      return byte_instruction("OP_DEFINE_GLOBAL", chunk, offset);
     }
     case OP_SET_GLOBAL: {
-      return constant_instruction_long("OP_SET_GLOBAL", chunk, offset);
+      return byte_instruction("OP_SET_GLOBAL", chunk, offset);
     }
     case OP_GET_LOCAL: {
-      return constant_instruction_long("OP_GET_LOCAL", chunk, offset);
+      return byte_instruction("OP_GET_LOCAL", chunk, offset);
     }
     case OP_SET_LOCAL: {
-      return constant_instruction_long("OP_SET_LOCAL", chunk, offset);
+      return byte_instruction("OP_SET_LOCAL", chunk, offset);
     }
 
     case OP_JUMP_IF_FALSE: {
-      return constant_instruction_long("OP_JUMP_IF_FALSE", chunk, offset);
+      return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     }
 
     case OP_JUMP_BACK: {
-      return constant_instruction_long("OP_JUMP_BACK", chunk, offset);
+      return jump_instruction("OP_JUMP_BACK", -1, chunk, offset);
     }
 
     case OP_JUMP: {
-      return constant_instruction_long("OP_JUMP", chunk, offset);
+      return jump_instruction("OP_JUMP", 1, chunk, offset);
     }
 
     case OP_CALL: {
@@ -155,11 +201,14 @@ u32 dissasemble_instruction(Chunk* chunk, u32 offset) {
     }
 
     case OP_GET_UPVALUE: {
-      return constant_instruction_long("OP_GET_UPVALUE", chunk, offset);
+      return byte_instruction("OP_GET_UPVALUE", chunk, offset);
     }
 
     case OP_SET_UPVALUE: {
-      return constant_instruction_long("OP_SET_UPVALUE", chunk, offset);
+      return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+    }
+    case OP_GET_CAPTURED: {
+      return byte_instruction("OP_GET_CAPTURED", chunk, offset);
     }
     case OP_METHOD: {
       return constant_instruction_long("OP_METHOD", chunk, offset);
@@ -174,10 +223,10 @@ u32 dissasemble_instruction(Chunk* chunk, u32 offset) {
       return simple_instruction("OP_GET_PROPERTY_TOP_STACK", offset);
     }
     case OP_GET_PROPERTY: {
-      return constant_instruction_long("OP_GET_PROPERTY", chunk, offset);
+      return cached_instruction("OP_GET_PROPERTY", chunk, offset);
     }
     case OP_SET_PROPERTY: {
-      return constant_instruction_long("OP_SET_PROPERTY", chunk, offset);
+      return cached_instruction("OP_SET_PROPERTY", chunk, offset);
     }
     case OP_CLASS: {
       return constant_instruction_long("OP_CLASS", chunk, offset);
@@ -196,17 +245,286 @@ u32 dissasemble_instruction(Chunk* chunk, u32 offset) {
 
       offset = simple_instruction("OP_CLOSURE", offset);
       ObjectFunction* fn =
-          (ObjectFunction*)chunk->constants.values[(chunk->code[offset] << 8) | chunk->code[(offset + 1)]].as.object;
+          (ObjectFunction*)AS_OBJECT(chunk->constants.values[(chunk->code[offset] << 8) | chunk->code[(offset + 1)]]);
       offset += 2;
       for (u8 i = 0; i < fn->upvalue_count; ++i) {
         offset += 2;
       }
       return offset;
     }
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_NEGATE_NUMBER:
+    case OP_ADD_NUMBERS:
+    case OP_SUBTRACT_NUMBERS:
+    case OP_MULTIPLY_NUMBERS:
+    case OP_DIVIDE_NUMBERS:
+    case OP_GREATER_NUMBERS:
+    case OP_LESS_NUMBERS:
+    case OP_GREATER_EQUAL_NUMBERS:
+    case OP_LESS_EQUAL_NUMBERS: {
+      return simple_instruction(op_code_name(instruction), offset);
+    }
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_NUMBERS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS: {
+      return jump_instruction(op_code_name(instruction), 1, chunk, offset);
+    }
+    case OP_SWITCH: {
+      // The targets are in the SwitchTable of the function
+      printf("%-16s %4d\n", "OP_SWITCH", read_u16(chunk, offset + 1));
+      return offset + 3;
+    }
+    case OP_INSTANCE: {
+      return simple_instruction("OP_INSTANCE", offset);
+    }
+    case OP_INLINE_RETURN: {
+      return byte_instruction("OP_INLINE_RETURN", chunk, offset);
+    }
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT: {
+      return local_constant_instruction(op_code_name(instruction), chunk, offset);
+    }
+    case OP_ADD_LOCAL_LOCAL: {
+      printf("%-16s %4d, %d\n", "OP_ADD_LOCAL_LOCAL", chunk->code[offset + 1], chunk->code[offset + 3]);
+      return offset + 5;
+    }
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP: {
+      return u8_superinstruction(op_code_name(instruction), chunk, offset);
+    }
+    case OP_JUMP_IF_FALSE_POP: {
+      return u16_superinstruction(op_code_name(instruction), chunk, offset, 1);
+    }
+    case OP_GET_LOCAL_0:
+    case OP_GET_LOCAL_1:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3: {
+      return simple_instruction(op_code_name(instruction), offset);
+    }
+    case OP_WIDE: {
+      printf("OP_WIDE %-16s %4d\n", op_code_name(chunk->code[offset + 1]), read_u16(chunk, offset + 2));
+      return offset + 4;
+    }
+    case OP_POP_JUMP_BACK: {
+      return u16_superinstruction("OP_POP_JUMP_BACK", chunk, offset, 2);
+    }
     default: {
       printf("unknown opcode: %d\n", instruction);
       return offset + 1;
     }
   }
   return 0;
-}
\ No newline at end of file
+}
+
+void print_inline_cache_stats(ObjectFunction* function) {
+  const char* name = function->name != NULL ? function->name->chars : "<script>";
+  for (u32 i = 0; i < function->inline_cache_count; i++) {
+    InlineCache* cache = &function->inline_caches[i];
+    u32 total = cache->hits + cache->misses;
+    u32 classes = 0;
+    for (u32 j = 0; j < INLINE_CACHE_ENTRIES; j++) {
+      classes += cache->entries[j].kind != CACHE_EMPTY;
+    }
+    printf("[INLINE_CACHE] %s @%04d line %d: %u hits, %u misses (%.2f%%), %u entries\n", name, cache->offset,
+           get_line_from_chunk(&function->chunk, cache->offset), cache->hits, cache->misses,
+           total == 0 ? 0.0 : 100.0 * cache->hits / total, classes);
+  }
+  for (u32 i = 0; i < function->chunk.constants.count; i++) {
+    Value constant = function->chunk.constants.values[i];
+    if (IS_OBJECT(constant) && OBJECT_TYPE(constant) == OBJECT_FUNCTION) {
+      print_inline_cache_stats((ObjectFunction*)AS_OBJECT(constant));
+    }
+  }
+}
+
+static const char* op_code_names[OP_CODE_COUNT] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_BACK] = "OP_JUMP_BACK",
+    [OP_PUSH_TOP] = "OP_PUSH_TOP",
+    [OP_ASSERT] = "OP_ASSERT",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_GET_CAPTURED] = "OP_GET_CAPTURED",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY_TOP_STACK] = "OP_SET_PROPERTY_TOP_STACK",
+    [OP_GET_PROPERTY_TOP_STACK] = "OP_GET_PROPERTY_TOP_STACK",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_ARRAY] = "OP_ARRAY",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL] = "OP_JUMP_IF_NOT_LESS_EQUAL",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL] = "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    [OP_SWITCH] = "OP_SWITCH",
+    [OP_INSTANCE] = "OP_INSTANCE",
+    [OP_INLINE_RETURN] = "OP_INLINE_RETURN",
+    [OP_NEGATE_NUMBER] = "OP_NEGATE_NUMBER",
+    [OP_ADD_NUMBERS] = "OP_ADD_NUMBERS",
+    [OP_SUBTRACT_NUMBERS] = "OP_SUBTRACT_NUMBERS",
+    [OP_MULTIPLY_NUMBERS] = "OP_MULTIPLY_NUMBERS",
+    [OP_DIVIDE_NUMBERS] = "OP_DIVIDE_NUMBERS",
+    [OP_GREATER_NUMBERS] = "OP_GREATER_NUMBERS",
+    [OP_LESS_NUMBERS] = "OP_LESS_NUMBERS",
+    [OP_GREATER_EQUAL_NUMBERS] = "OP_GREATER_EQUAL_NUMBERS",
+    [OP_LESS_EQUAL_NUMBERS] = "OP_LESS_EQUAL_NUMBERS",
+    [OP_JUMP_IF_NOT_LESS_NUMBERS] = "OP_JUMP_IF_NOT_LESS_NUMBERS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS] = "OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS",
+    [OP_JUMP_IF_NOT_GREATER_NUMBERS] = "OP_JUMP_IF_NOT_GREATER_NUMBERS",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS] = "OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_GET_LOCAL_0] = "OP_GET_LOCAL_0",
+    [OP_GET_LOCAL_1] = "OP_GET_LOCAL_1",
+    [OP_GET_LOCAL_2] = "OP_GET_LOCAL_2",
+    [OP_GET_LOCAL_3] = "OP_GET_LOCAL_3",
+    [OP_WIDE] = "OP_WIDE",
+    [OP_GET_LOCAL_CONSTANT] = "OP_GET_LOCAL_CONSTANT",
+    [OP_ADD_LOCAL_LOCAL] = "OP_ADD_LOCAL_LOCAL",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_LESS_LOCAL_CONSTANT] = "OP_LESS_LOCAL_CONSTANT",
+    [OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT] = "OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_JUMP_IF_FALSE_POP] = "OP_JUMP_IF_FALSE_POP",
+    [OP_POP_JUMP_BACK] = "OP_POP_JUMP_BACK",
+};
+
+const char* op_code_name(u8 op_code) {
+  if (op_code >= OP_CODE_COUNT || op_code_names[op_code] == NULL) return "OP_UNKNOWN";
+  return op_code_names[op_code];
+}
+
+#ifdef DEBUG_OPCODE_PROFILE
+#include <stdlib.h>
+
+/// How many rows of each table print_op_code_profile() shows
+#define PROFILE_TOP 12
+
+static u64 op_code_counts[OP_CODE_COUNT];
+static u64 bigram_counts[OP_CODE_COUNT][OP_CODE_COUNT];
+static u64 trigram_counts[OP_CODE_COUNT][OP_CODE_COUNT][OP_CODE_COUNT];
+/// The two previously executed opcodes, OP_CODE_COUNT when there is none yet
+static u8 previous[2] = {OP_CODE_COUNT, OP_CODE_COUNT};
+
+void profile_op_code(u8 op_code) {
+  op_code_counts[op_code]++;
+  if (previous[1] != OP_CODE_COUNT) bigram_counts[previous[1]][op_code]++;
+  if (previous[0] != OP_CODE_COUNT) trigram_counts[previous[0]][previous[1]][op_code]++;
+  previous[0] = previous[1];
+  previous[1] = op_code;
+}
+
+typedef struct {
+  u64 count;
+  u8 op_codes[3];
+} Sequence;
+
+static int compare_sequences(const void* a, const void* b) {
+  u64 left = ((const Sequence*)a)->count;
+  u64 right = ((const Sequence*)b)->count;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+/// Sorts the `count` sequences of `length` opcodes and prints the most executed ones
+static void print_sequences(Sequence* sequences, u32 count, u32 length, u64 total) {
+  qsort(sequences, count, sizeof(Sequence), compare_sequences);
+  for (u32 i = 0; i < count && i < PROFILE_TOP && sequences[i].count > 0; i++) {
+    printf("[OPCODE_PROFILE] %12llu (%5.2f%%) ", (unsigned long long)sequences[i].count,
+           100.0 * sequences[i].count / total);
+    for (u32 j = 0; j < length; j++) {
+      printf("%s%s", j == 0 ? "" : " ", op_code_name(sequences[i].op_codes[j]));
+    }
+    printf("\n");
+  }
+}
+
+void print_op_code_profile() {
+  u64 total = 0;
+  for (u32 i = 0; i < OP_CODE_COUNT; i++) total += op_code_counts[i];
+  if (total == 0) return;
+  printf("[OPCODE_PROFILE] %llu dispatches\n", (unsigned long long)total);
+
+  static Sequence sequences[OP_CODE_COUNT * OP_CODE_COUNT * OP_CODE_COUNT];
+  u32 count = 0;
+  for (u32 i = 0; i < OP_CODE_COUNT; i++) {
+    sequences[count++] = (Sequence){op_code_counts[i], {i}};
+  }
+  print_sequences(sequences, count, 1, total);
+
+  count = 0;
+  for (u32 i = 0; i < OP_CODE_COUNT; i++) {
+    for (u32 j = 0; j < OP_CODE_COUNT; j++) {
+      if (bigram_counts[i][j] > 0) sequences[count++] = (Sequence){bigram_counts[i][j], {i, j}};
+    }
+  }
+  print_sequences(sequences, count, 2, total);
+
+  count = 0;
+  for (u32 i = 0; i < OP_CODE_COUNT; i++) {
+    for (u32 j = 0; j < OP_CODE_COUNT; j++) {
+      for (u32 k = 0; k < OP_CODE_COUNT; k++) {
+        if (trigram_counts[i][j][k] > 0) sequences[count++] = (Sequence){trigram_counts[i][j][k], {i, j, k}};
+      }
+    }
+  }
+  print_sequences(sequences, count, 3, total);
+
+  memset(op_code_counts, 0, sizeof(op_code_counts));
+  memset(bigram_counts, 0, sizeof(bigram_counts));
+  memset(trigram_counts, 0, sizeof(trigram_counts));
+  previous[0] = previous[1] = OP_CODE_COUNT;
+}
+#endif
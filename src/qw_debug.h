@@ -2,9 +2,22 @@
 #define qw_debug
 
 #include "qw_chunk.h"
+#include "qw_object.h"
 #include "qw_values.h"
 
 void dissasemble_chunk(Chunk* chunk, const char* name);
 u32 dissasemble_instruction(Chunk* chunk, u32 offset);
 
+/// Prints the hit/miss counters of every inline cache of `function` and of the functions it defines
+void print_inline_cache_stats(ObjectFunction* function);
+
+/// Returns the name of `op_code` ("OP_ADD"...)
+const char* op_code_name(u8 op_code);
+
+/// Counts `op_code` as executed, together with the sequences of 2 and 3 opcodes it ends
+void profile_op_code(u8 op_code);
+
+/// Prints the most executed opcode sequences since the last call and resets the counters
+void print_op_code_profile();
+
 #endif
\ No newline at end of file
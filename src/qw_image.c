@@ -0,0 +1,463 @@
+#include "qw_image.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memory.h"
+#include "qw_ir.h"
+#include "qw_native_functions.h"
+
+u64 hash_source(const char* source) {
+  // FNV-1a
+  u64 hash = 14695981039346656037ull;
+  for (const char* c = source; *c != '\0'; c++) hash = (hash ^ (u8)*c) * 1099511628211ull;
+  return (hash ^ optimize) * 1099511628211ull;
+}
+
+/// FNV-1a of `count` bytes, the checksum of images
+static u64 hash_bytes(const u8* bytes, u32 count) {
+  u64 hash = 14695981039346656037ull;
+  for (u32 i = 0; i < count; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+  return hash;
+}
+
+/// Objects numbered in the order they were added. The slots find the index of an object by its
+/// address (open addressing, index + 1 or 0 when empty): scripts have thousands of functions and
+/// strings, and a Table would allocate through the collector while nothing roots the script
+typedef struct {
+  Object** objects;
+  u32 count;
+  u32 capacity;
+  u32* slots;
+  u32 slot_count;
+} Numbering;
+
+static u32 object_slot(Numbering* numbering, Object* object) {
+  u32 slot = (u32)(((uintptr_t)object >> 3) * 2654435761u) & (numbering->slot_count - 1);
+  while (numbering->slots[slot] != 0 && numbering->objects[numbering->slots[slot] - 1] != object) {
+    slot = (slot + 1) & (numbering->slot_count - 1);
+  }
+  return slot;
+}
+
+/// Returns the index of `object`, `numbering->count` if it has none
+static u32 find_number(Numbering* numbering, Object* object) {
+  if (numbering->count == 0) return 0;
+  u32 slot = numbering->slots[object_slot(numbering, object)];
+  return slot != 0 ? slot - 1 : numbering->count;
+}
+
+/// Returns the index of `object`, numbering it unless it already is
+static u32 number(Numbering* numbering, Object* object) {
+  u32 index = find_number(numbering, object);
+  if (index < numbering->count) return index;
+  if (numbering->capacity < numbering->count + 1) {
+    numbering->capacity = GROW_CAPACITY(numbering->capacity);
+    numbering->objects = realloc(numbering->objects, sizeof(Object*) * numbering->capacity);
+  }
+  numbering->objects[numbering->count++] = object;
+  // At most half full
+  if (numbering->slot_count < numbering->count * 2) {
+    free(numbering->slots);
+    numbering->slot_count = numbering->slot_count == 0 ? 16 : numbering->slot_count * 2;
+    numbering->slots = calloc(numbering->slot_count, sizeof(u32));
+    for (u32 i = 0; i < numbering->count; i++) {
+      numbering->slots[object_slot(numbering, numbering->objects[i])] = i + 1;
+    }
+  } else {
+    numbering->slots[object_slot(numbering, object)] = numbering->count;
+  }
+  return numbering->count - 1;
+}
+
+static void free_numbering(Numbering* numbering) {
+  free(numbering->objects);
+  free(numbering->slots);
+}
+
+/// The image write_image() is building and the functions, shared objects and strings it numbered
+typedef struct {
+  u8* bytes;
+  u32 count;
+  u32 capacity;
+  Numbering functions;
+  /// Closures and classes of the constants (qw_inline.h)
+  Numbering shared;
+  Numbering strings;
+} ImageWriter;
+
+/// Numbers `function`, the functions in its constants and the objects they share, and the functions
+/// inlined into it
+static void collect_function(ImageWriter* writer, ObjectFunction* function) {
+  if (find_number(&writer->functions, (Object*)function) < writer->functions.count) return;
+  number(&writer->functions, (Object*)function);
+  ValueArray* constants = &function->chunk.constants;
+  for (u32 i = 0; i < constants->count; i++) {
+    if (!IS_OBJECT(constants->values[i])) continue;
+    Object* object = AS_OBJECT(constants->values[i]);
+    if (object->type == OBJECT_FUNCTION) collect_function(writer, (ObjectFunction*)object);
+    if (object->type != OBJECT_CLOSURE && object->type != OBJECT_CLASS) continue;
+    number(&writer->shared, object);
+    if (object->type == OBJECT_CLOSURE) collect_function(writer, ((ObjectClosure*)object)->function);
+  }
+  for (u32 i = 0; i < function->inlined_call_count; i++) collect_function(writer, function->inlined_calls[i].function);
+}
+
+/// Appends `size` bytes of `data` (zeros if NULL) 8 byte aligned, returns their offset
+static u32 append(ImageWriter* writer, const void* data, u32 size) {
+  u32 offset = (writer->count + 7) & ~7u;
+  if (writer->capacity < offset + size) {
+    u32 capacity = writer->capacity < 64 ? 64 : writer->capacity;
+    while (capacity < offset + size) capacity *= 2;
+    writer->bytes = realloc(writer->bytes, capacity);
+    writer->capacity = capacity;
+  }
+  memset(writer->bytes + writer->count, 0, offset - writer->count);
+  if (data != NULL) {
+    memcpy(writer->bytes + offset, data, size);
+  } else {
+    memset(writer->bytes + offset, 0, size);
+  }
+  writer->count = offset + size;
+  return offset;
+}
+
+static ImageConstant image_constant(ImageWriter* writer, ObjectFunction* script, Value constant) {
+  ImageConstant image = {LOAD_CONSTANT_NUMBER, 0, 0, 0};
+  if (IS_NUMBER(constant)) {
+    image.number = AS_NUMBER(constant);
+    return image;
+  }
+  Object* object = AS_OBJECT(constant);
+  image.shared = find_number(&writer->shared, object);
+  switch (object->type) {
+    case OBJECT_STRING:
+      image.kind = LOAD_CONSTANT_STRING;
+      image.index = number(&writer->strings, object);
+      break;
+    case OBJECT_NATIVE: {
+      ValueArray* globals = script->global_array;
+      image.kind = LOAD_CONSTANT_NATIVE;
+      while (image.index < globals->count) {
+        if (IS_OBJECT(globals->values[image.index]) && AS_OBJECT(globals->values[image.index]) == object) break;
+        image.index++;
+      }
+      break;
+    }
+    case OBJECT_CLOSURE:
+      image.kind = LOAD_CONSTANT_CLOSURE;
+      image.index = find_number(&writer->functions, (Object*)((ObjectClosure*)object)->function);
+      break;
+    case OBJECT_CLASS:
+      image.kind = LOAD_CONSTANT_CLASS;
+      image.index = number(&writer->strings, (Object*)((ObjectClass*)object)->name);
+      break;
+    default:
+      image.kind = LOAD_CONSTANT_FUNCTION;
+      image.index = find_number(&writer->functions, object);
+      break;
+  }
+  return image;
+}
+
+/// Appends the arrays of function `index` and fills its ImageFunction
+static void write_function(ImageWriter* writer, ObjectFunction* script, u32 index) {
+  ObjectFunction* function = (ObjectFunction*)writer->functions.objects[index];
+  Chunk* chunk = &function->chunk;
+  ImageFunction image = {0};
+  image.name = function->name != NULL ? number(&writer->strings, (Object*)function->name) : IMAGE_NONE;
+  image.number_of_parameters = function->number_of_parameters;
+  image.upvalue_count = function->upvalue_count;
+  image.code = append(writer, chunk->code, chunk->count);
+  image.count = chunk->count;
+  image.lines = append(writer, chunk->lines.lines, sizeof(Line) * chunk->lines.count);
+  image.line_count = chunk->lines.count;
+
+  image.constant_count = chunk->constants.count;
+  image.constants = append(writer, NULL, sizeof(ImageConstant) * image.constant_count);
+  for (u32 i = 0; i < image.constant_count; i++) {
+    ImageConstant constant = image_constant(writer, script, chunk->constants.values[i]);
+    memcpy(writer->bytes + image.constants + sizeof(ImageConstant) * i, &constant, sizeof(ImageConstant));
+  }
+
+  image.cache_count = function->inline_cache_count;
+  image.cache_offsets = append(writer, NULL, sizeof(u32) * image.cache_count);
+  for (u32 i = 0; i < image.cache_count; i++) {
+    memcpy(writer->bytes + image.cache_offsets + sizeof(u32) * i, &function->inline_caches[i].offset, sizeof(u32));
+  }
+
+  image.switch_count = function->switch_count;
+  image.switches = append(writer, NULL, sizeof(ImageSwitch) * image.switch_count);
+  for (u32 i = 0; i < image.switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    ImageSwitch entry = {0, table->pattern_count, table->arm_count, 0};
+    entry.patterns = append(writer, table->patterns, sizeof(SwitchPattern) * table->pattern_count);
+    entry.targets = append(writer, table->targets, sizeof(u32) * (table->arm_count + 1));
+    memcpy(writer->bytes + image.switches + sizeof(ImageSwitch) * i, &entry, sizeof(ImageSwitch));
+  }
+
+  image.inlined_call_count = function->inlined_call_count;
+  image.inlined_calls = append(writer, NULL, sizeof(LoadInlinedCall) * image.inlined_call_count);
+  for (u32 i = 0; i < image.inlined_call_count; i++) {
+    InlinedCall* call = &function->inlined_calls[i];
+    LoadInlinedCall entry = {find_number(&writer->functions, (Object*)call->function), call->line, call->parent};
+    memcpy(writer->bytes + image.inlined_calls + sizeof(LoadInlinedCall) * i, &entry, sizeof(LoadInlinedCall));
+  }
+  image.inlined_range_count = function->inlined_range_count;
+  image.inlined_ranges = append(writer, function->inlined_ranges, sizeof(InlinedRange) * image.inlined_range_count);
+  memcpy(writer->bytes + sizeof(ImageHeader) + sizeof(ImageFunction) * index, &image, sizeof(ImageFunction));
+}
+
+bool write_image(ObjectFunction* script, u64 source_hash, FILE* out) {
+  ImageWriter writer = {0};
+  collect_function(&writer, script);
+  append(&writer, NULL, sizeof(ImageHeader));
+  append(&writer, NULL, sizeof(ImageFunction) * writer.functions.count);
+  for (u32 i = 0; i < writer.functions.count; i++) write_function(&writer, script, i);
+
+  // Numbered while writing the functions
+  u32 strings = append(&writer, NULL, sizeof(ImageString) * writer.strings.count);
+  for (u32 i = 0; i < writer.strings.count; i++) {
+    ObjectString* string = (ObjectString*)writer.strings.objects[i];
+    ImageString entry = {append(&writer, string->chars, (u32)string->length), (u32)string->length};
+    memcpy(writer.bytes + strings + sizeof(ImageString) * i, &entry, sizeof(ImageString));
+  }
+
+  u64 checksum = hash_bytes(writer.bytes + sizeof(ImageHeader), writer.count - sizeof(ImageHeader));
+  ImageHeader header = {IMAGE_MAGIC, IMAGE_VERSION, OP_CODE_COUNT, NATIVE_FUNCTION_COUNT, source_hash, checksum,
+                        writer.count, script->global_array->count, writer.functions.count, writer.shared.count, strings,
+                        writer.strings.count};
+  memcpy(writer.bytes, &header, sizeof(ImageHeader));
+  bool written = fwrite(writer.bytes, 1, writer.count, out) == writer.count;
+  free(writer.bytes);
+  free_numbering(&writer.functions);
+  free_numbering(&writer.shared);
+  free_numbering(&writer.strings);
+  return written && fflush(out) == 0;
+}
+
+/// Whether the array of `count` elements of `size` bytes at `offset` is within the image
+static bool in_image(const Image* image, u32 offset, u32 count, u32 size) {
+  return offset % 8 == 0 && offset <= image->size && (u64)count * size <= image->size - offset;
+}
+
+/// Checks that build_switch_table() can read `table` of `function`: its patterns are constants of
+/// the function (numbers, or strings when not a range) and its targets in the code
+static bool check_switch(const Image* image, const ImageFunction* function, const ImageSwitch* table) {
+  if (table->arm_count > UINT16_MAX ||
+      !in_image(image, table->patterns, table->pattern_count, sizeof(SwitchPattern)) ||
+      !in_image(image, table->targets, table->arm_count + 1, sizeof(u32))) {
+    return false;
+  }
+  const ImageConstant* constants = (const ImageConstant*)(image->bytes + function->constants);
+  const SwitchPattern* patterns = (const SwitchPattern*)(image->bytes + table->patterns);
+  for (u32 i = 0; i < table->pattern_count; i++) {
+    const SwitchPattern* pattern = &patterns[i];
+    // Read as a byte, a bool that is neither 0 nor 1 can't be loaded
+    u8 range;
+    memcpy(&range, &pattern->range, 1);
+    if (pattern->arm > table->arm_count || range > 1 || pattern->low >= function->constant_count) return false;
+    u32 low = constants[pattern->low].kind;
+    if (range == 1) {
+      if (pattern->high >= function->constant_count || low != LOAD_CONSTANT_NUMBER ||
+          constants[pattern->high].kind != LOAD_CONSTANT_NUMBER) {
+        return false;
+      }
+    } else if (low != LOAD_CONSTANT_NUMBER && low != LOAD_CONSTANT_STRING) {
+      return false;
+    }
+  }
+  const u32* targets = (const u32*)(image->bytes + table->targets);
+  for (u32 i = 0; i <= table->arm_count; i++) {
+    if (targets[i] >= function->count) return false;
+  }
+  return true;
+}
+
+/// Checks that `image` is the one written, and its arrays and indexes within it. The code is
+/// trusted as the compiler's
+static bool check_image(const Image* image) {
+  const ImageHeader* header = image->header;
+  if (image->size < sizeof(ImageHeader) || header->magic != IMAGE_MAGIC || header->version != IMAGE_VERSION ||
+      header->op_code_count != OP_CODE_COUNT || header->native_count != NATIVE_FUNCTION_COUNT ||
+      header->size != image->size || header->function_count == 0 ||
+      header->global_count < NATIVE_FUNCTION_COUNT) {
+    return false;
+  }
+  if (hash_bytes(image->bytes + sizeof(ImageHeader), image->size - sizeof(ImageHeader)) != header->checksum) {
+    return false;
+  }
+  if (!in_image(image, sizeof(ImageHeader), header->function_count, sizeof(ImageFunction)) ||
+      !in_image(image, header->strings, header->string_count, sizeof(ImageString))) {
+    return false;
+  }
+  const ImageString* strings = (const ImageString*)(image->bytes + header->strings);
+  for (u32 i = 0; i < header->string_count; i++) {
+    if (!in_image(image, strings[i].chars, strings[i].length, 1)) return false;
+  }
+  const ImageFunction* functions = (const ImageFunction*)(image->bytes + sizeof(ImageHeader));
+  for (u32 i = 0; i < header->function_count; i++) {
+    const ImageFunction* function = &functions[i];
+    if ((function->name != IMAGE_NONE && function->name >= header->string_count) || function->count == 0 ||
+        function->upvalue_count < 0 || function->upvalue_count > UINT8_MAX ||
+        !in_image(image, function->code, function->count, 1) ||
+        !in_image(image, function->lines, function->line_count, sizeof(Line)) ||
+        !in_image(image, function->constants, function->constant_count, sizeof(ImageConstant)) ||
+        !in_image(image, function->cache_offsets, function->cache_count, sizeof(u32)) ||
+        !in_image(image, function->switches, function->switch_count, sizeof(ImageSwitch)) ||
+        !in_image(image, function->inlined_calls, function->inlined_call_count, sizeof(LoadInlinedCall)) ||
+        !in_image(image, function->inlined_ranges, function->inlined_range_count, sizeof(InlinedRange))) {
+      return false;
+    }
+    const ImageConstant* constants = (const ImageConstant*)(image->bytes + function->constants);
+    for (u32 j = 0; j < function->constant_count; j++) {
+      const ImageConstant* constant = &constants[j];
+      u32 limit = 1;
+      switch (constant->kind) {
+        case LOAD_CONSTANT_NUMBER:
+          break;
+        case LOAD_CONSTANT_STRING:
+          limit = header->string_count;
+          break;
+        case LOAD_CONSTANT_NATIVE:
+          limit = NATIVE_FUNCTION_COUNT;
+          break;
+        case LOAD_CONSTANT_FUNCTION:
+          limit = header->function_count;
+          break;
+        case LOAD_CONSTANT_CLOSURE:
+          limit = constant->shared < header->shared_count ? header->function_count : 0;
+          break;
+        case LOAD_CONSTANT_CLASS:
+          limit = constant->shared < header->shared_count ? header->string_count : 0;
+          break;
+        default:
+          return false;
+      }
+      if (constant->index >= limit) return false;
+    }
+    const u32* cache_offsets = (const u32*)(image->bytes + function->cache_offsets);
+    for (u32 j = 0; j < function->cache_count; j++) {
+      if (cache_offsets[j] >= function->count) return false;
+    }
+    const ImageSwitch* switches = (const ImageSwitch*)(image->bytes + function->switches);
+    for (u32 j = 0; j < function->switch_count; j++) {
+      if (!check_switch(image, function, &switches[j])) return false;
+    }
+    // runtime_error() follows the parents, which come first
+    const LoadInlinedCall* calls = (const LoadInlinedCall*)(image->bytes + function->inlined_calls);
+    for (u32 j = 0; j < function->inlined_call_count; j++) {
+      if (calls[j].function >= header->function_count || calls[j].parent < -1 || calls[j].parent >= (i32)j) {
+        return false;
+      }
+    }
+    const InlinedRange* ranges = (const InlinedRange*)(image->bytes + function->inlined_ranges);
+    for (u32 j = 0; j < function->inlined_range_count; j++) {
+      if (ranges[j].start >= ranges[j].end || ranges[j].end > function->count ||
+          ranges[j].call >= function->inlined_call_count) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool map_image(Image* image, FILE* file) {
+  struct stat status;
+  if (fstat(fileno(file), &status) != 0 || status.st_size < (off_t)sizeof(ImageHeader) || status.st_size > UINT32_MAX) {
+    return false;
+  }
+  // Private and writable: quickening rewrites the code in place, which copies the pages it touches
+  void* bytes = mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+  if (bytes == MAP_FAILED) return false;
+  image->bytes = bytes;
+  image->size = status.st_size;
+  image->header = bytes;
+  if (!check_image(image)) {
+    unmap_image(image);
+    return false;
+  }
+  return true;
+}
+
+void unmap_image(Image* image) {
+  munmap(image->bytes, image->size);
+  image->bytes = NULL;
+  image->size = 0;
+  image->header = NULL;
+}
+
+/// The arrays of a mapped image, read by load_script()
+typedef struct {
+  LoadSource source;
+  const Image* image;
+} ImageSource;
+
+static const ImageFunction* image_function(const Image* image, u32 index) {
+  return (const ImageFunction*)(image->bytes + sizeof(ImageHeader)) + index;
+}
+
+static const char* image_string(const Image* image, u32 index, u32* length) {
+  const ImageString* string = (const ImageString*)(image->bytes + image->header->strings) + index;
+  *length = string->length;
+  return (const char*)image->bytes + string->chars;
+}
+
+static void read_function(const LoadSource* source, u32 index, LoadFunction* function) {
+  const Image* image = ((const ImageSource*)source)->image;
+  const ImageFunction* stored = image_function(image, index);
+  function->name = NULL;
+  function->name_length = 0;
+  if (stored->name != IMAGE_NONE) function->name = image_string(image, stored->name, &function->name_length);
+  function->number_of_parameters = stored->number_of_parameters;
+  function->upvalue_count = stored->upvalue_count;
+  function->code = image->bytes + stored->code;
+  function->count = stored->count;
+  function->lines = (const Line*)(image->bytes + stored->lines);
+  function->line_count = stored->line_count;
+  function->constant_count = stored->constant_count;
+  function->cache_offsets = (const u32*)(image->bytes + stored->cache_offsets);
+  function->cache_count = stored->cache_count;
+  function->switch_count = stored->switch_count;
+  function->inlined_calls = (const LoadInlinedCall*)(image->bytes + stored->inlined_calls);
+  function->inlined_call_count = stored->inlined_call_count;
+  function->inlined_ranges = (const InlinedRange*)(image->bytes + stored->inlined_ranges);
+  function->inlined_range_count = stored->inlined_range_count;
+  function->native = NULL;
+  function->native_entries = NULL;
+}
+
+static void read_constant(const LoadSource* source, u32 function, u32 index, LoadConstant* constant) {
+  const Image* image = ((const ImageSource*)source)->image;
+  const ImageConstant* stored = (const ImageConstant*)(image->bytes + image_function(image, function)->constants) + index;
+  constant->kind = stored->kind;
+  constant->number = stored->number;
+  constant->chars = NULL;
+  constant->length = 0;
+  constant->index = stored->index;
+  constant->shared = stored->shared;
+  if (stored->kind == LOAD_CONSTANT_STRING || stored->kind == LOAD_CONSTANT_CLASS) {
+    constant->chars = image_string(image, stored->index, &constant->length);
+  }
+}
+
+static void read_switch(const LoadSource* source, u32 function, u32 index, LoadSwitch* table) {
+  const Image* image = ((const ImageSource*)source)->image;
+  const ImageSwitch* stored = (const ImageSwitch*)(image->bytes + image_function(image, function)->switches) + index;
+  table->patterns = (const SwitchPattern*)(image->bytes + stored->patterns);
+  table->pattern_count = stored->pattern_count;
+  table->arm_count = (u16)stored->arm_count;
+  table->targets = (const u32*)(image->bytes + stored->targets);
+}
+
+ObjectFunction* load_image(const Image* image) {
+  const ImageHeader* header = image->header;
+  // The code and lines are used from the mapping, which is private: quickening only copies the
+  // pages it rewrites
+  ImageSource source = {{header->function_count, header->shared_count, header->global_count, true, read_function,
+                         read_constant, read_switch},
+                        image};
+  return load_script(&source.source);
+}
@@ -0,0 +1,121 @@
+#ifndef qw_image_h
+#define qw_image_h
+
+#include <stdio.h>
+
+#include "qw_common.h"
+#include "qw_loader.h"
+#include "qw_object.h"
+
+/// Compiled bytecode images, `.qwc` files (`qwlang --emit-qwc`, `qwlang --cache`). write_image()
+/// writes the ObjectFunction tree compile() makes: the code, lines, constants, inline caches,
+/// switch tables and inlined calls of every function, the strings of its constants once each, and the number of
+/// globals. map_image() maps one back with mmap and load_image() rebuilds the tree without the
+/// compiler: the code and lines are used in place from the mapping (private, so quickening only
+/// copies the pages it rewrites), the rest holds heap objects and is rebuilt. Images are in the
+/// layout of the build that writes them, for the same build to read
+
+#define IMAGE_MAGIC 0x31435751u  // "QWC1"
+/// Changes with the format, the opcodes are checked on their own (ImageHeader.op_code_count)
+#define IMAGE_VERSION 4
+/// Index of no string, the name of the top-level script
+#define IMAGE_NONE UINT32_MAX
+
+/// Offsets are from the start of the image, every array starts 8 byte aligned
+typedef struct {
+  u32 magic;
+  u32 version;
+  /// The image is stale if the opcodes or the natives changed since it was written
+  u32 op_code_count;
+  u32 native_count;
+  /// hash_source() of the source it was compiled from
+  u64 source_hash;
+  /// FNV-1a of the bytes after the header: the code is trusted as the compiler's, a corrupted
+  /// image is rejected before it runs
+  u64 checksum;
+  u32 size;
+  u32 global_count;
+  /// ImageFunction array right after the header, the top-level script first
+  u32 function_count;
+  /// Distinct closures and classes of the constants
+  u32 shared_count;
+  /// ImageString array
+  u32 strings;
+  u32 string_count;
+} ImageHeader;
+
+typedef struct {
+  u32 name;
+  u32 number_of_parameters;
+  i32 upvalue_count;
+  u32 code;
+  u32 count;
+  /// Line array
+  u32 lines;
+  u32 line_count;
+  /// ImageConstant array
+  u32 constants;
+  u32 constant_count;
+  /// Bytecode offset of the instruction owning every inline cache, u32 array
+  u32 cache_offsets;
+  u32 cache_count;
+  /// ImageSwitch array
+  u32 switches;
+  u32 switch_count;
+  /// LoadInlinedCall array, their parents first (qw_loader.h)
+  u32 inlined_calls;
+  u32 inlined_call_count;
+  /// InlinedRange array
+  u32 inlined_ranges;
+  u32 inlined_range_count;
+} ImageFunction;
+
+/// LoadConstant with its chars as string `index` (qw_loader.h)
+typedef struct {
+  /// LoadConstantKind
+  u32 kind;
+  u32 index;
+  u32 shared;
+  double number;
+} ImageConstant;
+
+/// SwitchTable of an OP_SWITCH, rebuilt from its patterns
+typedef struct {
+  /// SwitchPattern array
+  u32 patterns;
+  u32 pattern_count;
+  u32 arm_count;
+  /// u32 array of `arm_count + 1` bytecode offsets
+  u32 targets;
+} ImageSwitch;
+
+typedef struct {
+  u32 chars;
+  u32 length;
+} ImageString;
+
+/// An image mapped by map_image()
+typedef struct Image {
+  u8* bytes;
+  isize size;
+  const ImageHeader* header;
+} Image;
+
+/// Hash of `source` that images are keyed by, with the flags that change what compile() makes
+u64 hash_source(const char* source);
+
+/// Writes the image of `script`, a function tree fresh out of compile() for the source with
+/// `source_hash`. Returns false if it couldn't write it all
+bool write_image(ObjectFunction* script, u64 source_hash, FILE* out);
+
+/// Maps the image in `file`, which can be closed afterwards. Returns false if it couldn't, or if
+/// the file isn't an image this build can run (of another build, corrupted or cut)
+bool map_image(Image* image, FILE* file);
+
+void unmap_image(Image* image);
+
+/// Rebuilds the function tree of `image` along with its globals, as compile() leaves them. The
+/// image must stay mapped while the functions exist
+ObjectFunction* load_image(const Image* image);
+
+#endif
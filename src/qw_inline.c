@@ -0,0 +1,616 @@
+#include "qw_inline.h"
+
+#include <stdlib.h>
+
+#include "memory.h"
+#include "qw_passes.h"
+#include "qw_vm.h"
+
+/// How a call is inlined
+typedef enum {
+  /// Call of a global function: the function is replaced by nil in its slot
+  INLINE_FUNCTION,
+  /// `this.method()`: `this` stays in the slot, as it does for the call
+  INLINE_METHOD,
+  /// Constructor call of a class with `init`: OP_INSTANCE after the class, then the body of `init`
+  INLINE_CONSTRUCTOR,
+  /// Constructor call of a class without `init` nor superclass: OP_INSTANCE in place of the call
+  INLINE_INSTANCE,
+} InlineKind;
+
+typedef struct {
+  InlineKind kind;
+  /// Instruction pushing the function (the class, `this`) and the OP_CALL/OP_INVOKE
+  u32 receiver;
+  u32 call;
+  /// Slot of the receiver, slot 0 of the callee
+  u32 slot;
+  /// Function called, NULL for INLINE_INSTANCE
+  ObjectFunction* function;
+  /// Built by can_inline(), unused by INLINE_INSTANCE
+  IrFunction callee;
+} InlineSite;
+
+#define GROW(type, array, count, capacity)                                  \
+  do {                                                                      \
+    if ((capacity) < (count) + 1) {                                         \
+      (capacity) = GROW_CAPACITY(capacity);                                 \
+      (array) = realloc((array), sizeof(type) * (capacity));                \
+    }                                                                       \
+  } while (false)
+
+static ObjectFunction* constant_function(IrFunction* ir, IrInstruction* instruction) {
+  return (ObjectFunction*)AS_OBJECT(ir->function->chunk.constants.values[instruction->operand]);
+}
+
+static ObjectString* constant_string(IrFunction* ir, IrInstruction* instruction) {
+  return AS_STRING(ir->function->chunk.constants.values[instruction->operand]);
+}
+
+static void bind_global(Program* program, u32 global, ObjectFunction* function, i32 class_index, u32 bound_at) {
+  if (global >= program->global_count) return;
+  program->globals[global].function = function;
+  program->globals[global].class_index = class_index;
+  program->globals[global].bound_at = bound_at;
+}
+
+/// Adds `function` and the functions it creates, run from `position` on (see ProgramFunction)
+static void add_function(Program* program, ObjectFunction* function, u32 position, i32 class_index) {
+  bool script = position == UINT32_MAX;
+  IrFunction ir;
+  build_ir(&ir, function);
+  ir.program = program;
+  if (script) {
+    // The constant expressions `let` declarations are initialized with become their value
+    ir_count_incoming(&ir);
+    fold_constants(&ir);
+  }
+  // The class declaration being read: from OP_CLASS to the OP_POP of the class, with the
+  // OP_CLOSURE, OP_METHOD pairs of its methods in between
+  i32 class = -1;
+  u32 class_end = 0;
+  for (u32 i = 0; i < ir.count; i++) {
+    IrInstruction* instruction = &ir.instructions[i];
+    IrInstruction* next = i + 1 < ir.count ? &ir.instructions[i + 1] : NULL;
+    switch (instruction->op_code) {
+      case OP_DEFINE_GLOBAL:
+        if (instruction->operand < program->global_count) program->globals[instruction->operand].definitions++;
+        break;
+      case OP_SET_GLOBAL:
+        if (instruction->operand < program->global_count) program->globals[instruction->operand].assignments++;
+        break;
+      case OP_SET_PROPERTY:
+        GROW(ObjectString*, program->fields, program->field_count, program->field_capacity);
+        program->fields[program->field_count++] = constant_string(&ir, instruction);
+        break;
+      case OP_SET_PROPERTY_TOP_STACK:
+        program->dynamic_fields = true;
+        break;
+      case OP_CLASS: {
+        GROW(ProgramClass, program->classes, program->class_count, program->class_capacity);
+        class = (i32)program->class_count++;
+        program->classes[class] = (ProgramClass){.has_superclass = false, .initializer = NULL};
+        class_end = i + 1;
+        while (class_end < ir.count && ir.instructions[class_end].op_code != OP_POP) class_end++;
+        if (script && next != NULL && next->op_code == OP_DEFINE_GLOBAL && class_end < ir.count) {
+          bind_global(program, next->operand, NULL, class, ir.instructions[class_end].offset);
+        }
+        break;
+      }
+      case OP_INHERIT:
+        if (class != -1) program->classes[class].has_superclass = true;
+        break;
+      case OP_POP:
+        if (class != -1 && i == class_end) class = -1;
+        break;
+      case OP_CLOSURE: {
+        ObjectFunction* nested = constant_function(&ir, instruction);
+        bool method = class != -1 && next != NULL && next->op_code == OP_METHOD;
+        u32 nested_position = position;
+        if (script) {
+          nested_position = method && class_end < ir.count ? ir.instructions[class_end].offset + 1 : instruction->offset;
+        }
+        add_function(program, nested, nested_position, method ? class : -1);
+        if (method) {
+          ObjectString* name = constant_string(&ir, next);
+          GROW(ProgramMethod, program->methods, program->method_count, program->method_capacity);
+          program->methods[program->method_count++] = (ProgramMethod){name, nested, class};
+          if (name->length == 4 && memcmp(name->chars, "init", 4) == 0) program->classes[class].initializer = nested;
+        }
+        if (script && next != NULL && next->op_code == OP_DEFINE_GLOBAL) {
+          bind_global(program, next->operand, nested, -1, next->offset);
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  GROW(ProgramFunction, program->functions, program->function_count, program->function_capacity);
+  program->functions[program->function_count++] = (ProgramFunction){function, ir, position, class_index};
+}
+
+/// Finds the value of the fixed globals (see is_fixed_global()) known at compile time. A global the
+/// script doesn't define keeps the one it starts with (a native, 0 for the others). The script
+/// defines one with the constant before its OP_DEFINE_GLOBAL, or with the closure of a function
+/// without upvalues or the class it creates there: they are created here once and for all, and the
+/// script pushes them as constants in place of its OP_CLOSURE or OP_CLASS
+static void find_global_values(Program* program, IrFunction* script) {
+  for (u32 global = 0; global < program->global_count; global++) {
+    GlobalBinding* binding = &program->globals[global];
+    if (binding->definitions == 0 && binding->assignments == 0) {
+      binding->known = true;
+      binding->value = script->function->global_array->values[global];
+      binding->known_from = 0;
+    }
+  }
+  for (u32 i = 0; i < script->count; i++) {
+    IrInstruction* definition = &script->instructions[i];
+    if (definition->op_code != OP_DEFINE_GLOBAL || definition->incoming > 0) continue;
+    if (!is_fixed_global(program, definition->operand)) continue;
+    u32 previous = ir_previous(script, i);
+    if (previous == script->count) continue;
+    IrInstruction* instruction = &script->instructions[previous];
+    // A function can only run once the script has defined it, itself included: from its OP_CLOSURE
+    u32 known_from = instruction->op_code == OP_CLOSURE ? instruction->offset : definition->offset + 1;
+    Value value;
+    if (instruction->op_code == OP_CLOSURE && constant_function(script, instruction)->upvalue_count == 0) {
+      value = OBJECT_VAL(new_closure(constant_function(script, instruction)));
+    } else if (instruction->op_code == OP_CLASS) {
+      value = OBJECT_VAL(new_class(constant_string(script, instruction)));
+    } else if (!ir_constant(script, instruction, &value)) {
+      continue;
+    }
+    if (instruction->op_code == OP_CLOSURE || instruction->op_code == OP_CLASS) {
+      // On the VM stack until it is a constant of the script
+      push(value);
+      ir_set_constant(script, instruction, value);
+      pop();
+    }
+    GlobalBinding* binding = &program->globals[definition->operand];
+    binding->known = true;
+    binding->value = value;
+    binding->known_from = known_from;
+  }
+}
+
+static void find_recursive_functions(Program* program);
+
+void analyze_program(Program* program, ObjectFunction* script) {
+  program->functions = NULL;
+  program->function_count = 0;
+  program->function_capacity = 0;
+  program->global_count = script->global_array != NULL ? script->global_array->count : 0;
+  program->globals = malloc(sizeof(GlobalBinding) * (program->global_count + 1));
+  for (u32 i = 0; i < program->global_count; i++) {
+    program->globals[i] = (GlobalBinding){.function = NULL, .class_index = -1, .known = false};
+  }
+  program->classes = NULL;
+  program->class_count = 0;
+  program->class_capacity = 0;
+  program->methods = NULL;
+  program->method_count = 0;
+  program->method_capacity = 0;
+  program->fields = NULL;
+  program->field_count = 0;
+  program->field_capacity = 0;
+  program->dynamic_fields = false;
+  add_function(program, script, UINT32_MAX, -1);
+  find_global_values(program, &program->functions[program->function_count - 1].ir);
+  find_recursive_functions(program);
+}
+
+void free_program(Program* program) {
+  free(program->functions);
+  free(program->globals);
+  free(program->classes);
+  free(program->methods);
+  free(program->fields);
+}
+
+bool is_fixed_global(Program* program, u32 global) {
+  if (global >= program->global_count) return false;
+  return program->globals[global].definitions <= 1 && program->globals[global].assignments == 0;
+}
+
+bool known_global(Program* program, IrFunction* ir, IrInstruction* load, Value* value) {
+  if (load->operand >= program->global_count || !program->globals[load->operand].known) return false;
+  GlobalBinding* binding = &program->globals[load->operand];
+  u32 position = load->offset;
+  for (u32 i = 0; i < program->function_count; i++) {
+    if (program->functions[i].function == ir->function && program->functions[i].position != UINT32_MAX) {
+      position = program->functions[i].position;
+    }
+  }
+  if (position < binding->known_from) return false;
+  *value = binding->value;
+  return true;
+}
+
+/// Returns the method `name` of class `class_index` if no other class declares a method with that
+/// name and no instance can have a field with it, NULL otherwise
+static ObjectFunction* unique_method(Program* program, i32 class_index, ObjectString* name) {
+  if (program->dynamic_fields) return NULL;
+  for (u32 i = 0; i < program->field_count; i++) {
+    if (program->fields[i] == name) return NULL;
+  }
+  ObjectFunction* method = NULL;
+  for (u32 i = 0; i < program->method_count; i++) {
+    if (program->methods[i].name != name) continue;
+    if (method != NULL || program->methods[i].class_index != class_index) return NULL;
+    method = program->methods[i].function;
+  }
+  return method;
+}
+
+/// Returns the instruction that pushes `slot`, the receiver of the call `call`, or `ir->count` if
+/// it isn't a plain variable load or a jump from outside lands between them
+static u32 find_receiver(IrFunction* ir, u32* depths, u32 call, u32 slot) {
+  u32 receiver = call;
+  while (receiver > 0) {
+    receiver--;
+    if (ir->instructions[receiver].op_code == IR_NOP) continue;
+    if (depths[receiver] == IR_NO_DEPTH || depths[receiver] <= slot) break;
+  }
+  if (depths[receiver] != slot) return ir->count;
+  u8 op_code = ir->instructions[receiver].op_code;
+  if (op_code != OP_GET_GLOBAL && op_code != OP_GET_LOCAL) return ir->count;
+  // The arguments are whole expressions, their jumps stay inside them
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    bool inside = i > receiver && i < call;
+    if (ir_is_jump(instruction->op_code)) {
+      u32 target = ir_next(ir, instruction->target);
+      if (inside != (target > receiver && target <= call)) return ir->count;
+    } else if (instruction->op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      for (u32 arm = 0; arm <= table->arm_count; arm++) {
+        u32 target = ir_next(ir, table->targets[arm]);
+        if (inside != (target > receiver && target <= call)) return ir->count;
+      }
+    }
+  }
+  return receiver;
+}
+
+/// Finds the callee of `site` (its `receiver`, `call` and `slot` set), returns false if it isn't
+/// known at compile time. With `bound_later` a global function or class is also the callee of the
+/// calls that can run before the global is bound, which then fail or call it
+static bool resolve_callee(Program* program, ProgramFunction* caller, InlineSite* site, bool bound_later) {
+  IrFunction* ir = &caller->ir;
+  IrInstruction* receiver = &ir->instructions[site->receiver];
+  IrInstruction* call = &ir->instructions[site->call];
+  site->function = NULL;
+  if (call->op_code == OP_INVOKE) {
+    // `this` in a method of the class
+    if (receiver->op_code != OP_GET_LOCAL || receiver->operand != 0 || caller->class_index == -1) return false;
+    site->kind = INLINE_METHOD;
+    site->function = unique_method(program, caller->class_index, constant_string(ir, call));
+    return site->function != NULL;
+  }
+  if (receiver->op_code != OP_GET_GLOBAL || !is_fixed_global(program, receiver->operand)) return false;
+  GlobalBinding* binding = &program->globals[receiver->operand];
+  if (binding->definitions != 1) return false;
+  // The global has its value by the time the call runs
+  u32 position = caller->position == UINT32_MAX ? receiver->offset : caller->position;
+  if (position <= binding->bound_at && !bound_later) return false;
+  if (binding->function != NULL) {
+    site->kind = INLINE_FUNCTION;
+    site->function = binding->function;
+    return true;
+  }
+  if (binding->class_index == -1) return false;
+  ProgramClass* class = &program->classes[binding->class_index];
+  if (class->initializer != NULL) {
+    site->kind = INLINE_CONSTRUCTOR;
+    site->function = class->initializer;
+    return true;
+  }
+  // Else the superclass may have an `init`
+  site->kind = INLINE_INSTANCE;
+  return !class->has_superclass && call->operand == 0;
+}
+
+/// Returns the calls of `program->functions[index]` that have a callee known at compile time, in
+/// order, and leaves their number in `site_count` (`bound_later` as for resolve_callee())
+static InlineSite* find_sites(Program* program, u32 index, bool bound_later, u32* site_count) {
+  ProgramFunction* caller = &program->functions[index];
+  IrFunction* ir = &caller->ir;
+  InlineSite* sites = NULL;
+  u32 site_capacity = 0;
+  *site_count = 0;
+  u32* depths = malloc(sizeof(u32) * (ir->count + 1));
+  if (!ir_stack_depths(ir, depths)) {
+    free(depths);
+    return NULL;
+  }
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* call = &ir->instructions[i];
+    if ((call->op_code != OP_CALL && call->op_code != OP_INVOKE) || depths[i] == IR_NO_DEPTH) continue;
+    u32 argument_count = call->op_code == OP_CALL ? call->operand : call->argument_count;
+    if (depths[i] < argument_count + 1) continue;
+    InlineSite site = {.call = i, .slot = depths[i] - argument_count - 1};
+    site.receiver = find_receiver(ir, depths, i, site.slot);
+    if (site.receiver == ir->count || !resolve_callee(program, caller, &site, bound_later)) continue;
+    GROW(InlineSite, sites, *site_count, site_capacity);
+    sites[(*site_count)++] = site;
+  }
+  free(depths);
+  return sites;
+}
+
+/// Returns the index of `function` in `program->functions`
+static u32 function_index(Program* program, ObjectFunction* function) {
+  u32 index = 0;
+  while (program->functions[index].function != function) index++;
+  return index;
+}
+
+/// The calls with a callee known at compile time between the functions of a program, searched for
+/// cycles by visit_calls() (Tarjan's strongly connected components)
+typedef struct {
+  /// Callees of function i, by index: `callees[first[i]]` up to `callees[first[i + 1]]`
+  u32* first;
+  u32* callees;
+  /// Visit number of every function (0 before it is visited) and the lowest one it reaches among
+  /// the functions on the stack
+  u32* visit;
+  u32* low;
+  u32 visit_count;
+  /// Visited functions whose component isn't complete yet
+  u32* stack;
+  u32 stack_count;
+  bool* on_stack;
+} CallGraph;
+
+/// Visits `function` and the functions it calls, marking the ones in a cycle as recursive
+static void visit_calls(Program* program, CallGraph* graph, u32 function) {
+  graph->visit[function] = graph->low[function] = ++graph->visit_count;
+  graph->stack[graph->stack_count++] = function;
+  graph->on_stack[function] = true;
+  for (u32 i = graph->first[function]; i < graph->first[function + 1]; i++) {
+    u32 callee = graph->callees[i];
+    if (callee == function) program->functions[function].recursive = true;
+    if (graph->visit[callee] == 0) {
+      visit_calls(program, graph, callee);
+      if (graph->low[callee] < graph->low[function]) graph->low[function] = graph->low[callee];
+    } else if (graph->on_stack[callee] && graph->visit[callee] < graph->low[function]) {
+      graph->low[function] = graph->visit[callee];
+    }
+  }
+  if (graph->low[function] != graph->visit[function]) return;
+  // `function` and the functions above it on the stack are a component, a cycle if there are several
+  u32 root = graph->stack_count - 1;
+  while (graph->stack[root] != function) root--;
+  for (u32 i = root; i < graph->stack_count; i++) {
+    graph->on_stack[graph->stack[i]] = false;
+    if (graph->stack_count - root > 1) program->functions[graph->stack[i]].recursive = true;
+  }
+  graph->stack_count = root;
+}
+
+/// Marks the functions of `program` that can call themselves through calls to known callees
+static void find_recursive_functions(Program* program) {
+  u32 count = program->function_count;
+  CallGraph graph = {.first = malloc(sizeof(u32) * (count + 1)), .callees = NULL};
+  u32 callee_count = 0;
+  u32 callee_capacity = 0;
+  for (u32 i = 0; i < count; i++) {
+    graph.first[i] = callee_count;
+    u32 site_count;
+    InlineSite* sites = find_sites(program, i, true, &site_count);
+    for (u32 j = 0; j < site_count; j++) {
+      if (sites[j].function == NULL) continue;
+      GROW(u32, graph.callees, callee_count, callee_capacity);
+      graph.callees[callee_count++] = function_index(program, sites[j].function);
+    }
+    free(sites);
+  }
+  graph.first[count] = callee_count;
+  graph.visit = calloc(count, sizeof(u32));
+  graph.low = malloc(sizeof(u32) * count);
+  graph.stack = malloc(sizeof(u32) * count);
+  graph.stack_count = 0;
+  graph.on_stack = calloc(count, sizeof(bool));
+  graph.visit_count = 0;
+  for (u32 i = 0; i < count; i++) {
+    if (graph.visit[i] == 0) visit_calls(program, &graph, i);
+  }
+  free(graph.first);
+  free(graph.callees);
+  free(graph.visit);
+  free(graph.low);
+  free(graph.stack);
+  free(graph.on_stack);
+}
+
+/// Returns whether the instruction `op_code` can be moved into another function
+static bool can_move(u8 op_code) {
+  switch (op_code) {
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSURE:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLOSE_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_GET_SUPER:
+    case OP_SUPER_INVOKE:
+    case OP_SWITCH:
+      return false;
+    default:
+      return true;
+  }
+}
+
+/// Builds the IR of the callee of `site` into `site->callee` if it is small enough and has nothing
+/// tied to its own frame, returns false otherwise
+static bool can_inline(Program* program, IrFunction* ir, InlineSite* site) {
+  ObjectFunction* callee = site->function;
+  IrInstruction* call = &ir->instructions[site->call];
+  u32 argument_count = call->op_code == OP_CALL ? call->operand : call->argument_count;
+  if (program->functions[function_index(program, callee)].recursive) return false;
+  if (callee->number_of_parameters != argument_count) return false;
+  // Its switch tables would have to be copied too
+  if (callee->upvalue_count != 0 || callee->switch_count != 0) return false;
+  ObjectFunction* caller = ir->function;
+  if (caller->chunk.constants.count + callee->chunk.constants.count > UINT16_MAX ||
+      caller->inline_cache_count + callee->inline_cache_count > UINT16_MAX) {
+    return false;
+  }
+  build_ir(&site->callee, callee);
+  u32 size = 0;
+  for (u32 i = 0; i < site->callee.count; i++) {
+    u8 op_code = site->callee.instructions[i].op_code;
+    if (op_code == IR_NOP) continue;
+    if (!can_move(op_code) || ++size > INLINE_MAX_INSTRUCTIONS) {
+      free_ir(&site->callee);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void add_instruction(IrInstruction** instructions, u32* count, u32* capacity, IrInstruction instruction) {
+  GROW(IrInstruction, *instructions, *count, *capacity);
+  (*instructions)[(*count)++] = instruction;
+}
+
+/// Appends the body of the callee of `site` to `instructions`, recording the call among the inlined
+/// calls of the caller along with the ones inlined into the callee, which go under it
+static void add_body(IrFunction* ir, InlineSite* site, IrInstruction** instructions, u32* count, u32* capacity) {
+  IrFunction* callee = &site->callee;
+  IrInstruction* call = &ir->instructions[site->call];
+  u32 inlined = ir_add_inlined_call(ir, (InlinedCall){callee->function, call->line, (i32)call->inlined - 1}) + 1;
+  u32 first_call = ir->call_count;
+  for (u32 i = 0; i < callee->call_count; i++) {
+    InlinedCall nested = callee->calls[i];
+    nested.parent = nested.parent == -1 ? (i32)inlined - 1 : (i32)first_call + nested.parent;
+    ir_add_inlined_call(ir, nested);
+  }
+  // The instruction every instruction of the callee starts at
+  u32* index_of = malloc(sizeof(u32) * (callee->count + 1));
+  u32 last = ir_previous(callee, callee->count);
+  for (u32 i = 0; i < callee->count; i++) {
+    index_of[i] = *count;
+    IrInstruction instruction = callee->instructions[i];
+    if (instruction.op_code == IR_NOP) continue;
+    instruction.incoming = 0;
+    instruction.offset = call->offset;
+    instruction.inlined = instruction.inlined == 0 ? inlined : first_call + instruction.inlined;
+    switch (instruction.op_code) {
+      case OP_GET_LOCAL:
+      case OP_SET_LOCAL:
+      case OP_INLINE_RETURN:
+        instruction.operand += site->slot;
+        break;
+      case OP_CONSTANT:
+        instruction.operand = ir_add_constant(ir, callee->function->chunk.constants.values[instruction.operand]);
+        break;
+      case OP_GET_PROPERTY:
+      case OP_SET_PROPERTY:
+      case OP_INVOKE:
+        instruction.operand = ir_add_constant(ir, callee->function->chunk.constants.values[instruction.operand]);
+        instruction.cache = (u16)add_inline_cache(ir->function, 0);
+        break;
+      case OP_RETURN:
+        instruction.op_code = OP_INLINE_RETURN;
+        instruction.operand = site->slot;
+        break;
+      default:
+        break;
+    }
+    add_instruction(instructions, count, capacity, instruction);
+    if (instruction.op_code == OP_INLINE_RETURN && callee->instructions[i].op_code == OP_RETURN && i != last) {
+      // To the end of the body, target set below
+      IrInstruction jump = {.op_code = OP_JUMP, .line = instruction.line, .inlined = inlined};
+      add_instruction(instructions, count, capacity, jump);
+    }
+  }
+  index_of[callee->count] = *count;
+  for (u32 i = 0; i < callee->count; i++) {
+    IrInstruction* instruction = &callee->instructions[i];
+    if (ir_is_jump(instruction->op_code)) {
+      (*instructions)[index_of[i]].target = index_of[instruction->target];
+    } else if (instruction->op_code == OP_RETURN && i != last) {
+      (*instructions)[index_of[i] + 1].target = *count;
+    }
+  }
+  free(index_of);
+}
+
+/// Rewrites the IR with the calls of `sites` (sorted by call) inlined
+static void rewrite(IrFunction* ir, InlineSite* sites, u32 site_count) {
+  // Site + 1 of the instructions that are the receiver or the call of one, 0 for the others
+  u32* receiver_of = calloc(ir->count, sizeof(u32));
+  u32* call_of = calloc(ir->count, sizeof(u32));
+  for (u32 i = 0; i < site_count; i++) {
+    receiver_of[sites[i].receiver] = i + 1;
+    call_of[sites[i].call] = i + 1;
+  }
+  u32* index_of = malloc(sizeof(u32) * (ir->count + 1));
+  IrInstruction* instructions = NULL;
+  u32 count = 0;
+  u32 capacity = 0;
+  for (u32 i = 0; i < ir->count; i++) {
+    index_of[i] = count;
+    IrInstruction instruction = ir->instructions[i];
+    if (call_of[i] != 0) {
+      InlineSite* site = &sites[call_of[i] - 1];
+      if (site->kind == INLINE_INSTANCE) {
+        IrInstruction instance = {.op_code = OP_INSTANCE, .line = instruction.line, .inlined = instruction.inlined};
+        add_instruction(&instructions, &count, &capacity, instance);
+      } else {
+        add_body(ir, site, &instructions, &count, &capacity);
+      }
+      continue;
+    }
+    if (receiver_of[i] != 0 && sites[receiver_of[i] - 1].kind == INLINE_FUNCTION) {
+      // Slot 0 of a function is never read
+      instruction.op_code = OP_NIL;
+      instruction.operand = 0;
+    }
+    add_instruction(&instructions, &count, &capacity, instruction);
+    if (receiver_of[i] != 0 && sites[receiver_of[i] - 1].kind == INLINE_CONSTRUCTOR) {
+      IrInstruction* call = &ir->instructions[sites[receiver_of[i] - 1].call];
+      IrInstruction instance = {.op_code = OP_INSTANCE, .line = call->line, .inlined = call->inlined};
+      add_instruction(&instructions, &count, &capacity, instance);
+    }
+  }
+  index_of[ir->count] = count;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (call_of[i] == 0 && ir_is_jump(instruction->op_code)) {
+      instructions[index_of[i]].target = index_of[instruction->target];
+    }
+  }
+  for (u32 i = 0; i < ir->function->switch_count; i++) {
+    SwitchTable* table = &ir->function->switches[i];
+    for (u32 arm = 0; arm <= table->arm_count; arm++) table->targets[arm] = index_of[table->targets[arm]];
+  }
+  free(ir->instructions);
+  ir->instructions = instructions;
+  ir->count = count;
+  ir->capacity = capacity;
+  free(index_of);
+  free(call_of);
+  free(receiver_of);
+}
+
+void inline_calls(Program* program, u32 index) {
+  IrFunction* ir = &program->functions[index].ir;
+  u32 site_count = 0;
+  InlineSite* sites = find_sites(program, index, false, &site_count);
+  u32 inlined = 0;
+  for (u32 i = 0; i < site_count; i++) {
+    if (sites[i].kind != INLINE_INSTANCE && !can_inline(program, ir, &sites[i])) continue;
+    sites[inlined++] = sites[i];
+  }
+  if (inlined > 0) rewrite(ir, sites, inlined);
+  for (u32 i = 0; i < inlined; i++) {
+    if (sites[i].kind != INLINE_INSTANCE) free_ir(&sites[i].callee);
+  }
+  free(sites);
+}
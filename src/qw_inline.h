@@ -0,0 +1,103 @@
+#ifndef qw_inline_h
+#define qw_inline_h
+
+#include "qw_ir.h"
+
+/// Inlining of calls to small functions known at compile time. Once the whole script is compiled
+/// it is known which globals a `fun` or `class` declaration binds once and nothing assigns, and
+/// which method names a single class declares and nothing sets as a field. A call to such a
+/// function, a constructor call of such a class and `this.method()` in the methods of that class
+/// get the body of the callee in place of their OP_CALL/OP_INVOKE: the slots of the callee go on
+/// top of the ones of the caller (its locals are renumbered), its returns become OP_INLINE_RETURN
+/// and its instructions keep their lines. The caller records the call and the code it left
+/// (ObjectFunction.inlined_calls), from which runtime_error() prints the frame the callee would
+/// have had. Callees that capture variables or create closures aren't inlined, nor are the
+/// functions that can call themselves through such calls (ProgramFunction.recursive)
+
+/// Largest callee inlined, in instructions
+#define INLINE_MAX_INSTRUCTIONS 24
+
+typedef struct {
+  ObjectFunction* function;
+  /// IR of the function, built by analyze_program() from the code the compiler emitted
+  IrFunction ir;
+  /// Script offset from which the function can run: where the script creates it (right after its
+  /// class declaration for a method), that of the top-level function enclosing it for the others.
+  /// UINT32_MAX for the script itself, whose calls are checked at their own offset
+  u32 position;
+  /// Class the function is a method of, -1 if it isn't one
+  i32 class_index;
+  /// Whether the function is in a cycle of calls with callees known at compile time, itself
+  /// included: it is never inlined, into other functions either
+  bool recursive;
+} ProgramFunction;
+
+/// What a global is bound to by the script
+typedef struct {
+  u32 definitions;
+  u32 assignments;
+  /// Function of its `fun` declaration, NULL if it isn't bound to one
+  ObjectFunction* function;
+  /// Class of its `class` declaration, -1 if it isn't bound to one
+  i32 class_index;
+  /// Script offset from which the declaration is complete (the class has all its methods)
+  u32 bound_at;
+  /// Whether the global has `value` from script offset `known_from` on
+  bool known;
+  Value value;
+  u32 known_from;
+} GlobalBinding;
+
+typedef struct {
+  bool has_superclass;
+  /// Its own `init` method, NULL if it has none
+  ObjectFunction* initializer;
+} ProgramClass;
+
+typedef struct {
+  ObjectString* name;
+  ObjectFunction* function;
+  i32 class_index;
+} ProgramMethod;
+
+/// What inline_calls() and the passes know about the whole script
+typedef struct Program {
+  /// Every function of the script, the ones it creates before the one creating them and the
+  /// script last: the order they are optimized in
+  ProgramFunction* functions;
+  u32 function_count;
+  u32 function_capacity;
+  GlobalBinding* globals;
+  u32 global_count;
+  ProgramClass* classes;
+  u32 class_count;
+  u32 class_capacity;
+  ProgramMethod* methods;
+  u32 method_count;
+  u32 method_capacity;
+  /// Names of the properties OP_SET_PROPERTY assigns, a field shadows the method of the same name
+  ObjectString** fields;
+  u32 field_count;
+  u32 field_capacity;
+  /// Whether an OP_SET_PROPERTY_TOP_STACK can set a field of any name
+  bool dynamic_fields;
+} Program;
+
+/// Builds the IR of every function of `script`, fresh out of the compiler, and finds what they bind
+void analyze_program(Program* program, ObjectFunction* script);
+
+/// Returns whether `global` keeps the value it is first defined with: at most one declaration binds
+/// it and nothing assigns it
+bool is_fixed_global(Program* program, u32 global);
+
+/// Returns whether the OP_GET_GLOBAL `load` of `ir` pushes a value known at compile time, which it
+/// leaves in `value`
+bool known_global(Program* program, IrFunction* ir, IrInstruction* load, Value* value);
+
+/// Inlines the calls of `program->functions[index]` that have a callee known at compile time
+void inline_calls(Program* program, u32 index);
+
+/// Frees what analyze_program() allocated, the IR of the functions must be freed already
+void free_program(Program* program);
+
+#endif
@@ -0,0 +1,616 @@
+#include "qw_ir.h"
+
+#include <stdlib.h>
+
+#include "memory.h"
+#include "qw_debug.h"
+#include "qw_inline.h"
+#include "qw_passes.h"
+#include "qw_vm.h"
+
+bool optimize = true;
+bool dump_ir = false;
+
+/// Passes run again while they keep changing the IR, at most this many times
+#define MAX_PASS_ROUNDS 4
+
+static u16 read_u16(const u8* code) { return (code[0] << 8) | code[1]; }
+
+static void write_u16(u8* code, u16 value) {
+  code[0] = value >> 8;
+  code[1] = value & 0xFF;
+}
+
+bool ir_is_jump(u8 op_code) {
+  switch (op_code) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_BACK:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_NUMBERS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool ir_is_terminator(u8 op_code) {
+  return op_code == OP_RETURN || op_code == OP_JUMP || op_code == OP_JUMP_BACK || op_code == OP_SWITCH;
+}
+
+SwitchTable* ir_switch(IrFunction* ir, IrInstruction* instruction) {
+  return &ir->function->switches[instruction->operand];
+}
+
+/// Returns whether `op_code` takes a variable index, 2 bytes long behind OP_WIDE
+static bool is_variable_op(u8 op_code) {
+  switch (op_code) {
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_INLINE_RETURN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether `op_code` owns an inline cache
+static bool has_cache(u8 op_code) {
+  return op_code == OP_GET_PROPERTY || op_code == OP_SET_PROPERTY || op_code == OP_INVOKE;
+}
+
+u32 ir_next(IrFunction* ir, u32 index) {
+  while (index < ir->count && ir->instructions[index].op_code == IR_NOP) index++;
+  return index;
+}
+
+u32 ir_previous(IrFunction* ir, u32 index) {
+  while (index > 0) {
+    if (ir->instructions[--index].op_code != IR_NOP) return index;
+  }
+  return ir->count;
+}
+
+bool ir_constant(IrFunction* ir, IrInstruction* instruction, Value* value) {
+  switch (instruction->op_code) {
+    case OP_CONSTANT:
+      *value = ir->function->chunk.constants.values[instruction->operand];
+      return true;
+    case OP_TRUE:
+      *value = BOOL_VAL(true);
+      return true;
+    case OP_FALSE:
+      *value = BOOL_VAL(false);
+      return true;
+    case OP_NIL:
+      *value = NIL_VAL;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether the constants `a` and `b` are the same, numbers bit for bit (0 and -0 differ)
+static bool same_constant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return IS_OBJECT(a) && IS_OBJECT(b) && AS_OBJECT(a) == AS_OBJECT(b);
+}
+
+u32 ir_add_constant(IrFunction* ir, Value value) {
+  ValueArray* constants = &ir->function->chunk.constants;
+  u32 index = 0;
+  while (index < constants->count && !same_constant(constants->values[index], value)) index++;
+  if (index == constants->count) {
+    push(value);
+    index = add_constant(&ir->function->chunk, value);
+    pop();
+  }
+  return index;
+}
+
+void ir_set_constant(IrFunction* ir, IrInstruction* instruction, Value value) {
+  if (IS_BOOL(value) || IS_NIL(value)) {
+    instruction->op_code = IS_NIL(value) ? OP_NIL : AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+    instruction->operand = 0;
+    return;
+  }
+  instruction->op_code = OP_CONSTANT;
+  instruction->operand = ir_add_constant(ir, value);
+}
+
+/// Returns how many values `instruction` leaves on the stack minus how many it takes, false if it
+/// isn't an instruction of the IR. OP_INLINE_RETURN is left to ir_stack_depths()
+static bool stack_effect(IrInstruction* instruction, i32* effect) {
+  switch (checked_op_code(instruction->op_code)) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+    case OP_PUSH_TOP:
+    case OP_CLOSURE:
+    case OP_CLASS:
+      *effect = 1;
+      return true;
+    case OP_NEGATE:
+    case OP_NOT:
+    case OP_SET_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_SET_UPVALUE:
+    case OP_GET_PROPERTY:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+    case OP_SWITCH:
+    case OP_INSTANCE:
+      *effect = 0;
+      return true;
+    case OP_RETURN:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_ASSERT:
+    case OP_DEFINE_GLOBAL:
+    case OP_CLOSE_UPVALUE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_SET_PROPERTY:
+    case OP_GET_PROPERTY_TOP_STACK:
+    case OP_METHOD:
+    case OP_INHERIT:
+    case OP_GET_SUPER:
+      *effect = -1;
+      return true;
+    case OP_SET_PROPERTY_TOP_STACK:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      *effect = -2;
+      return true;
+    case OP_CALL:
+      *effect = -(i32)instruction->operand;
+      return true;
+    case OP_INVOKE:
+      *effect = -(i32)instruction->argument_count;
+      return true;
+    case OP_SUPER_INVOKE:
+      // The superclass goes too
+      *effect = -(i32)instruction->argument_count - 1;
+      return true;
+    case OP_ARRAY:
+      *effect = 1 - (i32)instruction->operand;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool ir_stack_depths(IrFunction* ir, u32* depths) {
+  for (u32 i = 0; i < ir->count; i++) depths[i] = IR_NO_DEPTH;
+  if (ir->count == 0) return true;
+  u32* worklist = malloc(sizeof(u32) * ir->count);
+  u32 pending = 0;
+  bool consistent = true;
+  // Slot 0 (the closure or `this`) and the arguments
+  depths[0] = ir->function->number_of_parameters + 1;
+  worklist[pending++] = 0;
+  while (pending > 0 && consistent) {
+    u32 index = worklist[--pending];
+    IrInstruction* instruction = &ir->instructions[index];
+    u32 after = depths[index];
+    i32 effect = 0;
+    if (instruction->op_code == OP_INLINE_RETURN) {
+      after = instruction->operand + 1;
+    } else if (instruction->op_code != IR_NOP) {
+      if (!stack_effect(instruction, &effect) || (i32)after + effect < 0) {
+        consistent = false;
+        break;
+      }
+      after = (u32)((i32)after + effect);
+    }
+    u32 successors[2];
+    u32 successor_count = 0;
+    if (!ir_is_terminator(instruction->op_code)) successors[successor_count++] = index + 1;
+    if (ir_is_jump(instruction->op_code)) successors[successor_count++] = instruction->target;
+    if (instruction->op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      for (u32 arm = 0; arm <= table->arm_count && consistent; arm++) {
+        u32 target = table->targets[arm];
+        if (target >= ir->count) continue;
+        if (depths[target] == IR_NO_DEPTH) {
+          depths[target] = after;
+          worklist[pending++] = target;
+        } else {
+          consistent = depths[target] == after;
+        }
+      }
+    }
+    for (u32 i = 0; i < successor_count && consistent; i++) {
+      u32 successor = successors[i];
+      if (successor >= ir->count) continue;
+      if (depths[successor] == IR_NO_DEPTH) {
+        depths[successor] = after;
+        worklist[pending++] = successor;
+      } else {
+        consistent = depths[successor] == after;
+      }
+    }
+  }
+  free(worklist);
+  return consistent;
+}
+
+static void add_instruction(IrFunction* ir, IrInstruction instruction) {
+  if (ir->capacity < ir->count + 1) {
+    ir->capacity = GROW_CAPACITY(ir->capacity);
+    ir->instructions = realloc(ir->instructions, sizeof(IrInstruction) * ir->capacity);
+  }
+  ir->instructions[ir->count++] = instruction;
+}
+
+/// Decodes the instruction at `offset`, leaving the offset it jumps to in `target`
+static IrInstruction decode(Chunk* chunk, u32 offset) {
+  IrInstruction instruction = {.op_code = chunk->code[offset], .offset = offset};
+  Jump jump;
+  if (find_jump(chunk, offset, &jump)) {
+    instruction.target = jump_target(chunk, &jump);
+    return instruction;
+  }
+  const u8* operands = &chunk->code[offset + 1];
+  switch (instruction.op_code) {
+    case OP_WIDE:
+      instruction.op_code = chunk->code[offset + 1];
+      instruction.operand = read_u16(operands + 1);
+      break;
+    case OP_CONSTANT_LONG:
+      instruction.op_code = OP_CONSTANT;
+      instruction.operand = read_u16(operands);
+      break;
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_ARRAY:
+    case OP_CLOSURE:
+    case OP_SWITCH:
+      instruction.operand = read_u16(operands);
+      break;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      instruction.operand = read_u16(operands);
+      instruction.cache = read_u16(operands + 2);
+      break;
+    case OP_INVOKE:
+      instruction.operand = read_u16(operands);
+      instruction.argument_count = operands[2];
+      instruction.cache = read_u16(operands + 3);
+      break;
+    case OP_SUPER_INVOKE:
+      instruction.operand = read_u16(operands);
+      instruction.argument_count = operands[2];
+      break;
+    default:
+      if (op_code_length(instruction.op_code) == 2) instruction.operand = operands[0];
+      break;
+  }
+  return instruction;
+}
+
+void build_ir(IrFunction* ir, ObjectFunction* function) {
+  Chunk* chunk = &function->chunk;
+  ir->function = function;
+  ir->program = NULL;
+  ir->instructions = NULL;
+  ir->count = 0;
+  ir->capacity = 0;
+  ir->code = malloc(chunk->count);
+  memcpy(ir->code, chunk->code, chunk->count);
+  ir->calls = NULL;
+  ir->call_count = 0;
+  ir->call_capacity = 0;
+  for (u32 i = 0; i < function->inlined_call_count; i++) ir_add_inlined_call(ir, function->inlined_calls[i]);
+  // The instruction of every offset, to turn the offsets jumps land on into instructions
+  u32* index_of = malloc(sizeof(u32) * (chunk->count + 1));
+  // Walks the run length encoded lines along with the instructions
+  u32 line_index = 0;
+  u32 line_end = chunk->lines.count > 0 ? chunk->lines.lines[0].times : 0;
+  for (u32 offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+    while (offset >= line_end && line_index + 1 < chunk->lines.count) {
+      line_end += chunk->lines.lines[++line_index].times;
+    }
+    IrInstruction instruction = decode(chunk, offset);
+    instruction.line = chunk->lines.lines[line_index].line;
+    instruction.inlined = (u32)(inlined_call_at(function, offset) + 1);
+    index_of[offset] = ir->count;
+    add_instruction(ir, instruction);
+  }
+  index_of[chunk->count] = ir->count;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (ir_is_jump(instruction->op_code)) instruction->target = index_of[instruction->target];
+  }
+  for (u32 i = 0; i < function->switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    for (u32 arm = 0; arm <= table->arm_count; arm++) table->targets[arm] = index_of[table->targets[arm]];
+  }
+  free(index_of);
+}
+
+/// Returns the number of bytes `instruction` is encoded with
+static u32 encoded_length(IrFunction* ir, IrInstruction* instruction) {
+  u8 op_code = instruction->op_code;
+  if (op_code == IR_NOP) return 0;
+  if (op_code == OP_CONSTANT) return instruction->operand <= UINT8_MAX ? 2 : 3;
+  if (is_variable_op(op_code)) return instruction->operand <= UINT8_MAX ? 2 : 4;
+  if (op_code == OP_CLOSURE) {
+    Value function = ir->function->chunk.constants.values[instruction->operand];
+    return 3 + 2 * ((ObjectFunction*)AS_OBJECT(function))->upvalue_count;
+  }
+  return op_code_length(op_code);
+}
+
+/// Encodes the instruction `index` at `code`, `offsets` has the new offset of every instruction
+static void encode(IrFunction* ir, u32 index, u8* code, u32* offsets) {
+  IrInstruction* instruction = &ir->instructions[index];
+  u8 op_code = instruction->op_code;
+  u32 operand = instruction->operand;
+  if (ir_is_jump(op_code)) {
+    u32 end = offsets[index] + 3;
+    u32 target = offsets[instruction->target];
+    code[0] = op_code;
+    write_u16(code + 1, (u16)(op_code == OP_JUMP_BACK ? end - target : target - end));
+    return;
+  }
+  if (op_code == OP_CONSTANT && operand > UINT8_MAX) {
+    code[0] = OP_CONSTANT_LONG;
+    write_u16(code + 1, (u16)operand);
+    return;
+  }
+  if (is_variable_op(op_code) && operand > UINT8_MAX) {
+    code[0] = OP_WIDE;
+    code[1] = op_code;
+    write_u16(code + 2, (u16)operand);
+    return;
+  }
+  code[0] = op_code;
+  switch (op_code) {
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_ARRAY:
+    case OP_SWITCH:
+      write_u16(code + 1, (u16)operand);
+      break;
+    case OP_CLOSURE: {
+      write_u16(code + 1, (u16)operand);
+      // The (is_local, index) pairs are copied as they were
+      u32 length = encoded_length(ir, instruction);
+      memcpy(code + 3, ir->code + instruction->offset + 3, length - 3);
+      break;
+    }
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      write_u16(code + 1, (u16)operand);
+      write_u16(code + 3, instruction->cache);
+      break;
+    case OP_INVOKE:
+      write_u16(code + 1, (u16)operand);
+      code[3] = instruction->argument_count;
+      write_u16(code + 4, instruction->cache);
+      break;
+    case OP_SUPER_INVOKE:
+      write_u16(code + 1, (u16)operand);
+      code[3] = instruction->argument_count;
+      break;
+    default:
+      if (op_code_length(op_code) == 2) code[1] = (u8)operand;
+      break;
+  }
+}
+
+/// Sets the inlined calls of the function and the ranges of the instructions they left, one per
+/// run of instructions from the same call
+static void generate_inlined_code(IrFunction* ir, u32* offsets) {
+  u32 range_count = 0;
+  u32 current = 0;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == IR_NOP || instruction->inlined == current) continue;
+    current = instruction->inlined;
+    if (current != 0) range_count++;
+  }
+  InlinedCall* calls = ALLOCATE(InlinedCall, ir->call_count);
+  for (u32 i = 0; i < ir->call_count; i++) calls[i] = ir->calls[i];
+  InlinedRange* ranges = ALLOCATE(InlinedRange, range_count);
+  range_count = 0;
+  current = 0;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == IR_NOP) continue;
+    if (instruction->inlined != current) {
+      if (current != 0) ranges[range_count - 1].end = offsets[i];
+      current = instruction->inlined;
+      if (current != 0) ranges[range_count++] = (InlinedRange){offsets[i], 0, current - 1};
+    }
+  }
+  if (current != 0) ranges[range_count - 1].end = offsets[ir->count];
+  set_inlined_code(ir->function, calls, ir->call_count, ranges, range_count);
+}
+
+void generate_bytecode(IrFunction* ir) {
+  ObjectFunction* function = ir->function;
+  Chunk* chunk = &function->chunk;
+  // An IR_NOP gets the offset of the instruction after it, where the jumps to it land
+  u32* offsets = malloc(sizeof(u32) * (ir->count + 1));
+  u32 count = 0;
+  for (u32 i = 0; i < ir->count; i++) {
+    offsets[i] = count;
+    count += encoded_length(ir, &ir->instructions[i]);
+  }
+  offsets[ir->count] = count;
+
+  u8* code = malloc(count);
+  Lines lines;
+  init_lines(&lines);
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == IR_NOP) continue;
+    encode(ir, i, code + offsets[i], offsets);
+    for (u32 j = offsets[i]; j < offsets[i + 1]; j++) write_line(&lines, instruction->line);
+    if (has_cache(instruction->op_code)) function->inline_caches[instruction->cache].offset = offsets[i];
+  }
+  for (u32 i = 0; i < function->switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    for (u32 arm = 0; arm <= table->arm_count; arm++) table->targets[arm] = offsets[table->targets[arm]];
+  }
+  generate_inlined_code(ir, offsets);
+
+  if (chunk->capacity < count) {
+    chunk->code = GROW_ARRAY(u8, chunk->code, chunk->capacity, count);
+    chunk->capacity = count;
+  }
+  memcpy(chunk->code, code, count);
+  chunk->count = count;
+  free_lines(&chunk->lines);
+  chunk->lines = lines;
+  free(code);
+  free(offsets);
+}
+
+void free_ir(IrFunction* ir) {
+  free(ir->instructions);
+  free(ir->code);
+  free(ir->calls);
+  ir->calls = NULL;
+  ir->call_count = 0;
+  ir->call_capacity = 0;
+  ir->instructions = NULL;
+  ir->code = NULL;
+  ir->count = 0;
+  ir->capacity = 0;
+}
+
+u32 ir_add_inlined_call(IrFunction* ir, InlinedCall call) {
+  if (ir->call_capacity < ir->call_count + 1) {
+    ir->call_capacity = GROW_CAPACITY(ir->call_capacity);
+    ir->calls = realloc(ir->calls, sizeof(InlinedCall) * ir->call_capacity);
+  }
+  ir->calls[ir->call_count] = call;
+  return ir->call_count++;
+}
+
+void ir_count_incoming(IrFunction* ir) {
+  for (u32 i = 0; i < ir->count; i++) ir->instructions[i].incoming = 0;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      for (u32 arm = 0; arm <= table->arm_count; arm++) {
+        u32 target = ir_next(ir, table->targets[arm]);
+        if (target < ir->count) ir->instructions[target].incoming++;
+      }
+    }
+    if (instruction->op_code == IR_NOP || !ir_is_jump(instruction->op_code)) continue;
+    u32 target = ir_next(ir, instruction->target);
+    if (target < ir->count) ir->instructions[target].incoming++;
+  }
+}
+
+void print_ir(IrFunction* ir, const char* name) {
+  printf("=== ir %s ===\n", name);
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    u8 op_code = instruction->op_code;
+    if (op_code == IR_NOP) continue;
+    printf("%4u [%4u] %-28s", i, instruction->line, op_code_name(op_code));
+    if (ir_is_jump(op_code)) {
+      printf(" -> %u", ir_next(ir, instruction->target));
+    } else if (op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      for (u32 arm = 0; arm <= table->arm_count; arm++) {
+        printf("%s%u", arm == 0 ? " -> " : ", ", ir_next(ir, table->targets[arm]));
+      }
+    } else if (op_code == OP_CONSTANT || op_code == OP_CLASS || op_code == OP_METHOD || op_code == OP_GET_SUPER ||
+               op_code == OP_CLOSURE || has_cache(op_code) || op_code == OP_SUPER_INVOKE) {
+      printf(" %4u '", instruction->operand);
+      print_value(ir->function->chunk.constants.values[instruction->operand]);
+      printf("'");
+      if (op_code == OP_INVOKE || op_code == OP_SUPER_INVOKE) printf(" (%u args)", instruction->argument_count);
+    } else if (op_code_length(op_code) > 1 || is_variable_op(op_code)) {
+      printf(" %4u", instruction->operand);
+    }
+    printf("\n");
+  }
+}
+
+/// Runs the passes over `ir` while they keep changing it
+static void run_passes(IrFunction* ir) {
+  for (u32 round = 0; round < MAX_PASS_ROUNDS; round++) {
+    bool changed = false;
+    for (u32 i = 0; i < PASS_COUNT; i++) {
+      ir_count_incoming(ir);
+      changed |= passes[i].run(ir);
+    }
+    if (!changed) break;
+  }
+}
+
+void optimize_script(ObjectFunction* script) {
+  if (!optimize && !dump_ir) return;
+  Program program;
+  analyze_program(&program, script);
+  for (u32 i = 0; i < program.function_count; i++) {
+    ProgramFunction* function = &program.functions[i];
+    if (optimize) {
+      inline_calls(&program, i);
+      run_passes(&function->ir);
+    }
+    if (dump_ir) {
+      print_ir(&function->ir, function->function->name != NULL ? function->function->name->chars : "<script>");
+    }
+    generate_bytecode(&function->ir);
+    free_ir(&function->ir);
+  }
+  free_program(&program);
+}
+
+void optimize_function(ObjectFunction* function) {
+  if (!optimize && !dump_ir) return;
+  IrFunction ir;
+  build_ir(&ir, function);
+  if (optimize) run_passes(&ir);
+  if (dump_ir) print_ir(&ir, function->name != NULL ? function->name->chars : "<script>");
+  generate_bytecode(&ir);
+  free_ir(&ir);
+}
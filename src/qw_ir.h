@@ -0,0 +1,126 @@
+#ifndef qw_ir_h
+#define qw_ir_h
+
+#include "qw_chunk.h"
+#include "qw_common.h"
+#include "qw_object.h"
+
+/// Intermediate representation between the compiler and the bytecode. compile() builds it
+/// from the code the parser emitted, runs the passes of qw_passes.h over it and generates the
+/// Chunk again. It is the bytecode with the encoding taken out: one IrInstruction per instruction
+/// with its operands decoded (no OP_WIDE, OP_CONSTANT_LONG or jump distances), jumps pointing to
+/// instructions and a line per instruction. Passes rewrite instructions in place and remove them
+/// by turning them into IR_NOP, so the indexes jumps point to stay valid; the generator picks the
+/// encoding, relocates the jumps, lines and inline caches and drops the IR_NOPs
+
+/// Pseudo opcode of a removed instruction. A jump to it lands on the next instruction
+#define IR_NOP OP_CODE_COUNT
+
+typedef struct {
+  u8 op_code;
+  /// Constant, slot, global or upvalue index, argument count of OP_CALL or length of OP_ARRAY
+  u32 operand;
+  /// Argument count of OP_INVOKE and OP_SUPER_INVOKE
+  u8 argument_count;
+  /// Inline cache of OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE
+  u16 cache;
+  /// Index of the instruction a jump lands on (the instruction count for the end of the code). The
+  /// targets of an OP_SWITCH are in its SwitchTable, as instruction indexes too while the IR exists
+  u32 target;
+  u32 line;
+  /// Bytecode offset the instruction was built from, where OP_CLOSURE has its upvalue pairs. The
+  /// instructions inlined in place of a call have the offset of the call
+  u32 offset;
+  /// Number of jumps that land on the instruction, updated before every pass
+  u32 incoming;
+  /// IrFunction.calls index + 1 of the inlined call the instruction comes from, 0 if it is the
+  /// function's own
+  u32 inlined;
+} IrInstruction;
+
+typedef struct {
+  ObjectFunction* function;
+  IrInstruction* instructions;
+  u32 count;
+  u32 capacity;
+  /// The code the IR was built from
+  u8* code;
+  /// The whole script the function is part of (qw_inline.h), NULL when it is optimized on its own
+  struct Program* program;
+  /// Calls inlined into the function, ObjectFunction.inlined_calls until the generator replaces them
+  InlinedCall* calls;
+  u32 call_count;
+  u32 call_capacity;
+} IrFunction;
+
+/// Whether compile() runs the passes and inlines calls (qw_inline.h), turned off with --no-optimize
+extern bool optimize;
+/// Whether compile() prints the IR of every function after the passes, set with --dump-ir
+extern bool dump_ir;
+
+/// Builds the IR of `function` from its code, as the compiler emitted it or generate_bytecode() did
+void build_ir(IrFunction* ir, ObjectFunction* function);
+
+/// Generates the code of `ir->function` from the IR, with its inlined calls and ranges
+void generate_bytecode(IrFunction* ir);
+
+/// Frees the IR, not the function
+void free_ir(IrFunction* ir);
+
+/// Counts the jumps that land on every instruction (IrInstruction.incoming), on the instruction
+/// after when they land on an IR_NOP
+void ir_count_incoming(IrFunction* ir);
+
+/// Adds `call` to the calls inlined into the function and returns its index
+u32 ir_add_inlined_call(IrFunction* ir, InlinedCall call);
+
+/// Returns whether `op_code` jumps to IrInstruction.target
+bool ir_is_jump(u8 op_code);
+
+/// Returns whether control never falls through the instruction with `op_code` to the next one
+bool ir_is_terminator(u8 op_code);
+
+/// Returns the SwitchTable of the OP_SWITCH `instruction`
+SwitchTable* ir_switch(IrFunction* ir, IrInstruction* instruction);
+
+/// Returns the index of the first instruction from `index` on that isn't an IR_NOP
+u32 ir_next(IrFunction* ir, u32 index);
+
+/// Returns the index of the last instruction before `index` that isn't an IR_NOP, `ir->count` if
+/// there is none
+u32 ir_previous(IrFunction* ir, u32 index);
+
+/// Returns whether `instruction` pushes a constant (OP_CONSTANT, OP_TRUE, OP_FALSE, OP_NIL), which
+/// it leaves in `value`
+bool ir_constant(IrFunction* ir, IrInstruction* instruction, Value* value);
+
+/// Returns the index of `value` among the constants of the function, adding it unless it is
+/// already there
+u32 ir_add_constant(IrFunction* ir, Value value);
+
+/// Turns `instruction` into the instruction that pushes `value`, adding it to the constants of the
+/// function unless it is already there
+void ir_set_constant(IrFunction* ir, IrInstruction* instruction, Value value);
+
+/// Depth of an instruction no path from the entry reaches
+#define IR_NO_DEPTH UINT32_MAX
+
+/// Fills `depths` (one per instruction) with the number of stack slots of the frame in use before
+/// every instruction, IR_NO_DEPTH for the unreachable ones: a local is in the slot of its index, the
+/// values an instruction takes are the ones right below that depth. Returns false if the paths
+/// reaching an instruction disagree or the IR has an instruction of unknown effect
+bool ir_stack_depths(IrFunction* ir, u32* depths);
+
+/// Prints the IR the way dissasemble_chunk() prints bytecode
+void print_ir(IrFunction* ir, const char* name);
+
+/// Runs the IR pipeline on every function of `script` once the compiler has emitted all of their
+/// code (see `optimize` and `dump_ir`): calls are inlined, then the passes run. The functions a
+/// function creates go through it before that function, the script last
+void optimize_script(ObjectFunction* script);
+
+/// Runs the passes on `function` alone, without inlining, for the functions that aren't compiled
+/// along with the rest of the script (lazy_compile in qw_compiler.h). Not the functions it creates
+void optimize_function(ObjectFunction* function);
+
+#endif
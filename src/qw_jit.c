@@ -0,0 +1,543 @@
+#include "qw_jit.h"
+
+#ifdef QW_JIT
+
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "qw_chunk.h"
+#include "qw_peephole.h"
+#include "qw_trace.h"
+
+bool jit_enabled = false;
+
+// Stencils are assembled with the rest of the binary and never executed in place, the JIT copies
+// them. They use fixed registers: rbx = JitState, r12 = stack top, r13 = slots, r14 = constants and
+// r15 = globals. The values they get patched with are written as magic numbers (holes), found
+// once by scanning the assembled bytes
+#define HOLE_OPERAND 0x7eadbe01
+#define HOLE_INDEX 0x7eadbe02
+#define HOLE_TARGET 0x7eadbe03
+#define HOLE_EXIT 0x7eadbe04
+#define HOLE_EPILOGUE 0x7eadbe05
+#define HOLE_OFFSET 0x7eadbe06
+
+#define STRINGIFY(x) #x
+#define TO_STRING(x) STRINGIFY(x)
+
+/// rel32 jumps to a hole: `cc` is the second byte of the 0x0f 0x8? conditional jump
+#define JCC(cc, hole) ".byte 0x0f, " #cc "\n.long " TO_STRING(hole) "\n"
+#define JMP(hole) ".byte 0xe9\n.long " TO_STRING(hole) "\n"
+
+#define STENCIL(name, code) "jit_stencil_" #name ":\n" code "jit_stencil_" #name "_end:\n"
+
+#ifdef QW_NAN_BOXING
+
+#define VALUE_SIZE "8"
+#define TWO_VALUES "16"
+#define NUMBER_AT(offset) offset "(%r12)"
+#define COPY_VALUE(from, to) "movq " from ", %rax\nmovq %rax, " to "\n"
+#define PUSH_CONSTANT(value) "movabs $" value ", %rax\nmovq %rax, (%r12)\naddq $8, %r12\n"
+/// Exits unless the value at `offset` from the stack top is a number
+#define GUARD_NUMBER(offset)                   \
+  "movq " offset "(%r12), %rax\n"              \
+  "movabs $0x7ffc000000000000, %rcx\n"         \
+  "andq %rcx, %rax\n"                          \
+  "cmpq %rcx, %rax\n" JCC(0x84, HOLE_EXIT)
+/// Exits unless the value on top of the stack is a bool, leaves ZF set if it is true
+#define TEST_BOOL                              \
+  "movq -8(%r12), %rax\n"                      \
+  "movabs $0x7ffc000000000003, %rcx\n"         \
+  "movq %rax, %rdx\n"                          \
+  "orq $1, %rdx\n"                             \
+  "cmpq %rcx, %rdx\n" JCC(0x85, HOLE_EXIT) "cmpq %rcx, %rax\n"
+
+#else
+
+#define VALUE_SIZE "16"
+#define TWO_VALUES "32"
+#define NUMBER_AT(offset) offset "+8(%r12)"
+#define COPY_VALUE(from, to) "movups " from ", %xmm0\nmovups %xmm0, " to "\n"
+#define PUSH_CONSTANT(type, number) "movl $" type ", (%r12)\nmovq $" number ", 8(%r12)\naddq $16, %r12\n"
+#define GUARD_NUMBER(offset) "cmpl $2, " offset "(%r12)\n" JCC(0x85, HOLE_EXIT)
+#define TEST_BOOL "cmpl $0, -16(%r12)\n" JCC(0x85, HOLE_EXIT) "cmpb $1, -8(%r12)\n"
+
+#endif
+
+#define LEFT "-" TWO_VALUES
+#define RIGHT "-" VALUE_SIZE
+
+#define BINARY_STENCIL(name, instruction)                               \
+  STENCIL(name, GUARD_NUMBER(RIGHT) GUARD_NUMBER(LEFT)                  \
+                "movsd " NUMBER_AT(LEFT) ", %xmm0\n"                    \
+                instruction " " NUMBER_AT(RIGHT) ", %xmm0\n"            \
+                "movsd %xmm0, " NUMBER_AT(LEFT) "\n"                    \
+                "subq $" VALUE_SIZE ", %r12\n")
+
+/// Pops two numbers and compares them with ucomisd `operands`, jumps with `jump`
+#define COMPARE_JUMP_STENCIL(name, operands, jump)                      \
+  STENCIL(name, GUARD_NUMBER(RIGHT) GUARD_NUMBER(LEFT)                  \
+                "movsd " NUMBER_AT(LEFT) ", %xmm0\n"                    \
+                "movsd " NUMBER_AT(RIGHT) ", %xmm1\n"                   \
+                "subq $" TWO_VALUES ", %r12\n"                          \
+                "ucomisd " operands "\n" jump)
+
+// clang-format off
+__asm__(
+    ".pushsection .rodata\n"
+    STENCIL(prologue,
+            "pushq %rbx\npushq %r12\npushq %r13\npushq %r14\npushq %r15\n"
+            "movq %rdi, %rbx\n"
+            "movq 0(%rbx), %r12\n"
+            "movq 8(%rbx), %r13\n"
+            "movq 16(%rbx), %r14\n"
+            "movq 24(%rbx), %r15\n"
+            "jmp *%rsi\n")
+    STENCIL(epilogue,
+            "movq %r12, 0(%rbx)\n"
+            "popq %r15\npopq %r14\npopq %r13\npopq %r12\npopq %rbx\n"
+            "ret\n")
+    STENCIL(exit,
+            "movl $" TO_STRING(HOLE_OFFSET) ", %eax\n"
+            JMP(HOLE_EPILOGUE))
+    STENCIL(constant,
+            COPY_VALUE(TO_STRING(HOLE_OPERAND) "(%r14)", "(%r12)")
+            "addq $" VALUE_SIZE ", %r12\n")
+#ifdef QW_NAN_BOXING
+    STENCIL(nil, PUSH_CONSTANT("0x7ffc000000000001"))
+    STENCIL(false, PUSH_CONSTANT("0x7ffc000000000002"))
+    STENCIL(true, PUSH_CONSTANT("0x7ffc000000000003"))
+#else
+    STENCIL(nil, PUSH_CONSTANT("1", "0"))
+    STENCIL(false, PUSH_CONSTANT("0", "0"))
+    STENCIL(true, PUSH_CONSTANT("0", "1"))
+#endif
+    STENCIL(pop, "subq $" VALUE_SIZE ", %r12\n")
+    STENCIL(push_top,
+            COPY_VALUE(RIGHT "(%r12)", "(%r12)")
+            "addq $" VALUE_SIZE ", %r12\n")
+    STENCIL(get_local,
+            COPY_VALUE(TO_STRING(HOLE_OPERAND) "(%r13)", "(%r12)")
+            "addq $" VALUE_SIZE ", %r12\n")
+    STENCIL(set_local, COPY_VALUE(RIGHT "(%r12)", TO_STRING(HOLE_OPERAND) "(%r13)"))
+    // Indexes past the defined globals exit so the interpreter reports them
+    STENCIL(get_global,
+            "cmpl $" TO_STRING(HOLE_INDEX) ", 32(%rbx)\n" JCC(0x86, HOLE_EXIT)
+            COPY_VALUE(TO_STRING(HOLE_OPERAND) "(%r15)", "(%r12)")
+            "addq $" VALUE_SIZE ", %r12\n")
+    STENCIL(set_global,
+            "cmpl $" TO_STRING(HOLE_INDEX) ", 32(%rbx)\n" JCC(0x86, HOLE_EXIT)
+            COPY_VALUE(RIGHT "(%r12)", TO_STRING(HOLE_OPERAND) "(%r15)"))
+    BINARY_STENCIL(add, "addsd")
+    BINARY_STENCIL(subtract, "subsd")
+    BINARY_STENCIL(multiply, "mulsd")
+    BINARY_STENCIL(divide, "divsd")
+    STENCIL(negate, GUARD_NUMBER(RIGHT) "btcq $63, " NUMBER_AT(RIGHT) "\n")
+    STENCIL(jump, JMP(HOLE_TARGET))
+    // Conditions other than bools exit, the interpreter knows their truthiness
+    STENCIL(jump_if_false, TEST_BOOL JCC(0x85, HOLE_TARGET))
+    STENCIL(pop_jump_if_false,
+            TEST_BOOL "leaq " RIGHT "(%r12), %r12\n" JCC(0x85, HOLE_TARGET))
+    // ucomisd sets CF and ZF for unordered (NaN) operands: jbe takes them, ja doesn't, as
+    // <= and >= are !(>) and !(<) and hold on NaN
+    COMPARE_JUMP_STENCIL(jump_if_not_less, "%xmm0, %xmm1", JCC(0x86, HOLE_TARGET))
+    COMPARE_JUMP_STENCIL(jump_if_not_less_equal, "%xmm1, %xmm0", JCC(0x87, HOLE_TARGET))
+    COMPARE_JUMP_STENCIL(jump_if_not_greater, "%xmm1, %xmm0", JCC(0x86, HOLE_TARGET))
+    COMPARE_JUMP_STENCIL(jump_if_not_greater_equal, "%xmm0, %xmm1", JCC(0x87, HOLE_TARGET))
+    COMPARE_JUMP_STENCIL(jump_if_equal, "%xmm1, %xmm0", "jp 1f\n" JCC(0x84, HOLE_TARGET) "1:\n")
+    COMPARE_JUMP_STENCIL(jump_if_not_equal, "%xmm1, %xmm0", JCC(0x8a, HOLE_TARGET) JCC(0x85, HOLE_TARGET))
+    ".popsection\n");
+// clang-format on
+
+typedef enum {
+  STENCIL_PROLOGUE,
+  STENCIL_EPILOGUE,
+  STENCIL_EXIT,
+  STENCIL_CONSTANT,
+  STENCIL_NIL,
+  STENCIL_FALSE,
+  STENCIL_TRUE,
+  STENCIL_POP,
+  STENCIL_PUSH_TOP,
+  STENCIL_GET_LOCAL,
+  STENCIL_SET_LOCAL,
+  STENCIL_GET_GLOBAL,
+  STENCIL_SET_GLOBAL,
+  STENCIL_ADD,
+  STENCIL_SUBTRACT,
+  STENCIL_MULTIPLY,
+  STENCIL_DIVIDE,
+  STENCIL_NEGATE,
+  STENCIL_JUMP,
+  STENCIL_JUMP_IF_FALSE,
+  STENCIL_POP_JUMP_IF_FALSE,
+  STENCIL_JUMP_IF_NOT_LESS,
+  STENCIL_JUMP_IF_NOT_LESS_EQUAL,
+  STENCIL_JUMP_IF_NOT_GREATER,
+  STENCIL_JUMP_IF_NOT_GREATER_EQUAL,
+  STENCIL_JUMP_IF_EQUAL,
+  STENCIL_JUMP_IF_NOT_EQUAL,
+  STENCIL_COUNT
+} StencilKind;
+
+#define DECLARE_STENCIL(name) extern const u8 jit_stencil_##name[], jit_stencil_##name##_end[];
+#define STENCIL_BYTES(name) {jit_stencil_##name, jit_stencil_##name##_end}
+
+DECLARE_STENCIL(prologue)
+DECLARE_STENCIL(epilogue)
+DECLARE_STENCIL(exit)
+DECLARE_STENCIL(constant)
+DECLARE_STENCIL(nil)
+DECLARE_STENCIL(false)
+DECLARE_STENCIL(true)
+DECLARE_STENCIL(pop)
+DECLARE_STENCIL(push_top)
+DECLARE_STENCIL(get_local)
+DECLARE_STENCIL(set_local)
+DECLARE_STENCIL(get_global)
+DECLARE_STENCIL(set_global)
+DECLARE_STENCIL(add)
+DECLARE_STENCIL(subtract)
+DECLARE_STENCIL(multiply)
+DECLARE_STENCIL(divide)
+DECLARE_STENCIL(negate)
+DECLARE_STENCIL(jump)
+DECLARE_STENCIL(jump_if_false)
+DECLARE_STENCIL(pop_jump_if_false)
+DECLARE_STENCIL(jump_if_not_less)
+DECLARE_STENCIL(jump_if_not_less_equal)
+DECLARE_STENCIL(jump_if_not_greater)
+DECLARE_STENCIL(jump_if_not_greater_equal)
+DECLARE_STENCIL(jump_if_equal)
+DECLARE_STENCIL(jump_if_not_equal)
+
+#define MAX_HOLES 4
+
+typedef struct {
+  u32 position;
+  u32 kind;
+} Hole;
+
+typedef struct {
+  const u8* start;
+  const u8* end;
+  Hole holes[MAX_HOLES];
+  u32 hole_count;
+  /// Whether any of its holes jumps to the exit of the instruction
+  bool exits;
+} Stencil;
+
+static Stencil stencils[STENCIL_COUNT] = {
+    STENCIL_BYTES(prologue),
+    STENCIL_BYTES(epilogue),
+    STENCIL_BYTES(exit),
+    STENCIL_BYTES(constant),
+    STENCIL_BYTES(nil),
+    STENCIL_BYTES(false),
+    STENCIL_BYTES(true),
+    STENCIL_BYTES(pop),
+    STENCIL_BYTES(push_top),
+    STENCIL_BYTES(get_local),
+    STENCIL_BYTES(set_local),
+    STENCIL_BYTES(get_global),
+    STENCIL_BYTES(set_global),
+    STENCIL_BYTES(add),
+    STENCIL_BYTES(subtract),
+    STENCIL_BYTES(multiply),
+    STENCIL_BYTES(divide),
+    STENCIL_BYTES(negate),
+    STENCIL_BYTES(jump),
+    STENCIL_BYTES(jump_if_false),
+    STENCIL_BYTES(pop_jump_if_false),
+    STENCIL_BYTES(jump_if_not_less),
+    STENCIL_BYTES(jump_if_not_less_equal),
+    STENCIL_BYTES(jump_if_not_greater),
+    STENCIL_BYTES(jump_if_not_greater_equal),
+    STENCIL_BYTES(jump_if_equal),
+    STENCIL_BYTES(jump_if_not_equal),
+};
+
+static bool stencils_ready = false;
+
+static u32 read_u32(const u8* bytes) {
+  u32 value;
+  memcpy(&value, bytes, sizeof(u32));
+  return value;
+}
+
+static void write_u32(u8* bytes, u32 value) { memcpy(bytes, &value, sizeof(u32)); }
+
+/// Finds the holes of every stencil
+static void init_stencils(void) {
+  for (u32 i = 0; i < STENCIL_COUNT; i++) {
+    Stencil* stencil = &stencils[i];
+    u32 length = (u32)(stencil->end - stencil->start);
+    for (u32 position = 0; position + 4 <= length; position++) {
+      u32 value = read_u32(stencil->start + position);
+      if (value < HOLE_OPERAND || value > HOLE_OFFSET) continue;
+      stencil->holes[stencil->hole_count++] = (Hole){position, value};
+      stencil->exits |= value == HOLE_EXIT;
+      position += 3;
+    }
+  }
+  stencils_ready = true;
+}
+
+static u32 stencil_length(StencilKind kind) { return (u32)(stencils[kind].end - stencils[kind].start); }
+
+/// An instruction as the JIT sees it: superinstructions are compiled as the instructions they
+/// replaced, which are still in the bytecode
+typedef struct {
+  u8 op_code;
+  u32 offset;
+  u32 length;
+  StencilKind stencil;
+  /// Value patched into HOLE_INDEX, HOLE_OPERAND gets it scaled by the size of a Value
+  u32 operand;
+} Instruction;
+
+static u32 read_operand(Chunk* chunk, u32 offset, u32 length) {
+  // Every instruction with a stencil has at most one operand, u8 or u16
+  if (length == 2) return chunk->code[offset + 1];
+  return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+static Instruction decode(Chunk* chunk, u32 offset) {
+  Instruction instruction = {checked_op_code(unfused_op_code(chunk->code[offset])), offset, 0, STENCIL_EXIT, 0};
+  instruction.length =
+      instruction.op_code == chunk->code[offset] ? instruction_length(chunk, offset) : op_code_length(instruction.op_code);
+  switch (instruction.op_code) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+      instruction.stencil = STENCIL_CONSTANT;
+      break;
+    case OP_NIL:
+      instruction.stencil = STENCIL_NIL;
+      break;
+    case OP_FALSE:
+      instruction.stencil = STENCIL_FALSE;
+      break;
+    case OP_TRUE:
+      instruction.stencil = STENCIL_TRUE;
+      break;
+    case OP_POP:
+      instruction.stencil = STENCIL_POP;
+      break;
+    case OP_PUSH_TOP:
+      instruction.stencil = STENCIL_PUSH_TOP;
+      break;
+    case OP_GET_LOCAL:
+      instruction.stencil = STENCIL_GET_LOCAL;
+      break;
+    case OP_GET_LOCAL_0:
+    case OP_GET_LOCAL_1:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_3:
+      instruction.stencil = STENCIL_GET_LOCAL;
+      instruction.operand = instruction.op_code - OP_GET_LOCAL_0;
+      return instruction;
+    case OP_SET_LOCAL:
+      instruction.stencil = STENCIL_SET_LOCAL;
+      break;
+    case OP_GET_GLOBAL:
+      instruction.stencil = STENCIL_GET_GLOBAL;
+      break;
+    case OP_SET_GLOBAL:
+      instruction.stencil = STENCIL_SET_GLOBAL;
+      break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+      instruction.stencil = STENCIL_ADD;
+      break;
+    case OP_SUBTRACT:
+      instruction.stencil = STENCIL_SUBTRACT;
+      break;
+    case OP_MULTIPLY:
+      instruction.stencil = STENCIL_MULTIPLY;
+      break;
+    case OP_DIVIDE:
+      instruction.stencil = STENCIL_DIVIDE;
+      break;
+    case OP_NEGATE:
+      instruction.stencil = STENCIL_NEGATE;
+      break;
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+      instruction.stencil = STENCIL_JUMP;
+      break;
+    case OP_JUMP_IF_FALSE:
+      instruction.stencil = STENCIL_JUMP_IF_FALSE;
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+      instruction.stencil = STENCIL_POP_JUMP_IF_FALSE;
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      instruction.stencil = STENCIL_JUMP_IF_NOT_LESS;
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      instruction.stencil = STENCIL_JUMP_IF_NOT_LESS_EQUAL;
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      instruction.stencil = STENCIL_JUMP_IF_NOT_GREATER;
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      instruction.stencil = STENCIL_JUMP_IF_NOT_GREATER_EQUAL;
+      break;
+    case OP_JUMP_IF_EQUAL:
+      instruction.stencil = STENCIL_JUMP_IF_EQUAL;
+      break;
+    case OP_JUMP_IF_NOT_EQUAL:
+      instruction.stencil = STENCIL_JUMP_IF_NOT_EQUAL;
+      break;
+    default:
+      return instruction;
+  }
+  if (instruction.length > 1) instruction.operand = read_operand(chunk, offset, instruction.length);
+  return instruction;
+}
+
+/// Returns the bytecode offset a jump instruction lands on, its u16 operand is relative to its end
+static u32 jump_destination(Instruction* instruction) {
+  u32 end = instruction->offset + instruction->length;
+  return instruction->op_code == OP_JUMP_BACK ? end - instruction->operand : end + instruction->operand;
+}
+
+static void patch_rel32(u8* code, u32 position, u32 destination) {
+  write_u32(code + position, destination - (position + 4));
+}
+
+/// Copies the stencil of `instruction` at `position` and fills its holes
+static void emit(u8* code, u32 position, StencilKind kind, Instruction* instruction, u32* entries, u32 exit,
+                 u32 epilogue) {
+  Stencil* stencil = &stencils[kind];
+  memcpy(code + position, stencil->start, stencil_length(kind));
+  for (u32 i = 0; i < stencil->hole_count; i++) {
+    u32 hole = position + stencil->holes[i].position;
+    switch (stencil->holes[i].kind) {
+      case HOLE_OPERAND:
+        write_u32(code + hole, instruction->operand * (u32)sizeof(Value));
+        break;
+      case HOLE_INDEX:
+        write_u32(code + hole, instruction->operand);
+        break;
+      case HOLE_TARGET:
+        patch_rel32(code, hole, entries[jump_destination(instruction)]);
+        break;
+      case HOLE_EXIT:
+        patch_rel32(code, hole, exit);
+        break;
+      case HOLE_EPILOGUE:
+        patch_rel32(code, hole, epilogue);
+        break;
+      case HOLE_OFFSET:
+        write_u32(code + hole, instruction->offset);
+        break;
+    }
+  }
+}
+
+/// Entering and leaving native code costs about as much as interpreting a dozen instructions, so
+/// run() only enters where native code runs at least this many before exiting
+#define JIT_MIN_RUN 16
+
+/// Fills `runs` with the number of instructions native code runs from every instruction until it
+/// exits, up to JIT_MIN_RUN. Branches are followed on their fall through and loops around their back
+/// edge, which takes a pass per iteration until nothing changes
+static void count_runs(Instruction* instructions, u32 count, u32* runs) {
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (u32 i = count; i-- > 0;) {
+      Instruction* instruction = &instructions[i];
+      u32 next;
+      if (instruction->stencil == STENCIL_EXIT) {
+        next = 0;
+      } else if (instruction->op_code == OP_JUMP || instruction->op_code == OP_JUMP_BACK) {
+        next = runs[jump_destination(instruction)] + 1;
+      } else {
+        next = runs[instruction->offset + instruction->length] + 1;
+      }
+      if (next > JIT_MIN_RUN) next = JIT_MIN_RUN;
+      changed |= next != runs[instruction->offset];
+      runs[instruction->offset] = next;
+    }
+  }
+}
+
+/// Compiles `function` into [prologue][an stencil per instruction][exits of the guards][epilogue]
+static bool jit_compile(ObjectFunction* function) {
+  if (!stencils_ready) init_stencils();
+  Chunk* chunk = &function->chunk;
+  u32* entries = ALLOCATE(u32, chunk->count + 1);
+  u32* runs = ALLOCATE(u32, chunk->count + 1);
+  Instruction* instructions = ALLOCATE(Instruction, chunk->count);
+
+  u32 count = 0;
+  u32 size = stencil_length(STENCIL_PROLOGUE);
+  u32 exit_count = 0;
+  for (u32 offset = 0; offset < chunk->count; offset += instructions[count++].length) {
+    instructions[count] = decode(chunk, offset);
+#ifdef QW_TRACING
+    // Back edges of the top-level script go through run(), which traces its loops, until the loop
+    // turns out impossible to trace
+    Instruction* instruction = &instructions[count];
+    if (function->name == NULL && instruction->op_code == OP_JUMP_BACK &&
+        !trace_failed(function, jump_destination(instruction))) {
+      instruction->stencil = STENCIL_EXIT;
+    }
+#endif
+    entries[offset] = size;
+    size += stencil_length(instructions[count].stencil);
+    exit_count += stencils[instructions[count].stencil].exits;
+  }
+  u32 exits = size;
+  u32 epilogue = exits + exit_count * stencil_length(STENCIL_EXIT);
+  size = epilogue + stencil_length(STENCIL_EPILOGUE);
+
+  u8* code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code != MAP_FAILED) {
+    memcpy(code, stencils[STENCIL_PROLOGUE].start, stencil_length(STENCIL_PROLOGUE));
+    u32 exit = exits;
+    for (u32 i = 0; i < count; i++) {
+      Instruction* instruction = &instructions[i];
+      emit(code, entries[instruction->offset], instruction->stencil, instruction, entries, exit, epilogue);
+      if (stencils[instruction->stencil].exits) {
+        emit(code, exit, STENCIL_EXIT, instruction, entries, exit, epilogue);
+        exit += stencil_length(STENCIL_EXIT);
+      }
+    }
+    memcpy(code + epilogue, stencils[STENCIL_EPILOGUE].start, stencil_length(STENCIL_EPILOGUE));
+    mprotect(code, size, PROT_READ | PROT_EXEC);
+
+    memset(runs, 0, sizeof(u32) * (chunk->count + 1));
+    count_runs(instructions, count, runs);
+    for (u32 i = 0; i < count; i++) {
+      if (runs[instructions[i].offset] < JIT_MIN_RUN) entries[instructions[i].offset] = JIT_NO_ENTRY;
+    }
+    function->jit_code = code;
+    function->jit_size = size;
+    function->jit_entries = entries;
+  } else {
+    FREE_ARRAY(u32, entries, chunk->count + 1);
+  }
+  FREE_ARRAY(u32, runs, chunk->count + 1);
+  FREE_ARRAY(Instruction, instructions, chunk->count);
+  return code != MAP_FAILED;
+}
+
+typedef u32 (*JitEntry)(JitState* state, u8* target);
+
+u32 jit_run(ObjectFunction* function, JitState* state, u32 offset) {
+  if (function->jit_code == NULL && !jit_compile(function)) return offset;
+  if (!jit_has_entry(function, offset)) return offset;
+  JitEntry entry = (JitEntry)(void*)function->jit_code;
+  return entry(state, function->jit_code + function->jit_entries[offset]);
+}
+
+void free_jit_code(ObjectFunction* function) {
+  if (function->jit_code == NULL) return;
+  munmap(function->jit_code, function->jit_size);
+  FREE_ARRAY(u32, function->jit_entries, function->chunk.count + 1);
+  function->jit_code = NULL;
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef qw_jit_h
+#define qw_jit_h
+
+#include "qw_common.h"
+#include "qw_object.h"
+#include "qw_values.h"
+
+/// Interpreter registers handed over to native code and back, the JIT's and the code compiled
+/// ahead of time (qw_aot.h)
+typedef struct JitState {
+  Value* sp;
+  Value* slots;
+  Value* constants;
+  Value* globals;
+  u32 global_count;
+} JitState;
+
+#ifdef QW_JIT
+
+/// Baseline copy-and-patch JIT. Every instruction of a function becomes a copy of a precompiled
+/// machine code template (stencil, see qw_jit.c) with its operands and jump targets patched in.
+/// Native code works on the same value stack and CallFrame as run(). Instructions without a
+/// stencil (calls, returns, objects...) and operands the stencils don't expect (a string in
+/// OP_ADD) exit back to run(), which interprets from there until the next call, return or loop
+
+/// Whether run() goes native, set with --jit
+extern bool jit_enabled;
+
+/// Entry of the bytecode offsets where native code isn't worth entering
+#define JIT_NO_ENTRY UINT32_MAX
+
+/// Returns whether jit_run() would run any native code from bytecode `offset`
+static inline bool jit_has_entry(ObjectFunction* function, u32 offset) {
+  return function->jit_code == NULL || function->jit_entries[offset] != JIT_NO_ENTRY;
+}
+
+/// Runs the native code of `function` from the instruction at bytecode `offset`, compiling it the
+/// first time. Returns the bytecode offset of the instruction that the interpreter must continue
+/// with, `state->sp` is updated
+u32 jit_run(ObjectFunction* function, JitState* state, u32 offset);
+
+/// Frees the native code of `function`
+void free_jit_code(ObjectFunction* function);
+
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+#include "qw_loader.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "qw_native_functions.h"
+#include "qw_vm.h"
+
+/// What load_function() has rebuilt so far, by index: functions and the closures and classes
+/// they share
+typedef struct {
+  const LoadSource* source;
+  ValueArray* globals;
+  ObjectFunction** functions;
+  Value* shared;
+} Loader;
+
+static ObjectFunction* load_function(Loader* loader, u32 index);
+
+/// The closures and classes loaded once stay alive through the constants they are in
+static Value load_constant(Loader* loader, const LoadConstant* constant) {
+  switch (constant->kind) {
+    case LOAD_CONSTANT_NUMBER:
+      return NUMBER_VAL(constant->number);
+    case LOAD_CONSTANT_STRING:
+      return OBJECT_VAL(copy_string(constant->length, constant->chars));
+    case LOAD_CONSTANT_NATIVE:
+      return loader->globals->values[constant->index];
+    case LOAD_CONSTANT_FUNCTION:
+      return OBJECT_VAL(load_function(loader, constant->index));
+    default:
+      break;
+  }
+  if (!IS_NIL(loader->shared[constant->shared])) return loader->shared[constant->shared];
+  Value value;
+  if (constant->kind == LOAD_CONSTANT_CLOSURE) {
+    ObjectFunction* function = load_function(loader, constant->index);
+    push(OBJECT_VAL(function));
+    value = OBJECT_VAL(new_closure(function));
+  } else {
+    ObjectString* name = copy_string(constant->length, constant->chars);
+    push(OBJECT_VAL(name));
+    value = OBJECT_VAL(new_class(name));
+  }
+  pop();
+  loader->shared[constant->shared] = value;
+  return value;
+}
+
+/// Rebuilds function `index` and the functions in its constants. Everything being built stays on
+/// the VM stack, allocating may collect garbage
+static ObjectFunction* load_function(Loader* loader, u32 index) {
+  if (loader->functions[index] != NULL) return loader->functions[index];
+  const LoadSource* source = loader->source;
+  LoadFunction stored;
+  source->function(source, index, &stored);
+  ObjectFunction* function = new_function();
+  push(OBJECT_VAL(function));
+  loader->functions[index] = function;
+  if (stored.name != NULL) function->name = copy_string(stored.name_length, stored.name);
+  function->number_of_parameters = stored.number_of_parameters;
+  function->upvalue_count = stored.upvalue_count;
+  function->global_array = loader->globals;
+  function->aot_code = stored.native;
+  function->aot_entries = stored.native_entries;
+
+  Chunk* chunk = &function->chunk;
+  if (source->in_place) {
+    // With no capacity the chunk doesn't free them (see Chunk)
+    chunk->code = (u8*)stored.code;
+    chunk->lines.lines = (Line*)stored.lines;
+  } else {
+    u8* code = ALLOCATE(u8, stored.count);
+    memcpy(code, stored.code, stored.count);
+    chunk->code = code;
+    chunk->capacity = stored.count;
+    Line* lines = ALLOCATE(Line, stored.line_count);
+    memcpy(lines, stored.lines, sizeof(Line) * stored.line_count);
+    chunk->lines.lines = lines;
+    chunk->lines.capacity = stored.line_count;
+  }
+  chunk->count = stored.count;
+  chunk->lines.count = stored.line_count;
+
+  for (u32 i = 0; i < stored.constant_count; i++) {
+    LoadConstant constant;
+    source->constant(source, index, i, &constant);
+    Value value = load_constant(loader, &constant);
+    push(value);
+    push_value(&chunk->constants, value);
+    pop();
+  }
+  for (u32 i = 0; i < stored.cache_count; i++) add_inline_cache(function, stored.cache_offsets[i]);
+  for (u32 i = 0; i < stored.switch_count; i++) {
+    LoadSwitch table;
+    source->switch_table(source, index, i, &table);
+    SwitchPattern* patterns = ALLOCATE(SwitchPattern, table.pattern_count);
+    memcpy(patterns, table.patterns, sizeof(SwitchPattern) * table.pattern_count);
+    u32* targets = ALLOCATE(u32, table.arm_count + 1);
+    memcpy(targets, table.targets, sizeof(u32) * (table.arm_count + 1));
+    add_switch_table(function, patterns, table.pattern_count, table.arm_count, targets);
+  }
+  if (stored.inlined_call_count > 0) {
+    InlinedCall* calls = ALLOCATE(InlinedCall, stored.inlined_call_count);
+    InlinedRange* ranges = ALLOCATE(InlinedRange, stored.inlined_range_count);
+    memcpy(ranges, stored.inlined_ranges, sizeof(InlinedRange) * stored.inlined_range_count);
+    set_inlined_code(function, calls, 0, ranges, stored.inlined_range_count);
+    // Marked by the collector as they are loaded
+    for (u32 i = 0; i < stored.inlined_call_count; i++) {
+      const LoadInlinedCall* call = &stored.inlined_calls[i];
+      calls[i] = (InlinedCall){load_function(loader, call->function), call->line, call->parent};
+      function->inlined_call_count++;
+    }
+  }
+  pop();
+  return function;
+}
+
+ValueArray* new_script_globals(u32 global_count) {
+  ValueArray* globals = malloc(sizeof(ValueArray));
+  init_value_array(globals);
+  // The natives stay on the VM stack until the globals are a root
+  for (u32 i = 0; i < global_count; i++) {
+    Value value = NUMBER_VAL(0);
+    if (i < NATIVE_FUNCTION_COUNT) {
+      value = OBJECT_VAL(new_native_function(native_functions[i].function));
+      push(value);
+    }
+    push_value(globals, value);
+  }
+  vm.globals = *globals;
+  for (u32 i = 0; i < NATIVE_FUNCTION_COUNT && i < global_count; i++) pop();
+  return globals;
+}
+
+ObjectFunction* load_script(const LoadSource* source) {
+  Loader loader = {source, new_script_globals(source->global_count), NULL, NULL};
+  loader.functions = calloc(source->function_count, sizeof(ObjectFunction*));
+  loader.shared = malloc(sizeof(Value) * source->shared_count);
+  for (u32 i = 0; i < source->shared_count; i++) loader.shared[i] = NIL_VAL;
+  ObjectFunction* script = load_function(&loader, 0);
+  free(loader.functions);
+  free(loader.shared);
+  return script;
+}
@@ -0,0 +1,107 @@
+#ifndef qw_loader_h
+#define qw_loader_h
+
+#include "qw_common.h"
+#include "qw_jit.h"
+#include "qw_lines.h"
+#include "qw_object.h"
+
+/// Rebuilds a function tree compile() made without the compiler, from the C data of a program
+/// written by emit_c() (qw_aot.h) or from an image (qw_image.h). Both number the functions of the
+/// tree, the top-level script first, and the closures and classes their constants share. A
+/// LoadSource reads them from its format, load_script() does the rest the same way for both: the
+/// globals, rooting what it allocates, the shared objects, the inline caches and switch tables
+/// and the inlined calls
+
+typedef enum {
+  LOAD_CONSTANT_NUMBER,
+  LOAD_CONSTANT_STRING,
+  /// Function `index`
+  LOAD_CONSTANT_FUNCTION,
+  /// Native function, the one in global `index`
+  LOAD_CONSTANT_NATIVE,
+  /// Closure of function `index` with no upvalues, the same one for every constant with its `shared`
+  LOAD_CONSTANT_CLOSURE,
+  /// Class named `chars`, the same one for every constant with its `shared`
+  LOAD_CONSTANT_CLASS,
+} LoadConstantKind;
+
+typedef struct {
+  LoadConstantKind kind;
+  double number;
+  /// Of strings and class names
+  const char* chars;
+  u32 length;
+  u32 index;
+  u32 shared;
+} LoadConstant;
+
+/// SwitchTable of an OP_SWITCH, rebuilt from its patterns
+typedef struct {
+  const SwitchPattern* patterns;
+  u32 pattern_count;
+  u16 arm_count;
+  /// `arm_count + 1` bytecode offsets
+  const u32* targets;
+} LoadSwitch;
+
+/// InlinedCall with the index of its function
+typedef struct {
+  u32 function;
+  u32 line;
+  i32 parent;
+} LoadInlinedCall;
+
+/// C code of a function compiled ahead of time (qw_aot.h): runs it from the instruction at
+/// bytecode `offset` and returns the offset of the instruction run() must continue with,
+/// `state->sp` is updated
+typedef u32 (*AotCode)(JitState* state, u32 offset);
+
+typedef struct {
+  /// NULL for the top-level script
+  const char* name;
+  u32 name_length;
+  u32 number_of_parameters;
+  i32 upvalue_count;
+  const u8* code;
+  u32 count;
+  const Line* lines;
+  u32 line_count;
+  u32 constant_count;
+  /// Bytecode offset of the instruction owning every inline cache
+  const u32* cache_offsets;
+  u32 cache_count;
+  u32 switch_count;
+  const LoadInlinedCall* inlined_calls;
+  u32 inlined_call_count;
+  const InlinedRange* inlined_ranges;
+  u32 inlined_range_count;
+  AotCode native;
+  /// Bytecode offsets `native` is entered at, as ObjectFunction.aot_entries
+  const u8* native_entries;
+} LoadFunction;
+
+/// A stored function tree. Formats embed it first in a struct of their own, which the functions
+/// get back by casting `source`
+typedef struct LoadSource {
+  u32 function_count;
+  u32 shared_count;
+  u32 global_count;
+  /// Whether the code and lines can be used where they are. The VM rewrites them (quickening),
+  /// they are copied otherwise
+  bool in_place;
+  void (*function)(const struct LoadSource* source, u32 index, LoadFunction* function);
+  /// Constant `index` of function `function`
+  void (*constant)(const struct LoadSource* source, u32 function, u32 index, LoadConstant* constant);
+  /// Switch table `index` of function `function`
+  void (*switch_table)(const struct LoadSource* source, u32 function, u32 index, LoadSwitch* table);
+} LoadSource;
+
+/// The globals compile() makes for a script with `global_count` of them: the natives and then the
+/// variables of the script, set to 0. They are the VM's from then on
+ValueArray* new_script_globals(u32 global_count);
+
+/// Rebuilds the function tree of `source` along with its globals, as compile() leaves them
+ObjectFunction* load_script(const LoadSource* source);
+
+#endif
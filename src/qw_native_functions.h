@@ -49,10 +49,22 @@ static Value len_array(int arg_count, Value* args) {
     return NIL_VAL;
   }
   ObjectArray* arr = AS_ARRAY(*args);
-  Value v;
-  v.type = VAL_NUMBER;
-  v.as.number = arr->array.count;
-  return v;
+  return NUMBER_VAL(arr->array.count);
 }
 
-#endif
\ No newline at end of file
+typedef struct {
+  const char* name;
+  NativeFn function;
+} NativeFunction;
+
+/// Natives defined by every script, they take the first global slots in this order
+static const NativeFunction native_functions[] = {
+    {"clock", clock_native},
+    {"push", push_array},
+    {"len", len_array},
+    {"pop", pop_array},
+};
+
+#define NATIVE_FUNCTION_COUNT (sizeof(native_functions) / sizeof(native_functions[0]))
+
+#endif
@@ -1,6 +1,8 @@
 
 #include "qw_object.h"
 
+#include <stdlib.h>
+
 #include "memory.h"
 #include "qw_vm.h"
 
@@ -83,12 +85,12 @@ void print_object(Value value) {
     }
     case OBJECT_CLASS: {
       ObjectClass* klass = AS_CLASS(value);
-      printf("<constructor %s %p>", klass->name->chars, value.as.object);
+      printf("<constructor %s %p>", klass->name->chars, AS_OBJECT(value));
       break;
     }
     case OBJECT_CLOSURE: {
       printf("!CLOSURE ");
-      print_function(((ObjectClosure*)value.as.object)->function);
+      print_function(((ObjectClosure*)AS_OBJECT(value))->function);
       break;
     }
     case OBJECT_STRING: {
@@ -96,32 +98,36 @@ void print_object(Value value) {
       break;
     }
     case OBJECT_FUNCTION: {
-      print_function((ObjectFunction*)value.as.object);
+      print_function((ObjectFunction*)AS_OBJECT(value));
       break;
     }
     case OBJECT_NATIVE: {
-      printf("<native_function [%zu]>\n", (isize)((ObjectNative*)value.as.object)->function);
+      printf("<native_function [%zu]>\n", (isize)((ObjectNative*)AS_OBJECT(value))->function);
       break;
     }
     case OBJECT_UPVALUE: {
       printf("upvalue");
       break;
     }
+    case OBJECT_SHAPE: {
+      printf("<shape %d fields>", AS_SHAPE(value)->field_count);
+      break;
+    }
     default: {
-      printf("[print_object WARNING] COULDN'T PRINT OBJECT OF TYPE: %d\n", value.as.object->type);
+      printf("[print_object WARNING] COULDN'T PRINT OBJECT OF TYPE: %d\n", AS_OBJECT(value)->type);
       return;
     }
   }
 }
 
 bool is_truthy(Value* obj) {
-  if (obj->type == VAL_BOOL) {
-    return obj->as.boolean;
+  if (IS_BOOL(*obj)) {
+    return AS_BOOL(*obj);
   }
-  if (obj->type == VAL_NIL) return false;
-  if (obj->type == VAL_NUMBER) return obj->as.number > 0.0;
+  if (IS_NIL(*obj)) return false;
+  if (IS_NUMBER(*obj)) return AS_NUMBER(*obj) > 0.0;
   // TODO check string
-  if (obj->type == VAL_OBJECT) return true;
+  if (IS_OBJECT(*obj)) return true;
   return false;
 }
 
@@ -131,6 +137,34 @@ ObjectFunction* new_function() {
   function->number_of_parameters = 0;
   function->upvalue_count = 0;
   function->global_array = NULL;
+  function->inline_caches = NULL;
+  function->inline_cache_count = 0;
+  function->inline_cache_capacity = 0;
+  function->switches = NULL;
+  function->switch_count = 0;
+  function->switch_capacity = 0;
+  function->inlined_calls = NULL;
+  function->inlined_call_count = 0;
+  function->inlined_ranges = NULL;
+  function->inlined_range_count = 0;
+  function->lazy = NULL;
+  function->call_count = 0;
+  function->loop_counts = NULL;
+  function->aot_code = NULL;
+  function->aot_entries = NULL;
+#ifdef QW_THREADED_CODE
+  function->threaded_code = NULL;
+  function->threaded_offsets = NULL;
+  function->threaded_count = 0;
+#endif
+#ifdef QW_JIT
+  function->jit_code = NULL;
+  function->jit_size = 0;
+  function->jit_entries = NULL;
+#endif
+#ifdef QW_TRACING
+  function->traces = NULL;
+#endif
   init_chunk(&function->chunk);
   return function;
 }
@@ -142,17 +176,13 @@ ObjectNative* new_native_function(NativeFn callback) {
 }
 
 ObjectClosure* new_closure(ObjectFunction* function) {
-  ObjectUpvalue** upvalues = ALLOCATE(ObjectUpvalue*, function->upvalue_count);
-  ObjectClosure* closure = ALLOCATE_OBJECT(ObjectClosure, OBJECT_CLOSURE);
+  ObjectClosure* closure = (ObjectClosure*)allocate_object(
+      OBJECT_CLOSURE, sizeof(ObjectClosure) + sizeof(Value) * function->upvalue_count);
   closure->function = function;
-  closure->upvalues = NULL;
-  closure->upvalue_count = 0;
-  closure->upvalues = upvalues;
+  closure->upvalue_count = function->upvalue_count;
   for (u32 i = 0; i < function->upvalue_count; ++i) {
-    upvalues[i] = NULL;
+    closure->upvalues[i] = NIL_VAL;
   }
-  closure->upvalues = upvalues;
-  closure->upvalue_count = function->upvalue_count;
   return closure;
 }
 
@@ -167,17 +197,123 @@ ObjectUpvalue* new_upvalue(Value* slot) {
 ObjectClass* new_class(ObjectString* name) {
   ObjectClass* klass = ALLOCATE_OBJECT(ObjectClass, OBJECT_CLASS);
   klass->name = name;
+  klass->root_shape = NULL;
+  klass->instance_field_hint = 0;
   init_table(&klass->methods);
+  push(OBJECT_VAL(klass));
+  klass->root_shape = new_shape();
+  pop();
   return klass;
 }
 
+ObjectShape* new_shape() {
+  ObjectShape* shape = ALLOCATE_OBJECT(ObjectShape, OBJECT_SHAPE);
+  init_table(&shape->slots);
+  init_table(&shape->transitions);
+  shape->field_count = 0;
+  return shape;
+}
+
 ObjectInstance* new_instance(ObjectClass* klass) {
-  ObjectInstance* instance = ALLOCATE_OBJECT(ObjectInstance, OBJECT_INSTANCE);
+  u32 inline_capacity = klass->instance_field_hint;
+  ObjectInstance* instance = (ObjectInstance*)allocate_object(
+      OBJECT_INSTANCE, sizeof(ObjectInstance) + sizeof(Value) * inline_capacity);
   instance->klass = klass;
+  instance->shape = klass->root_shape;
+  instance->values = instance->inline_values;
+  instance->capacity = inline_capacity;
+  instance->inline_capacity = inline_capacity;
   init_table(&instance->fields);
   return instance;
 }
 
+/// Returns the slot of `name` in instances with this shape, or -1
+i32 shape_find_slot(ObjectShape* shape, ObjectString* name) {
+  Value slot;
+  if (!table_get(&shape->slots, name, &slot)) return -1;
+  return (i32)AS_NUMBER(slot);
+}
+
+/// Returns the shape that results of adding `name` to `shape`, creating it the first time
+static ObjectShape* shape_transition(ObjectShape* shape, ObjectString* name) {
+  Value next;
+  if (table_get(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+  ObjectShape* next_shape = new_shape();
+  push(OBJECT_VAL(next_shape));
+  table_copy(&shape->slots, &next_shape->slots);
+  table_set(&next_shape->slots, name, NUMBER_VAL(shape->field_count));
+  next_shape->field_count = shape->field_count + 1;
+  table_set(&shape->transitions, name, OBJECT_VAL(next_shape));
+  pop();
+  return next_shape;
+}
+
+bool instance_get_field(ObjectInstance* instance, ObjectString* name, Value* value) {
+  if (instance->shape == NULL) {
+    return table_get(&instance->fields, name, value);
+  }
+  i32 slot = shape_find_slot(instance->shape, name);
+  if (slot == -1) return false;
+  *value = instance->values[slot];
+  return true;
+}
+
+/// Sets (or adds) a field. Adding a field moves the instance to the next shape, growing `values`
+/// out of the inline slots if needed.
+/// The instance and the value must be reachable by the GC (i.e. on the stack) when calling this.
+void instance_set_field(ObjectInstance* instance, ObjectString* name, Value value) {
+  if (instance->shape == NULL) {
+    table_set(&instance->fields, name, value);
+    return;
+  }
+  i32 slot = shape_find_slot(instance->shape, name);
+  if (slot != -1) {
+    instance->values[slot] = value;
+    return;
+  }
+  if (instance->shape->field_count == SHAPE_MAX_FIELDS) {
+    instance_to_dictionary(instance);
+    table_set(&instance->fields, name, value);
+    return;
+  }
+  ObjectShape* next_shape = shape_transition(instance->shape, name);
+  if (instance->capacity < next_shape->field_count) {
+    u32 capacity = GROW_CAPACITY(instance->capacity);
+    Value* values = ALLOCATE(Value, capacity);
+    memcpy(values, instance->values, sizeof(Value) * instance->shape->field_count);
+    if (instance->values != instance->inline_values) {
+      FREE_ARRAY(Value, instance->values, instance->capacity);
+    }
+    instance->values = values;
+    instance->capacity = capacity;
+  }
+  instance->values[next_shape->field_count - 1] = value;
+  instance->shape = next_shape;
+  if (instance->klass->instance_field_hint < next_shape->field_count) {
+    instance->klass->instance_field_hint = next_shape->field_count;
+  }
+}
+
+/// Moves the fields out of the shape slots into the `fields` hash table. Used when the instance
+/// is used as a hash map, which would otherwise create a new shape per key.
+void instance_to_dictionary(ObjectInstance* instance) {
+  ObjectShape* shape = instance->shape;
+  if (shape == NULL) return;
+  for (u32 i = 0; i < shape->slots.capacity; i++) {
+    Entry* entry = &shape->slots.entries[i];
+    if (entry->key == NULL) continue;
+    table_set(&instance->fields, entry->key, instance->values[(u32)AS_NUMBER(entry->value)]);
+  }
+  if (instance->values != instance->inline_values) {
+    FREE_ARRAY(Value, instance->values, instance->capacity);
+  }
+  instance->values = instance->inline_values;
+  instance->capacity = instance->inline_capacity;
+  instance->shape = NULL;
+}
+
 ObjectBoundMethod* new_bound_method(Value klass_instance, ObjectClosure* method) {
   ObjectBoundMethod* method_instance = ALLOCATE_OBJECT(ObjectBoundMethod, OBJECT_BOUND_METHOD);
   method_instance->this = klass_instance;
@@ -185,6 +321,166 @@ ObjectBoundMethod* new_bound_method(Value klass_instance, ObjectClosure* method)
   return method_instance;
 }
 
+/// Reserves a new (empty) inline cache for the instruction at `offset` and returns its index
+u32 add_inline_cache(ObjectFunction* function, u32 offset) {
+  if (function->inline_cache_capacity < function->inline_cache_count + 1) {
+    u32 old_capacity = function->inline_cache_capacity;
+    function->inline_cache_capacity = GROW_CAPACITY(old_capacity);
+    function->inline_caches =
+        GROW_ARRAY(InlineCache, function->inline_caches, old_capacity, function->inline_cache_capacity);
+  }
+  InlineCache* cache = &function->inline_caches[function->inline_cache_count];
+  memset(cache, 0, sizeof(InlineCache));
+  cache->offset = offset;
+  return function->inline_cache_count++;
+}
+
+static int compare_keys(const void* left, const void* right) {
+  double a = *(const double*)left, b = *(const double*)right;
+  return (a > b) - (a < b);
+}
+
+/// Fills the number keys and the string table of `table` from its patterns
+static void build_switch_table(SwitchTable* table, ValueArray* constants) {
+  u32 key_count = 0;
+  double* keys = ALLOCATE(double, table->pattern_count * 2);
+  for (u32 i = 0; i < table->pattern_count; i++) {
+    SwitchPattern* pattern = &table->patterns[i];
+    Value low = constants->values[pattern->low];
+    if (pattern->range) {
+      if (table->first_range == table->pattern_count) table->first_range = i;
+      keys[key_count++] = AS_NUMBER(low);
+      keys[key_count++] = AS_NUMBER(constants->values[pattern->high]);
+    } else if (IS_NUMBER(low)) {
+      keys[key_count++] = AS_NUMBER(low);
+    } else {
+      Value first;
+      if (!table_get(&table->strings, AS_STRING(low), &first)) table_set(&table->strings, AS_STRING(low), NUMBER_VAL(i));
+    }
+  }
+  qsort(keys, key_count, sizeof(double), compare_keys);
+  u32 unique = 0;
+  for (u32 i = 0; i < key_count; i++) {
+    if (unique == 0 || keys[unique - 1] != keys[i]) keys[unique++] = keys[i];
+  }
+  table->keys = GROW_ARRAY(double, keys, table->pattern_count * 2, unique);
+  table->key_count = unique;
+  table->point_arms = ALLOCATE(u16, unique);
+  table->interval_arms = ALLOCATE(u16, unique);
+
+  // Patterns are in arm order, the first one that matches has the arm the chain of comparisons takes
+  for (u32 i = 0; i < unique; i++) {
+    double key = table->keys[i];
+    table->point_arms[i] = table->interval_arms[i] = table->arm_count;
+    for (u32 j = table->pattern_count; j-- > 0;) {
+      SwitchPattern* pattern = &table->patterns[j];
+      Value low = constants->values[pattern->low];
+      if (!pattern->range) {
+        if (IS_NUMBER(low) && AS_NUMBER(low) == key) table->point_arms[i] = pattern->arm;
+        continue;
+      }
+      double high = AS_NUMBER(constants->values[pattern->high]);
+      if (AS_NUMBER(low) < key && key < high) table->point_arms[i] = pattern->arm;
+      if (i + 1 < unique && AS_NUMBER(low) <= key && table->keys[i + 1] <= high) table->interval_arms[i] = pattern->arm;
+    }
+  }
+}
+
+/// Adds the table of an OP_SWITCH matching `patterns` against the constants of `function` and
+/// jumping to `targets` (`arm_count` + 1 of them). It takes both arrays, which must be ALLOCATEd.
+/// Returns its index
+u32 add_switch_table(ObjectFunction* function, SwitchPattern* patterns, u32 pattern_count, u16 arm_count,
+                     u32* targets) {
+  if (function->switch_capacity < function->switch_count + 1) {
+    u32 old_capacity = function->switch_capacity;
+    function->switch_capacity = GROW_CAPACITY(old_capacity);
+    function->switches = GROW_ARRAY(SwitchTable, function->switches, old_capacity, function->switch_capacity);
+  }
+  SwitchTable* table = &function->switches[function->switch_count];
+  memset(table, 0, sizeof(SwitchTable));
+  init_table(&table->strings);
+  table->patterns = patterns;
+  table->pattern_count = pattern_count;
+  table->arm_count = arm_count;
+  table->targets = targets;
+  table->first_range = pattern_count;
+  // Marked by the collector from now on, building the string table allocates
+  function->switch_count++;
+  build_switch_table(table, &function->chunk.constants);
+  return function->switch_count - 1;
+}
+
+void free_switch_tables(ObjectFunction* function) {
+  for (u32 i = 0; i < function->switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    FREE_ARRAY(SwitchPattern, table->patterns, table->pattern_count);
+    FREE_ARRAY(u32, table->targets, table->arm_count + 1);
+#ifdef QW_THREADED_CODE
+    FREE_ARRAY(u32, table->threaded_targets, table->arm_count + 1);
+#endif
+    FREE_ARRAY(double, table->keys, table->key_count);
+    FREE_ARRAY(u16, table->point_arms, table->key_count);
+    FREE_ARRAY(u16, table->interval_arms, table->key_count);
+    free_table(&table->strings);
+  }
+  FREE_ARRAY(SwitchTable, function->switches, function->switch_capacity);
+}
+
+void set_inlined_code(ObjectFunction* function, InlinedCall* calls, u32 call_count, InlinedRange* ranges,
+                      u32 range_count) {
+  FREE_ARRAY(InlinedCall, function->inlined_calls, function->inlined_call_count);
+  FREE_ARRAY(InlinedRange, function->inlined_ranges, function->inlined_range_count);
+  function->inlined_calls = calls;
+  function->inlined_call_count = call_count;
+  function->inlined_ranges = ranges;
+  function->inlined_range_count = range_count;
+}
+
+i32 inlined_call_at(ObjectFunction* function, u32 offset) {
+  // Sorted by offset
+  u32 low = 0;
+  u32 high = function->inlined_range_count;
+  while (low < high) {
+    u32 middle = low + (high - low) / 2;
+    InlinedRange* range = &function->inlined_ranges[middle];
+    if (offset < range->start) {
+      high = middle;
+    } else if (offset >= range->end) {
+      low = middle + 1;
+    } else {
+      return (i32)range->call;
+    }
+  }
+  return -1;
+}
+
+bool switch_arm(SwitchTable* table, Value value, u16* arm) {
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    *arm = table->arm_count;
+    // NaN is equal to nothing and in no range
+    if (table->key_count == 0 || !(number >= table->keys[0])) return true;
+    // The last key that isn't greater than the number
+    u32 low = 0, high = table->key_count - 1;
+    while (low < high) {
+      u32 middle = low + (high - low + 1) / 2;
+      if (table->keys[middle] <= number) {
+        low = middle;
+      } else {
+        high = middle - 1;
+      }
+    }
+    *arm = table->keys[low] == number ? table->point_arms[low] : table->interval_arms[low];
+    return true;
+  }
+  u32 pattern = table->pattern_count;
+  Value first;
+  if (IS_STRING(value) && table_get(&table->strings, AS_STRING(value), &first)) pattern = (u32)AS_NUMBER(first);
+  if (table->first_range < pattern) return false;
+  *arm = pattern < table->pattern_count ? table->patterns[pattern].arm : table->arm_count;
+  return true;
+}
+
 ObjectArray* new_array(ValueArray array) {
   ObjectArray* arr = ALLOCATE_OBJECT(ObjectArray, OBJECT_ARRAY);
   arr->array = array;
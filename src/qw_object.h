@@ -15,6 +15,8 @@ struct Object {
 
 typedef Value (*NativeFn)(int arg_count, Value* args);
 
+struct JitState;
+
 typedef struct {
   Object object;
   NativeFn function;
@@ -36,19 +38,125 @@ struct ObjectString {
   char chars[];
 };
 
+/// Hidden class: the field layout shared by every instance of a class that got the same fields
+/// added in the same order. Shapes form a tree per class rooted at `ObjectClass.root_shape`.
+typedef struct ObjectShape {
+  Object object;
+  /// Field name -> slot inside `ObjectInstance.values` (as a number)
+  Table slots;
+  /// Field name -> shape of an instance after adding that field
+  Table transitions;
+  u32 field_count;
+} ObjectShape;
+
+/// Instances with more fields than this are moved to dictionary mode
+#define SHAPE_MAX_FIELDS 64
+
 typedef struct ObjectClass {
   Object object;
   ObjectString* name;
   Table methods;
+  /// Shape of a new instance (no fields)
+  ObjectShape* root_shape;
+  /// Biggest number of fields an instance of this class reached, new instances get that many inline slots
+  u32 instance_field_hint;
 } ObjectClass;
 
 typedef struct ObjectInstance {
   Object object;
   ObjectClass* klass;
+  /// Layout of `values`, NULL once the instance is in dictionary mode (used as a hash map)
+  ObjectShape* shape;
+  /// Shape mode: field values indexed by their slot. Points to `inline_values` until the
+  /// instance outgrows them
+  Value* values;
+  u32 capacity;
+  u32 inline_capacity;
+  /// Dictionary mode: the fields
   Table fields;
+  Value inline_values[];
 } ObjectInstance;
 
+typedef enum { CACHE_EMPTY, CACHE_FIELD, CACHE_METHOD, CACHE_TRANSITION } InlineCacheKind;
+
+typedef struct {
+  /// Receiver shape this entry is valid for
+  ObjectShape* shape;
+  InlineCacheKind kind;
+  /// CACHE_FIELD, CACHE_TRANSITION: slot of the field
+  u32 slot;
+  /// CACHE_TRANSITION: shape of the receiver once the field is added
+  ObjectShape* next_shape;
+  /// CACHE_METHOD: the method found in the class
+  Value method;
+} InlineCacheEntry;
+
+#define INLINE_CACHE_ENTRIES 4
+
+/// Per bytecode site cache of OP_GET_PROPERTY, OP_SET_PROPERTY and OP_INVOKE.
+/// Monomorphic sites only use the first entry, polymorphic ones up to INLINE_CACHE_ENTRIES.
+/// Instances in dictionary mode always miss.
+typedef struct {
+  InlineCacheEntry entries[INLINE_CACHE_ENTRIES];
+  /// Bytecode offset of the instruction owning this cache
+  u32 offset;
+  u32 hits;
+  u32 misses;
+} InlineCache;
+
+/// Pattern of a `when` arm: a number or string constant the value must be equal to or, for a
+/// range `low..high`, two number constants it must be strictly between
+typedef struct {
+  u16 arm;
+  bool range;
+  /// Constant indexes
+  u32 low;
+  u32 high;
+  /// Line of the comparisons of a range, where a value that isn't a number fails them
+  u32 line;
+} SwitchPattern;
+
+/// Jump table of an OP_SWITCH, the `when` statement it comes from having only literal patterns.
+/// Arms are numbered in source order, `arm_count` is the `nothing` arm
+typedef struct {
+  SwitchPattern* patterns;
+  u32 pattern_count;
+  u16 arm_count;
+  /// Bytecode offset of the statement of every arm and then of the `nothing` arm
+  u32* targets;
+#ifdef QW_THREADED_CODE
+  /// `targets` in words of the threaded code, filled by translate_function()
+  u32* threaded_targets;
+#endif
+  /// Every number of the patterns, sorted. A number equal to keys[i] takes point_arms[i], one
+  /// between keys[i] and keys[i + 1] interval_arms[i]
+  double* keys;
+  u16* point_arms;
+  u16* interval_arms;
+  u32 key_count;
+  /// String -> index of the first pattern equal to it
+  Table strings;
+  /// Index of the first range pattern, whose comparison fails on other values than numbers
+  u32 first_range;
+} SwitchTable;
+
+/// A call inlined into a function (qw_inline.h): `function` was called on `line` of the function,
+/// or of the inlined call `parent` when the call is in inlined code too (-1 otherwise)
 typedef struct {
+  struct ObjectFunction* function;
+  u32 line;
+  i32 parent;
+} InlinedCall;
+
+/// Bytecode offsets [start, end) of a function holding the code of InlinedCall `call`, not the
+/// calls inlined into it, which have ranges of their own
+typedef struct {
+  u32 start;
+  u32 end;
+  u32 call;
+} InlinedRange;
+
+typedef struct ObjectFunction {
   Object object;
   u32 number_of_parameters;
   // Compiled bytecode
@@ -57,13 +165,69 @@ typedef struct {
 
   ValueArray* global_array;
   i32 upvalue_count;
+
+  /// Inline caches referenced by index from the property access/invoke instructions of `chunk`
+  InlineCache* inline_caches;
+  u32 inline_cache_count;
+  u32 inline_cache_capacity;
+
+  /// Jump tables referenced by index from the OP_SWITCHes of `chunk`
+  SwitchTable* switches;
+  u32 switch_count;
+  u32 switch_capacity;
+
+  /// Calls inlined into `chunk` and where their code is, by offset, for runtime_error() to show
+  /// the frames they would have had
+  InlinedCall* inlined_calls;
+  u32 inlined_call_count;
+  InlinedRange* inlined_ranges;
+  u32 inlined_range_count;
+
+  /// Where compile_function_body() finds the body the compiler skipped (see lazy_compile in
+  /// qw_compiler.h), NULL once `chunk` has the code
+  struct LazyBody* lazy;
+
+  /// Calls counted by call_value() (see qw_tier.h)
+  u32 call_count;
+  /// Back edges taken to every loop header, by its position in the code run() runs. NULL until the
+  /// function first runs
+  u32* loop_counts;
+
+  /// Native code compiled ahead of time (see qw_aot.h), NULL when the function was compiled from source
+  u32 (*aot_code)(struct JitState* state, u32 offset);
+  /// Bytecode offsets `aot_code` is entered at, bit `offset % 8` of byte `offset / 8`
+  const u8* aot_entries;
+
+#ifdef QW_THREADED_CODE
+  /// `chunk` translated by translate_function() the first time the function runs, NULL before that
+  ThreadedWord* threaded_code;
+  /// Bytecode offset of the instruction each word of `threaded_code` belongs to
+  u32* threaded_offsets;
+  u32 threaded_count;
+#endif
+
+#ifdef QW_JIT
+  /// Native code compiled by jit_run() once the function or one of its loops is hot, NULL before
+  u8* jit_code;
+  u32 jit_size;
+  /// Offset in `jit_code` of the instruction at every bytecode offset
+  u32* jit_entries;
+#endif
+
+#ifdef QW_TRACING
+  /// Loops counted and traced by trace_loop() by the bytecode offset of their header, NULL until the
+  /// first back edge. Only the top-level script has them
+  struct Trace** traces;
+#endif
 } ObjectFunction;
 
 typedef struct {
   Object object;
   ObjectFunction* function;
-  ObjectUpvalue** upvalues;
   u32 upvalue_count;
+  /// What OP_CLOSURE captured: the ObjectUpvalue of a shared variable, or the value itself of a
+  /// copied one (see CaptureKind)
+  Value upvalues[];
 } ObjectClosure;
 
 // Instance method
@@ -98,6 +262,8 @@ void print_object(Value value);
 #define AS_BOUND_METHOD(value) ((ObjectBoundMethod*)AS_OBJECT(value))
 #define IS_ARRAY(value) (is_object_type(value, OBJECT_ARRAY))
 #define AS_ARRAY(value) ((ObjectArray*)AS_OBJECT(value))
+#define AS_SHAPE(value) ((ObjectShape*)AS_OBJECT(value))
+#define AS_UPVALUE(value) ((ObjectUpvalue*)AS_OBJECT(value))
 
 ObjectString* allocate_string(u32 length, u32 hash);
 Object* allocate_object(ObjectType type, isize true_size);
@@ -109,8 +275,27 @@ ObjectNative* new_native_function(NativeFn callback);
 ObjectString* copy_string(u32 length, const char* start);
 ObjectClass* new_class(ObjectString* name);
 ObjectInstance* new_instance(ObjectClass* klass);
+ObjectShape* new_shape(void);
+i32 shape_find_slot(ObjectShape* shape, ObjectString* name);
+bool instance_get_field(ObjectInstance* instance, ObjectString* name, Value* value);
+void instance_set_field(ObjectInstance* instance, ObjectString* name, Value value);
+void instance_to_dictionary(ObjectInstance* instance);
 ObjectBoundMethod* new_bound_method(Value klass_instance, ObjectClosure* method);
 ObjectArray* new_array(ValueArray array);
+u32 add_inline_cache(ObjectFunction* function, u32 offset);
+u32 add_switch_table(ObjectFunction* function, SwitchPattern* patterns, u32 pattern_count, u16 arm_count,
+                     u32* targets);
+void free_switch_tables(ObjectFunction* function);
+/// Replaces the inlined calls and ranges of `function` with `calls` and `ranges`, which it takes
+/// and must be ALLOCATEd
+void set_inlined_code(ObjectFunction* function, InlinedCall* calls, u32 call_count, InlinedRange* ranges,
+                      u32 range_count);
+/// Returns the InlinedCall the code at bytecode `offset` of `function` comes from, -1 if it is its own
+i32 inlined_call_at(ObjectFunction* function, u32 offset);
+/// Leaves in `arm` the arm of `table` that `value` matches (`arm_count` for none). Returns false if
+/// the `when` would compare something else than a number with a range before finding it, the
+/// range of table->first_range
+bool switch_arm(SwitchTable* table, Value value, u16* arm);
 u32 hash_string(char* str, u32 length);
 bool is_truthy(Value* obj);
 
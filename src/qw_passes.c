@@ -0,0 +1,1035 @@
+#include "qw_passes.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "qw_inline.h"
+#include "qw_object.h"
+
+/// Evaluates `left op_code right` the way run() does, returns false if run() would report an error
+/// or `op_code` isn't an arithmetic, comparison or equality instruction
+static bool fold_binary(u8 op_code, Value left, Value right, Value* result) {
+  if (op_code == OP_EQUAL || op_code == OP_NOT_EQUAL) {
+    bool equal;
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {
+      equal = AS_NUMBER(left) == AS_NUMBER(right);
+    } else if (VALUE_TYPE(left) != VALUE_TYPE(right)) {
+      equal = false;
+    } else if (IS_STRING(left) || IS_BOOL(left)) {
+      // Strings are interned
+      equal = IS_STRING(left) ? AS_OBJECT(left) == AS_OBJECT(right) : AS_BOOL(left) == AS_BOOL(right);
+    } else {
+      return false;
+    }
+    *result = BOOL_VAL(op_code == OP_EQUAL ? equal : !equal);
+    return true;
+  }
+  if (op_code == OP_ADD && IS_STRING(left) && IS_STRING(right)) {
+    ObjectString* a = AS_STRING(left);
+    ObjectString* b = AS_STRING(right);
+    u32 length = (u32)a->length + (u32)b->length;
+    char* chars = malloc(length + 1);
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    *result = OBJECT_VAL(copy_string(length, chars));
+    free(chars);
+    return true;
+  }
+  if (!IS_NUMBER(left) || !IS_NUMBER(right)) return false;
+  double a = AS_NUMBER(left);
+  double b = AS_NUMBER(right);
+  switch (op_code) {
+    case OP_ADD:
+      *result = NUMBER_VAL(a + b);
+      return true;
+    case OP_SUBTRACT:
+      *result = NUMBER_VAL(a - b);
+      return true;
+    case OP_MULTIPLY:
+      *result = NUMBER_VAL(a * b);
+      return true;
+    case OP_DIVIDE:
+      *result = NUMBER_VAL(a / b);
+      return true;
+    case OP_GREATER:
+      *result = BOOL_VAL(a > b);
+      return true;
+    case OP_LESS:
+      *result = BOOL_VAL(a < b);
+      return true;
+    // Not less and not greater, so true when a number is NaN
+    case OP_GREATER_EQUAL:
+      *result = BOOL_VAL(!(a < b));
+      return true;
+    case OP_LESS_EQUAL:
+      *result = BOOL_VAL(!(a > b));
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Evaluates OP_NEGATE or OP_NOT on `value` the way run() does, returns false if run() would report
+/// an error
+static bool fold_unary(u8 op_code, Value value, Value* result) {
+  if (op_code == OP_NEGATE) {
+    if (!IS_NUMBER(value)) return false;
+    *result = NUMBER_VAL(-AS_NUMBER(value));
+    return true;
+  }
+  if (IS_NIL(value)) {
+    *result = BOOL_VAL(true);
+  } else if (IS_BOOL(value)) {
+    *result = BOOL_VAL(!AS_BOOL(value));
+  } else if (IS_NUMBER(value)) {
+    *result = BOOL_VAL(AS_NUMBER(value) <= 0.0001);
+  } else {
+    *result = BOOL_VAL(false);
+  }
+  return true;
+}
+
+/// Returns whether the value `instruction` pushes is always a number
+static bool pushes_number(IrFunction* ir, IrInstruction* instruction) {
+  Value value;
+  if (ir_constant(ir, instruction, &value)) return IS_NUMBER(value);
+  switch (checked_op_code(instruction->op_code)) {
+    case OP_NEGATE:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether the value `instruction` pushes is always a boolean
+static bool pushes_bool(u8 op_code) {
+  switch (checked_op_code(op_code)) {
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether `x op_code constant` is `x` for every number x (-0 and NaN included, so x + 0
+/// and x * -1 don't qualify)
+static bool is_identity(u8 op_code, Value constant) {
+  if (!IS_NUMBER(constant)) return false;
+  double value = AS_NUMBER(constant);
+  switch (op_code) {
+    case OP_SUBTRACT:
+      return value == 0.0 && !signbit(value);
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      return value == 1.0;
+    default:
+      return false;
+  }
+}
+
+/// Folds the instruction `index` with the constants it pops: arithmetic, comparisons and string
+/// concatenation of constants become the constant they evaluate to, and the condition jumps of a
+/// constant either always jump or never do. Returns whether it changed anything
+static bool fold_instruction(IrFunction* ir, u32 index) {
+  IrInstruction* instruction = &ir->instructions[index];
+  u8 op_code = checked_op_code(instruction->op_code);
+  u32 previous = ir_previous(ir, index);
+  // Every operand comes from the instructions right before when no jump lands after them
+  if (instruction->incoming > 0 || previous == ir->count) return false;
+  IrInstruction* right = &ir->instructions[previous];
+  Value b;
+  if (!ir_constant(ir, right, &b)) {
+    // !!x is x when x is a boolean, -(-x) when x is a number
+    bool negation = op_code == OP_NEGATE && checked_op_code(right->op_code) == OP_NEGATE;
+    bool not = instruction->op_code == OP_NOT && right->op_code == OP_NOT;
+    u32 operand = ir_previous(ir, previous);
+    if ((!negation && !not) || right->incoming > 0 || operand == ir->count) return false;
+    if (negation ? !pushes_number(ir, &ir->instructions[operand]) : !pushes_bool(ir->instructions[operand].op_code)) {
+      return false;
+    }
+    right->op_code = IR_NOP;
+    instruction->op_code = IR_NOP;
+    return true;
+  }
+  Value result;
+  switch (op_code) {
+    case OP_NEGATE:
+    case OP_NOT:
+      if (!fold_unary(op_code, b, &result)) return false;
+      right->op_code = IR_NOP;
+      ir_set_constant(ir, instruction, result);
+      return true;
+    case OP_POP_JUMP_IF_FALSE:
+      right->op_code = IR_NOP;
+      instruction->op_code = is_truthy(&b) ? IR_NOP : OP_JUMP;
+      return true;
+    case OP_JUMP_IF_FALSE:
+      // The condition stays on the stack
+      instruction->op_code = is_truthy(&b) ? IR_NOP : OP_JUMP;
+      return true;
+    default:
+      break;
+  }
+  u32 operand = ir_previous(ir, previous);
+  if (right->incoming > 0 || operand == ir->count) return false;
+  IrInstruction* left = &ir->instructions[operand];
+  Value a;
+  if (!ir_constant(ir, left, &a)) {
+    if (!is_identity(op_code, b) || !pushes_number(ir, left)) return false;
+    right->op_code = IR_NOP;
+    instruction->op_code = IR_NOP;
+    return true;
+  }
+  if (!fold_binary(op_code, a, b, &result)) return false;
+  left->op_code = IR_NOP;
+  right->op_code = IR_NOP;
+  ir_set_constant(ir, instruction, result);
+  return true;
+}
+
+bool fold_constants(IrFunction* ir) {
+  bool changed = false;
+  for (u32 i = 0; i < ir->count; i++) {
+    if (ir->instructions[i].op_code != IR_NOP) changed |= fold_instruction(ir, i);
+  }
+  return changed;
+}
+
+/// Removes the instructions no path from the entry reaches: the code after an OP_RETURN, an OP_JUMP
+/// or an OP_JUMP_BACK that no jump lands on, and the code jumped over by constant conditions
+static bool remove_unreachable(IrFunction* ir) {
+  if (ir->count == 0) return false;
+  bool* reached = calloc(ir->count, sizeof(bool));
+  u32* worklist = malloc(sizeof(u32) * ir->count);
+  u32 pending = 0;
+  reached[0] = true;
+  worklist[pending++] = 0;
+  while (pending > 0) {
+    u32 index = worklist[--pending];
+    IrInstruction* instruction = &ir->instructions[index];
+    u32 successors[2];
+    u32 successor_count = 0;
+    if (!ir_is_terminator(instruction->op_code)) successors[successor_count++] = index + 1;
+    if (ir_is_jump(instruction->op_code)) successors[successor_count++] = instruction->target;
+    if (instruction->op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      for (u32 arm = 0; arm <= table->arm_count; arm++) {
+        u32 target = table->targets[arm];
+        if (target < ir->count && !reached[target]) {
+          reached[target] = true;
+          worklist[pending++] = target;
+        }
+      }
+    }
+    for (u32 i = 0; i < successor_count; i++) {
+      u32 successor = successors[i];
+      if (successor < ir->count && !reached[successor]) {
+        reached[successor] = true;
+        worklist[pending++] = successor;
+      }
+    }
+  }
+  bool changed = false;
+  for (u32 i = 0; i < ir->count; i++) {
+    if (!reached[i] && ir->instructions[i].op_code != IR_NOP) {
+      ir->instructions[i].op_code = IR_NOP;
+      changed = true;
+    }
+  }
+  free(worklist);
+  free(reached);
+  return changed;
+}
+
+/// Returns whether the jump `instruction` taken from `index` can land on `target`: conditional jumps
+/// and OP_JUMP only go forward, OP_JUMP_BACK only backward
+static bool can_jump_to(IrInstruction* instruction, u32 index, u32 target) {
+  return instruction->op_code == OP_JUMP_BACK ? target <= index : target > index;
+}
+
+/// Jumps that land on an OP_JUMP or OP_JUMP_BACK (the end of an if inside another, of the last arm
+/// of a when...) go straight to where the chain ends, and so does an OP_JUMP_IF_FALSE that lands on
+/// another one, which jumps too with the same value. Jumps to the next instruction are removed
+static bool thread_jumps(IrFunction* ir) {
+  bool changed = false;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == IR_NOP || !ir_is_jump(instruction->op_code)) continue;
+    u32 target = ir_next(ir, instruction->target);
+    // Bounded, a chain can be a cycle (`while (true) {}`)
+    for (u32 hops = 0; target < ir->count && hops < ir->count; hops++) {
+      IrInstruction* next = &ir->instructions[target];
+      bool same_condition = instruction->op_code == OP_JUMP_IF_FALSE && next->op_code == OP_JUMP_IF_FALSE;
+      if (next->op_code != OP_JUMP && next->op_code != OP_JUMP_BACK && !same_condition) break;
+      u32 next_target = ir_next(ir, next->target);
+      if (!can_jump_to(instruction, i, next_target)) break;
+      target = next_target;
+    }
+    if (target != ir_next(ir, instruction->target)) {
+      instruction->target = target;
+      changed = true;
+    }
+    if (target == ir_next(ir, i + 1)) {
+      // The condition of OP_POP_JUMP_IF_FALSE still has to go
+      if (instruction->op_code == OP_JUMP || instruction->op_code == OP_JUMP_IF_FALSE) {
+        instruction->op_code = IR_NOP;
+        changed = true;
+      } else if (instruction->op_code == OP_POP_JUMP_IF_FALSE) {
+        instruction->op_code = OP_POP;
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+/// Returns whether `op_code` only pushes a value, without side effects or errors
+static bool is_pure_push(u8 op_code) {
+  switch (op_code) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_PUSH_TOP:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CAPTURED:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Removes the values pushed only to be popped (OP_PUSH_TOP, OP_POP and OP_NIL, OP_POP...)
+static bool remove_dead_pushes(IrFunction* ir) {
+  bool changed = false;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* pop = &ir->instructions[i];
+    if (pop->op_code != OP_POP || pop->incoming > 0) continue;
+    u32 previous = ir_previous(ir, i);
+    if (previous == ir->count || !is_pure_push(ir->instructions[previous].op_code)) continue;
+    ir->instructions[previous].op_code = IR_NOP;
+    pop->op_code = IR_NOP;
+    changed = true;
+  }
+  return changed;
+}
+
+/// Returns the compare-and-branch instruction that jumps when the comparison `op_code` is false,
+/// IR_NOP if it isn't a comparison
+static u8 compare_and_branch(u8 op_code) {
+  switch (op_code) {
+    case OP_EQUAL:
+      return OP_JUMP_IF_NOT_EQUAL;
+    case OP_NOT_EQUAL:
+      return OP_JUMP_IF_EQUAL;
+    case OP_LESS:
+      return OP_JUMP_IF_NOT_LESS;
+    case OP_LESS_EQUAL:
+      return OP_JUMP_IF_NOT_LESS_EQUAL;
+    case OP_GREATER:
+      return OP_JUMP_IF_NOT_GREATER;
+    case OP_GREATER_EQUAL:
+      return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    default:
+      return IR_NOP;
+  }
+}
+
+/// Fuses a comparison with the condition jump of if/while/for/when that follows it into a
+/// compare-and-branch instruction (OP_LESS, OP_POP_JUMP_IF_FALSE -> OP_JUMP_IF_NOT_LESS), unless a
+/// jump lands between them
+static bool fuse_conditions(IrFunction* ir) {
+  bool changed = false;
+  u32 previous = ir->count;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == IR_NOP) continue;
+    if (instruction->op_code == OP_POP_JUMP_IF_FALSE && instruction->incoming == 0 && previous < ir->count) {
+      IrInstruction* comparison = &ir->instructions[previous];
+      u8 fused = compare_and_branch(checked_op_code(comparison->op_code));
+      if (fused != IR_NOP) {
+        instruction->op_code = fused;
+        // Type errors are reported on the line of the comparison
+        instruction->line = comparison->line;
+        comparison->op_code = IR_NOP;
+        changed = true;
+      }
+    }
+    previous = i;
+  }
+  return changed;
+}
+
+/// Most values hoist_invariants() keeps in new slots for a loop
+#define MAX_HOISTED 8
+
+/// Value the instructions `first` to `last` of a loop push, as hoist_invariants() tracks them
+typedef struct {
+  u32 first;
+  u32 last;
+  /// The same on every iteration, and computing it has no side effects nor errors
+  bool invariant;
+  bool number;
+} LoopValue;
+
+/// The instructions from `head` to `back`, the last OP_JUMP_BACK into them, with `depth` slots in use
+/// before `head` and the values hoisted out of them
+typedef struct {
+  u32 head;
+  u32 back;
+  u32 depth;
+  /// The first occurrence of every hoisted value, which goes in slot `depth` + its index
+  LoopValue hoisted[MAX_HOISTED];
+  u32 hoisted_count;
+  /// Hoisted value + 1 of the instruction that starts an occurrence of it, 0 for the others
+  u32* occurrence_of;
+  /// Last instruction of the occurrence starting at the instruction
+  u32* occurrence_end;
+} Loop;
+
+/// Returns the function the OP_CLOSURE `instruction` creates
+static ObjectFunction* closure_function(IrFunction* ir, IrInstruction* instruction) {
+  return (ObjectFunction*)AS_OBJECT(ir->function->chunk.constants.values[instruction->operand]);
+}
+
+static bool in_loop(Loop* loop, u32 index) { return index >= loop->head && index <= loop->back; }
+
+/// Returns whether `instruction` pushes a value that is the same on every iteration of `loop`:
+/// a constant, a captured copy, a fixed global (qw_inline.h) that the loop doesn't define or a
+/// local of before the loop that it doesn't write and no closure can
+static bool is_invariant_load(IrFunction* ir, Loop* loop, bool* written, IrInstruction* instruction) {
+  Value value;
+  if (ir_constant(ir, instruction, &value)) return true;
+  switch (instruction->op_code) {
+    case OP_GET_CAPTURED:
+      return true;
+    case OP_GET_LOCAL:
+      return instruction->operand < loop->depth && !written[instruction->operand];
+    case OP_GET_GLOBAL:
+      if (ir->program == NULL || !is_fixed_global(ir->program, instruction->operand)) return false;
+      for (u32 i = loop->head; i <= loop->back; i++) {
+        IrInstruction* definition = &ir->instructions[i];
+        if (definition->op_code == OP_DEFINE_GLOBAL && definition->operand == instruction->operand) return false;
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether `op_code` takes two values and can't fail when both are numbers, leaving whether
+/// it pushes a number in `number`
+static bool is_binary(u8 op_code, bool* number) {
+  switch (checked_op_code(op_code)) {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      *number = true;
+      return true;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+      *number = false;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// Returns whether `a` and `b` are the same instructions
+static bool same_value(IrFunction* ir, LoopValue* a, LoopValue* b) {
+  u32 i = ir_next(ir, a->first);
+  u32 j = ir_next(ir, b->first);
+  while (i <= a->last && j <= b->last) {
+    IrInstruction* x = &ir->instructions[i];
+    IrInstruction* y = &ir->instructions[j];
+    if (x->op_code != y->op_code || x->operand != y->operand) return false;
+    i = ir_next(ir, i + 1);
+    j = ir_next(ir, j + 1);
+  }
+  return i > a->last && j > b->last;
+}
+
+/// Hoists `value` if it is invariant and worth a slot: loading a constant or a local is as fast as
+/// loading the slot
+static void consider(IrFunction* ir, Loop* loop, LoopValue* value) {
+  if (!value->invariant) return;
+  IrInstruction* first = &ir->instructions[value->first];
+  Value constant;
+  if (value->first == value->last && (first->op_code == OP_GET_LOCAL || ir_constant(ir, first, &constant))) return;
+  u32 hoisted = 0;
+  while (hoisted < loop->hoisted_count && !same_value(ir, &loop->hoisted[hoisted], value)) hoisted++;
+  if (hoisted == MAX_HOISTED) return;
+  if (hoisted == loop->hoisted_count) loop->hoisted[loop->hoisted_count++] = *value;
+  loop->occurrence_of[value->first] = hoisted + 1;
+  loop->occurrence_end[value->first] = value->last;
+}
+
+/// Finds the invariant values of `loop`. The instructions are followed with the values they push
+/// since the last jump target: an unary, arithmetic or comparison instruction extends the values it
+/// takes when it can't fail on them, any other instruction ends them all
+static void find_invariants(IrFunction* ir, Loop* loop) {
+  bool* written = calloc(loop->depth + 1, sizeof(bool));
+  for (u32 i = loop->head; i <= loop->back; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code == OP_SET_LOCAL && instruction->operand < loop->depth) {
+      written[instruction->operand] = true;
+    }
+  }
+  // Locals a closure shares can change in any call
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code != OP_CLOSURE) continue;
+    ObjectFunction* function = closure_function(ir, instruction);
+    const u8* pairs = ir->code + instruction->offset + 3;
+    for (i32 upvalue = 0; upvalue < function->upvalue_count; upvalue++) {
+      if (pairs[2 * upvalue] == CAPTURE_LOCAL && pairs[2 * upvalue + 1] < loop->depth) {
+        written[pairs[2 * upvalue + 1]] = true;
+      }
+    }
+  }
+  LoopValue* stack = malloc(sizeof(LoopValue) * (loop->back - loop->head + 1));
+  u32 count = 0;
+  for (u32 i = loop->head; i <= loop->back; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    bool number_result;
+    if (instruction->op_code == IR_NOP) continue;
+    if (instruction->incoming > 0) {
+      for (u32 j = 0; j < count; j++) consider(ir, loop, &stack[j]);
+      count = 0;
+    }
+    u8 op_code = instruction->op_code;
+    if (is_invariant_load(ir, loop, written, instruction)) {
+      Value constant;
+      bool number = ir_constant(ir, instruction, &constant) && IS_NUMBER(constant);
+      stack[count++] = (LoopValue){i, i, true, number};
+    } else if ((op_code == OP_NOT || op_code == OP_NEGATE) && count >= 1) {
+      LoopValue* operand = &stack[count - 1];
+      if (op_code == OP_NEGATE && !operand->number) {
+        consider(ir, loop, operand);
+        *operand = (LoopValue){i, i, false, true};
+      } else {
+        *operand = (LoopValue){operand->first, i, operand->invariant, op_code == OP_NEGATE};
+      }
+    } else if (is_binary(op_code, &number_result) && count >= 2) {
+      LoopValue* left = &stack[count - 2];
+      LoopValue* right = &stack[count - 1];
+      if (left->invariant && right->invariant && left->number && right->number) {
+        *left = (LoopValue){left->first, i, true, number_result};
+      } else {
+        consider(ir, loop, left);
+        consider(ir, loop, right);
+        *left = (LoopValue){i, i, false, number_result};
+      }
+      count--;
+    } else {
+      for (u32 j = 0; j < count; j++) consider(ir, loop, &stack[j]);
+      count = 0;
+    }
+  }
+  free(stack);
+  free(written);
+}
+
+/// Returns the index of `target` among the `exit_count` instructions of `exits`, `exit_count` if it
+/// isn't one
+static u32 find_exit(u32* exits, u32 exit_count, u32 target) {
+  u32 exit = 0;
+  while (exit < exit_count && exits[exit] != target) exit++;
+  return exit;
+}
+
+/// Returns whether the jumps of the rest of the function only enter `loop` at its head and the ones
+/// leaving it land where the stack is back to `loop->depth` slots, or one more (the condition of a
+/// while). Fills `exits` with where they land
+static bool has_simple_edges(IrFunction* ir, Loop* loop, u32* depths, u32* exits, u32* exit_count) {
+  *exit_count = 0;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (in_loop(loop, i) && depths[i] != IR_NO_DEPTH && depths[i] < loop->depth) return false;
+    u32 targets[1];
+    u32* jump_targets = targets;
+    u32 target_count = 0;
+    if (instruction->op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      jump_targets = table->targets;
+      target_count = table->arm_count + 1;
+    } else if (ir_is_jump(instruction->op_code)) {
+      targets[target_count++] = instruction->target;
+    }
+    for (u32 j = 0; j < target_count; j++) {
+      u32 target = ir_next(ir, jump_targets[j]);
+      if (!in_loop(loop, i)) {
+        if (in_loop(loop, target) && target != loop->head) return false;
+        continue;
+      }
+      if (in_loop(loop, target)) continue;
+      if (target >= ir->count || depths[target] == IR_NO_DEPTH) return false;
+      if (depths[target] != loop->depth && depths[target] != loop->depth + 1) return false;
+      if (find_exit(exits, *exit_count, target) == *exit_count) exits[(*exit_count)++] = target;
+    }
+  }
+  return true;
+}
+
+/// Returns the new index of the jump target `target` of the instruction `index`: jumps from outside
+/// `loop` to its head go to the hoisted values first, the ones leaving it go through its exit
+static u32 relocate(IrFunction* ir, Loop* loop, u32* index_of, u32* exits, u32 exit_count, u32* exit_index, u32 index,
+                    u32 target) {
+  u32 next = ir_next(ir, target);
+  if (!in_loop(loop, index)) return next == loop->head ? loop->head : index_of[target];
+  if (!in_loop(loop, next)) return exit_index[find_exit(exits, exit_count, next)];
+  return index_of[target < loop->head ? loop->head : target];
+}
+
+static void append(IrInstruction** instructions, u32* count, u32* capacity, IrInstruction instruction) {
+  if (*capacity < *count + 1) {
+    *capacity = GROW_CAPACITY(*capacity);
+    *instructions = realloc(*instructions, sizeof(IrInstruction) * *capacity);
+  }
+  (*instructions)[(*count)++] = instruction;
+}
+
+/// Puts the hoisted values of `loop` in slots pushed right before its head and popped on its exits:
+/// an occurrence becomes an OP_GET_LOCAL of its slot and the locals of the loop move up. The exit
+/// of every jump leaving the loop pops the slots (OP_INLINE_RETURN under a while condition) and
+/// jumps to where the jump did
+static void hoist(IrFunction* ir, Loop* loop, u32* exits, u32 exit_count, u32* depths) {
+  u32 slots = loop->hoisted_count;
+  u32 line = ir->instructions[loop->back].line;
+  u32* index_of = malloc(sizeof(u32) * (ir->count + 1));
+  u32* exit_index = malloc(sizeof(u32) * exit_count);
+  IrInstruction* instructions = NULL;
+  u32 count = 0;
+  u32 capacity = 0;
+  for (u32 i = 0; i < loop->head; i++) {
+    index_of[i] = count;
+    append(&instructions, &count, &capacity, ir->instructions[i]);
+  }
+  for (u32 value = 0; value < slots; value++) {
+    LoopValue* hoisted = &loop->hoisted[value];
+    for (u32 i = hoisted->first; i <= hoisted->last; i++) {
+      if (ir->instructions[i].op_code != IR_NOP) append(&instructions, &count, &capacity, ir->instructions[i]);
+    }
+  }
+  for (u32 i = loop->head; i <= loop->back; i++) {
+    index_of[i] = count;
+    IrInstruction instruction = ir->instructions[i];
+    u8 op_code = instruction.op_code;
+    if (loop->occurrence_of[i] != 0) {
+      instruction.op_code = OP_GET_LOCAL;
+      instruction.operand = loop->depth + loop->occurrence_of[i] - 1;
+      append(&instructions, &count, &capacity, instruction);
+      for (u32 j = i + 1; j <= loop->occurrence_end[i]; j++) {
+        index_of[j] = count;
+        append(&instructions, &count, &capacity, (IrInstruction){.op_code = IR_NOP, .line = ir->instructions[j].line});
+      }
+      i = loop->occurrence_end[i];
+      continue;
+    }
+    if ((op_code == OP_GET_LOCAL || op_code == OP_SET_LOCAL || op_code == OP_INLINE_RETURN) &&
+        instruction.operand >= loop->depth) {
+      instruction.operand += slots;
+    }
+    if (op_code == OP_CLOSURE) {
+      ObjectFunction* function = closure_function(ir, &instruction);
+      u8* pairs = ir->code + instruction.offset + 3;
+      for (i32 upvalue = 0; upvalue < function->upvalue_count; upvalue++) {
+        if (pairs[2 * upvalue] != CAPTURE_UPVALUE && pairs[2 * upvalue + 1] >= loop->depth) {
+          pairs[2 * upvalue + 1] += slots;
+        }
+      }
+    }
+    append(&instructions, &count, &capacity, instruction);
+  }
+  for (u32 exit = 0; exit < exit_count; exit++) {
+    exit_index[exit] = count;
+    if (depths[exits[exit]] == loop->depth) {
+      for (u32 slot = 0; slot < slots; slot++) {
+        append(&instructions, &count, &capacity, (IrInstruction){.op_code = OP_POP, .line = line});
+      }
+    } else {
+      // The condition goes down to the first slot
+      IrInstruction drop = {.op_code = OP_INLINE_RETURN, .operand = loop->depth, .line = line};
+      append(&instructions, &count, &capacity, drop);
+    }
+    // Relocated with the other jumps
+    u8 jump = exits[exit] > loop->back ? OP_JUMP : OP_JUMP_BACK;
+    append(&instructions, &count, &capacity, (IrInstruction){.op_code = jump, .target = exits[exit], .line = line});
+  }
+  for (u32 i = loop->back + 1; i < ir->count; i++) {
+    index_of[i] = count;
+    append(&instructions, &count, &capacity, ir->instructions[i]);
+  }
+  index_of[ir->count] = count;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (!ir_is_jump(instruction->op_code)) continue;
+    u32 target = relocate(ir, loop, index_of, exits, exit_count, exit_index, i, instruction->target);
+    instructions[index_of[i]].target = target;
+  }
+  for (u32 exit = 0; exit < exit_count; exit++) {
+    instructions[exit_index[exit] + (depths[exits[exit]] == loop->depth ? slots : 1)].target = index_of[exits[exit]];
+  }
+  // The tables of the switches removed as unreachable are relocated as if they were outside
+  bool* relocated = calloc(ir->function->switch_count + 1, sizeof(bool));
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code != OP_SWITCH) continue;
+    SwitchTable* table = ir_switch(ir, instruction);
+    for (u32 arm = 0; arm <= table->arm_count; arm++) {
+      table->targets[arm] = relocate(ir, loop, index_of, exits, exit_count, exit_index, i, table->targets[arm]);
+    }
+    relocated[instruction->operand] = true;
+  }
+  for (u32 i = 0; i < ir->function->switch_count; i++) {
+    SwitchTable* table = &ir->function->switches[i];
+    if (relocated[i]) continue;
+    for (u32 arm = 0; arm <= table->arm_count; arm++) table->targets[arm] = index_of[table->targets[arm]];
+  }
+  free(relocated);
+  free(ir->instructions);
+  ir->instructions = instructions;
+  ir->count = count;
+  ir->capacity = capacity;
+  free(exit_index);
+  free(index_of);
+}
+
+/// Returns whether the closures `loop` creates can capture its locals once they move up `slots`
+static bool can_move_captures(IrFunction* ir, Loop* loop, u32 slots) {
+  for (u32 i = loop->head; i <= loop->back; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code != OP_CLOSURE) continue;
+    ObjectFunction* function = closure_function(ir, instruction);
+    const u8* pairs = ir->code + instruction->offset + 3;
+    for (i32 upvalue = 0; upvalue < function->upvalue_count; upvalue++) {
+      if (pairs[2 * upvalue] != CAPTURE_UPVALUE && pairs[2 * upvalue + 1] + slots > UINT8_MAX) return false;
+    }
+  }
+  return true;
+}
+
+/// Hoists the invariant values of the outermost loop that has some, returns whether there was one
+static bool hoist_next_loop(IrFunction* ir, u32* depths, u32* back_of, u32* exits) {
+  if (!ir_stack_depths(ir, depths)) return false;
+  for (u32 i = 0; i < ir->count; i++) back_of[i] = ir->count;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code != OP_JUMP_BACK) continue;
+    u32 head = ir_next(ir, instruction->target);
+    if (head < i) back_of[head] = i;
+  }
+  Loop loop;
+  loop.occurrence_of = malloc(sizeof(u32) * ir->count);
+  loop.occurrence_end = malloc(sizeof(u32) * ir->count);
+  bool hoisted = false;
+  for (u32 head = 0; head < ir->count && !hoisted; head++) {
+    if (back_of[head] == ir->count || depths[head] == IR_NO_DEPTH) continue;
+    loop.head = head;
+    loop.back = back_of[head];
+    // A for jumps back from the end of its body to the increment, after the jump back to the condition
+    for (u32 i = loop.back + 1; i < ir->count; i++) {
+      IrInstruction* instruction = &ir->instructions[i];
+      u32 target = ir_next(ir, instruction->target);
+      if (instruction->op_code == OP_JUMP_BACK && target > head && target <= loop.back) loop.back = i;
+    }
+    loop.depth = depths[head];
+    loop.hoisted_count = 0;
+    memset(loop.occurrence_of, 0, sizeof(u32) * ir->count);
+    u32 exit_count;
+    if (!has_simple_edges(ir, &loop, depths, exits, &exit_count)) continue;
+    find_invariants(ir, &loop);
+    if (loop.hoisted_count == 0 || !can_move_captures(ir, &loop, loop.hoisted_count)) continue;
+    hoist(ir, &loop, exits, exit_count, depths);
+    hoisted = true;
+  }
+  free(loop.occurrence_end);
+  free(loop.occurrence_of);
+  return hoisted;
+}
+
+/// Loop-invariant code motion: the values a loop computes the same way on every iteration (loads of
+/// fixed globals, arithmetic on constants and on locals it doesn't write...) are computed once
+/// before it, in slots of their own. Loops nested in another go after it, for what it leaves
+static bool hoist_invariants(IrFunction* ir) {
+  u32 loops = 0;
+  for (u32 i = 0; i < ir->count; i++) loops += ir->instructions[i].op_code == OP_JUMP_BACK;
+  bool changed = false;
+  for (u32 loop = 0; loop < loops; loop++) {
+    u32* depths = malloc(sizeof(u32) * (ir->count + 1));
+    u32* back_of = malloc(sizeof(u32) * (ir->count + 1));
+    u32* exits = malloc(sizeof(u32) * (ir->count + 1));
+    bool hoisted = hoist_next_loop(ir, depths, back_of, exits);
+    free(exits);
+    free(back_of);
+    free(depths);
+    if (!hoisted) break;
+    ir_count_incoming(ir);
+    changed = true;
+  }
+  return changed;
+}
+
+/// Loads of globals whose value is known at compile time (qw_inline.h) become constants: `let`
+/// declarations of constant expressions, natives, and the functions and classes of declarations
+/// nothing assigns, which calls then get without looking up the global
+static bool propagate_globals(IrFunction* ir) {
+  if (ir->program == NULL) return false;
+  bool changed = false;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    Value value;
+    if (instruction->op_code != OP_GET_GLOBAL || !known_global(ir->program, ir, instruction, &value)) continue;
+    // Constants past the 16 bit operand of OP_CONSTANT_LONG can't be pushed
+    if (ir->function->chunk.constants.count >= UINT16_MAX) break;
+    ir_set_constant(ir, instruction, value);
+    changed = true;
+  }
+  return changed;
+}
+
+/// Returns the unchecked variant of the arithmetic, comparison or compare-and-branch `op_code`,
+/// IR_NOP if it has none
+static u8 unchecked_op_code(u8 op_code) {
+  switch (op_code) {
+    case OP_NEGATE:
+      return OP_NEGATE_NUMBER;
+    case OP_ADD:
+      return OP_ADD_NUMBERS;
+    case OP_SUBTRACT:
+      return OP_SUBTRACT_NUMBERS;
+    case OP_MULTIPLY:
+      return OP_MULTIPLY_NUMBERS;
+    case OP_DIVIDE:
+      return OP_DIVIDE_NUMBERS;
+    case OP_GREATER:
+      return OP_GREATER_NUMBERS;
+    case OP_LESS:
+      return OP_LESS_NUMBERS;
+    case OP_GREATER_EQUAL:
+      return OP_GREATER_EQUAL_NUMBERS;
+    case OP_LESS_EQUAL:
+      return OP_LESS_EQUAL_NUMBERS;
+    case OP_JUMP_IF_NOT_LESS:
+      return OP_JUMP_IF_NOT_LESS_NUMBERS;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      return OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS;
+    case OP_JUMP_IF_NOT_GREATER:
+      return OP_JUMP_IF_NOT_GREATER_NUMBERS;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      return OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS;
+    default:
+      return IR_NOP;
+  }
+}
+
+/// Slots of the frame proven to hold numbers before an instruction, a bit per slot
+typedef u64 NumberSet;
+
+static bool is_number(NumberSet* numbers, u32 slot) { return (numbers[slot / 64] >> (slot % 64)) & 1; }
+
+static void set_number(NumberSet* numbers, u32 slot, bool number) {
+  if (number) {
+    numbers[slot / 64] |= (u64)1 << (slot % 64);
+  } else {
+    numbers[slot / 64] &= ~((u64)1 << (slot % 64));
+  }
+}
+
+/// Marks the locals the closures of `ir` capture by reference: calls can change them behind its back
+static void find_captured_locals(IrFunction* ir, bool* captured, u32 slots) {
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    if (instruction->op_code != OP_CLOSURE) continue;
+    ObjectFunction* function = closure_function(ir, instruction);
+    const u8* pairs = ir->code + instruction->offset + 3;
+    for (i32 upvalue = 0; upvalue < function->upvalue_count; upvalue++) {
+      u8 slot = pairs[2 * upvalue + 1];
+      if (pairs[2 * upvalue] == CAPTURE_LOCAL && slot < slots) captured[slot] = true;
+    }
+  }
+}
+
+/// Updates `numbers` from before the instruction `index`, run with `depths[index]` slots in use, to
+/// after it. Arithmetic other than OP_ADD (which concatenates strings too) only gets past its type
+/// checks with numbers, and pushes one
+static void transfer_numbers(IrFunction* ir, u32 index, u32* depths, bool* captured, NumberSet* numbers) {
+  IrInstruction* instruction = &ir->instructions[index];
+  u32 depth = depths[index];
+  Value value;
+  if (ir_constant(ir, instruction, &value)) {
+    set_number(numbers, depth, IS_NUMBER(value));
+    return;
+  }
+  switch (checked_op_code(instruction->op_code)) {
+    case IR_NOP:
+    // They only pop values, or leave the stack as it is
+    case OP_POP:
+    case OP_PRINT:
+    case OP_ASSERT:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_CLOSE_UPVALUE:
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+    case OP_JUMP_IF_FALSE:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_SWITCH:
+    case OP_RETURN:
+      return;
+    case OP_GET_LOCAL:
+      set_number(numbers, depth, !captured[instruction->operand] && is_number(numbers, instruction->operand));
+      return;
+    case OP_SET_LOCAL:
+    case OP_INLINE_RETURN:
+      set_number(numbers, instruction->operand, is_number(numbers, depth - 1));
+      return;
+    case OP_PUSH_TOP:
+      set_number(numbers, depth, is_number(numbers, depth - 1));
+      return;
+    case OP_NEGATE:
+      set_number(numbers, depth - 1, true);
+      return;
+    case OP_ADD:
+      set_number(numbers, depth - 2, is_number(numbers, depth - 2) && is_number(numbers, depth - 1));
+      return;
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      set_number(numbers, depth - 2, true);
+      return;
+    default: {
+      // Whatever it pushes, on top of what it leaves of the stack
+      u32 after = index + 1 < ir->count ? depths[index + 1] : IR_NO_DEPTH;
+      if (after != IR_NO_DEPTH && after > 0) set_number(numbers, after - 1, false);
+      return;
+    }
+  }
+}
+
+/// Merges `numbers`, the slots holding numbers on an edge to `target`, into what is known before it,
+/// queueing it when that changes
+static void merge_numbers(NumberSet* numbers, u32 words, u32 target, NumberSet* known, bool* reached,
+                          bool* queued, u32* worklist, u32* pending) {
+  NumberSet* before = &known[target * words];
+  bool changed = !reached[target];
+  for (u32 word = 0; word < words; word++) {
+    NumberSet merged = reached[target] ? before[word] & numbers[word] : numbers[word];
+    changed |= merged != before[word];
+    before[word] = merged;
+  }
+  reached[target] = true;
+  if (changed && !queued[target]) {
+    queued[target] = true;
+    worklist[(*pending)++] = target;
+  }
+}
+
+/// Type inference for numeric specialization: finds, along every path, the slots that hold numbers
+/// (constants, arithmetic results, locals assigned those, loop counters) and turns the arithmetic,
+/// comparisons and compare-and-branch instructions whose operands all are into their unchecked
+/// variants. Locals captured by reference are never assumed to be numbers, and instructions with an
+/// operand the inference can't prove keep their checks and report type errors as before
+static bool specialize_numbers(IrFunction* ir) {
+  if (ir->count == 0) return false;
+  u32* depths = malloc(sizeof(u32) * ir->count);
+  if (!ir_stack_depths(ir, depths)) {
+    free(depths);
+    return false;
+  }
+  u32 slots = 1;
+  for (u32 i = 0; i < ir->count; i++) {
+    if (depths[i] != IR_NO_DEPTH && depths[i] + 1 > slots) slots = depths[i] + 1;
+  }
+  u32 words = (slots + 63) / 64;
+  NumberSet* known = calloc((size_t)ir->count * words, sizeof(NumberSet));
+  NumberSet* numbers = malloc(sizeof(NumberSet) * words);
+  bool* reached = calloc(ir->count, sizeof(bool));
+  bool* queued = calloc(ir->count, sizeof(bool));
+  bool* captured = calloc(slots, sizeof(bool));
+  u32* worklist = malloc(sizeof(u32) * ir->count);
+  find_captured_locals(ir, captured, slots);
+
+  // The closure and the arguments can be anything
+  u32 pending = 0;
+  reached[0] = queued[0] = true;
+  worklist[pending++] = 0;
+  while (pending > 0) {
+    u32 index = worklist[--pending];
+    queued[index] = false;
+    IrInstruction* instruction = &ir->instructions[index];
+    memcpy(numbers, &known[index * words], sizeof(NumberSet) * words);
+    transfer_numbers(ir, index, depths, captured, numbers);
+    if (!ir_is_terminator(instruction->op_code) && index + 1 < ir->count) {
+      merge_numbers(numbers, words, index + 1, known, reached, queued, worklist, &pending);
+    }
+    if (ir_is_jump(instruction->op_code) && instruction->target < ir->count) {
+      merge_numbers(numbers, words, instruction->target, known, reached, queued, worklist, &pending);
+    }
+    if (instruction->op_code == OP_SWITCH) {
+      SwitchTable* table = ir_switch(ir, instruction);
+      for (u32 arm = 0; arm <= table->arm_count; arm++) {
+        if (table->targets[arm] >= ir->count) continue;
+        merge_numbers(numbers, words, table->targets[arm], known, reached, queued, worklist, &pending);
+      }
+    }
+  }
+
+  bool changed = false;
+  for (u32 i = 0; i < ir->count; i++) {
+    IrInstruction* instruction = &ir->instructions[i];
+    u8 unchecked = unchecked_op_code(instruction->op_code);
+    if (!reached[i] || unchecked == IR_NOP) continue;
+    NumberSet* before = &known[i * words];
+    u32 depth = depths[i];
+    bool operands = is_number(before, depth - 1) && (unchecked == OP_NEGATE_NUMBER || is_number(before, depth - 2));
+    if (!operands) continue;
+    instruction->op_code = unchecked;
+    changed = true;
+  }
+  free(worklist);
+  free(captured);
+  free(queued);
+  free(reached);
+  free(numbers);
+  free(known);
+  free(depths);
+  return changed;
+}
+
+const Pass passes[] = {
+    {"propagate-globals", propagate_globals},
+    {"fold-constants", fold_constants},
+    {"remove-unreachable", remove_unreachable},
+    {"thread-jumps", thread_jumps},
+    {"remove-dead-pushes", remove_dead_pushes},
+    {"fuse-conditions", fuse_conditions},
+    {"hoist-invariants", hoist_invariants},
+    {"specialize-numbers", specialize_numbers},
+};
+
+const u32 PASS_COUNT = sizeof(passes) / sizeof(passes[0]);
@@ -0,0 +1,20 @@
+#ifndef qw_passes_h
+#define qw_passes_h
+
+#include "qw_ir.h"
+
+/// Optimization over the IR of a function (qw_ir.h), returns whether it changed anything
+typedef struct {
+  const char* name;
+  bool (*run)(IrFunction* ir);
+} Pass;
+
+/// The passes optimize_script() runs over every function, in order
+extern const Pass passes[];
+extern const u32 PASS_COUNT;
+
+/// Constant folding and the algebraic identities that hold for every number, also run by
+/// analyze_program() over the script to know the values of its declarations
+bool fold_constants(IrFunction* ir);
+
+#endif
@@ -0,0 +1,164 @@
+#include "qw_peephole.h"
+
+#include <stdlib.h>
+
+/// A sequence of up to 3 instructions and the superinstruction that replaces it
+typedef struct {
+  u8 superinstruction;
+  u8 length;
+  u8 op_codes[3];
+} Superinstruction;
+
+/// Sequences picked from the DEBUG_OPCODE_PROFILE output of the benchmarks, longest first so a
+/// sequence is preferred over its prefix
+static const Superinstruction superinstructions[] = {
+    {OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_JUMP_IF_NOT_LESS}},
+    {OP_ADD_LOCAL_LOCAL, 3, {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD}},
+    {OP_ADD_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD}},
+    {OP_SUBTRACT_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_SUBTRACT}},
+    {OP_LESS_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_LESS}},
+    {OP_GET_LOCAL_CONSTANT, 2, {OP_GET_LOCAL, OP_CONSTANT}},
+    {OP_SET_LOCAL_POP, 2, {OP_SET_LOCAL, OP_POP}},
+    {OP_SET_GLOBAL_POP, 2, {OP_SET_GLOBAL, OP_POP}},
+    {OP_JUMP_IF_FALSE_POP, 2, {OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_POP_JUMP_BACK, 2, {OP_POP, OP_JUMP_BACK}},
+};
+
+#define SUPERINSTRUCTION_COUNT (sizeof(superinstructions) / sizeof(superinstructions[0]))
+
+u8 unfused_op_code(u8 op_code) {
+  for (u32 i = 0; i < SUPERINSTRUCTION_COUNT; i++) {
+    if (superinstructions[i].superinstruction == op_code) return superinstructions[i].op_codes[0];
+  }
+  return op_code;
+}
+
+/// Marks every offset of the code of `function` that a jump or an OP_SWITCH lands on
+static void find_jump_targets(ObjectFunction* function, bool* is_jump_target) {
+  Chunk* chunk = &function->chunk;
+  for (u32 offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+    Jump jump;
+    if (!find_jump(chunk, offset, &jump)) continue;
+    u32 target = jump_target(chunk, &jump);
+    if (target <= chunk->count) is_jump_target[target] = true;
+  }
+  for (u32 i = 0; i < function->switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    for (u32 arm = 0; arm <= table->arm_count; arm++) is_jump_target[table->targets[arm]] = true;
+  }
+}
+
+/// Returns the length of the instructions matched by `superinstruction` at `offset`, or 0 if they
+/// don't match or a jump lands in the middle of them
+static u32 match_superinstruction(Chunk* chunk, u32 offset, const Superinstruction* superinstruction,
+                                  bool* is_jump_target) {
+  u32 position = offset;
+  for (u32 i = 0; i < superinstruction->length; i++) {
+    // They check the operand types, so they replace the unchecked opcodes too
+    if (position >= chunk->count || checked_op_code(chunk->code[position]) != superinstruction->op_codes[i]) return 0;
+    if (i > 0 && is_jump_target[position]) return 0;
+    position += instruction_length(chunk, position);
+  }
+  return position - offset;
+}
+
+static void form_superinstructions(ObjectFunction* function) {
+  Chunk* chunk = &function->chunk;
+  bool* is_jump_target = calloc(chunk->count + 1, sizeof(bool));
+  find_jump_targets(function, is_jump_target);
+  for (u32 offset = 0; offset < chunk->count;) {
+    u32 length = 0;
+    for (u32 i = 0; i < SUPERINSTRUCTION_COUNT && length == 0; i++) {
+      length = match_superinstruction(chunk, offset, &superinstructions[i], is_jump_target);
+      if (length != 0) chunk->code[offset] = superinstructions[i].superinstruction;
+    }
+    offset += length != 0 ? length : instruction_length(chunk, offset);
+  }
+  free(is_jump_target);
+}
+
+/// Returns whether the instruction at `offset` is an OP_GET_LOCAL with an operandless form
+static bool is_short_local(Chunk* chunk, u32 offset) {
+  return chunk->code[offset] == OP_GET_LOCAL && chunk->code[offset + 1] <= OP_GET_LOCAL_3 - OP_GET_LOCAL_0;
+}
+
+/// Replaces the OP_GET_LOCALs of slots 0 to 3 with OP_GET_LOCAL_0..3, shrinking the chunk. Every
+/// other instruction is copied as is, except for the distances of the jumps that cross them
+static void compact_locals(ObjectFunction* function) {
+  Chunk* chunk = &function->chunk;
+  // The new offset of every old offset, also inside of instructions (jumps can be relative to those)
+  u32* new_offsets = malloc(sizeof(u32) * (chunk->count + 1));
+  u32 new_count = 0;
+  for (u32 offset = 0; offset < chunk->count;) {
+    u32 length = instruction_length(chunk, offset);
+    u32 new_length = is_short_local(chunk, offset) ? 1 : length;
+    for (u32 i = 0; i < length; i++) {
+      new_offsets[offset + i] = new_count + (i < new_length ? i : new_length - 1);
+    }
+    offset += length;
+    new_count += new_length;
+  }
+  new_offsets[chunk->count] = new_count;
+  if (new_count == chunk->count) {
+    free(new_offsets);
+    return;
+  }
+
+  u8* code = malloc(new_count);
+  Lines lines;
+  init_lines(&lines);
+  // Walks the run length encoded lines along with the instructions
+  u32 line_index = 0;
+  u32 line_end = chunk->lines.count > 0 ? chunk->lines.lines[0].times : 0;
+  for (u32 offset = 0; offset < chunk->count;) {
+    while (offset >= line_end && line_index + 1 < chunk->lines.count) {
+      line_end += chunk->lines.lines[++line_index].times;
+    }
+    u32 line = chunk->lines.lines[line_index].line;
+    u32 length = instruction_length(chunk, offset);
+    u32 new_offset = new_offsets[offset];
+    if (is_short_local(chunk, offset)) {
+      code[new_offset] = OP_GET_LOCAL_0 + chunk->code[offset + 1];
+      write_line(&lines, line);
+    } else {
+      memcpy(&code[new_offset], &chunk->code[offset], length);
+      for (u32 i = 0; i < length; i++) write_line(&lines, line);
+      Jump jump;
+      if (find_jump(chunk, offset, &jump)) {
+        u32 target = new_offsets[jump_target(chunk, &jump)];
+        u32 base = new_offsets[jump.base];
+        u16 distance = (u16)(jump.backward ? base - target : target - base);
+        code[new_offsets[jump.operand]] = distance >> 8;
+        code[new_offsets[jump.operand] + 1] = distance & 0xFF;
+      }
+    }
+    offset += length;
+  }
+
+  for (u32 i = 0; i < function->inline_cache_count; i++) {
+    function->inline_caches[i].offset = new_offsets[function->inline_caches[i].offset];
+  }
+  for (u32 i = 0; i < function->switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    for (u32 arm = 0; arm <= table->arm_count; arm++) table->targets[arm] = new_offsets[table->targets[arm]];
+  }
+  for (u32 i = 0; i < function->inlined_range_count; i++) {
+    InlinedRange* range = &function->inlined_ranges[i];
+    range->start = new_offsets[range->start];
+    range->end = new_offsets[range->end];
+  }
+  memcpy(chunk->code, code, new_count);
+  chunk->count = new_count;
+  free_lines(&chunk->lines);
+  chunk->lines = lines;
+  free(code);
+  free(new_offsets);
+}
+
+void peephole_optimize(ObjectFunction* function) {
+  if (function->chunk.count == 0) return;
+#ifndef QW_NO_SUPERINSTRUCTIONS
+  form_superinstructions(function);
+#endif
+  compact_locals(function);
+}
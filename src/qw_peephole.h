@@ -0,0 +1,16 @@
+#ifndef qw_peephole_h
+#define qw_peephole_h
+
+#include "qw_chunk.h"
+#include "qw_object.h"
+
+/// Rewrites the common instruction sequences of `function` into superinstructions (see OpCode)
+/// and the accesses to the first local slots into their operandless forms, relocating jumps,
+/// lines, inline cache offsets, switch targets and inlined ranges
+void peephole_optimize(ObjectFunction* function);
+
+/// Returns the first opcode of the sequence that the superinstruction `op_code` replaced, whose
+/// other opcodes are still in place after it. Other opcodes are returned as is
+u8 unfused_op_code(u8 op_code);
+
+#endif
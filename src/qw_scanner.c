@@ -13,10 +13,12 @@ typedef struct {
 
 Scanner scanner;
 
-void init_scanner(const char* source) {
+void init_scanner(const char* source) { init_scanner_at(source, 1); }
+
+void init_scanner_at(const char* source, u32 line) {
   scanner.start = source;
   scanner.current = source;
-  scanner.line = 1;
+  scanner.line = line;
 }
 
 #define IS_END (*scanner.current == '\0')
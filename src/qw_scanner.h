@@ -80,6 +80,8 @@ typedef struct {
 } Token;
 
 void init_scanner(const char* source);
+/// Scans from `source`, somewhere in the middle of a script, counting lines from `line`
+void init_scanner_at(const char* source, u32 line);
 Token scan_token(void);
 
 #endif
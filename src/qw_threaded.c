@@ -0,0 +1,119 @@
+#include "qw_threaded.h"
+
+#ifdef QW_THREADED_CODE
+
+#include "memory.h"
+
+/// Fills `widths` with the size in bytes of every operand of the instruction at `offset` and
+/// returns how many there are
+static u32 operand_widths(Chunk* chunk, u32 offset, u8* widths) {
+  u32 length = instruction_length(chunk, offset);
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT_LONG:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+    case OP_POP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS_NUMBERS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_NUMBERS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_NUMBERS:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_GET_SUPER:
+    case OP_ARRAY:
+    case OP_SWITCH:
+      widths[0] = 2;
+      return 1;
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+      widths[0] = widths[1] = 2;
+      return 2;
+    case OP_SUPER_INVOKE:
+    case OP_JUMP_IF_FALSE_POP:
+      widths[0] = 2;
+      widths[1] = 1;
+      return 2;
+    case OP_WIDE:
+    case OP_POP_JUMP_BACK:
+      widths[0] = 1;
+      widths[1] = 2;
+      return 2;
+    case OP_INVOKE:
+      widths[0] = 2;
+      widths[1] = 1;
+      widths[2] = 2;
+      return 3;
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+      widths[0] = widths[1] = widths[2] = widths[3] = 1;
+      widths[4] = 2;
+      return 5;
+    case OP_CLOSURE:
+      widths[0] = 2;
+      for (u32 i = 1; i < length - 2; i++) widths[i] = 1;
+      return length - 2;
+    default:
+      // Single byte operands, the opcodes skipped by superinstructions among them
+      for (u32 i = 0; i < length - 1; i++) widths[i] = 1;
+      return length - 1;
+  }
+}
+
+void translate_function(ObjectFunction* function, void** handlers) {
+  Chunk* chunk = &function->chunk;
+  // An instruction never has more words than bytes
+  u8* widths = ALLOCATE(u8, chunk->count);
+  u32* word_of = ALLOCATE(u32, chunk->count + 1);
+  ThreadedWord* code = ALLOCATE(ThreadedWord, chunk->count);
+  u32* offsets = ALLOCATE(u32, chunk->count);
+
+  u32 count = 0;
+  for (u32 offset = 0; offset < chunk->count;) {
+    u32 position = offset;
+    word_of[position] = count;
+    offsets[count] = offset;
+    code[count++].handler = handlers[chunk->code[position++]];
+    u32 operand_count = operand_widths(chunk, offset, widths);
+    for (u32 i = 0; i < operand_count; i++) {
+      word_of[position] = count;
+      offsets[count] = offset;
+      code[count++].operand =
+          widths[i] == 2 ? (u32)((chunk->code[position] << 8) | chunk->code[position + 1]) : chunk->code[position];
+      position += widths[i];
+    }
+    offset = position;
+  }
+  word_of[chunk->count] = count;
+
+  // Jump distances are relative to (and land on) operand or instruction boundaries, which all have a word
+  for (u32 offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+    Jump jump;
+    if (!find_jump(chunk, offset, &jump)) continue;
+    u32 target = word_of[jump_target(chunk, &jump)];
+    u32 base = word_of[jump.base];
+    code[word_of[jump.operand]].operand = jump.backward ? base - target : target - base;
+  }
+  for (u32 i = 0; i < function->switch_count; i++) {
+    SwitchTable* table = &function->switches[i];
+    table->threaded_targets = ALLOCATE(u32, table->arm_count + 1);
+    for (u32 arm = 0; arm <= table->arm_count; arm++) table->threaded_targets[arm] = word_of[table->targets[arm]];
+  }
+
+  function->threaded_code = GROW_ARRAY(ThreadedWord, code, chunk->count, count);
+  function->threaded_offsets = GROW_ARRAY(u32, offsets, chunk->count, count);
+  function->threaded_count = count;
+  FREE_ARRAY(u8, widths, chunk->count);
+  FREE_ARRAY(u32, word_of, chunk->count + 1);
+}
+
+u32 threaded_offset(ObjectFunction* function, ThreadedWord* ip) {
+  return function->threaded_offsets[ip - function->threaded_code];
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef qw_threaded_h
+#define qw_threaded_h
+
+#include "qw_chunk.h"
+#include "qw_object.h"
+
+#ifdef QW_THREADED_CODE
+
+/// Translates the bytecode of `function` into direct threaded code: every opcode becomes the
+/// address of its handler in `handlers` and every operand a word of its own, so the VM neither
+/// indexes the dispatch table nor assembles multi-byte operands. Operands keep the order in which
+/// the handlers read them (the opcode bytes that superinstructions skip included) and jump
+/// distances are counted in words
+void translate_function(ObjectFunction* function, void** handlers);
+
+/// Returns the bytecode offset of the instruction that `ip` (a word of the threaded code of
+/// `function`) belongs to
+u32 threaded_offset(ObjectFunction* function, ThreadedWord* ip);
+
+#endif
+
+#endif
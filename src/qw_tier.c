@@ -0,0 +1,80 @@
+#include "qw_tier.h"
+
+#include <stdlib.h>
+
+#include "memory.h"
+#include "qw_vm.h"
+
+u32 tier_call_threshold = TIER_CALL_THRESHOLD;
+u32 tier_loop_threshold = TIER_LOOP_THRESHOLD;
+bool tier_report = false;
+
+/// How many functions print_hot_functions() shows
+#define REPORT_TOP 10
+
+/// Length of the code run() runs for `function`, what its loop counters are indexed by
+static u32 code_length(ObjectFunction* function) {
+#ifdef QW_THREADED_CODE
+  return function->threaded_count;
+#else
+  return function->chunk.count;
+#endif
+}
+
+void allocate_loop_counts(ObjectFunction* function) {
+  u32 length = code_length(function);
+  function->loop_counts = ALLOCATE(u32, length);
+  memset(function->loop_counts, 0, sizeof(u32) * length);
+}
+
+void free_loop_counts(ObjectFunction* function) {
+  if (function->loop_counts == NULL) return;
+  FREE_ARRAY(u32, function->loop_counts, code_length(function));
+  function->loop_counts = NULL;
+}
+
+typedef struct {
+  ObjectFunction* function;
+  u64 back_edges;
+} HotFunction;
+
+static u64 heat(const HotFunction* hot) {
+  return hot->function->call_count + hot->back_edges;
+}
+
+static int compare_hot_functions(const void* a, const void* b) {
+  u64 left = heat((const HotFunction*)a);
+  u64 right = heat((const HotFunction*)b);
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+void print_hot_functions(void) {
+  u32 count = 0;
+  for (Object* object = vm.objects; object != NULL; object = object->next) {
+    if (object->type == OBJECT_FUNCTION) count++;
+  }
+  if (count == 0) return;
+  HotFunction* functions = malloc(sizeof(HotFunction) * count);
+  count = 0;
+  for (Object* object = vm.objects; object != NULL; object = object->next) {
+    if (object->type != OBJECT_FUNCTION) continue;
+    ObjectFunction* function = (ObjectFunction*)object;
+    u64 back_edges = 0;
+    if (function->loop_counts != NULL) {
+      for (u32 i = 0; i < code_length(function); i++) back_edges += function->loop_counts[i];
+    }
+    if (function->call_count == 0 && back_edges == 0) continue;
+    functions[count++] = (HotFunction){function, back_edges};
+  }
+  qsort(functions, count, sizeof(HotFunction), compare_hot_functions);
+
+  printf("[TIER] hottest functions (tier up after %u calls or %u loop iterations)\n", tier_call_threshold,
+         tier_loop_threshold);
+  printf("%12s %12s  %s\n", "calls", "back edges", "function");
+  for (u32 i = 0; i < count && i < REPORT_TOP; i++) {
+    ObjectFunction* function = functions[i].function;
+    printf("%12u %12llu  %s\n", function->call_count, (unsigned long long)functions[i].back_edges,
+           function->name != NULL ? function->name->chars : "<script>");
+  }
+  free(functions);
+}
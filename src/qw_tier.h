@@ -0,0 +1,41 @@
+#ifndef qw_tier_h
+#define qw_tier_h
+
+#include "qw_common.h"
+#include "qw_object.h"
+
+/// Tiered execution. The interpreter is the base tier and counts what is hot: call_value() counts
+/// the calls of every function and the back edges count the iterations of every loop. A function
+/// tiers up at its entry once its calls reach tier_call_threshold, and a loop tiers up at its
+/// header once its back edges reach tier_loop_threshold. That is on-stack replacement: the frame
+/// carries on in the optimized code from the loop header (do_loop_hot in run()). With --jit the
+/// tiers above are the baseline JIT (qw_jit.h) and the tracing JIT (qw_trace.h); without it the
+/// counts only feed the report
+
+/// Default thresholds, changed with --tier-calls=N and --tier-loops=N
+#define TIER_CALL_THRESHOLD 100
+#define TIER_LOOP_THRESHOLD 64
+
+extern u32 tier_call_threshold;
+extern u32 tier_loop_threshold;
+/// Whether interpret_source() prints the hottest functions at exit, set with --tier-report
+extern bool tier_report;
+
+/// Allocates the loop counters of `function`
+void allocate_loop_counts(ObjectFunction* function);
+
+/// Returns the loop counters of `function`, allocated the first time one of its frames runs. They
+/// are indexed by the position of the loop header in the code run() runs (bytecode offset, or word
+/// of threaded code)
+static inline u32* function_loop_counts(ObjectFunction* function) {
+  if (unlikely(function->loop_counts == NULL)) allocate_loop_counts(function);
+  return function->loop_counts;
+}
+
+/// Frees the loop counters of `function`
+void free_loop_counts(ObjectFunction* function);
+
+/// Prints the functions with the most calls and loop iterations that are still alive
+void print_hot_functions(void);
+
+#endif
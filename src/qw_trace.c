@@ -0,0 +1,787 @@
+#include "qw_trace.h"
+
+#ifdef QW_TRACING
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "qw_chunk.h"
+#include "qw_peephole.h"
+
+#ifdef DEBUG_PRINT_TRACE
+#include "qw_debug.h"
+#endif
+
+/// Instructions a recording runs before giving up, loops longer than this aren't traced
+#define TRACE_MAX_LENGTH 256
+
+typedef enum {
+  TRACE_OP_CONSTANT,
+  TRACE_OP_GET_LOCAL,
+  TRACE_OP_SET_LOCAL,
+  TRACE_OP_GET_GLOBAL,
+  TRACE_OP_SET_GLOBAL,
+  // Locals declared inside the loop, which live on the part of the stack the trace owns
+  TRACE_OP_PICK,
+  TRACE_OP_PUT,
+  TRACE_OP_POP,
+  TRACE_OP_ADD,
+  TRACE_OP_SUBTRACT,
+  TRACE_OP_MULTIPLY,
+  TRACE_OP_DIVIDE,
+  TRACE_OP_NEGATE,
+  // Compare-and-branch that must go the same way it went while recording
+  TRACE_OP_GUARD,
+} TraceOpKind;
+
+/// Instruction of a trace. Every value it works with was a number while recording
+typedef struct {
+  TraceOpKind kind;
+  /// Constant index, local slot, global index or stack position
+  u32 operand;
+  /// Guards: the compare-and-branch opcode, whether it jumped while recording and the bytecode
+  /// offset run() continues at when it goes the other way
+  u8 op_code;
+  bool jumped;
+  u32 exit;
+} TraceOp;
+
+/// Reads the u8 or u16 operand of the instruction at `offset`, 0 if it has none
+static u32 read_operand(Chunk* chunk, u32 offset, u32 length) {
+  if (length == 1) return 0;
+  if (length == 2) return chunk->code[offset + 1];
+  return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+static bool compare_jumps(u8 op_code, double left, double right) {
+  switch (op_code) {
+    case OP_JUMP_IF_EQUAL:
+      return left == right;
+    case OP_JUMP_IF_NOT_EQUAL:
+      return left != right;
+    case OP_JUMP_IF_NOT_LESS:
+      return !(left < right);
+    // a <= b is !(a > b) and a >= b is !(a < b), so they don't jump on NaN
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      return left > right;
+    case OP_JUMP_IF_NOT_GREATER:
+      return !(left > right);
+    default:
+      return left < right;
+  }
+}
+
+/// Runs the loop at `header` until it gets back there, recording every instruction into `ops`.
+/// Stops before the first instruction it can't record (not a number, not supported), which run()
+/// then interprets as if it had run everything before. Returns the bytecode offset it stopped at,
+/// `header` with `state->sp` where it started when the whole iteration was recorded
+static u32 record(ObjectFunction* function, JitState* state, u32 header, TraceOp* ops, u32* count) {
+  Chunk* chunk = &function->chunk;
+  Value* base = state->sp;
+  Value* sp = base;
+  u32 offset = header;
+  *count = 0;
+  for (u32 steps = 0; steps < TRACE_MAX_LENGTH; steps++) {
+    if (offset == header && steps > 0) break;
+    u8 op_code = checked_op_code(unfused_op_code(chunk->code[offset]));
+    u32 length = op_code == chunk->code[offset] ? instruction_length(chunk, offset) : op_code_length(op_code);
+    u32 operand = read_operand(chunk, offset, length);
+    TraceOp op = {0, operand, op_code, false, 0};
+    switch (op_code) {
+      case OP_CONSTANT:
+      case OP_CONSTANT_LONG:
+        if (!IS_NUMBER(state->constants[operand])) goto stop;
+        op.kind = TRACE_OP_CONSTANT;
+        *sp++ = state->constants[operand];
+        break;
+      case OP_GET_LOCAL_0:
+      case OP_GET_LOCAL_1:
+      case OP_GET_LOCAL_2:
+      case OP_GET_LOCAL_3:
+        op.operand = operand = op_code - OP_GET_LOCAL_0;
+        // fallthrough
+      case OP_GET_LOCAL:
+        if (!IS_NUMBER(state->slots[operand])) goto stop;
+        if (state->slots + operand >= base) {
+          op.kind = TRACE_OP_PICK;
+          op.operand = (u32)(state->slots + operand - base);
+        } else {
+          op.kind = TRACE_OP_GET_LOCAL;
+        }
+        *sp = state->slots[operand];
+        sp++;
+        break;
+      case OP_SET_LOCAL:
+        if (sp == base) goto stop;
+        if (state->slots + operand >= base) {
+          op.kind = TRACE_OP_PUT;
+          op.operand = (u32)(state->slots + operand - base);
+        } else {
+          op.kind = TRACE_OP_SET_LOCAL;
+        }
+        state->slots[operand] = sp[-1];
+        break;
+      case OP_GET_GLOBAL:
+        if (operand >= state->global_count || !IS_NUMBER(state->globals[operand])) goto stop;
+        op.kind = TRACE_OP_GET_GLOBAL;
+        *sp++ = state->globals[operand];
+        break;
+      case OP_SET_GLOBAL:
+        if (sp == base || operand >= state->global_count) goto stop;
+        op.kind = TRACE_OP_SET_GLOBAL;
+        state->globals[operand] = sp[-1];
+        break;
+      case OP_POP:
+        if (sp == base) goto stop;
+        op.kind = TRACE_OP_POP;
+        sp--;
+        break;
+      case OP_NEGATE:
+        if (sp == base) goto stop;
+        op.kind = TRACE_OP_NEGATE;
+        sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));
+        break;
+      case OP_ADD:
+      case OP_ADD_NUM:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE: {
+        if (sp - base < 2) goto stop;
+        double left = AS_NUMBER(sp[-2]);
+        double right = AS_NUMBER(sp[-1]);
+        double result;
+        if (op_code == OP_SUBTRACT) {
+          op.kind = TRACE_OP_SUBTRACT;
+          result = left - right;
+        } else if (op_code == OP_MULTIPLY) {
+          op.kind = TRACE_OP_MULTIPLY;
+          result = left * right;
+        } else if (op_code == OP_DIVIDE) {
+          op.kind = TRACE_OP_DIVIDE;
+          result = left / right;
+        } else {
+          op.kind = TRACE_OP_ADD;
+          result = left + right;
+        }
+        sp--;
+        sp[-1] = NUMBER_VAL(result);
+        break;
+      }
+      case OP_JUMP:
+        offset += length + operand;
+        continue;
+      case OP_JUMP_BACK:
+        offset += length - operand;
+        continue;
+      case OP_JUMP_IF_EQUAL:
+      case OP_JUMP_IF_NOT_EQUAL:
+      case OP_JUMP_IF_NOT_LESS:
+      case OP_JUMP_IF_NOT_LESS_EQUAL:
+      case OP_JUMP_IF_NOT_GREATER:
+      case OP_JUMP_IF_NOT_GREATER_EQUAL: {
+        if (sp - base < 2) goto stop;
+        op.kind = TRACE_OP_GUARD;
+        op.jumped = compare_jumps(op_code, AS_NUMBER(sp[-2]), AS_NUMBER(sp[-1]));
+        op.exit = op.jumped ? offset + length : offset + length + operand;
+        sp -= 2;
+        ops[(*count)++] = op;
+        offset = op.jumped ? offset + length + operand : offset + length;
+        continue;
+      }
+      default:
+        goto stop;
+    }
+    ops[(*count)++] = op;
+    offset += length;
+  }
+stop:
+  state->sp = sp;
+  return offset;
+}
+
+// The trace is compiled to x86-64 by hand (not from stencils, its registers change with every
+// trace). Registers: rbx = JitState, r12 = stack top, r13 = slots, r14 = constants, r15 = globals
+// as in the baseline JIT, xmm0 and xmm1 scratch, then one SSE register per variable of the loop
+// followed by one per stack position
+#define RAX 0
+#define R12 12
+#define R13 13
+#define R14 14
+#define R15 15
+#define XMM0 0
+#define FIRST_REGISTER 2
+#define REGISTER_COUNT 16
+
+#define VALUE_SIZE ((u32)sizeof(Value))
+#ifdef QW_NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((u32)offsetof(Value, as.number))
+#endif
+
+#define MOVSD_LOAD 0x10
+#define MOVSD_STORE 0x11
+#define ADDSD 0x58
+#define MULSD 0x59
+#define SUBSD 0x5c
+#define DIVSD 0x5e
+#define UCOMISD 0x2e
+
+#define JE 0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA 0x87
+#define JP 0x8a
+
+typedef struct {
+  u8* code;
+  u32 count;
+  u32 capacity;
+} Assembler;
+
+static void emit_byte(Assembler* assembler, u8 byte) {
+  if (assembler->count == assembler->capacity) {
+    u32 old_capacity = assembler->capacity;
+    assembler->capacity = GROW_CAPACITY(old_capacity);
+    assembler->code = GROW_ARRAY(u8, assembler->code, old_capacity, assembler->capacity);
+  }
+  assembler->code[assembler->count++] = byte;
+}
+
+static void emit_bytes(Assembler* assembler, const u8* bytes, u32 count) {
+  for (u32 i = 0; i < count; i++) emit_byte(assembler, bytes[i]);
+}
+
+static void emit_u32(Assembler* assembler, u32 value) {
+  for (u32 i = 0; i < 4; i++) emit_byte(assembler, (u8)(value >> (8 * i)));
+}
+
+static void write_u32(u8* code, u32 value) {
+  memcpy(code, &value, sizeof(u32));
+}
+
+/// REX prefix for `reg` in the ModRM reg field and `base` in the r/m field, left out when empty
+static void emit_rex(Assembler* assembler, bool wide, u8 reg, u8 base) {
+  u8 rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) emit_byte(assembler, rex);
+}
+
+/// ModRM (and SIB) of [base + displacement]
+static void emit_address(Assembler* assembler, u8 reg, u8 base, u32 displacement) {
+  emit_byte(assembler, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == 4) emit_byte(assembler, 0x24);
+  emit_u32(assembler, displacement);
+}
+
+/// Scalar double instruction between two SSE registers, F2 prefixed (66 for ucomisd)
+static void emit_sse(Assembler* assembler, u8 op_code, u8 reg, u8 rm) {
+  emit_byte(assembler, op_code == UCOMISD ? 0x66 : 0xf2);
+  emit_rex(assembler, false, reg, rm);
+  emit_byte(assembler, 0x0f);
+  emit_byte(assembler, op_code);
+  emit_byte(assembler, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/// Scalar double instruction between an SSE register and the number at [base + displacement]
+static void emit_sse_memory(Assembler* assembler, u8 op_code, u8 reg, u8 base, u32 displacement) {
+  emit_byte(assembler, op_code == UCOMISD ? 0x66 : 0xf2);
+  emit_rex(assembler, false, reg, base);
+  emit_byte(assembler, 0x0f);
+  emit_byte(assembler, op_code);
+  emit_address(assembler, reg, base, displacement);
+}
+
+/// Jumps to a position patched later, returns where its rel32 is. `condition` 0 is jmp
+static u32 emit_jump(Assembler* assembler, u8 condition) {
+  if (condition == 0) {
+    emit_byte(assembler, 0xe9);
+  } else {
+    emit_byte(assembler, 0x0f);
+    emit_byte(assembler, condition);
+  }
+  emit_u32(assembler, 0);
+  return assembler->count - 4;
+}
+
+static void patch_jump(u8* code, u32 position, u32 destination) {
+  write_u32(code + position, destination - (position + 4));
+}
+
+/// Stores the number type in the Value at [base + displacement], NaN boxed numbers don't have one
+static void emit_number_type(Assembler* assembler, u8 base, u32 displacement) {
+#ifdef QW_NAN_BOXING
+  (void)assembler;
+  (void)base;
+  (void)displacement;
+#else
+  emit_rex(assembler, false, 0, base);
+  emit_byte(assembler, 0xc7);
+  emit_address(assembler, 0, base, displacement);
+  emit_u32(assembler, VAL_NUMBER);
+#endif
+}
+
+/// Jumps (rel32 returned) unless the Value at [base + displacement] is a number
+static u32 emit_guard_number(Assembler* assembler, u8 base, u32 displacement) {
+#ifdef QW_NAN_BOXING
+  emit_rex(assembler, true, RAX, base);
+  emit_byte(assembler, 0x8b);
+  emit_address(assembler, RAX, base, displacement);
+  static const u8 check[] = {
+      0x48, 0xb9, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x7f,  // movabs $QNAN, %rcx
+      0x48, 0x21, 0xc8,                                            // and %rcx, %rax
+      0x48, 0x39, 0xc8,                                            // cmp %rcx, %rax
+  };
+  emit_bytes(assembler, check, sizeof(check));
+  return emit_jump(assembler, JE);
+#else
+  emit_rex(assembler, false, 0, base);
+  emit_byte(assembler, 0x83);
+  emit_address(assembler, 7, base, displacement);
+  emit_byte(assembler, VAL_NUMBER);
+  return emit_jump(assembler, JNE);
+#endif
+}
+
+/// Flips the sign of SSE register `reg` through rax
+static void emit_negate(Assembler* assembler, u8 reg) {
+  u8 rex = 0x48 | ((reg >> 3) << 2);
+  u8 modrm = 0xc0 | ((reg & 7) << 3);
+  const u8 negate[] = {
+      0x66, rex, 0x0f, 0x7e, modrm,    // movq %xmm, %rax
+      0x48, 0x0f, 0xba, 0xf8, 0x3f,    // btc $63, %rax
+      0x66, rex, 0x0f, 0x6e, modrm,    // movq %rax, %xmm
+  };
+  emit_bytes(assembler, negate, sizeof(negate));
+}
+
+/// Variable of the loop, kept in an SSE register while the trace runs
+typedef struct {
+  bool global;
+  u32 index;
+  /// Read before it's written: its type is checked and its number loaded when the trace starts
+  bool loaded;
+} TraceVariable;
+
+/// Where the value of a stack position is: an SSE register (its own, or the register of the
+/// variable it was read from) or a number constant
+typedef struct {
+  u8 reg;
+  i32 variable;
+  i32 constant;
+} TraceValue;
+
+/// Jump from the trace to the exit stub at `stub`
+typedef struct {
+  u32 position;
+  u32 stub;
+} ExitJump;
+
+typedef struct {
+  TraceOp* ops;
+  u32 count;
+  TraceVariable variables[REGISTER_COUNT];
+  u32 variable_count;
+  /// SSE register of the first stack position
+  u8 first_temporary;
+  TraceValue stack[REGISTER_COUNT];
+  u32 depth;
+  Assembler code;
+  Assembler exits;
+  /// Up to two per guard and one per variable checked on entry
+  ExitJump exit_jumps[2 * TRACE_MAX_LENGTH + REGISTER_COUNT];
+  u32 exit_jump_count;
+  /// Positions in `exits` of the jumps to the epilogue, one per exit stub
+  u32 epilogue_jumps[TRACE_MAX_LENGTH + 1];
+  u32 epilogue_jump_count;
+} TraceCompiler;
+
+static u8 variable_base(TraceVariable* variable) {
+  return variable->global ? R15 : R13;
+}
+
+static u8 variable_register(u32 variable) {
+  return (u8)(FIRST_REGISTER + variable);
+}
+
+/// Finds (or adds) the variable that `op` reads or writes, -1 when there are too many
+static i32 find_variable(TraceCompiler* compiler, TraceOp* op) {
+  bool global = op->kind == TRACE_OP_GET_GLOBAL || op->kind == TRACE_OP_SET_GLOBAL;
+  for (u32 i = 0; i < compiler->variable_count; i++) {
+    if (compiler->variables[i].global == global && compiler->variables[i].index == op->operand) return (i32)i;
+  }
+  if (FIRST_REGISTER + compiler->variable_count == REGISTER_COUNT) return -1;
+  TraceVariable* variable = &compiler->variables[compiler->variable_count];
+  variable->global = global;
+  variable->index = op->operand;
+  variable->loaded = op->kind == TRACE_OP_GET_LOCAL || op->kind == TRACE_OP_GET_GLOBAL;
+  return (i32)compiler->variable_count++;
+}
+
+/// Finds the variables of the trace and checks that they and the deepest stack fit in registers
+static bool allocate_registers(TraceCompiler* compiler, i32* variables) {
+  u32 depth = 0;
+  u32 max_depth = 0;
+  for (u32 i = 0; i < compiler->count; i++) {
+    TraceOp* op = &compiler->ops[i];
+    variables[i] = -1;
+    switch (op->kind) {
+      case TRACE_OP_GET_LOCAL:
+      case TRACE_OP_GET_GLOBAL:
+        depth++;
+        // fallthrough
+      case TRACE_OP_SET_LOCAL:
+      case TRACE_OP_SET_GLOBAL:
+        variables[i] = find_variable(compiler, op);
+        if (variables[i] < 0) return false;
+        break;
+      case TRACE_OP_CONSTANT:
+      case TRACE_OP_PICK:
+        depth++;
+        break;
+      case TRACE_OP_POP:
+      case TRACE_OP_ADD:
+      case TRACE_OP_SUBTRACT:
+      case TRACE_OP_MULTIPLY:
+      case TRACE_OP_DIVIDE:
+        depth--;
+        break;
+      case TRACE_OP_GUARD:
+        depth -= 2;
+        break;
+      case TRACE_OP_PUT:
+      case TRACE_OP_NEGATE:
+        break;
+    }
+    if (depth > max_depth) max_depth = depth;
+  }
+  compiler->first_temporary = (u8)(FIRST_REGISTER + compiler->variable_count);
+  return compiler->first_temporary + max_depth <= REGISTER_COUNT;
+}
+
+static u8 temporary_register(TraceCompiler* compiler, u32 position) {
+  return (u8)(compiler->first_temporary + position);
+}
+
+static bool is_temporary(TraceValue* value) {
+  return value->variable < 0 && value->constant < 0;
+}
+
+static void push_temporary(TraceCompiler* compiler, u32 position) {
+  compiler->stack[position] = (TraceValue){temporary_register(compiler, position), -1, -1};
+}
+
+/// Loads `value` into SSE register `reg`
+static void load_value(TraceCompiler* compiler, u8 reg, TraceValue* value) {
+  if (value->constant >= 0) {
+    emit_sse_memory(&compiler->code, MOVSD_LOAD, reg, R14, (u32)value->constant * VALUE_SIZE + NUMBER_OFFSET);
+  } else if (value->reg != reg) {
+    emit_sse(&compiler->code, MOVSD_LOAD, reg, value->reg);
+  }
+}
+
+/// `op_code` of SSE register `reg` and `value`
+static void operate(TraceCompiler* compiler, u8 op_code, u8 reg, TraceValue* value) {
+  if (value->constant >= 0) {
+    emit_sse_memory(&compiler->code, op_code, reg, R14, (u32)value->constant * VALUE_SIZE + NUMBER_OFFSET);
+  } else {
+    emit_sse(&compiler->code, op_code, reg, value->reg);
+  }
+}
+
+/// Exit stub that writes the stack positions the trace still holds back to the value stack and
+/// returns `offset` to run()
+static u32 emit_exit(TraceCompiler* compiler, u32 offset) {
+  Assembler* exits = &compiler->exits;
+  u32 stub = exits->count;
+  for (u32 i = 0; i < compiler->depth; i++) {
+    TraceValue* value = &compiler->stack[i];
+    u8 reg = value->reg;
+    if (value->constant >= 0) {
+      emit_sse_memory(exits, MOVSD_LOAD, XMM0, R14, (u32)value->constant * VALUE_SIZE + NUMBER_OFFSET);
+      reg = XMM0;
+    }
+    emit_number_type(exits, R12, i * VALUE_SIZE);
+    emit_sse_memory(exits, MOVSD_STORE, reg, R12, i * VALUE_SIZE + NUMBER_OFFSET);
+  }
+  if (compiler->depth > 0) {
+    // add $imm32, %r12
+    const u8 add[] = {0x49, 0x81, 0xc4};
+    emit_bytes(exits, add, sizeof(add));
+    emit_u32(exits, compiler->depth * VALUE_SIZE);
+  }
+  // mov $offset, %eax
+  emit_byte(exits, 0xb8);
+  emit_u32(exits, offset);
+  compiler->epilogue_jumps[compiler->epilogue_jump_count++] = emit_jump(exits, 0);
+  return stub;
+}
+
+static void jump_to_exit(TraceCompiler* compiler, u32 position, u32 stub) {
+  compiler->exit_jumps[compiler->exit_jump_count++] = (ExitJump){position, stub};
+}
+
+/// Before `variable` changes, the stack positions that were read from it get their own copy
+static void detach_variable(TraceCompiler* compiler, i32 variable) {
+  for (u32 i = 0; i < compiler->depth; i++) {
+    if (compiler->stack[i].variable != variable) continue;
+    emit_sse(&compiler->code, MOVSD_LOAD, temporary_register(compiler, i), variable_register((u32)variable));
+    push_temporary(compiler, i);
+  }
+}
+
+/// Compares the two numbers on top of the stack like the compare-and-branch `op` and leaves the
+/// trace when it doesn't go the way it went while recording
+static void emit_guard(TraceCompiler* compiler, TraceOp* op) {
+  TraceValue right = compiler->stack[compiler->depth - 1];
+  TraceValue left = compiler->stack[compiler->depth - 2];
+  compiler->depth -= 2;
+  // `jump` is the condition of the flags left by `ucomisd first, second` under which `op` jumps
+  bool swap = op->op_code == OP_JUMP_IF_NOT_LESS || op->op_code == OP_JUMP_IF_NOT_GREATER_EQUAL;
+  TraceValue* first = swap ? &right : &left;
+  TraceValue* second = swap ? &left : &right;
+  u8 jump;
+  u8 stay;
+  switch (op->op_code) {
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+      jump = JBE;
+      stay = JA;
+      break;
+    // Unordered (NaN) sets CF and ZF: JBE takes it, JA doesn't
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      jump = JA;
+      stay = JBE;
+      break;
+    default:
+      jump = op->op_code == OP_JUMP_IF_EQUAL ? JE : JNE;
+      stay = jump == JE ? JNE : JE;
+      break;
+  }
+  u8 reg = first->reg;
+  if (first->constant >= 0) {
+    load_value(compiler, XMM0, first);
+    reg = XMM0;
+  }
+  operate(compiler, UCOMISD, reg, second);
+  u32 stub = emit_exit(compiler, op->exit);
+  // Exits on the condition of the branch the recording didn't take
+  u8 exit = op->jumped ? stay : jump;
+  if (exit == JE) {
+    // Unordered (NaN) compares as not equal: jp over the exit
+    emit_byte(&compiler->code, 0x7a);
+    emit_byte(&compiler->code, 6);
+  } else if (exit == JNE) {
+    jump_to_exit(compiler, emit_jump(&compiler->code, JP), stub);
+  }
+  jump_to_exit(compiler, emit_jump(&compiler->code, exit), stub);
+}
+
+static void emit_op(TraceCompiler* compiler, TraceOp* op, i32 variable) {
+  Assembler* code = &compiler->code;
+  u32 top = compiler->depth - 1;
+  switch (op->kind) {
+    case TRACE_OP_CONSTANT:
+      compiler->stack[compiler->depth++] = (TraceValue){0, -1, (i32)op->operand};
+      break;
+    case TRACE_OP_GET_LOCAL:
+    case TRACE_OP_GET_GLOBAL:
+      compiler->stack[compiler->depth++] = (TraceValue){variable_register((u32)variable), variable, -1};
+      break;
+    case TRACE_OP_SET_LOCAL:
+    case TRACE_OP_SET_GLOBAL: {
+      TraceValue value = compiler->stack[top];
+      if (value.variable == variable) break;
+      detach_variable(compiler, variable);
+      u8 reg = variable_register((u32)variable);
+      load_value(compiler, reg, &value);
+      // Written through, side exits don't have to write variables back
+      TraceVariable* written = &compiler->variables[variable];
+      u8 base = variable_base(written);
+      if (!written->loaded) emit_number_type(code, base, written->index * VALUE_SIZE);
+      emit_sse_memory(code, MOVSD_STORE, reg, base, written->index * VALUE_SIZE + NUMBER_OFFSET);
+      break;
+    }
+    case TRACE_OP_PICK: {
+      TraceValue* value = &compiler->stack[op->operand];
+      if (is_temporary(value)) {
+        emit_sse(code, MOVSD_LOAD, temporary_register(compiler, compiler->depth), value->reg);
+        push_temporary(compiler, compiler->depth);
+      } else {
+        compiler->stack[compiler->depth] = *value;
+      }
+      compiler->depth++;
+      break;
+    }
+    case TRACE_OP_PUT:
+      if (op->operand == top) break;
+      load_value(compiler, temporary_register(compiler, op->operand), &compiler->stack[top]);
+      push_temporary(compiler, op->operand);
+      break;
+    case TRACE_OP_POP:
+      compiler->depth--;
+      break;
+    case TRACE_OP_ADD:
+    case TRACE_OP_SUBTRACT:
+    case TRACE_OP_MULTIPLY:
+    case TRACE_OP_DIVIDE: {
+      static const u8 op_codes[] = {ADDSD, SUBSD, MULSD, DIVSD};
+      u8 reg = temporary_register(compiler, top - 1);
+      load_value(compiler, reg, &compiler->stack[top - 1]);
+      operate(compiler, op_codes[op->kind - TRACE_OP_ADD], reg, &compiler->stack[top]);
+      compiler->depth--;
+      push_temporary(compiler, top - 1);
+      break;
+    }
+    case TRACE_OP_NEGATE: {
+      u8 reg = temporary_register(compiler, top);
+      load_value(compiler, reg, &compiler->stack[top]);
+      emit_negate(code, reg);
+      push_temporary(compiler, top);
+      break;
+    }
+    case TRACE_OP_GUARD:
+      emit_guard(compiler, op);
+      break;
+  }
+}
+
+#ifdef DEBUG_PRINT_TRACE
+static void print_trace(TraceOp* ops, u32 count, u32 header) {
+  static const char* names[] = {"CONSTANT", "GET_LOCAL", "SET_LOCAL", "GET_GLOBAL", "SET_GLOBAL",
+                                "PICK",     "PUT",       "POP",       "ADD",        "SUBTRACT",
+                                "MULTIPLY", "DIVIDE",    "NEGATE",    "GUARD"};
+  printf("== trace of the loop at %04d ==\n", header);
+  for (u32 i = 0; i < count; i++) {
+    if (ops[i].kind == TRACE_OP_GUARD) {
+      printf("%-10s %s, exit to %04d\n", names[ops[i].kind], op_code_name(ops[i].op_code), ops[i].exit);
+    } else {
+      printf("%-10s %d\n", names[ops[i].kind], ops[i].operand);
+    }
+  }
+}
+#endif
+
+/// Compiles the trace into [prologue][checks and loads of the variables][loop][exit stubs][epilogue]
+static bool trace_compile(Trace* trace, u32 header, TraceOp* ops, u32 count) {
+  TraceCompiler compiler;
+  compiler.ops = ops;
+  compiler.count = count;
+  compiler.variable_count = 0;
+  compiler.depth = 0;
+  compiler.code = (Assembler){NULL, 0, 0};
+  compiler.exits = (Assembler){NULL, 0, 0};
+  compiler.exit_jump_count = 0;
+  compiler.epilogue_jump_count = 0;
+  i32* variables = ALLOCATE(i32, count);
+  bool compiled = allocate_registers(&compiler, variables);
+  if (compiled) {
+    Assembler* code = &compiler.code;
+    static const u8 prologue[] = {
+        0x53,                    // push %rbx
+        0x41, 0x54,              // push %r12
+        0x41, 0x55,              // push %r13
+        0x41, 0x56,              // push %r14
+        0x41, 0x57,              // push %r15
+        0x48, 0x89, 0xfb,        // mov %rdi, %rbx
+        0x4c, 0x8b, 0x23,        // mov (%rbx), %r12
+        0x4c, 0x8b, 0x6b, 0x08,  // mov 8(%rbx), %r13
+        0x4c, 0x8b, 0x73, 0x10,  // mov 16(%rbx), %r14
+        0x4c, 0x8b, 0x7b, 0x18,  // mov 24(%rbx), %r15
+    };
+    emit_bytes(code, prologue, sizeof(prologue));
+    // The guards on the types of the variables are hoisted here: inside the loop only numbers are
+    // written to them
+    u32 not_numbers = emit_exit(&compiler, header);
+    for (u32 i = 0; i < compiler.variable_count; i++) {
+      TraceVariable* variable = &compiler.variables[i];
+      if (!variable->loaded) continue;
+      u32 displacement = variable->index * VALUE_SIZE;
+      jump_to_exit(&compiler, emit_guard_number(code, variable_base(variable), displacement), not_numbers);
+      emit_sse_memory(code, MOVSD_LOAD, variable_register(i), variable_base(variable), displacement + NUMBER_OFFSET);
+    }
+    u32 loop = code->count;
+    for (u32 i = 0; i < count; i++) emit_op(&compiler, &ops[i], variables[i]);
+    patch_jump(code->code, emit_jump(code, 0), loop);
+
+    static const u8 epilogue[] = {
+        0x4c, 0x89, 0x23,  // mov %r12, (%rbx)
+        0x41, 0x5f,        // pop %r15
+        0x41, 0x5e,        // pop %r14
+        0x41, 0x5d,        // pop %r13
+        0x41, 0x5c,        // pop %r12
+        0x5b,              // pop %rbx
+        0xc3,              // ret
+    };
+    u32 exits = code->count;
+    u32 size = exits + compiler.exits.count + sizeof(epilogue);
+    u8* native = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    compiled = native != MAP_FAILED;
+    if (compiled) {
+      memcpy(native, code->code, exits);
+      memcpy(native + exits, compiler.exits.code, compiler.exits.count);
+      memcpy(native + exits + compiler.exits.count, epilogue, sizeof(epilogue));
+      for (u32 i = 0; i < compiler.exit_jump_count; i++) {
+        patch_jump(native, compiler.exit_jumps[i].position, exits + compiler.exit_jumps[i].stub);
+      }
+      for (u32 i = 0; i < compiler.epilogue_jump_count; i++) {
+        patch_jump(native, exits + compiler.epilogue_jumps[i], exits + compiler.exits.count);
+      }
+      mprotect(native, size, PROT_READ | PROT_EXEC);
+      trace->code = native;
+      trace->size = size;
+    }
+  }
+  FREE_ARRAY(u8, compiler.code.code, compiler.code.capacity);
+  FREE_ARRAY(u8, compiler.exits.code, compiler.exits.capacity);
+  FREE_ARRAY(i32, variables, count);
+  return compiled;
+}
+
+typedef u32 (*TraceEntry)(JitState* state);
+
+bool trace_loop(ObjectFunction* function, JitState* state, u32 header, u32* resume) {
+  if (function->traces == NULL) {
+    function->traces = ALLOCATE(Trace*, function->chunk.count);
+    memset(function->traces, 0, sizeof(Trace*) * function->chunk.count);
+  }
+  Trace* trace = function->traces[header];
+  if (trace != NULL) {
+    if (trace->code == NULL) return false;
+    *resume = ((TraceEntry)(void*)trace->code)(state);
+    return true;
+  }
+  trace = ALLOCATE(Trace, 1);
+  *trace = (Trace){NULL, 0};
+  function->traces[header] = trace;
+
+  TraceOp* ops = ALLOCATE(TraceOp, TRACE_MAX_LENGTH);
+  u32 count;
+  Value* sp = state->sp;
+  *resume = record(function, state, header, ops, &count);
+  bool complete = *resume == header && state->sp == sp && count > 0;
+#ifdef DEBUG_PRINT_TRACE
+  if (complete) print_trace(ops, count, header);
+#endif
+  // Native code exits on every back edge of the script, recompiled it keeps a failed loop native
+  if (!complete || !trace_compile(trace, header, ops, count)) free_jit_code(function);
+  FREE_ARRAY(TraceOp, ops, TRACE_MAX_LENGTH);
+  // The recording ran the loop up to `*resume`
+  return true;
+}
+
+void free_traces(ObjectFunction* function) {
+  if (function->traces == NULL) return;
+  for (u32 header = 0; header < function->chunk.count; header++) {
+    Trace* trace = function->traces[header];
+    if (trace == NULL) continue;
+    if (trace->code != NULL) munmap(trace->code, trace->size);
+    FREE(Trace, trace);
+  }
+  FREE_ARRAY(Trace*, function->traces, function->chunk.count);
+  function->traces = NULL;
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef qw_trace_h
+#define qw_trace_h
+
+#include "qw_common.h"
+#include "qw_jit.h"
+#include "qw_object.h"
+
+#ifdef QW_TRACING
+
+/// Tracing JIT for the hot loops of the top-level script, on with --jit next to the baseline JIT.
+/// Once a loop is hot (see qw_tier.h), trace_loop() runs one iteration itself and records the
+/// instructions it executes with the types it sees: a linear trace, the branches it took turned
+/// into guards. Traces that only see numbers are compiled into a native loop that keeps the
+/// variables unboxed in SSE registers, checks their types once on entry instead of on every
+/// instruction, and leaves through side exits back to run() when a guard fails (the loop ends or
+/// takes another path). Loops that can't be traced (calls, strings, objects...) are left to the
+/// baseline JIT
+
+/// Loop of a function, found by the bytecode offset its back edges jump to
+typedef struct Trace {
+  /// Native code of the trace, NULL when the loop can't be traced
+  u8* code;
+  u32 size;
+} Trace;
+
+/// Called by run() on the back edges of the hot loops of the top-level script, `header` is the
+/// bytecode offset the back edge jumped to. Records and compiles the loop the first time. Returns
+/// false when the loop can't be traced, otherwise `*resume` is the offset to continue from and
+/// `state->sp` is updated
+bool trace_loop(ObjectFunction* function, JitState* state, u32 header, u32* resume);
+
+/// Returns whether the loop at `header` was found impossible to trace
+static inline bool trace_failed(ObjectFunction* function, u32 header) {
+  return function->traces != NULL && function->traces[header] != NULL && function->traces[header]->code == NULL;
+}
+
+/// Frees the traces of `function`
+void free_traces(ObjectFunction* function);
+
+#endif
+
+#endif
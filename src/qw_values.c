@@ -32,9 +32,9 @@ void free_value_array(ValueArray* array) {
 }
 
 void print_value(Value value) {
-  switch (value.type) {
+  switch (VALUE_TYPE(value)) {
     case VAL_BOOL: {
-      if (value.as.boolean) {
+      if (AS_BOOL(value)) {
         printf("true");
       } else {
         printf("false");
@@ -53,7 +53,7 @@ void print_value(Value value) {
       print_object(value);
       break;
     default: {
-      printf("COULDN'T PRINT VALUE OF TYPE: %d\n", value.type);
+      printf("COULDN'T PRINT VALUE OF TYPE: %d\n", VALUE_TYPE(value));
       return;
     }
   }
@@ -14,7 +14,8 @@ typedef enum {
   OBJECT_CLASS,
   OBJECT_INSTANCE,
   OBJECT_BOUND_METHOD,
-  OBJECT_ARRAY
+  OBJECT_ARRAY,
+  OBJECT_SHAPE
 } ObjectType;
 
 typedef struct ObjectString ObjectString;
@@ -38,6 +39,64 @@ typedef enum {
   VAL_INTERNAL_COMPILER_MUTABLE,
 } ValueType;
 
+#ifdef QW_NAN_BOXING
+
+/// NaN boxing: a Value is a single 64 bit word. Numbers are stored as plain doubles, everything else
+/// hides inside the unused payload of a quiet NaN. Objects set the sign bit and keep the pointer in
+/// the low 48 bits, singletons (nil, true, false) use small tags in the low bits.
+typedef u64 Value;
+
+#define SIGN_BIT ((u64)0x8000000000000000)
+#define QNAN ((u64)0x7ffc000000000000)
+
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+
+static inline double value_to_number(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+static inline Value number_to_value(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) value_to_number(value)
+#define AS_OBJECT(value) ((Object*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+#define OBJECT_VAL(obj) (Value)(SIGN_BIT | QNAN | (u64)(uintptr_t)(obj))
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define TRUE_VAL ((Value)(u64)(QNAN | TAG_TRUE))
+#define FALSE_VAL ((Value)(u64)(QNAN | TAG_FALSE))
+#define NIL_VAL ((Value)(u64)(QNAN | TAG_NIL))
+#define NUMBER_VAL(value) number_to_value(value)
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJECT(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+static inline ValueType value_type(Value value) {
+  if (IS_NUMBER(value)) return VAL_NUMBER;
+  if (IS_OBJECT(value)) return VAL_OBJECT;
+  if (IS_BOOL(value)) return VAL_BOOL;
+  if (IS_NIL(value)) return VAL_NIL;
+  return VAL_UNDEFINED;
+}
+#define VALUE_TYPE(value) value_type(value)
+
+/// There is no room for the compiler internal types, so the symbol table stores the global index
+/// as a number, negative (-index - 1) when the global is immutable.
+#define COMPILER_SYMBOL_VAL(mutable, index) NUMBER_VAL((mutable) ? (double)(index) : -(double)(index)-1)
+#define IS_COMPILER_SYMBOL_IMMUTABLE(value) (AS_NUMBER(value) < 0)
+#define AS_COMPILER_SYMBOL_INDEX(value) \
+  ((i32)(AS_NUMBER(value) < 0 ? -AS_NUMBER(value) - 1 : AS_NUMBER(value)))
+
+#else
+
 typedef struct {
   ValueType type;
   union {
@@ -58,6 +117,14 @@ typedef struct {
 #define IS_NIL(value) ((value).type == VAL_NIL)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJECT(value) ((value).type == VAL_OBJECT)
+#define VALUE_TYPE(value) ((value).type)
+
+#define COMPILER_SYMBOL_VAL(mutable, index) \
+  ((Value){(mutable) ? VAL_INTERNAL_COMPILER_MUTABLE : VAL_INTERNAL_COMPILER_IMMUTABLE, {.number = (index)}})
+#define IS_COMPILER_SYMBOL_IMMUTABLE(value) ((value).type == VAL_INTERNAL_COMPILER_IMMUTABLE)
+#define AS_COMPILER_SYMBOL_INDEX(value) ((i32)(value).as.number)
+
+#endif
 
 typedef struct {
   u32 capacity;
@@ -4,12 +4,20 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "qw_aot.h"
 #include "qw_common.h"
 #include "qw_compiler.h"
 #include "qw_debug.h"
+#include "qw_image.h"
+#include "qw_jit.h"
 #include "qw_object.h"
+#include "qw_threaded.h"
+#include "qw_tier.h"
+#include "qw_trace.h"
 
+#ifndef QW_RELEASE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 #define PEEK_STACK(distance) *(vm.stack_top - 1 - distance)
 
@@ -47,6 +55,8 @@ void init_vm() {
 }
 
 void free_vm() {
+  // The symbols of the script point to strings freed below
+  free_table(&symbol_table);
   free_objects();
   free_table(&vm.strings);
   vm.init_string = NULL;
@@ -96,34 +106,98 @@ static ObjectUpvalue* capture_upvalue(Value* stack_pointer) {
   return created_upvalue;
 }
 
-static void runtime_error(const char* format, ...) {
-  va_list args;
-  va_start(args, format);
+#ifdef DEBUG_TRACE_EXECUTION
+/// Returns the value an upvalue of a closure holds, shared or copied
+static Value upvalue_value(Value upvalue) {
+  return is_object_type(upvalue, OBJECT_UPVALUE) ? *AS_UPVALUE(upvalue)->location : upvalue;
+}
+#endif
+
+/// Returns the bytecode offset of the instruction that `frame` is executing
+static u32 frame_offset(CallFrame* frame) {
+#ifdef QW_THREADED_CODE
+  return threaded_offset(frame->function->function, frame->ip - 1);
+#else
+  return (u32)(frame->ip - frame->function->function->chunk.code - 1);
+#endif
+}
+
+/// Returns where a new frame of `function` starts running
+static inline CodeUnit* function_code(ObjectFunction* function) {
+#ifdef QW_THREADED_CODE
+  // NULL until run() translates the function
+  return function->threaded_code;
+#else
+  return function->chunk.code;
+#endif
+}
+
+/// Whether the C code of `function` compiled ahead of time can be entered at bytecode `offset`
+static inline bool aot_entry(ObjectFunction* function, u32 offset) {
+  return function->aot_code != NULL && (function->aot_entries[offset / 8] >> (offset % 8) & 1);
+}
+
+static void print_frame(ObjectFunction* fn, u32 line) {
+  fprintf(stderr, "[line %d] in ", line);
+  if (fn->name == NULL) {
+    fprintf(stderr, "<main>\n");
+  } else {
+    fprintf(stderr, "%s()\n", fn->name->chars);
+  }
+}
+
+/// Prints the error and the stack trace, the innermost frame at `line` unless it is 0 (at the line
+/// of its instruction then)
+static void report_error(u32 line, const char* format, va_list args) {
   vfprintf(stderr, format, args);
-  va_end(args);
   fputs("\n", stderr);
   for (int i = vm.frame_count - 1; i >= 0; i--) {
     CallFrame* frame = &vm.frames[i];
     ObjectFunction* fn = frame->function->function;
-    isize ins = frame->ip - frame->function->function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", (u32)get_line_from_chunk(&fn->chunk, (u32)ins));
-    if (fn->name == NULL) {
-      fprintf(stderr, "<main>\n");
-    } else {
-      fprintf(stderr, "%s()\n", fn->name->chars);
+    u32 offset = frame_offset(frame);
+    if (i < vm.frame_count - 1 || line == 0) line = (u32)get_line_from_chunk(&fn->chunk, offset);
+    // The frames the inlined calls the code comes from would have had, the innermost first
+    for (i32 call = inlined_call_at(fn, offset); call != -1; call = fn->inlined_calls[call].parent) {
+      print_frame(fn->inlined_calls[call].function, line);
+      line = fn->inlined_calls[call].line;
     }
+    print_frame(fn, line);
 
     //    u32 line = get_line_from_chunk(&frame->function->function->chunk, ins);
   }
   reset_stack();
 }
 
+static void runtime_error(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  report_error(0, format, args);
+  va_end(args);
+}
+
+/// runtime_error() for an instruction standing for code of another line, raising the error there
+static void runtime_error_at_line(u32 line, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  report_error(line, format, args);
+  va_end(args);
+}
+
+/// Compiles the body of `function` if compile() skipped it (lazy_compile), false on errors
+static inline bool compile_on_call(ObjectFunction* function) {
+  if (unlikely(function->lazy != NULL) && !compile_function_body(function)) {
+    runtime_error("couldn't compile `%s`", function->name->chars);
+    return false;
+  }
+  return true;
+}
+
 static bool call_value(Value method_value, u8 arg_count) {
-  if (method_value.type != VAL_OBJECT) {
+  if (!IS_OBJECT(method_value)) {
     runtime_error("can't call non function");
     return false;
   }
-  Object* obj = method_value.as.object;
+  Object* obj = AS_OBJECT(method_value);
   if (vm.frame_count == FRAMES_MAX) {
     runtime_error("Stackoverflow...");
     return false;
@@ -138,14 +212,17 @@ static bool call_value(Value method_value, u8 arg_count) {
                       arg_count, closure->function->name->chars);
         return false;
       }
+      if (!compile_on_call(closure->function)) return false;
 #ifdef DEBUG_TRACE_EXECUTION
       printf("[CLOSURE] Called '%s'\n[CLOSURE] Adding new frame...\n",
              closure->function->name == NULL ? "main" : closure->function->name->chars);
 #endif
       // vm.stack_top[-arg_count - 1] = method->this;
+      closure->function->call_count++;
       CallFrame* frame = &vm.frames[vm.frame_count++];
-      frame->ip = closure->function->chunk.code;
+      frame->ip = function_code(closure->function);
       frame->function = closure;
+      frame->constants = closure->function->chunk.constants.values;
       frame->slots = vm.stack_top - arg_count - 1;
       // `this` context
       *(frame->slots) = method->this;
@@ -158,19 +235,22 @@ static bool call_value(Value method_value, u8 arg_count) {
       Value initializer;
       // if the class contains a constructor call the constructor
       if (table_get(&class->methods, vm.init_string, &initializer)) {
-        ObjectClosure* closure = (ObjectClosure*)initializer.as.object;
+        ObjectClosure* closure = (ObjectClosure*)AS_OBJECT(initializer);
         if (closure->function->number_of_parameters != arg_count) {
           runtime_error("expected %d parameters, got: %d on `%s` call", closure->function->number_of_parameters,
                         arg_count, closure->function->name->chars);
           return false;
         }
+        if (!compile_on_call(closure->function)) return false;
 #ifdef DEBUG_TRACE_EXECUTION
         printf("[CLOSURE] Called '%s'\n[CLOSURE] Adding new frame...\n",
                closure->function->name == NULL ? "main" : closure->function->name->chars);
 #endif
+        closure->function->call_count++;
         CallFrame* frame = &vm.frames[vm.frame_count++];
-        frame->ip = closure->function->chunk.code;
+        frame->ip = function_code(closure->function);
         frame->function = closure;
+        frame->constants = closure->function->chunk.constants.values;
         frame->slots = vm.stack_top - arg_count - 1;
         return true;
       } else if (arg_count != 0) {
@@ -186,13 +266,16 @@ static bool call_value(Value method_value, u8 arg_count) {
                       arg_count, closure->function->name->chars);
         return false;
       }
+      if (!compile_on_call(closure->function)) return false;
 #ifdef DEBUG_TRACE_EXECUTION
       printf("[CLOSURE] Called '%s'\n[CLOSURE] Adding new frame...\n",
              closure->function->name == NULL ? "main" : closure->function->name->chars);
 #endif
+      closure->function->call_count++;
       CallFrame* frame = &vm.frames[vm.frame_count++];
-      frame->ip = closure->function->chunk.code;
+      frame->ip = function_code(closure->function);
       frame->function = closure;
+      frame->constants = closure->function->chunk.constants.values;
       frame->slots = vm.stack_top - arg_count - 1;
       return true;
     }
@@ -211,13 +294,16 @@ static bool call_value(Value method_value, u8 arg_count) {
                       fn->name->chars);
         return false;
       }
+      if (!compile_on_call(fn)) return false;
 #ifdef DEBUG_TRACE_EXECUTION
       printf("[FUNCTION_CALL] Called '%s'\n[FUNCTION_CALL] Adding new frame...\n",
              fn->name == NULL ? "main" : fn->name->chars);
 #endif
+      fn->call_count++;
       CallFrame* frame = &vm.frames[vm.frame_count++];
-      frame->ip = fn->chunk.code;
+      frame->ip = function_code(fn);
       frame->function = new_closure(fn);
+      frame->constants = fn->chunk.constants.values;
       frame->slots = vm.stack_top - arg_count - 1;
       return true;
       break;
@@ -238,24 +324,112 @@ static bool invoke_from_class(ObjectClass* klass, ObjectString* name, u8 arg_cou
   return call_value(method, arg_count);
 }
 
-static bool invoke(ObjectString* name, u8 arg_count) {
+/// Returns the entry of `cache` for the shape of `instance` (counting the hit or miss), or NULL.
+/// A shape fixes which fields exist and where, so an entry never needs any other validation.
+static inline InlineCacheEntry* inline_cache_lookup(InlineCache* cache, ObjectInstance* instance) {
+  ObjectShape* shape = instance->shape;
+  if (shape != NULL) {
+    for (u32 i = 0; i < INLINE_CACHE_ENTRIES; i++) {
+      if (cache->entries[i].shape == shape) {
+        cache->hits++;
+        return &cache->entries[i];
+      }
+    }
+  }
+  cache->misses++;
+  return NULL;
+}
+
+/// Stores a lookup result for `shape`, reusing the entry of the same shape if there is one, else an
+/// empty entry, else evicting one (round robin on the number of misses).
+static inline InlineCacheEntry* inline_cache_update(InlineCache* cache, ObjectShape* shape, InlineCacheKind kind) {
+  InlineCacheEntry* entry = NULL;
+  for (u32 i = 0; i < INLINE_CACHE_ENTRIES && entry == NULL; i++) {
+    if (cache->entries[i].shape == shape) entry = &cache->entries[i];
+  }
+  for (u32 i = 0; i < INLINE_CACHE_ENTRIES && entry == NULL; i++) {
+    if (cache->entries[i].kind == CACHE_EMPTY) entry = &cache->entries[i];
+  }
+  if (entry == NULL) {
+    entry = &cache->entries[cache->misses % INLINE_CACHE_ENTRIES];
+  }
+  entry->shape = shape;
+  entry->kind = kind;
+  entry->slot = 0;
+  entry->next_shape = NULL;
+  entry->method = NIL_VAL;
+  return entry;
+}
+
+/// Sets `equal` to whether both values are equal, returns false if they can't be compared
+static inline bool values_equal(Value left, Value right, bool* equal) {
+  if (IS_NUMBER(right) && IS_NUMBER(left)) {
+    *equal = AS_NUMBER(left) == AS_NUMBER(right);
+    return true;
+  }
+  if (VALUE_TYPE(right) != VALUE_TYPE(left)) {
+    *equal = false;
+    return true;
+  }
+  if (IS_STRING(right)) {
+    // we can compare memory addresses because we use the technique string interning (we reuse string mem. addresses)
+    *equal = AS_OBJECT(left) == AS_OBJECT(right);
+    return true;
+  }
+  if (IS_BOOL(right)) {
+    *equal = AS_BOOL(left) == AS_BOOL(right);
+    return true;
+  }
+  return false;
+}
+
+static bool invoke(ObjectString* name, u8 arg_count, InlineCache* cache) {
   Value this = PEEK_STACK(arg_count);
   if (!IS_INSTANCE(this)) {
     runtime_error("can't call a non-instance method");
     return false;
   }
   ObjectInstance* instance = AS_INSTANCE(this);
-  Value value;
+
+  InlineCacheEntry* entry = inline_cache_lookup(cache, instance);
+  if (entry != NULL) {
+    if (entry->kind == CACHE_METHOD) {
+      return call_value(entry->method, arg_count);
+    }
+    Value value = instance->values[entry->slot];
+    vm.stack_top[-arg_count - 1] = value;
+    return call_value(value, arg_count);
+  }
 
   // If it's a field variable
-  if (table_get(&instance->fields, name, &value)) {
+  Value value;
+  if (instance_get_field(instance, name, &value)) {
+    if (instance->shape != NULL) {
+      inline_cache_update(cache, instance->shape, CACHE_FIELD)->slot = shape_find_slot(instance->shape, name);
+    }
     // Set the root as the function call
     vm.stack_top[-arg_count - 1] = value;
     return call_value(value, arg_count);
   }
 
   // A method call
-  return invoke_from_class(instance->klass, name, arg_count);
+  Value method;
+  if (!table_get(&instance->klass->methods, name, &method)) {
+    runtime_error("Undefined method class '%s'.", name->chars);
+    return false;
+  }
+  if (instance->shape != NULL) {
+    inline_cache_update(cache, instance->shape, CACHE_METHOD)->method = method;
+  }
+  return call_value(method, arg_count);
+}
+
+/// Replaces the instance on top of the stack with `method` bound to it
+static inline void bind_closure(ObjectClosure* method) {
+  ObjectBoundMethod* bound_method = new_bound_method(PEEK_STACK(0), method);
+  // class instance pop
+  pop();
+  push(OBJECT_VAL(bound_method));
 }
 
 static inline bool bind_method(ObjectClass* klass, ObjectString* name) {
@@ -263,10 +437,7 @@ static inline bool bind_method(ObjectClass* klass, ObjectString* name) {
   if (!table_get(&klass->methods, name, &method)) {
     return false;
   }
-  ObjectBoundMethod* bound_method = new_bound_method(PEEK_STACK(0), (ObjectClosure*)method.as.object);
-  // class instance pop
-  pop();
-  push(OBJECT_VAL(bound_method));
+  bind_closure((ObjectClosure*)AS_OBJECT(method));
   return true;
 }
 
@@ -297,6 +468,10 @@ static inline void concatenate() {
     // Let the garbage collector do its thing
     // FREE_ARRAY(char, new_string, new_string->length + 1);
     new_string = intern_string;
+  } else {
+    // Interned like every other string, so == compares it by address with the constants (folded
+    // concatenations included)
+    table_set(&vm.strings, new_string, NIL_VAL);
   }
   pop();
   pop();
@@ -305,26 +480,125 @@ static inline void concatenate() {
 }
 
 static InterpretResult run() {
+  // Interpreter registers. The dispatch loop works on these local copies and only writes them back
+  // (SAVE_STATE) before calling code that looks at the VM state (calls, allocations and errors).
   CallFrame* frame = &vm.frames[vm.frame_count - 1];
-//  u8* ip = frame->ip;
-//  u8* initial = frame->ip;
-
+  register CodeUnit* ip = frame->ip;
+  register Value* sp = vm.stack_top;
+  Value* slots = frame->slots;
+  Value* constants = frame->constants;
+  InlineCache* caches = frame->function->function->inline_caches;
+  // Set once the frame's code is ready (TRANSLATE_FRAME), loop headers are counted by `ip - code`
+  u32* loop_counts = NULL;
+  CodeUnit* code = NULL;
+  // Globals live in the script function and never move once compiled
+  ValueArray* global_array = vm.frames[0].function->function->global_array;
+  Value* globals = global_array->values;
+  u32 global_count = global_array->count;
+
+#ifdef QW_THREADED_CODE
+/// Threaded code has every operand in a word of its own, already decoded
+#define READ_BYTE() ((u8)(ip++)->operand)
+#define READ_U16() ((u16)(ip++)->operand)
+/// The opcode word is the address of its handler
+#define DISPATCH() goto*(ip++)->handler
+/// Bytecode offset of the instruction `ip` points to
+#define CURRENT_OFFSET() threaded_offset(frame->function->function, ip)
+/// Functions are translated to threaded code the first time one of their frames runs
+#define TRANSLATE_FRAME()                                                   \
+  do {                                                                      \
+    if (ip == NULL) {                                                       \
+      ObjectFunction* function = frame->function->function;                 \
+      if (function->threaded_code == NULL) {                                \
+        translate_function(function, dispatch_table);                       \
+      }                                                                     \
+      ip = frame->ip = function->threaded_code;                             \
+    }                                                                       \
+  } while (false)
+#else
 /// Returns the value of the current instrucction
 /// and advances instruction pointer to the next byte
-#define READ_BYTE() (*(frame->ip++))
+#define READ_BYTE() (*ip++)
+/// Reads a big endian u16 operand
+#define READ_U16() (ip += 2, (u16)((ip[-2] << 8) | ip[-1]))
 /// Dispatch gets the current IP (should be an instruction)
 /// and evaluates that instruction inside the dispatch table,
 /// making a goto to that memory location
 #define DISPATCH() goto* dispatch_table[READ_BYTE()]
+#define CURRENT_OFFSET() ((u32)(ip - frame->function->function->chunk.code))
+#define TRANSLATE_FRAME() ((void)0)
+#endif
+
+#ifdef QW_JIT
+/// Continues in native code (do_jit_enter) when the JIT is on. Done on entry and after calls and
+/// returns, hot loops enter from their header (do_loop_hot)
+#define JIT_ENTER()                  \
+  do {                               \
+    if (unlikely(jit_enabled)) {     \
+      goto do_jit_enter;             \
+    }                                \
+  } while (false)
+#else
+#define JIT_ENTER() ((void)0)
+#endif
+
+#ifndef QW_THREADED_CODE
+/// Continues in the C code of the function (do_aot_enter) when it was compiled ahead of time and
+/// has an entry at `ip`, at the same points as JIT_ENTER(). Threaded code interprets it
+#define AOT_ENTER()                                                          \
+  do {                                                                       \
+    if (unlikely(aot_entry(frame->function->function, (u32)(ip - code)))) {  \
+      goto do_aot_enter;                                                     \
+    }                                                                        \
+  } while (false)
+#else
+#define AOT_ENTER() ((void)0)
+#endif
+
+/// Counts an iteration of the loop whose header `ip` just jumped back to, hot loops tier up
+/// (do_loop_hot)
+#define COUNT_LOOP()                                                     \
+  do {                                                                   \
+    if (unlikely(++loop_counts[ip - code] >= tier_loop_threshold)) {     \
+      goto do_loop_hot;                                                  \
+    }                                                                    \
+  } while (false)
 
 /// Reads the constant from the constant array
-#define READ_CONSTANT() (frame->function->function->chunk.constants.values[READ_BYTE()])
+#define READ_CONSTANT() (constants[READ_BYTE()])
 
 /// Constant long is able to contain 2 byte constants
-#define READ_CONSTANT_LONG() (frame->function->function->chunk.constants.values[(READ_BYTE() << 8) | READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_U16()])
 
 #define READ_STRING() (AS_STRING(READ_CONSTANT_LONG()))
 
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+
+/// Writes back the registers so the rest of the VM (GC roots, call_value, runtime_error) sees them
+#define SAVE_STATE()   \
+  do {                 \
+    frame->ip = ip;    \
+    vm.stack_top = sp; \
+  } while (false)
+
+/// Reloads the registers from the frame on top of the call stack
+#define LOAD_STATE()                                               \
+  do {                                                             \
+    frame = &vm.frames[vm.frame_count - 1];                        \
+    ip = frame->ip;                                                \
+    TRANSLATE_FRAME();                                             \
+    slots = frame->slots;                                          \
+    constants = frame->constants;                                  \
+    caches = frame->function->function->inline_caches;             \
+    loop_counts = function_loop_counts(frame->function->function); \
+    code = function_code(frame->function->function);               \
+    sp = vm.stack_top;                                             \
+    JIT_ENTER();                                                   \
+    AOT_ENTER();                                                   \
+  } while (false)
+
   static void* dispatch_table[] = {&&do_op_return,
                                    &&do_op_constant,
                                    &&do_op_constant_long,
@@ -357,6 +631,7 @@ static InterpretResult run() {
                                    &&do_op_get_upvalue,
                                    &&do_op_set_upvalue,
                                    &&do_op_close_upvalue,
+                                   &&do_op_get_captured,
                                    &&do_op_class,
                                    &&do_op_set_property,
                                    &&do_op_get_property,
@@ -367,27 +642,136 @@ static InterpretResult run() {
                                    &&do_op_inherit,
                                    &&do_op_get_super,
                                    &&do_op_super_invoke,
-                                   &&do_op_array};
+                                   &&do_op_array,
+                                   &&do_op_not_equal,
+                                   &&do_op_greater_equal,
+                                   &&do_op_less_equal,
+                                   &&do_op_pop_jump_if_false,
+                                   &&do_op_jump_if_equal,
+                                   &&do_op_jump_if_not_equal,
+                                   &&do_op_jump_if_not_less,
+                                   &&do_op_jump_if_not_less_equal,
+                                   &&do_op_jump_if_not_greater,
+                                   &&do_op_jump_if_not_greater_equal,
+                                   &&do_op_switch,
+                                   &&do_op_instance,
+                                   &&do_op_inline_return,
+                                   &&do_op_negate_number,
+                                   &&do_op_add_numbers,
+                                   &&do_op_subtract_numbers,
+                                   &&do_op_multiply_numbers,
+                                   &&do_op_divide_numbers,
+                                   &&do_op_greater_numbers,
+                                   &&do_op_less_numbers,
+                                   &&do_op_greater_equal_numbers,
+                                   &&do_op_less_equal_numbers,
+                                   &&do_op_jump_if_not_less_numbers,
+                                   &&do_op_jump_if_not_less_equal_numbers,
+                                   &&do_op_jump_if_not_greater_numbers,
+                                   &&do_op_jump_if_not_greater_equal_numbers,
+                                   &&do_op_add_num,
+                                   &&do_op_add_str,
+                                   &&do_op_get_local_0,
+                                   &&do_op_get_local_1,
+                                   &&do_op_get_local_2,
+                                   &&do_op_get_local_3,
+                                   &&do_op_wide,
+                                   &&do_op_get_local_constant,
+                                   &&do_op_add_local_local,
+                                   &&do_op_add_local_constant,
+                                   &&do_op_subtract_local_constant,
+                                   &&do_op_less_local_constant,
+                                   &&do_op_jump_if_not_less_local_constant,
+                                   &&do_op_set_local_pop,
+                                   &&do_op_set_global_pop,
+                                   &&do_op_jump_if_false_pop,
+                                   &&do_op_pop_jump_back};
+
+/// Rewrites the opcode that is executing into `op_code`, a variant specialized (or generalized
+/// back) for the operands it sees. Superinstructions that fall back to a generic handler only
+/// rewrite the opcode byte they skip over, which is never dispatched
+#if defined(QW_NO_QUICKENING)
+#define QUICKEN(op_code) ((void)0)
+#elif defined(QW_THREADED_CODE)
+#define QUICKEN(op_code) (ip[-1].handler = dispatch_table[op_code])
+#else
+#define QUICKEN(op_code) (ip[-1] = (op_code))
+#endif
 
 /// BinaryOp does a binary operation on the vm
 #define BINARY_OP(value_type, _op_)                                                                  \
   /* Equivalent of popping two values and making the operation and then pushing to the stack */      \
   do {                                                                                               \
-    if (!IS_NUMBER(PEEK_STACK(1)) || !IS_NUMBER(PEEK_STACK(0))) {                                    \
-      runtime_error("Operands %d, %d, must be numbers", (PEEK_STACK(1)).type, (PEEK_STACK(0)).type); \
+    if (!IS_NUMBER(PEEK(1)) || !IS_NUMBER(PEEK(0))) {                                                \
+      SAVE_STATE();                                                                                  \
+      runtime_error("Operands %d, %d, must be numbers", VALUE_TYPE(PEEK(1)), VALUE_TYPE(PEEK(0)));     \
       return INTERPRET_RUNTIME_ERROR;                                                                \
     }                                                                                                \
-    double b = AS_NUMBER(pop());                                                                     \
-    (*(vm.stack_top - 1)) = value_type(AS_NUMBER(*(vm.stack_top - 1)) _op_ b);                       \
+    double b = AS_NUMBER(POP());                                                                     \
+    PEEK(0) = value_type(AS_NUMBER(PEEK(0)) _op_ b);                                                 \
+  } while (false);
+
+/// Pops two numbers and jumps (by the u16 operand) when `left _op_ right` is `jump_if`
+#define COMPARE_JUMP(_op_, jump_if)                                                              \
+  do {                                                                                           \
+    u16 offset = READ_U16();                                                                     \
+    if (!IS_NUMBER(PEEK(1)) || !IS_NUMBER(PEEK(0))) {                                            \
+      SAVE_STATE();                                                                              \
+      runtime_error("Operands %d, %d, must be numbers", VALUE_TYPE(PEEK(1)), VALUE_TYPE(PEEK(0))); \
+      return INTERPRET_RUNTIME_ERROR;                                                            \
+    }                                                                                            \
+    double right = AS_NUMBER(PEEK(0));                                                           \
+    double left = AS_NUMBER(PEEK(1));                                                            \
+    sp -= 2;                                                                                     \
+    if ((left _op_ right) == (jump_if)) ip += offset;                                            \
   } while (false);
 
+/// BINARY_OP of operands the compiler proved to be numbers (OP_ADD_NUMBERS...)
+#define NUMBER_OP(value_type, _op_)                  \
+  do {                                               \
+    double b = AS_NUMBER(POP());                     \
+    PEEK(0) = value_type(AS_NUMBER(PEEK(0)) _op_ b); \
+  } while (false);
+
+/// COMPARE_JUMP of operands the compiler proved to be numbers
+#define NUMBER_COMPARE_JUMP(_op_, jump_if)                                 \
+  do {                                                                     \
+    u16 offset = READ_U16();                                               \
+    bool jump = (AS_NUMBER(PEEK(1)) _op_ AS_NUMBER(PEEK(0))) == (jump_if); \
+    sp -= 2;                                                               \
+    if (jump) ip += offset;                                                \
+  } while (false);
+
+/// `a >= b` is `!(a < b)` and `a <= b` is `!(a > b)`, so both are true when a or b is NaN
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+/// Pops two values and jumps (by the u16 operand) when their equality isn't `jump_if`
+#define EQUAL_JUMP(jump_if)                                          \
+  do {                                                               \
+    u16 offset = READ_U16();                                         \
+    bool equal;                                                      \
+    if (!values_equal(PEEK(1), PEEK(0), &equal)) {                   \
+      SAVE_STATE();                                                  \
+      runtime_error("can't evaluate these types with this type");    \
+      return INTERPRET_RUNTIME_ERROR;                                \
+    }                                                                \
+    sp -= 2;                                                         \
+    if (equal == (jump_if)) ip += offset;                            \
+  } while (false);
+
+  TRANSLATE_FRAME();
+  loop_counts = function_loop_counts(frame->function->function);
+  code = function_code(frame->function->function);
+  JIT_ENTER();
+  AOT_ENTER();
+
 #ifdef DEBUG_TRACE_EXECUTION
   /// TODO: I don't wanna copy every version of debug_trace_execution :(
   // Prints the current instruction and it's operands
-  dissasemble_instruction(&frame->function->function->chunk, (u64)(frame->ip - frame->function->function->chunk.code));
+  dissasemble_instruction(&frame->function->function->chunk, CURRENT_OFFSET());
 
   printf("    ** STACK **     ");
-  for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+  for (Value* slot = vm.stack; slot < sp; slot++) {
     printf("[ ");
     print_value(*slot);
     printf(" ]");
@@ -404,21 +788,23 @@ static InterpretResult run() {
   printf("    ** UPVALUES **     ");
   for (u32 i = 0; i < frame->function->upvalue_count; i++) {
     printf("[ ");
-    print_value(*(*(frame->function->upvalues + i))->location);
+    print_value(upvalue_value(frame->function->upvalues[i]));
     printf(" ]");
   }
   printf("\n");
 #endif
 
+#ifdef DEBUG_OPCODE_PROFILE
+  profile_op_code(frame->function->function->chunk.code[CURRENT_OFFSET()]);
+#endif
   // Goto current opcode handler
   DISPATCH();
   for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
     // Prints the current instruction and it's operands
-    dissasemble_instruction(&frame->function->function->chunk,
-                            (u32)(frame->ip - frame->function->function->chunk.code));
+    dissasemble_instruction(&frame->function->function->chunk, CURRENT_OFFSET());
     printf("    ** STACK **     ");
-    for (Value* slot = vm.stack; slot < vm.stack_top; slot++) {
+    for (Value* slot = vm.stack; slot < sp; slot++) {
       printf("[ ");
       print_value(*slot);
       printf(" ]");
@@ -435,26 +821,32 @@ static InterpretResult run() {
     printf("    ** UPVALUES **     ");
     for (u32 i = 0; i < frame->function->upvalue_count; i++) {
       printf("[ ");
-      print_value(*(*(frame->function->upvalues + i))->location);
+      print_value(upvalue_value(frame->function->upvalues[i]));
       printf(" ]");
     }
     printf("\n");
 #endif
 
+#ifdef DEBUG_OPCODE_PROFILE
+    profile_op_code(frame->function->function->chunk.code[CURRENT_OFFSET()]);
+#endif
     // Goto current opcode handler
     DISPATCH();
 
   do_op_array : {
-    u16 arr_len = (READ_BYTE() << 8) | READ_BYTE();
+    u16 arr_len = READ_U16();
     ValueArray arr;
     init_value_array(&arr);
+    // Elements stay on the stack while we allocate so the GC can see them
+    SAVE_STATE();
     grow(&arr, arr_len);
-    while (arr_len) {
-      arr.values[arr_len - 1] = pop();
-      arr.count++;
-      arr_len--;
+    for (u16 i = 0; i < arr_len; i++) {
+      arr.values[i] = sp[i - arr_len];
     }
-    push(OBJECT_VAL(new_array(arr)));
+    arr.count = arr_len;
+    ObjectArray* object_array = new_array(arr);
+    sp -= arr_len;
+    PUSH(OBJECT_VAL(object_array));
     continue;
   }
 
@@ -462,50 +854,52 @@ static InterpretResult run() {
     Value method_val = READ_CONSTANT_LONG();
     ObjectString* method_name = AS_STRING(method_val);
     u8 arg_count = READ_BYTE();
-    ObjectClass* superclass = AS_CLASS(pop());
+    ObjectClass* superclass = AS_CLASS(POP());
+    SAVE_STATE();
     if (!invoke_from_class(superclass, method_name, arg_count)) {
       return INTERPRET_RUNTIME_ERROR;
     }
-    frame = &vm.frames[vm.frame_count - 1];
+    LOAD_STATE();
     continue;
   }
 
   do_op_get_super : {
     Value method_val = READ_CONSTANT_LONG();
     ObjectString* method = AS_STRING(method_val);
-    ObjectClass* superclass = AS_CLASS(pop());
+    ObjectClass* superclass = AS_CLASS(POP());
+    SAVE_STATE();
     if (!bind_method(superclass, method)) {
       return INTERPRET_RUNTIME_ERROR;
     }
+    sp = vm.stack_top;
     continue;
   }
 
   do_op_invoke : {
-    ObjectString* method_name = AS_STRING(READ_CONSTANT_LONG());
+    ObjectString* method_name = READ_STRING();
     u8 arg_count = READ_BYTE();
-    // vm.frame_count++;
-    if (!invoke(method_name, arg_count)) {
-      return INTERPRET_RUNTIME_ERROR;
-    }
-    if (run() == INTERPRET_RUNTIME_ERROR) {
+    InlineCache* cache = &caches[READ_U16()];
+    SAVE_STATE();
+    if (!invoke(method_name, arg_count, cache)) {
       return INTERPRET_RUNTIME_ERROR;
     }
-    if (vm.frame_count == 0) {
-      return INTERPRET_OK;
-    }
+    // The invoked method (if any) pushed a new frame, keep running from there
+    LOAD_STATE();
     continue;
   }
   do_op_inherit : {
     //
-    ObjectClass* superclass = AS_CLASS(PEEK_STACK(1));
-    if (!IS_CLASS(PEEK_STACK(1))) {
+    ObjectClass* superclass = AS_CLASS(PEEK(1));
+    if (!IS_CLASS(PEEK(1))) {
+      SAVE_STATE();
       runtime_error("can't inherit from ");
-      print_value(PEEK_STACK(1));
+      print_value(PEEK(1));
       return INTERPRET_RUNTIME_ERROR;
     }
-    ObjectClass* subclass = AS_CLASS(PEEK_STACK(0));
+    ObjectClass* subclass = AS_CLASS(PEEK(0));
+    SAVE_STATE();
     table_copy(&superclass->methods, &subclass->methods);
-    pop();  // Subclass
+    sp--;  // Subclass
     // Ok so we don't pop because the
     // guy in charge of popping the superclass
     // is the scope of the class,
@@ -515,165 +909,219 @@ static InterpretResult run() {
   }
   do_op_method : {
     Value string = READ_CONSTANT_LONG();
-    Value method = PEEK_STACK(0);
-    Value class_constructor = PEEK_STACK(1);
+    Value method = PEEK(0);
+    Value class_constructor = PEEK(1);
     ObjectClass* klass = AS_CLASS(class_constructor);
+    SAVE_STATE();
     table_set(&klass->methods, AS_STRING(string), method);
     // pop method
-    pop();
+    sp--;
     continue;
   }
   do_op_set_property_top_stack : {
     //
-    Value instance = PEEK_STACK(2);
+    Value instance = PEEK(2);
     if (!IS_INSTANCE(instance)) {
+      SAVE_STATE();
       runtime_error("cannot access property on a non instance value: ");
-      print_value(PEEK_STACK(2));
+      print_value(instance);
       return INTERPRET_RUNTIME_ERROR;
     }
-    Value key = PEEK_STACK(1);
+    Value key = PEEK(1);
     if (!IS_STRING(key)) {
+      SAVE_STATE();
       runtime_error("cannot access property with a non string key: ");
-      print_value(PEEK_STACK(1));
+      print_value(key);
       return INTERPRET_RUNTIME_ERROR;
     }
-    Value value = PEEK_STACK(0);
-    table_set(&AS_INSTANCE(instance)->fields, AS_STRING(key), value);
-    pop();
-    pop();
-    pop();
-    push(value);
+    Value value = PEEK(0);
+    SAVE_STATE();
+    // Used as a hash map, don't create a shape per key
+    instance_to_dictionary(AS_INSTANCE(instance));
+    instance_set_field(AS_INSTANCE(instance), AS_STRING(key), value);
+    sp -= 3;
+    PUSH(value);
     continue;
   }
 
   do_op_get_property_top_stack : {
     //
-    Value instance = PEEK_STACK(1);
+    Value instance = PEEK(1);
 
     if (IS_ARRAY(instance)) {
       ObjectArray* arr = AS_ARRAY(instance);
-      Value index = PEEK_STACK(0);
+      Value index = PEEK(0);
       if (!IS_NUMBER(index)) {
+        SAVE_STATE();
         runtime_error("expected number for index access on array...");
         return INTERPRET_RUNTIME_ERROR;
       }
       int number = (int)AS_NUMBER(index);
       if (number < 0 || number >= arr->array.count) {
+        SAVE_STATE();
         runtime_error("out of bounds");
         return INTERPRET_RUNTIME_ERROR;
       }
-      pop();
-      pop();
-      push(arr->array.values[number]);
+      sp -= 2;
+      PUSH(arr->array.values[number]);
       continue;
     }
 
     if (!IS_INSTANCE(instance)) {
+      SAVE_STATE();
       runtime_error("cannot access property on a non instance value: ");
-      print_value(PEEK_STACK(1));
+      print_value(instance);
       return INTERPRET_RUNTIME_ERROR;
     }
-    Value key = PEEK_STACK(0);
+    Value key = PEEK(0);
     if (!IS_STRING(key)) {
+      SAVE_STATE();
       runtime_error("cannot access property with a non string key: ");
-      print_value(PEEK_STACK(0));
+      print_value(key);
       return INTERPRET_RUNTIME_ERROR;
     }
     ObjectInstance* instance_obj = AS_INSTANCE(instance);
     Value value;
-    if (!table_get(&instance_obj->fields, AS_STRING(key), &value)) {
+    if (!instance_get_field(instance_obj, AS_STRING(key), &value)) {
       value = NIL_VAL;
     }
-    pop();
-    pop();
-    push(value);
+    sp -= 2;
+    PUSH(value);
     continue;
   }
 
   do_op_get_property : {
-    if (!IS_INSTANCE(PEEK_STACK(0))) {
+    if (!IS_INSTANCE(PEEK(0))) {
+      Value not_instance = PEEK(0);
+      SAVE_STATE();
       runtime_error("cannot access property on a non instance value: ");
-      print_value(PEEK_STACK(0));
+      print_value(not_instance);
       return INTERPRET_RUNTIME_ERROR;
     }
-    ObjectInstance* instance = AS_INSTANCE(PEEK_STACK(0));
-    ObjectString* name = AS_STRING(READ_CONSTANT_LONG());
-    Value v;
-    if (table_get(&instance->fields, name, &v)) {
-      // Pop instance
-      pop();
-      // Push the property value
-      push(v);
+    ObjectInstance* instance = AS_INSTANCE(PEEK(0));
+    ObjectString* name = READ_STRING();
+    InlineCache* cache = &caches[READ_U16()];
+    InlineCacheEntry* entry = inline_cache_lookup(cache, instance);
+    if (entry != NULL && entry->kind == CACHE_FIELD) {
+      // Replace the instance with the property value
+      PEEK(0) = instance->values[entry->slot];
       continue;
     }
-    if (bind_method(instance->klass, name)) {
+    SAVE_STATE();
+    if (entry != NULL) {
+      bind_closure((ObjectClosure*)AS_OBJECT(entry->method));
+      sp = vm.stack_top;
       continue;
     }
-    pop();
-    push(NIL_VAL);
+    Value value;
+    if (instance_get_field(instance, name, &value)) {
+      if (instance->shape != NULL) {
+        inline_cache_update(cache, instance->shape, CACHE_FIELD)->slot = shape_find_slot(instance->shape, name);
+      }
+      PEEK(0) = value;
+      continue;
+    }
+    Value method;
+    if (table_get(&instance->klass->methods, name, &method)) {
+      if (instance->shape != NULL) {
+        inline_cache_update(cache, instance->shape, CACHE_METHOD)->method = method;
+      }
+      bind_closure((ObjectClosure*)AS_OBJECT(method));
+      sp = vm.stack_top;
+      continue;
+    }
+    PEEK(0) = NIL_VAL;
     continue;
   }
 
   do_op_set_property : {
-    //
-    ObjectInstance* instance = AS_INSTANCE(PEEK_STACK(1));
-    Value set = PEEK_STACK(0);
-    ObjectString* name = AS_STRING(READ_CONSTANT_LONG());
-    table_set(&instance->fields, name, set);
-    pop();
-    pop();
-    push(set);
+    if (!IS_INSTANCE(PEEK(1))) {
+      Value not_instance = PEEK(1);
+      SAVE_STATE();
+      runtime_error("cannot set property on a non instance value: ");
+      print_value(not_instance);
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    ObjectInstance* instance = AS_INSTANCE(PEEK(1));
+    Value set = PEEK(0);
+    ObjectString* name = READ_STRING();
+    InlineCache* cache = &caches[READ_U16()];
+    InlineCacheEntry* entry = inline_cache_lookup(cache, instance);
+    if (entry != NULL && entry->kind == CACHE_FIELD) {
+      instance->values[entry->slot] = set;
+    } else if (entry != NULL && entry->slot < instance->capacity) {
+      // Adding a field, the slot is already there so just move to the next shape
+      instance->values[entry->slot] = set;
+      instance->shape = entry->next_shape;
+    } else {
+      SAVE_STATE();
+      ObjectShape* shape = instance->shape;
+      instance_set_field(instance, name, set);
+      if (shape != NULL && instance->shape != NULL) {
+        InlineCacheEntry* new_entry =
+            inline_cache_update(cache, shape, shape == instance->shape ? CACHE_FIELD : CACHE_TRANSITION);
+        new_entry->slot = shape_find_slot(instance->shape, name);
+        new_entry->next_shape = instance->shape;
+      }
+    }
+    sp -= 2;
+    PUSH(set);
     continue;
   }
 
   do_op_class : {
-    u16 index = (READ_BYTE() << 8) | READ_BYTE();
-    ObjectString* str = (ObjectString*)frame->function->function->chunk.constants.values[index].as.object;
-    push(OBJECT_VAL(new_class(str)));
+    u16 index = READ_U16();
+    ObjectString* str = AS_STRING(constants[index]);
+    SAVE_STATE();
+    ObjectClass* klass = new_class(str);
+    PUSH(OBJECT_VAL(klass));
     continue;
   }
 
   do_op_call : {
     u8 arg_count = READ_BYTE();
-    if (!call_value(PEEK_STACK(arg_count), arg_count)) {
+    SAVE_STATE();
+    if (!call_value(PEEK(arg_count), arg_count)) {
       return INTERPRET_RUNTIME_ERROR;
     }
-    if (run() == INTERPRET_RUNTIME_ERROR) return INTERPRET_RUNTIME_ERROR;
-    if (vm.frame_count == 0) return INTERPRET_OK;
+    // No recursion into run(), calls just push a CallFrame (natives and classes without
+    // `init` don't) and we continue dispatching from whatever frame is on top
+    LOAD_STATE();
     continue;
   }
 
   do_op_return : {
-    Value result = pop();
+    Value result = POP();
+    // Copy all of the open values to their upvalues before the slots get overwritten by the result.
+    close_upvalues(slots);
     vm.frame_count--;
     if (vm.frame_count == 0) {
       // Pop the frame
-      pop();
+      vm.stack_top = sp - 1;
       return INTERPRET_OK;
     }
-    vm.stack_top = frame->slots;
+    vm.stack_top = slots;
     push(result);
-    // Copy all of the open values to their upvalues.
-    close_upvalues(frame->slots);
-
-    //    frame = &vm.frames[vm.frame_count - 1];
-    return INTERPRET_OK;
+    // Back to the caller frame
+    LOAD_STATE();
+    continue;
   }
 
   do_op_pop : {
-    pop();
+    sp--;
     continue;
   }
 
   do_op_print : {
-    print_value(pop());
+    print_value(POP());
     printf("\n");
     continue;
   }
 
   do_op_assert : {
-    Value value = pop();
+    Value value = POP();
     if (!is_truthy(&value)) {
+      SAVE_STATE();
       runtime_error("[assert failed] non truthy value on assert");
       return INTERPRET_RUNTIME_ERROR;
     }
@@ -681,39 +1129,67 @@ static InterpretResult run() {
   }
 
   do_op_constant : {
-    Value constant = READ_CONSTANT();
-    push(constant);
+    PUSH(READ_CONSTANT());
     continue;
   }
 
   do_op_constant_long : {
-    Value constant = READ_CONSTANT_LONG();
-    push(constant);
+    PUSH(READ_CONSTANT_LONG());
     continue;
   }
 
   do_op_negate : {
-    Value* v = &PEEK_STACK(0);
+    Value* v = &PEEK(0);
     // Equivalent of popping a value from the stack, negating it, and then pushing it again
     if (!IS_NUMBER(*v)) {
+      SAVE_STATE();
       runtime_error("expected a number");
       return INTERPRET_RUNTIME_ERROR;
     }
-    v->as.number = -v->as.number;
+    *v = NUMBER_VAL(-AS_NUMBER(*v));
     continue;
   }
 
   do_op_add : {
-    Value left = PEEK_STACK(1);
-    Value right = PEEK_STACK(0);
+    Value left = PEEK(1);
+    Value right = PEEK(0);
     if (IS_STRING(left) && IS_STRING(right)) {
+      QUICKEN(OP_ADD_STR);
+      SAVE_STATE();
       concatenate();
+      sp = vm.stack_top;
     } else if (IS_NUMBER(left) && IS_NUMBER(right)) {
-      right = pop();
-      (&PEEK_STACK(0))->as.number = left.as.number + right.as.number;
+      QUICKEN(OP_ADD_NUM);
+      sp--;
+      PEEK(0) = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
     } else {
+      SAVE_STATE();
       runtime_error("error, operands either are strings or numbers");
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    continue;
+  }
+
+  do_op_add_num : {
+    Value left = PEEK(1);
+    Value right = PEEK(0);
+    if (!IS_NUMBER(left) || !IS_NUMBER(right)) {
+      QUICKEN(OP_ADD);
+      goto do_op_add;
     }
+    sp--;
+    PEEK(0) = NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right));
+    continue;
+  }
+
+  do_op_add_str : {
+    if (!IS_STRING(PEEK(1)) || !IS_STRING(PEEK(0))) {
+      QUICKEN(OP_ADD);
+      goto do_op_add;
+    }
+    SAVE_STATE();
+    concatenate();
+    sp = vm.stack_top;
     continue;
   }
 
@@ -732,50 +1208,88 @@ static InterpretResult run() {
     continue;
   }
 
+  do_op_negate_number : {
+    PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+    continue;
+  }
+
+  do_op_add_numbers : {
+    NUMBER_OP(NUMBER_VAL, +);
+    continue;
+  }
+
+  do_op_subtract_numbers : {
+    NUMBER_OP(NUMBER_VAL, -);
+    continue;
+  }
+
+  do_op_multiply_numbers : {
+    NUMBER_OP(NUMBER_VAL, *);
+    continue;
+  }
+
+  do_op_divide_numbers : {
+    NUMBER_OP(NUMBER_VAL, /);
+    continue;
+  }
+
+  do_op_greater_numbers : {
+    NUMBER_OP(BOOL_VAL, >);
+    continue;
+  }
+
+  do_op_less_numbers : {
+    NUMBER_OP(BOOL_VAL, <);
+    continue;
+  }
+
+  do_op_greater_equal_numbers : {
+    NUMBER_OP(NOT_BOOL_VAL, <);
+    continue;
+  }
+
+  do_op_less_equal_numbers : {
+    NUMBER_OP(NOT_BOOL_VAL, >);
+    continue;
+  }
+
   do_op_true : {
-    push(BOOL_VAL(true));
+    PUSH(BOOL_VAL(true));
     continue;
   }
 
   do_op_false : {
-    push(BOOL_VAL(false));
+    PUSH(BOOL_VAL(false));
     continue;
   }
 
   do_op_nil : {
-    push(NIL_VAL);
+    PUSH(NIL_VAL);
     continue;
   }
 
   do_op_equal : {
-    Value right = pop();
-    Value* left = &PEEK_STACK(0);
-    if (right.type != left->type) {
-      left->type = VAL_BOOL;
-      left->as.number = 0;
-      left->as.boolean = false;
-      continue;
-    }
-    if (IS_STRING(right)) {
-      ObjectString* right_s = AS_STRING(right);
-      ObjectString* left_s = AS_STRING(*left);
-      // we can compare memory addresses because we use the technique string interning (we reuse string mem. addresses)
-      left->as.boolean = (left_s == right_s) ||
-                         // Put memory 8 bytes to 0
-                         ((left->as.object = 0));
-      left->type = VAL_BOOL;
-      continue;
-    }
-    if (IS_BOOL(right)) {
-      left->as.boolean = right.as.boolean == left->as.boolean;
-      continue;
+    bool equal;
+    if (!values_equal(PEEK(1), PEEK(0), &equal)) {
+      SAVE_STATE();
+      runtime_error("can't evaluate these types with this type");
+      return INTERPRET_RUNTIME_ERROR;
     }
-    if (IS_NUMBER(right)) {
-      left->type = VAL_BOOL;
-      left->as.boolean = (left->as.number == right.as.number) || (left->as.number = 0);
-      continue;
+    sp--;
+    PEEK(0) = BOOL_VAL(equal);
+    continue;
+  }
+
+  do_op_not_equal : {
+    bool equal;
+    if (!values_equal(PEEK(1), PEEK(0), &equal)) {
+      SAVE_STATE();
+      runtime_error("can't evaluate these types with this type");
+      return INTERPRET_RUNTIME_ERROR;
     }
-    runtime_error("can't evaluate these types with this type");
+    sp--;
+    PEEK(0) = BOOL_VAL(!equal);
+    continue;
   }
 
   do_op_greater : {
@@ -788,128 +1302,462 @@ static InterpretResult run() {
     continue;
   }
 
+  do_op_greater_equal : {
+    BINARY_OP(NOT_BOOL_VAL, <);
+    continue;
+  }
+
+  do_op_less_equal : {
+    BINARY_OP(NOT_BOOL_VAL, >);
+    continue;
+  }
+
   do_op_bang : {
-    Value* top = &PEEK_STACK(0);
-    if (top->type == VAL_NIL) {
-      top->as.boolean = true;
-    } else if (top->type == VAL_BOOL) {
-      top->as.boolean = !top->as.boolean;
-    } else if (top->type == VAL_NUMBER) {
-      top->as.boolean = top->as.number <= 0.0001;
+    Value top = PEEK(0);
+    if (IS_NIL(top)) {
+      PEEK(0) = BOOL_VAL(true);
+    } else if (IS_BOOL(top)) {
+      PEEK(0) = BOOL_VAL(!AS_BOOL(top));
+    } else if (IS_NUMBER(top)) {
+      PEEK(0) = BOOL_VAL(AS_NUMBER(top) <= 0.0001);
     } else {
-      top->as.boolean = false;
+      PEEK(0) = BOOL_VAL(false);
     }
-    top->type = VAL_BOOL;
     continue;
   }
 
   do_op_define_global : {
     // ...
-    u16 index = (READ_BYTE() << 8) | READ_BYTE();
+    u8 index = READ_BYTE();
 #ifdef DEBUG_TRACE_EXECUTION
     printf("[DEFINE_GLOBAL] DEFINED GLOBAL: %d\n", index);
     printf("[DEFINE_GLOBAL] VALUE: ");
-    print_value(PEEK_STACK(0));
+    print_value(PEEK(0));
     printf("\n");
 #endif
-    // push_value(frame->function->function->chunk.constants)
-    vm.frames[0].function->function->global_array->values[index] = pop();
-    // table_set(&vm.globals, name, PEEK_STACK(0));
+    globals[index] = POP();
     continue;
   }
 
   do_op_get_global : {
-    u16 index = (READ_BYTE() << 8) | READ_BYTE();
-#ifdef DEBUG_TRACE_EXECUTION
-    // printf("[GET_GLOBAL] GOT GLOBAL: %s\n", name->chars);
-    // if (ok) {
-    //   printf("[GET_GLOBAL] VALUE:");
-    //   print_value(value);
-    // } else
-    //   printf("[GET_GLOBAL] VALUE NOT FOUND");
-#endif
-    if (index >= vm.frames[0].function->function->global_array->count) {
+    u8 index = READ_BYTE();
+    if (index >= global_count) {
+      SAVE_STATE();
       runtime_error("undefined variable %d", index);
       return INTERPRET_RUNTIME_ERROR;
     }
-    push(vm.frames[0].function->function->global_array->values[index]);
+    PUSH(globals[index]);
     continue;
   }
 
   do_op_set_global : {
     // ...
-    u16 index = (READ_BYTE() << 8) | READ_BYTE();
-    if (index >= frame->function->function->chunk.constants.count) {
+    u8 index = READ_BYTE();
+    if (index >= global_count) {
+      SAVE_STATE();
       runtime_error("undefined variable");
       return INTERPRET_RUNTIME_ERROR;
     }
-    vm.frames[0].function->function->global_array->values[index] =
-        PEEK_STACK(0);  // << holy fuck, be careful, this SHOULD be popped by the
-                        // variable declaration or expression_stmt Not by this operation
+    globals[index] = PEEK(0);  // << holy fuck, be careful, this SHOULD be popped by the
+                               // variable declaration or expression_stmt Not by this operation
     continue;
   }
 
   do_op_get_local : {
     //
-    u16 slot = (READ_BYTE() << 8) | READ_BYTE();
-    push(frame->slots[slot]);
+    PUSH(slots[READ_BYTE()]);
     continue;
   }
   do_op_set_local : {
-    u16 slot = (READ_BYTE() << 8) | READ_BYTE();
-    frame->slots[slot] = PEEK_STACK(0);
+    slots[READ_BYTE()] = PEEK(0);
     continue;
   }
 
+  do_op_get_local_0 : {
+    PUSH(slots[0]);
+    continue;
+  }
+
+  do_op_get_local_1 : {
+    PUSH(slots[1]);
+    continue;
+  }
+
+  do_op_get_local_2 : {
+    PUSH(slots[2]);
+    continue;
+  }
+
+  do_op_get_local_3 : {
+    PUSH(slots[3]);
+    continue;
+  }
+
+  // The same variable access opcodes with a 2 bytes index
+  do_op_wide : {
+    u8 op_code = READ_BYTE();
+    u16 index = READ_U16();
+    switch (op_code) {
+      case OP_GET_LOCAL:
+        PUSH(slots[index]);
+        continue;
+      case OP_SET_LOCAL:
+        slots[index] = PEEK(0);
+        continue;
+      case OP_GET_UPVALUE:
+        PUSH(*AS_UPVALUE(frame->function->upvalues[index])->location);
+        continue;
+      case OP_SET_UPVALUE:
+        *AS_UPVALUE(frame->function->upvalues[index])->location = PEEK(0);
+        continue;
+      case OP_INLINE_RETURN: {
+        Value result = POP();
+        sp = slots + index;
+        PUSH(result);
+        continue;
+      }
+      case OP_DEFINE_GLOBAL:
+        globals[index] = POP();
+        continue;
+      case OP_GET_GLOBAL:
+      case OP_SET_GLOBAL:
+        if (index >= global_count) {
+          SAVE_STATE();
+          runtime_error("undefined variable %d", index);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (op_code == OP_GET_GLOBAL) {
+          PUSH(globals[index]);
+        } else {
+          globals[index] = PEEK(0);
+        }
+        continue;
+    }
+    SAVE_STATE();
+    runtime_error("unknown wide opcode %d", op_code);
+    return INTERPRET_RUNTIME_ERROR;
+  }
+
   do_op_jump_if_false : {
-#ifdef DEBUG_TRACE_EXECUTION
-    // TODO
+    u16 offset = READ_U16();
+    ip += offset * !is_truthy(&PEEK(0));
+    continue;
+  }
+
+  do_op_pop_jump_if_false : {
+    u16 offset = READ_U16();
+    Value condition = POP();
+    ip += offset * !is_truthy(&condition);
+    continue;
+  }
+
+  do_op_jump_if_equal : {
+    EQUAL_JUMP(true);
+    continue;
+  }
+
+  do_op_jump_if_not_equal : {
+    EQUAL_JUMP(false);
+    continue;
+  }
+
+  do_op_jump_if_not_less : {
+    COMPARE_JUMP(<, false);
+    continue;
+  }
+
+  do_op_jump_if_not_less_equal : {
+    COMPARE_JUMP(>, true);
+    continue;
+  }
+
+  do_op_jump_if_not_greater : {
+    COMPARE_JUMP(>, false);
+    continue;
+  }
+
+  do_op_jump_if_not_greater_equal : {
+    COMPARE_JUMP(<, true);
+    continue;
+  }
+
+  do_op_jump_if_not_less_numbers : {
+    NUMBER_COMPARE_JUMP(<, false);
+    continue;
+  }
+
+  do_op_jump_if_not_less_equal_numbers : {
+    NUMBER_COMPARE_JUMP(>, true);
+    continue;
+  }
+
+  do_op_jump_if_not_greater_numbers : {
+    NUMBER_COMPARE_JUMP(>, false);
+    continue;
+  }
+
+  do_op_jump_if_not_greater_equal_numbers : {
+    NUMBER_COMPARE_JUMP(<, true);
+    continue;
+  }
+
+  do_op_switch : {
+    SwitchTable* table = &frame->function->function->switches[READ_U16()];
+    u16 arm;
+    if (!switch_arm(table, PEEK(0), &arm)) {
+      SAVE_STATE();
+      // At the comparisons of the range the value fails
+      runtime_error_at_line(table->patterns[table->first_range].line, "Operands %d, %d, must be numbers",
+                            VALUE_TYPE(PEEK(0)), VAL_NUMBER);
+      return INTERPRET_RUNTIME_ERROR;
+    }
+#ifdef QW_THREADED_CODE
+    ip = code + table->threaded_targets[arm];
+#else
+    ip = code + table->targets[arm];
 #endif
-    Value value = PEEK_STACK(0);
-    u16 offset = ((READ_BYTE() << 8) | READ_BYTE());
-    frame->ip += offset * !is_truthy(&value);
-    // #if DEBUG_TRACE_EXECUTION
-    //     printf("[OP_JUMP_IF_FALSE] Jumping %d -> %d by %d\n", (frame->ip - initial) - offset - 3, (frame->ip -
-    //     initial),
-    //            offset + 3);
-    // #endif
+    continue;
+  }
+
+  do_op_instance : {
+    // inline_calls() only writes it after loading a class
+    SAVE_STATE();
+    ObjectInstance* instance = new_instance(AS_CLASS(PEEK(0)));
+    PEEK(0) = OBJECT_VAL(instance);
+    continue;
+  }
+
+  do_op_inline_return : {
+    u8 slot = READ_BYTE();
+    Value result = POP();
+    // The callee creates no closures, so no upvalue points into the dropped slots
+    sp = slots + slot;
+    PUSH(result);
     continue;
   }
 
   do_op_jump : {
-    u16 offset = ((READ_BYTE() << 8) | READ_BYTE());
-    frame->ip += offset;
-    // #if DEBUG_TRACE_EXECUTION
-    //     printf("[OP_JUMP] Jumping %d -> %d by %d\n", (frame->ip - initial) - offset - 3, (frame->ip - initial),
-    //     offset + 3);
-    //#endif
+    u16 offset = READ_U16();
+    ip += offset;
     continue;
   }
     // var x = 2; when x { 4 | 3 | 1-> print "really good"; 3 | 10 | 32 ->print "cool"; nothing -> print "bad"; }
   do_op_jump_back : {
-    u16 offset = ((READ_BYTE() << 8) | READ_BYTE());
-    frame->ip -= offset;
+    u16 offset = READ_U16();
+    ip -= offset;
+    COUNT_LOOP();
+    continue;
+  }
+  // Superinstructions skip the opcode bytes of the instructions they replaced with `ip++`. When the
+  // operands aren't numbers they push them and let the generic handler deal with it
+
+  do_op_get_local_constant : {
+    PUSH(slots[READ_BYTE()]);
+    ip++;
+    PUSH(READ_CONSTANT());
+    continue;
+  }
+
+  do_op_add_local_local : {
+    Value left = slots[READ_BYTE()];
+    ip++;
+    Value right = slots[READ_BYTE()];
+    ip++;
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {
+      PUSH(NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)));
+      continue;
+    }
+    PUSH(left);
+    PUSH(right);
+    goto do_op_add;
+  }
+
+  do_op_add_local_constant : {
+    Value left = slots[READ_BYTE()];
+    ip++;
+    Value right = READ_CONSTANT();
+    ip++;
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {
+      PUSH(NUMBER_VAL(AS_NUMBER(left) + AS_NUMBER(right)));
+      continue;
+    }
+    PUSH(left);
+    PUSH(right);
+    goto do_op_add;
+  }
+
+  do_op_subtract_local_constant : {
+    Value left = slots[READ_BYTE()];
+    ip++;
+    Value right = READ_CONSTANT();
+    ip++;
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {
+      PUSH(NUMBER_VAL(AS_NUMBER(left) - AS_NUMBER(right)));
+      continue;
+    }
+    PUSH(left);
+    PUSH(right);
+    goto do_op_substract;
+  }
+
+  do_op_less_local_constant : {
+    Value left = slots[READ_BYTE()];
+    ip++;
+    Value right = READ_CONSTANT();
+    ip++;
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {
+      PUSH(BOOL_VAL(AS_NUMBER(left) < AS_NUMBER(right)));
+      continue;
+    }
+    PUSH(left);
+    PUSH(right);
+    goto do_op_less;
+  }
+
+  do_op_jump_if_not_less_local_constant : {
+    Value left = slots[READ_BYTE()];
+    ip++;
+    Value right = READ_CONSTANT();
+    ip++;
+    if (IS_NUMBER(left) && IS_NUMBER(right)) {
+      u16 offset = READ_U16();
+      if (!(AS_NUMBER(left) < AS_NUMBER(right))) ip += offset;
+      continue;
+    }
+    PUSH(left);
+    PUSH(right);
+    goto do_op_jump_if_not_less;
+  }
+
+  do_op_set_local_pop : {
+    slots[READ_BYTE()] = POP();
+    ip++;
     continue;
   }
+
+  do_op_set_global_pop : {
+    u8 index = READ_BYTE();
+    ip++;
+    if (index >= global_count) {
+      SAVE_STATE();
+      runtime_error("undefined variable");
+      return INTERPRET_RUNTIME_ERROR;
+    }
+    globals[index] = POP();
+    continue;
+  }
+
+  do_op_jump_if_false_pop : {
+    u16 offset = READ_U16();
+    ip++;
+    if (is_truthy(&PEEK(0))) {
+      sp--;
+    } else {
+      // The jump is relative to the end of OP_JUMP_IF_FALSE, one byte before the OP_POP
+      ip += offset - 1;
+    }
+    continue;
+  }
+
+  do_op_pop_jump_back : {
+    sp--;
+    ip++;
+    u16 offset = READ_U16();
+    ip -= offset;
+    COUNT_LOOP();
+    continue;
+  }
+
+  // Loop header of a hot loop: on-stack replacement into the tiers above the interpreter
+  do_loop_hot : {
+#ifdef QW_TRACING
+    if (jit_enabled && frame->function->function->name == NULL) goto do_trace_loop;
+#endif
+#ifdef QW_JIT
+    if (jit_enabled) goto do_jit_osr;
+#endif
+#ifndef QW_THREADED_CODE
+    if (aot_entry(frame->function->function, (u32)(ip - code))) goto do_aot_enter;
+#endif
+    continue;
+  }
+
+#ifndef QW_THREADED_CODE
+  do_aot_enter : {
+    ObjectFunction* function = frame->function->function;
+    // The C code doesn't allocate, the VM state doesn't need to be saved
+    JitState state = {sp, slots, constants, globals, global_count};
+    u32 offset = function->aot_code(&state, (u32)(ip - code));
+    sp = state.sp;
+    ip = code + offset;
+    // Interprets the instruction it stopped at
+    continue;
+  }
+#endif
+
+#ifdef QW_JIT
+  do_jit_enter : {
+    // Functions enter native code once they are hot, before that only from their hot loops
+    ObjectFunction* function = frame->function->function;
+    if (function->jit_code == NULL && function->call_count < tier_call_threshold) continue;
+  }
+  do_jit_osr : {
+    ObjectFunction* function = frame->function->function;
+    u32 offset = (u32)(ip - code);
+    if (!jit_has_entry(function, offset)) continue;
+    // Compiling allocates
+    SAVE_STATE();
+    JitState state = {sp, slots, constants, globals, global_count};
+    offset = jit_run(function, &state, offset);
+    sp = state.sp;
+    ip = code + offset;
+    // Interprets the instruction native code stopped at
+    continue;
+  }
+#endif
+
+#ifdef QW_TRACING
+  do_trace_loop : {
+    ObjectFunction* function = frame->function->function;
+    if (trace_failed(function, (u32)(ip - code))) goto do_jit_osr;
+    // Recording and compiling allocate
+    SAVE_STATE();
+    JitState state = {sp, slots, constants, globals, global_count};
+    u32 resume;
+    if (trace_loop(function, &state, (u32)(ip - code), &resume)) {
+      sp = state.sp;
+      ip = code + resume;
+      continue;
+    }
+    goto do_jit_osr;
+  }
+#endif
+
   do_push_again : {
-    push(PEEK_STACK(0));
+    Value top = PEEK(0);
+    PUSH(top);
     continue;
   }
 
   do_op_close_upvalue : {
-    close_upvalues(vm.stack_top - 1);
-    pop();
+    close_upvalues(sp - 1);
+    sp--;
     continue;
   }
 
   do_op_get_upvalue : {
-    push(*frame->function->upvalues[(READ_BYTE() << 8) | READ_BYTE()]->location);
+    PUSH(*AS_UPVALUE(frame->function->upvalues[READ_BYTE()])->location);
+    continue;
+  }
+
+  do_op_get_captured : {
+    PUSH(frame->function->upvalues[READ_BYTE()]);
     continue;
   }
 
   do_op_set_upvalue : {
-    u16 slot = (READ_BYTE() << 8) | READ_BYTE();
-    *frame->function->upvalues[slot]->location = PEEK_STACK(0);
+    u8 slot = READ_BYTE();
+    *AS_UPVALUE(frame->function->upvalues[slot])->location = PEEK(0);
     continue;
   }
 
@@ -918,35 +1766,60 @@ static InterpretResult run() {
   do_op_closure : {
     Value constant = READ_CONSTANT_LONG();
 
-    ObjectFunction* function = (ObjectFunction*)constant.as.object;
+    ObjectFunction* function = (ObjectFunction*)AS_OBJECT(constant);
+    SAVE_STATE();
     ObjectClosure* closure = new_closure(function);
-    push(OBJECT_VAL(closure));
+    PUSH(OBJECT_VAL(closure));
+    // The closure must be reachable while capturing allocates upvalues
+    vm.stack_top = sp;
 #ifdef DEBUG_TRACE_EXECUTION
     printf("[OP_CLOSURE] Capturing upvalues: %d\n", closure->upvalue_count);
 #endif
     for (u32 i = 0; i < closure->upvalue_count; ++i) {
       // Check if it's just above this
-      u8 is_local = READ_BYTE();
+      u8 kind = READ_BYTE();
       // Index (maybe stack, maybe upvalues)
       u8 index = READ_BYTE();
 #ifdef DEBUG_TRACE_EXECUTION
-      printf("[OP_CLOSURE] Capturing upvalue is_local: %d, index: %d\n", is_local, index);
+      printf("[OP_CLOSURE] Capturing upvalue kind: %d, index: %d\n", kind, index);
 #endif
-      if (is_local) {
-        closure->upvalues[i] = capture_upvalue(index + frame->slots);
-      } else {
-        closure->upvalues[i] = frame->function->upvalues[index];
+      switch (kind) {
+        case CAPTURE_LOCAL:
+          closure->upvalues[i] = OBJECT_VAL(capture_upvalue(index + slots));
+          break;
+        case CAPTURE_LOCAL_VALUE:
+          closure->upvalues[i] = slots[index];
+          break;
+        default:
+          closure->upvalues[i] = frame->function->upvalues[index];
+          break;
       }
     }
     continue;
   }
   }
 #undef READ_BYTE
+#undef READ_U16
 #undef READ_STRING
 #undef READ_CONSTANT
 #undef READ_CONSTANT_LONG
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SAVE_STATE
+#undef LOAD_STATE
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef NUMBER_COMPARE_JUMP
+#undef COMPARE_JUMP
+#undef QUICKEN
+#undef EQUAL_JUMP
 #undef DISPATCH
+#undef CURRENT_OFFSET
+#undef TRANSLATE_FRAME
+#undef JIT_ENTER
+#undef AOT_ENTER
+#undef COUNT_LOOP
 }
 
 InterpretResult interpret(Chunk* chunk) {
@@ -957,12 +1830,8 @@ InterpretResult interpret(Chunk* chunk) {
 
 Value* stack_vm() { return vm.stack; }
 
-InterpretResult interpret_source(const char* source) {
-  ObjectFunction* obj;
-  init_vm();
-  if (!(obj = compile(source))) {
-    return INTERPRET_COMPILER_ERROR;
-  }
+/// Runs the top-level function `obj` of a script
+static InterpretResult interpret_function(ObjectFunction* obj) {
   vm.globals = *obj->global_array;
   vm.stack_top = vm.stack;
   push(OBJECT_VAL(obj));
@@ -971,7 +1840,37 @@ InterpretResult interpret_source(const char* source) {
   push(OBJECT_VAL(closure));
   call_value(OBJECT_VAL(closure), 0);
   InterpretResult ok = run();
-  free_vm();
+  if (tier_report) print_hot_functions();
+#ifdef DEBUG_INLINE_CACHE_STATS
+  print_inline_cache_stats(obj);
+#endif
+#ifdef DEBUG_OPCODE_PROFILE
+  print_op_code_profile();
+#endif
+  // `obj` is freed along with the rest of the objects
   free_value_array(obj->global_array);
+  free_vm();
   return ok;
 }
+
+InterpretResult interpret_source(const char* source) {
+  ObjectFunction* obj;
+  init_vm();
+  if (!(obj = compile(source))) {
+    return INTERPRET_COMPILER_ERROR;
+  }
+  return interpret_function(obj);
+}
+
+InterpretResult interpret_image(const struct Image* image) {
+  init_vm();
+  return interpret_function(load_image(image));
+}
+
+InterpretResult interpret_aot(const struct AotProgram* program) {
+  init_vm();
+  ObjectFunction* obj = load_aot_script(program);
+  // The C code is ready from the start, loops enter it on their first interpreted back edge
+  tier_loop_threshold = 0;
+  return interpret_function(obj);
+}
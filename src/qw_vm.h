@@ -11,10 +11,14 @@ typedef struct {
   ObjectClosure* function;
 
   // Points to the instruction pointer
-  u8* ip;
+  CodeUnit* ip;
 
   // Points to the start of the stack function
   Value* slots;
+
+  // Cached `function->function->chunk.constants.values` so the dispatch loop
+  // doesn't have to chase the closure -> function -> chunk chain
+  Value* constants;
 } CallFrame;
 
 #define FRAMES_MAX 64
@@ -80,6 +84,14 @@ void push(Value value);
 Value* stack_vm(void);
 InterpretResult interpret_source(const char* source);
 
+struct Image;
+/// Runs a script from its compiled image, mapped by map_image() (see qw_image.h)
+InterpretResult interpret_image(const struct Image* image);
+
+struct AotProgram;
+/// Runs a script compiled ahead of time (see qw_aot.h)
+InterpretResult interpret_aot(const struct AotProgram* program);
+
 Value pop(void);
 
 InterpretResult interpret(Chunk* chunk);
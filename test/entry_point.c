@@ -1,5 +1,13 @@
+#include <unistd.h>
+
+#include "../src/qw_aot.h"
 #include "../src/qw_chunk.h"
+#include "../src/qw_compiler.h"
+#include "../src/qw_image.h"
+#include "../src/qw_ir.h"
+#include "../src/qw_jit.h"
 #include "../src/qw_scanner.h"
+#include "../src/qw_tier.h"
 #include "../src/qw_vm.h"
 #include "greatest.h"
 
@@ -114,7 +122,7 @@ TEST test_vm_stack(void) {
   }
 
   for (int i = STACK_MAX - 1; i >= 0; i--) {
-    ASSERT_EQ(pop().as.number, i);
+    ASSERT_EQ(AS_NUMBER(pop()), i);
   }
 
   free_vm();
@@ -130,7 +138,7 @@ TEST test_vm_ins_negate(void) {
   write_chunk(&ch, OP_NEGATE, 1);
   write_chunk(&ch, OP_RETURN, 1);
   interpret(&ch);
-  ASSERT_EQ(stack_vm()[0].as.number, -1);
+  ASSERT_EQ(AS_NUMBER(stack_vm()[0]), -1);
   free_chunk(&ch);
   free_vm();
   PASS();
@@ -154,7 +162,7 @@ TEST test_vm_ins_binary_ops(void) {
     write_chunk(&ch, tests[i].code, 1);
     write_chunk(&ch, OP_RETURN, 1);
     interpret(&ch);
-    ASSERT_EQ(stack_vm()[0].as.number, tests[i].expected);
+    ASSERT_EQ(AS_NUMBER(stack_vm()[0]), tests[i].expected);
     free_chunk(&ch);
     free_vm();
   }
@@ -179,7 +187,7 @@ TEST test_large_op(void) {
   write_chunk(&ch, OP_SUBTRACT, 1);
   write_chunk(&ch, OP_RETURN, 1);
   interpret(&ch);
-  ASSERT_EQ(stack_vm()[0].as.number, 27);
+  ASSERT_EQ(AS_NUMBER(stack_vm()[0]), 27);
   free_chunk(&ch);
   free_vm();
   PASS();
@@ -210,11 +218,21 @@ TEST test_lines(void) {
   PASS();
 }
 
+static const u32 number_of_scripts = 25;  // 26 * 4;
+static const char* scripts[] = {"./scripts/array.qw.test",   "./scripts/class.qw.test",        "./scripts/epic_closure.qw.test",
+                                "./scripts/closure.qw.test", "./scripts/vec.qw.test",          "./scripts/scopes.qw.test",
+                                "./scripts/fib.qw.test",     "./scripts/gc01.qw.test",         "./scripts/inline_cache.qw.test",
+                                "./scripts/shape.qw.test",   "./scripts/superinstructions.qw.test",
+                                "./scripts/comparison.qw.test", "./scripts/quickening.qw.test",
+                                "./scripts/wide.qw.test",    "./scripts/trace.qw.test",
+                                "./scripts/when.qw.test",    "./scripts/folding.qw.test",
+                                "./scripts/dead_code.qw.test", "./scripts/switch.qw.test",
+                                "./scripts/captures.qw.test",
+                                "./scripts/inline.qw.test",        "./scripts/invariants.qw.test",
+                                "./scripts/globals.qw.test",       "./scripts/numbers.qw.test",
+                                "./scripts/lazy.qw.test"};
+
 TEST test_file_compilations() {
-  const u32 number_of_scripts = 8;  // 26 * 4;
-  const char* scripts[] = {"./scripts/array.qw.test",   "./scripts/class.qw.test", "./scripts/epic_closure.qw.test",
-                           "./scripts/closure.qw.test", "./scripts/vec.qw.test",   "./scripts/scopes.qw.test",
-                           "./scripts/fib.qw.test",     "./scripts/gc01.qw.test",  "./scripts/when.qw.test"};
   for (u16 i = 0; i < number_of_scripts; ++i) {
     char* f = read_file(scripts[i]);
     InterpretResult result = interpret_source(f);
@@ -224,6 +242,349 @@ TEST test_file_compilations() {
   PASS();
 }
 
+/// Same scripts, with the bytecode as the compiler emitted it (no IR passes)
+TEST test_file_compilations_no_optimize() {
+  optimize = false;
+  for (u16 i = 0; i < number_of_scripts; ++i) {
+    char* f = read_file(scripts[i]);
+    InterpretResult result = interpret_source(f);
+    ASSERT_EQ(result, INTERPRET_OK);
+    free(f);
+  }
+  optimize = true;
+  PASS();
+}
+
+/// Same scripts, with the function bodies compiled on their first call
+TEST test_file_compilations_lazy() {
+  lazy_compile = true;
+  for (u16 i = 0; i < number_of_scripts; ++i) {
+    char* f = read_file(scripts[i]);
+    InterpretResult result = interpret_source(f);
+    ASSERT_EQ(result, INTERPRET_OK);
+    free(f);
+  }
+  // Until they are called the functions have no code
+  const char* source = "fun unused() { return 1; } fun used() { return 2; } assert used() == 2;";
+  init_vm();
+  ObjectFunction* script = compile(source);
+  ASSERT(script != NULL);
+  for (u32 i = 0; i < script->chunk.constants.count; i++) {
+    Value constant = script->chunk.constants.values[i];
+    if (!IS_OBJECT(constant) || OBJECT_TYPE(constant) != OBJECT_FUNCTION) continue;
+    ObjectFunction* function = (ObjectFunction*)AS_OBJECT(constant);
+    ASSERT(function->lazy != NULL);
+    ASSERT_EQ(function->chunk.count, 0);
+  }
+  free_value_array(script->global_array);
+  free_vm();
+  // Names declared in a skipped body don't capture the variables they shadow
+  source = "fun outer() { var n = 0; fun inner(m) { var n = 5; n = n + m; fun n2() {} return n; } return n; }";
+  init_vm();
+  script = compile(source);
+  ASSERT(script != NULL);
+  ObjectFunction* outer = NULL;
+  for (u32 i = 0; i < script->chunk.constants.count; i++) {
+    Value constant = script->chunk.constants.values[i];
+    if (IS_OBJECT(constant) && OBJECT_TYPE(constant) == OBJECT_FUNCTION) outer = (ObjectFunction*)AS_OBJECT(constant);
+  }
+  ASSERT(outer != NULL);
+  ASSERT(compile_function_body(outer));
+  bool found_inner = false;
+  for (u32 i = 0; i < outer->chunk.constants.count; i++) {
+    Value constant = outer->chunk.constants.values[i];
+    if (!IS_OBJECT(constant) || OBJECT_TYPE(constant) != OBJECT_FUNCTION) continue;
+    ASSERT_EQ(((ObjectFunction*)AS_OBJECT(constant))->upvalue_count, 0);
+    found_inner = true;
+  }
+  ASSERT(found_inner);
+  free_value_array(script->global_array);
+  free_vm();
+  lazy_compile = false;
+  PASS();
+}
+
+#ifdef QW_JIT
+/// Same scripts, running as native code once hot and then from the start
+TEST test_file_compilations_jit() {
+  jit_enabled = true;
+  for (u32 eager = 0; eager < 2; eager++) {
+    tier_call_threshold = eager ? 0 : TIER_CALL_THRESHOLD;
+    tier_loop_threshold = eager ? 0 : TIER_LOOP_THRESHOLD;
+    for (u16 i = 0; i < number_of_scripts; ++i) {
+      char* f = read_file(scripts[i]);
+      InterpretResult result = interpret_source(f);
+      ASSERT_EQ(result, INTERPRET_OK);
+      free(f);
+    }
+  }
+  jit_enabled = false;
+  tier_call_threshold = TIER_CALL_THRESHOLD;
+  tier_loop_threshold = TIER_LOOP_THRESHOLD;
+  PASS();
+}
+#endif
+
+/// Same scripts, written as C programs that must compile (`make check` also builds and runs them)
+TEST test_file_emit_c() {
+  for (u16 i = 0; i < number_of_scripts; ++i) {
+    char* f = read_file(scripts[i]);
+    init_vm();
+    ObjectFunction* script = compile(f);
+    ASSERT(script != NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/qw_emit_c_%d.c", (int)getpid());
+    FILE* out = fopen(path, "w");
+    ASSERT(out != NULL);
+    ASSERT(emit_c(script, out));
+    fclose(out);
+    char command[128];
+    snprintf(command, sizeof(command), "cc -std=c11 -Wall -Werror -fsyntax-only -I../src %s", path);
+    int status = system(command);
+    remove(path);
+    ASSERT_EQm(scripts[i], 0, status);
+    free_value_array(script->global_array);
+    free_vm();
+    free(f);
+  }
+  PASS();
+}
+
+/// Functions of a call-heavy script get C code too, entered at their start
+TEST test_emit_c_calls() {
+  const char* source = "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); } assert fib(10) == 55;";
+  init_vm();
+  ObjectFunction* script = compile(source);
+  ASSERT(script != NULL);
+  FILE* out = tmpfile();
+  ASSERT(emit_c(script, out));
+  free_value_array(script->global_array);
+  free_vm();
+  long size = ftell(out);
+  char* c = calloc(size + 1, 1);
+  rewind(out);
+  ASSERT_EQ(fread(c, 1, size, out), (size_t)size);
+  fclose(out);
+  // The script is function 0, fib function 1
+  ASSERT(strstr(c, "static u32 native_0(") != NULL);
+  ASSERT(strstr(c, "static u32 native_1(") != NULL);
+  ASSERT(strstr(c, "native_1, native_entries_1};") != NULL);
+  free(c);
+  PASS();
+}
+
+/// Same scripts, run from their compiled image
+TEST test_file_images() {
+  for (u16 i = 0; i < number_of_scripts; ++i) {
+    char* f = read_file(scripts[i]);
+    init_vm();
+    ObjectFunction* script = compile(f);
+    ASSERT(script != NULL);
+    FILE* file = tmpfile();
+    ASSERT(write_image(script, hash_source(f), file));
+    free_value_array(script->global_array);
+    free_vm();
+    Image image;
+    ASSERT(map_image(&image, file));
+    ASSERT_EQ(image.header->source_hash, hash_source(f));
+    ASSERT_EQ(interpret_image(&image), INTERPRET_OK);
+    unmap_image(&image);
+    // A cut image is rejected
+    ASSERT_EQ(ftruncate(fileno(file), image.size / 2), 0);
+    ASSERT_FALSE(map_image(&image, file));
+    fclose(file);
+    free(f);
+  }
+  PASS();
+}
+
+/// Returns how many OP_INLINE_RETURN `function` has
+static u32 count_inline_returns(ObjectFunction* function) {
+  u32 count = 0;
+  for (u32 offset = 0; offset < function->chunk.count; offset += instruction_length(&function->chunk, offset)) {
+    if (function->chunk.code[offset] == OP_INLINE_RETURN) count++;
+  }
+  return count;
+}
+
+/// Returns how many OP_INLINE_RETURN the script of `source` and its functions have
+static u32 count_script_inline_returns(const char* source) {
+  init_vm();
+  ObjectFunction* script = compile(source);
+  u32 count = count_inline_returns(script);
+  for (u32 i = 0; i < script->chunk.constants.count; i++) {
+    Value constant = script->chunk.constants.values[i];
+    if (!IS_OBJECT(constant)) continue;
+    if (OBJECT_TYPE(constant) == OBJECT_FUNCTION) count += count_inline_returns((ObjectFunction*)AS_OBJECT(constant));
+    if (OBJECT_TYPE(constant) == OBJECT_CLOSURE) count += count_inline_returns(((ObjectClosure*)AS_OBJECT(constant))->function);
+  }
+  free_value_array(script->global_array);
+  free_vm();
+  return count;
+}
+
+/// Functions that can call themselves, directly or through others, aren't inlined
+TEST test_recursive_functions_not_inlined() {
+  const char* recursive = "fun deep(n) { if (n == 0) return 0; return deep(n - 1) + 1; }"
+                          "fun ev(n) { if (n == 0) return true; return od(n - 1); }"
+                          "fun od(n) { if (n == 0) return false; return ev(n - 1); }"
+                          "print deep(3); print ev(4); print od(4);";
+  ASSERT_EQ(count_script_inline_returns(recursive), 0);
+  // Other calls still are
+  char source[512];
+  snprintf(source, sizeof(source), "%s fun square(n) { return n * n; } print square(3);", recursive);
+  ASSERT_EQ(count_script_inline_returns(source), 1);
+  PASS();
+}
+
+/// Writes `size` bytes of an image into a new file and maps it, with the checksum of its bytes
+static bool map_image_bytes(u8* bytes, u32 size) {
+  // FNV-1a, as write_image() computes it
+  u64 checksum = 14695981039346656037ull;
+  for (u32 i = sizeof(ImageHeader); i < size; i++) checksum = (checksum ^ bytes[i]) * 1099511628211ull;
+  ((ImageHeader*)bytes)->checksum = checksum;
+  FILE* file = tmpfile();
+  fwrite(bytes, 1, size, file);
+  fflush(file);
+  Image image;
+  bool mapped = map_image(&image, file);
+  if (mapped) unmap_image(&image);
+  fclose(file);
+  return mapped;
+}
+
+/// Corrupted images are rejected before anything runs from them
+TEST test_corrupted_images() {
+  const char* source = "var x = 3; when x { 1 -> print 1; 2..5 -> print 2; \"a\" -> print 3; nothing -> print 4; }";
+  init_vm();
+  ObjectFunction* script = compile(source);
+  ASSERT(script != NULL);
+  FILE* file = tmpfile();
+  ASSERT(write_image(script, hash_source(source), file));
+  free_value_array(script->global_array);
+  free_vm();
+  u32 size = (u32)ftell(file);
+  u8* bytes = malloc(size);
+  rewind(file);
+  ASSERT_EQ(fread(bytes, 1, size, file), size);
+  fclose(file);
+  ASSERT(map_image_bytes(bytes, size));
+
+  // Any byte changed after the header fails the checksum
+  u8* changed = malloc(size);
+  memcpy(changed, bytes, size);
+  changed[size - 1] ^= 1;
+  FILE* corrupted = tmpfile();
+  fwrite(changed, 1, size, corrupted);
+  fflush(corrupted);
+  Image image;
+  ASSERT_FALSE(map_image(&image, corrupted));
+  fclose(corrupted);
+
+  // Switch tables that don't match the constants, even with the right checksum: the patterns are
+  // the number 1, the range 2..5 and the string "a"
+  const ImageFunction* function = (const ImageFunction*)(bytes + sizeof(ImageHeader));
+  ASSERT_EQ(function->switch_count, 1);
+  const ImageSwitch* table = (const ImageSwitch*)(bytes + function->switches);
+  ASSERT_EQ(table->pattern_count, 3);
+  const SwitchPattern* patterns = (const SwitchPattern*)(bytes + table->patterns);
+  SwitchPattern* pattern;
+  for (u32 i = 0; i < table->pattern_count; i++) {
+    memcpy(changed, bytes, size);
+    pattern = (SwitchPattern*)(changed + table->patterns) + i;
+    pattern->arm = table->arm_count + 1;
+    ASSERT_FALSE(map_image_bytes(changed, size));
+    memcpy(changed, bytes, size);
+    memset(&pattern->range, 2, 1);
+    ASSERT_FALSE(map_image_bytes(changed, size));
+    memcpy(changed, bytes, size);
+    pattern->low = function->constant_count;
+    ASSERT_FALSE(map_image_bytes(changed, size));
+  }
+  memcpy(changed, bytes, size);
+  pattern = (SwitchPattern*)(changed + table->patterns) + 1;
+  pattern->high = function->constant_count;
+  ASSERT_FALSE(map_image_bytes(changed, size));
+  // A range of strings
+  pattern->high = pattern->low = patterns[2].low;
+  ASSERT_FALSE(map_image_bytes(changed, size));
+  u32* targets = (u32*)(changed + table->targets);
+  memcpy(changed, bytes, size);
+  targets[0] = function->count;
+  ASSERT_FALSE(map_image_bytes(changed, size));
+  free(changed);
+  free(bytes);
+  PASS();
+}
+
+/// What running `source` writes to stderr, from its compiled image if `image`
+static char* error_output(const char* source, bool image) {
+  FILE* err = tmpfile();
+  fflush(stderr);
+  int saved = dup(fileno(stderr));
+  dup2(fileno(err), fileno(stderr));
+  if (image) {
+    init_vm();
+    ObjectFunction* script = compile(source);
+    FILE* file = tmpfile();
+    write_image(script, hash_source(source), file);
+    free_value_array(script->global_array);
+    free_vm();
+    Image mapped;
+    if (map_image(&mapped, file)) {
+      interpret_image(&mapped);
+      unmap_image(&mapped);
+    }
+    fclose(file);
+  } else {
+    interpret_source(source);
+  }
+  fflush(stderr);
+  dup2(saved, fileno(stderr));
+  close(saved);
+  long size = ftell(err);
+  char* output = calloc(size + 1, 1);
+  rewind(err);
+  fread(output, 1, size, err);
+  fclose(err);
+  return output;
+}
+
+/// Errors raised in inlined calls show their frames, as when the calls aren't inlined
+TEST test_inlined_error_trace() {
+  const char* source = "fun g(a) {\n  return a - \"x\";\n}\nfun h(a) {\n  return g(a) + 1;\n}\n"
+                       "class C {\n  m(a) {\n    return h(a);\n  }\n}\nprint C().m(1);\n";
+  const char* trace = "[line 2] in g()\n[line 5] in h()\n[line 9] in m()\n[line 12] in <main>\n";
+  for (u32 image = 0; image < 2; image++) {
+    for (u32 optimized = 0; optimized < 2; optimized++) {
+      optimize = optimized;
+      char* output = error_output(source, image);
+      ASSERT(strstr(output, trace) != NULL);
+      free(output);
+    }
+  }
+  optimize = true;
+  PASS();
+}
+
+/// A value that isn't a number fails the first range of a `when` at the line of that range, as the
+/// comparisons OP_SWITCH stands for would
+TEST test_when_range_error_line() {
+  const char* source = "fun f(x) {\n  when x {\n    1 -> print 1;\n    \"b\" -> print 2;\n    2..\n    5 -> print 3;\n"
+                       "    nothing -> print 4;\n  }\n}\nf(\"c\");\n";
+  const char* trace = "[line 5] in f()\n[line 10] in <main>\n";
+  for (u32 image = 0; image < 2; image++) {
+    for (u32 optimized = 0; optimized < 2; optimized++) {
+      optimize = optimized;
+      char* output = error_output(source, image);
+      ASSERT(strstr(output, trace) != NULL);
+      free(output);
+    }
+  }
+  optimize = true;
+  PASS();
+}
+
 TEST test_compilations() {
   const u32 number_of_scripts = 3;
   const char* texts[] = {
@@ -256,6 +617,18 @@ TEST test_compilations() {
 SUITE(code_suite) {
   // RUN_TEST(test_compilations);
   RUN_TEST(test_file_compilations);
+  RUN_TEST(test_file_compilations_no_optimize);
+  RUN_TEST(test_file_compilations_lazy);
+#ifdef QW_JIT
+  RUN_TEST(test_file_compilations_jit);
+#endif
+  RUN_TEST(test_file_emit_c);
+  RUN_TEST(test_emit_c_calls);
+  RUN_TEST(test_file_images);
+  RUN_TEST(test_corrupted_images);
+  RUN_TEST(test_inlined_error_trace);
+  RUN_TEST(test_recursive_functions_not_inlined);
+  RUN_TEST(test_when_range_error_line);
 }
 
 SUITE(chunk_suite) {